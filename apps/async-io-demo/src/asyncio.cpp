@@ -0,0 +1,224 @@
+/*
+Entry point of the asynchronous I/O demo.
+
+Runs two virtual machines on a single host thread. One of them reads from a
+slow device whose accesses wait for simulated host I/O, while the other
+polls a fast device. The slow device parks its virtual processor instead of
+blocking the thread, so the fast guest keeps running in the meantime.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "vp_scheduler.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x1000;
+
+const uint16_t slowPort = 0x10;
+const uint16_t fastPort = 0x20;
+const int numSlowReads = 10;
+const auto slowReadLatency = std::chrono::milliseconds(20);
+
+// A device whose reads take a long time to complete, like a disk.
+// Every read is serviced by a host thread after a delay.
+class SlowDevice : public IODevice {
+public:
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        AsyncOperation op;
+        const uint32_t value = ++m_reads;
+        std::thread hostIO([&op, value]() {
+            std::this_thread::sleep_for(slowReadLatency);
+            op.Complete(value);
+        });
+        // Parks the virtual processor until the host I/O completes
+        const uint64_t result = awaitOperation(op);
+        hostIO.join();
+        return (uint32_t)result;
+    }
+
+    uint32_t Reads() const noexcept { return m_reads; }
+
+private:
+    uint32_t m_reads = 0;
+};
+
+// A device that responds immediately. Reads return 1 until told to stop.
+class FastDevice : public IODevice {
+public:
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        m_reads++;
+        return m_stop ? 0 : 1;
+    }
+
+    void Stop() noexcept { m_stop = true; }
+    uint64_t Reads() const noexcept { return m_reads; }
+
+private:
+    std::atomic<bool> m_stop{ false };
+    uint64_t m_reads = 0;
+};
+
+struct Guest {
+    uint8_t *rom = nullptr;
+    uint8_t *ram = nullptr;
+    VirtualMachine *vm = nullptr;
+    IOBus bus;
+};
+
+// Allocates memory for and creates a virtual machine that boots into the
+// given kernel.
+static bool createGuest(Platform& platform, Guest& guest, const char *kernel, size_t kernelSize) {
+    guest.rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    guest.ram = alignedAlloc(ramSize);
+    if (guest.rom == NULL || guest.ram == NULL) {
+        printf("Failed to allocate guest memory\n");
+        return false;
+    }
+    writeFlatGuestROM(guest.rom, kernelBase, stackTop);
+    memset(guest.ram, 0, ramSize);
+    memcpy(&guest.ram[kernelBase], kernel, kernelSize);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("Failed to create virtual machine\n");
+        return false;
+    }
+    guest.vm = &opt_vm->get();
+
+    if (guest.vm->MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, guest.rom) != MemoryMappingStatus::OK) {
+        printf("Failed to map ROM\n");
+        return false;
+    }
+    if (guest.vm->MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, guest.ram) != MemoryMappingStatus::OK) {
+        printf("Failed to map RAM\n");
+        return false;
+    }
+    guest.bus.Attach(*guest.vm);
+    return true;
+}
+
+static void freeGuest(Platform& platform, Guest& guest) {
+    if (guest.vm != nullptr) {
+        platform.FreeVM(*guest.vm);
+    }
+    alignedFree(guest.ram);
+    alignedFree(guest.rom);
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Reads the slow device a number of times, then halts
+    const char slowKernel[] =
+        "\x66\xba\x10\x00"                             // [0x1000] mov     dx, 0x10
+        "\xb9\x0a\x00\x00\x00"                         // [0x1004] mov    ecx, 10
+        "\xed"                                         // [0x1009] in     eax, dx
+        "\x49"                                         // [0x100a] dec    ecx
+        "\x75\xfc"                                     // [0x100b] jnz    0x1009
+        "\xf4";                                        // [0x100d] hlt
+
+    // Polls the fast device until it reads zero, then halts
+    const char fastKernel[] =
+        "\x66\xba\x20\x00"                             // [0x1000] mov     dx, 0x20
+        "\xed"                                         // [0x1004] in     eax, dx
+        "\x85\xc0"                                     // [0x1005] test   eax, eax
+        "\x75\xfb"                                     // [0x1007] jnz    0x1004
+        "\xf4";                                        // [0x1009] hlt
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    Guest slowGuest, fastGuest;
+    SlowDevice slowDevice;
+    FastDevice fastDevice;
+    if (!createGuest(platform, slowGuest, slowKernel, sizeof(slowKernel) - 1)) return -1;
+    if (!createGuest(platform, fastGuest, fastKernel, sizeof(fastKernel) - 1)) return -1;
+    slowGuest.bus.AddPIODevice(slowPort, 1, slowDevice);
+    fastGuest.bus.AddPIODevice(fastPort, 1, fastDevice);
+
+    // Stop at HLT; keep going on I/O and interruptions
+    const auto makeHandler = [](const char *name, std::function<void()> onHalt) {
+        return [name, onHalt](VirtualProcessor& vp, const VMExitInfo& exitInfo) -> bool {
+            switch (exitInfo.reason) {
+            case VMExitReason::PIO:
+            case VMExitReason::MMIO:
+            case VMExitReason::Cancelled:
+            case VMExitReason::Interrupt:
+                return true;
+            case VMExitReason::HLT:
+                printf("%s guest halted\n", name);
+                onHalt();
+                return false;
+            default:
+                printf("%s guest exited for another reason: %s\n", name, reason_str(exitInfo.reason));
+                onHalt();
+                return false;
+            }
+        };
+    };
+
+    // Run both virtual processors on a single thread
+    VPScheduler scheduler(1);
+    scheduler.AddVP(slowGuest.vm->GetVirtualProcessor(0)->get(), makeHandler("Slow", [&]() { fastDevice.Stop(); }), &slowGuest.bus);
+    scheduler.AddVP(fastGuest.vm->GetVirtualProcessor(0)->get(), makeHandler("Fast", []() {}), &fastGuest.bus);
+
+    printf("\nRunning both guests on one thread...\n");
+    const auto start = std::chrono::steady_clock::now();
+    scheduler.Run();
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("\nElapsed time: %.1f ms\n", elapsed.count());
+    printf("Slow device reads: %u (%d ms each)\n", slowDevice.Reads(), (int)slowReadLatency.count());
+    printf("Fast device reads: %" PRIu64 "\n", fastDevice.Reads());
+    if (slowDevice.Reads() == numSlowReads && fastDevice.Reads() > 1) {
+        printf("The fast guest kept running while the slow guest waited for I/O!\n");
+    }
+
+    freeGuest(platform, slowGuest);
+    freeGuest(platform, fastGuest);
+
+    return 0;
+}
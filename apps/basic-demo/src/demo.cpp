@@ -58,7 +58,9 @@ using namespace virt86;
 //#define DO_MANUAL_JMP
 //#define DO_MANUAL_PAGING
 
-int main() {
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
     // Initialize ROM and RAM
     const uint32_t romSize = PAGE_SIZE * 16;  // 64 KiB
     const uint32_t ramSize = PAGE_SIZE * 256; // 1 MiB
@@ -393,27 +395,13 @@ int main() {
 
     printf("virt86 version: " VIRT86_VERSION "\n\n");
 
-    // Pick the first hypervisor platform that is available and properly initialized on this system.
-    printf("Loading virtualization platform... ");
-
-    bool foundPlatform = false;
-    size_t platformIndex = 0;
-    for (size_t i = 0; i < array_size(PlatformFactories); i++) {
-        const Platform& platform = PlatformFactories[i]();
-        if (platform.GetInitStatus() == PlatformInitStatus::OK) {
-            printf("%s loaded successfully\n", platform.GetName().c_str());
-            foundPlatform = true;
-            platformIndex = i;
-            break;
-        }
-    }
-
-    if (!foundPlatform) {
-        printf("none found\n");
+    // Pick the first hypervisor platform that is available and properly initialized on this system,
+    // or the reference interpreter if --reference was given.
+    Platform *platformPtr = loadFirstPlatform();
+    if (platformPtr == NULL) {
         return -1;
     }
-
-    Platform& platform = PlatformFactories[platformIndex]();
+    Platform& platform = *platformPtr;
     auto& features = platform.GetFeatures();
 
     // Print out the host's features
@@ -0,0 +1,357 @@
+/*
+Demonstrates a block device served through io_uring with many requests in
+flight and batched completions.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "block_device.hpp"
+#include "event_loop.hpp"
+#include "flat_guest.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace virt86;
+
+const uint32_t ramSize = 8 * 1024 * 1024;  // 8 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t handlerBase = 0x1200;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t stackTop = 0x8000;
+
+// Parameters and results shared with the guest
+const uint32_t paramQueueSize = 0x3000;
+const uint32_t paramRounds = 0x3004;
+const uint32_t paramBlockMask = 0x3008;
+const uint32_t paramSeed = 0x300C;
+const uint32_t resultErrors = 0x3010;
+const uint32_t resultDone = 0x3014;
+
+const uint32_t sqBase = 0x10000;
+const uint32_t cqBase = 0x18000;
+const uint32_t bufferBase = 0x100000;
+const uint32_t blockSize = 4096;
+
+const uint16_t diskPort = 0xD00;
+const uint8_t diskVector = 0x30;
+
+const uint64_t imageSize = 64 * 1024 * 1024;  // 64 MiB
+const uint32_t defaultRequests = 16384;
+
+// Every 4 KiB block of the image starts with its block number, which lets the
+// guest check that it received the right data
+static bool createImage(const char *path) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    const size_t chunkSize = 1024 * 1024;
+    uint8_t *chunk = alignedAlloc(chunkSize);
+    bool ok = chunk != NULL;
+    for (uint64_t offset = 0; ok && offset < imageSize; offset += chunkSize) {
+        memset(chunk, 0, chunkSize);
+        for (uint32_t i = 0; i < chunkSize / blockSize; i++) {
+            const uint32_t block = (uint32_t)(offset / blockSize) + i;
+            memcpy(&chunk[i * blockSize], &block, sizeof(block));
+        }
+        ok = pwrite(fd, chunk, chunkSize, (off_t)offset) == (ssize_t)chunkSize;
+    }
+    alignedFree(chunk);
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    return ok;
+}
+
+static void writeGuest(uint8_t *ram, uint32_t queueSize, uint32_t rounds) noexcept {
+    memset(ram, 0, ramSize);
+
+    const uint32_t blockMask = (uint32_t)(imageSize / blockSize) - 1;
+    const uint32_t seed = 12345;
+    memcpy(&ram[paramQueueSize], &queueSize, sizeof(queueSize));
+    memcpy(&ram[paramRounds], &rounds, sizeof(rounds));
+    memcpy(&ram[paramBlockMask], &blockMask, sizeof(blockMask));
+    memcpy(&ram[paramSeed], &seed, sizeof(seed));
+
+    // One 4 KiB read per slot, each into its own page-aligned buffer. The
+    // guest picks a new random block for every slot on each round.
+    for (uint32_t i = 0; i < queueSize; i++) {
+        BlockDevice::Request request = { 0 };
+        request.opcode = BlockDevice::OpRead;
+        request.numSectors = blockSize / BlockDevice::SectorSize;
+        request.buffer = bufferBase + i * blockSize;
+        request.tag = i;
+        memcpy(&ram[sqBase + i * sizeof(request)], &request, sizeof(request));
+    }
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Sets up the queues, then on each round fills every slot with a request,
+    // rings the doorbell once and halts until all completions are in. Each
+    // buffer and completion status is checked, and mismatches are counted at
+    // 0x3010. Sets 0x3014 when done.
+    addr = kernelBase;
+    emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");     // [0x1000] lidt   [0x1800]
+    emit(ram, "\x66\xba\x04\x0d");                 // [0x1007] mov     dx, 0xd04    ; QUEUE_SIZE
+    emit(ram, "\xa1\x00\x30\x00\x00");             // [0x100b] mov    eax, [0x3000]
+    emit(ram, "\xef");                             // [0x1010] out     dx, eax
+    emit(ram, "\x66\xba\x08\x0d");                 // [0x1011] mov     dx, 0xd08    ; SQ_BASE
+    emit(ram, "\xb8\x00\x00\x01\x00");             // [0x1015] mov    eax, 0x10000
+    emit(ram, "\xef");                             // [0x101a] out     dx, eax
+    emit(ram, "\x66\xba\x0c\x0d");                 // [0x101b] mov     dx, 0xd0c    ; CQ_BASE
+    emit(ram, "\xb8\x00\x80\x01\x00");             // [0x101f] mov    eax, 0x18000
+    emit(ram, "\xef");                             // [0x1024] out     dx, eax
+    emit(ram, "\x66\xba\x00\x0d");                 // [0x1025] mov     dx, 0xd00    ; CONTROL
+    emit(ram, "\xb8\x01\x00\x00\x00");             // [0x1029] mov    eax, 1
+    emit(ram, "\xef");                             // [0x102e] out     dx, eax
+    emit(ram, "\x8b\x1d\x0c\x30\x00\x00");         // [0x102f] mov    ebx, [0x300c]
+    emit(ram, "\x31\xff");                         // [0x1035] xor    edi, edi
+    emit(ram, "\xfb");                             // [0x1037] sti
+    emit(ram, "\x8b\x0d\x00\x30\x00\x00");         // [0x1038] mov    ecx, [0x3000]
+    emit(ram, "\xbe\x00\x00\x01\x00");             // [0x103e] mov    esi, 0x10000
+    emit(ram, "\x69\xdb\x0d\x66\x19\x00");         // [0x1043] imul   ebx, ebx, 1664525
+    emit(ram, "\x81\xc3\x5f\xf3\x6e\x3c");         // [0x1049] add    ebx, 1013904223
+    emit(ram, "\x89\xd8");                         // [0x104f] mov    eax, ebx
+    emit(ram, "\xc1\xe8\x08");                     // [0x1051] shr    eax, 8
+    emit(ram, "\x23\x05\x08\x30\x00\x00");         // [0x1054] and    eax, [0x3008]
+    emit(ram, "\xc1\xe0\x03");                     // [0x105a] shl    eax, 3
+    emit(ram, "\x89\x46\x08");                     // [0x105d] mov    [esi+8], eax
+    emit(ram, "\x83\xc6\x20");                     // [0x1060] add    esi, 32
+    emit(ram, "\x49");                             // [0x1063] dec    ecx
+    emit(ram, "\x75\xdd");                         // [0x1064] jnz    0x1043
+    emit(ram, "\x03\x3d\x00\x30\x00\x00");         // [0x1066] add    edi, [0x3000]
+    emit(ram, "\x66\xba\x10\x0d");                 // [0x106c] mov     dx, 0xd10    ; SQ_TAIL
+    emit(ram, "\x89\xf8");                         // [0x1070] mov    eax, edi
+    emit(ram, "\xef");                             // [0x1072] out     dx, eax
+    emit(ram, "\x66\xba\x14\x0d");                 // [0x1073] mov     dx, 0xd14    ; CQ_TAIL
+    emit(ram, "\xfa");                             // [0x1077] cli
+    emit(ram, "\xed");                             // [0x1078] in     eax, dx
+    emit(ram, "\x39\xf8");                         // [0x1079] cmp    eax, edi
+    emit(ram, "\x74\x04");                         // [0x107b] je     0x1081
+    emit(ram, "\xfb");                             // [0x107d] sti
+    emit(ram, "\xf4");                             // [0x107e] hlt
+    emit(ram, "\xeb\xf2");                         // [0x107f] jmp    0x1073
+    emit(ram, "\xfb");                             // [0x1081] sti
+    emit(ram, "\x8b\x0d\x00\x30\x00\x00");         // [0x1082] mov    ecx, [0x3000]
+    emit(ram, "\xbe\x00\x00\x01\x00");             // [0x1088] mov    esi, 0x10000
+    emit(ram, "\xbd\x00\x80\x01\x00");             // [0x108d] mov    ebp, 0x18000
+    emit(ram, "\x8b\x46\x08");                     // [0x1092] mov    eax, [esi+8]
+    emit(ram, "\xc1\xe8\x03");                     // [0x1095] shr    eax, 3
+    emit(ram, "\x8b\x56\x10");                     // [0x1098] mov    edx, [esi+16]
+    emit(ram, "\x3b\x02");                         // [0x109b] cmp    eax, [edx]
+    emit(ram, "\x74\x06");                         // [0x109d] je     0x10a5
+    emit(ram, "\xff\x05\x10\x30\x00\x00");         // [0x109f] inc    dword ptr [0x3010]
+    emit(ram, "\x83\x7d\x08\x00");                 // [0x10a5] cmp    dword ptr [ebp+8], 0
+    emit(ram, "\x74\x06");                         // [0x10a9] je     0x10b1
+    emit(ram, "\xff\x05\x10\x30\x00\x00");         // [0x10ab] inc    dword ptr [0x3010]
+    emit(ram, "\x83\xc6\x20");                     // [0x10b1] add    esi, 32
+    emit(ram, "\x83\xc5\x10");                     // [0x10b4] add    ebp, 16
+    emit(ram, "\x49");                             // [0x10b7] dec    ecx
+    emit(ram, "\x75\xd8");                         // [0x10b8] jnz    0x1092
+    emit(ram, "\x66\xba\x14\x0d");                 // [0x10ba] mov     dx, 0xd14    ; CQ_HEAD
+    emit(ram, "\x89\xf8");                         // [0x10be] mov    eax, edi
+    emit(ram, "\xef");                             // [0x10c0] out     dx, eax
+    emit(ram, "\xff\x0d\x04\x30\x00\x00");         // [0x10c1] dec    dword ptr [0x3004]
+    emit(ram, "\x0f\x85\x6b\xff\xff\xff");         // [0x10c7] jnz    0x1038
+    emit(ram, "\xc7\x05\x14\x30\x00\x00\x01\x00\x00\x00"); // [0x10cd] mov    dword ptr [0x3014], 1
+    emit(ram, "\xf4");                             // [0x10d7] hlt
+
+    // Disk interrupt handler: the main loop checks CQ_TAIL when it wakes up
+    addr = handlerBase;
+    emit(ram, "\xcf");                             // [0x1200] iretd
+
+    // IDT pointer
+    addr = idtrBase;
+    emit(ram, "\x87\x01\x00\x20\x00\x00");         // [0x1800] IDT pointer: 0x00002000:0x0187
+#undef emit
+    writeFlatGuestIDTEntry(ram, idtBase, diskVector, handlerBase);
+}
+
+static bool runPhase(Platform& platform, uint8_t *rom, uint8_t *ram, const char *imagePath, bool useIOUring, uint32_t queueSize, uint32_t numRequests) {
+    const uint32_t rounds = (numRequests + queueSize - 1) / queueSize;
+    writeGuest(ram, queueSize, rounds);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    EventLoop loop;
+    if (!loop.IsValid()) {
+        printf("fatal: failed to create event loop\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    InterruptQueue irqs;
+    BlockDevice disk(loop, irqs, diskVector, diskPort, ram, ramBase, ramSize);
+    if (!disk.Open(imagePath, true, useIOUring)) {
+        printf("fatal: failed to open disk image\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (useIOUring && !disk.UsesIOUring()) {
+        printf("\nio_uring is not available; skipping queue depth %" PRIu32 "\n", queueSize);
+        platform.FreeVM(vm);
+        return true;
+    }
+    printf("\n%s, queue depth %" PRIu32 ", %s I/O:\n", disk.UsesIOUring() ? "io_uring" : "Synchronous", queueSize, disk.IsDirect() ? "direct" : "buffered");
+
+    IOBus bus;
+    bus.AddPIODevice(diskPort, BlockDevice::NumPorts, disk);
+    bus.Attach(vm);
+
+    std::thread loopThread([&]() { loop.Run(); });
+
+    uint64_t exits = 0, halts = 0;
+    const auto wallStart = std::chrono::steady_clock::now();
+    bool running = true;
+    bool ok = true;
+    while (running) {
+        irqs.Deliver(vp);
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            if (ram[resultDone] != 0) {
+                running = false;
+                break;
+            }
+            halts++;
+            irqs.WaitForInterrupt();
+            break;
+        case VMExitReason::PIO:
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+
+    loop.Stop();
+    loopThread.join();
+    platform.FreeVM(vm);
+
+    uint32_t errors;
+    memcpy(&errors, &ram[resultErrors], sizeof(errors));
+    const auto stats = disk.GetStats();
+    const uint64_t requests = (uint64_t)rounds * queueSize;
+
+    printf("  %" PRIu64 " reads of %" PRIu32 " bytes in %.3f s: %.0f IOPS, %.1f MiB/s\n",
+        requests, blockSize, wallTime.count(), requests / wallTime.count(), requests * blockSize / wallTime.count() / (1024.0 * 1024.0));
+    printf("  Doorbells: %" PRIu64 ", submission system calls: %" PRIu64 "\n", stats.doorbells, stats.submitCalls);
+    printf("  Completions: %" PRIu64 " in %" PRIu64 " batches, %" PRIu64 " interrupts (%.1f completions per interrupt)\n",
+        stats.completions, stats.batches, stats.interrupts, stats.interrupts ? (double)stats.completions / stats.interrupts : 0.0);
+    printf("  VM exits: %" PRIu64 " (%.2f per request), HLT waits: %" PRIu64 "\n", exits, (double)exits / requests, halts);
+    if (!ok || errors != 0 || stats.completions != requests) {
+        printf("  The guest found %" PRIu32 " bad blocks or failed requests\n", errors);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    const char *imagePath = (argc >= 2) ? argv[1] : "block-demo.img";
+    uint32_t numRequests = defaultRequests;
+    if (argc >= 3) {
+        numRequests = (uint32_t)strtoul(argv[2], NULL, 0);
+        if (numRequests == 0) {
+            printf("usage: %s [image path] [requests per phase]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("Creating %" PRIu64 " MiB disk image at %s\n", imageSize / (1024 * 1024), imagePath);
+    if (!createImage(imagePath)) {
+        printf("fatal: failed to create disk image\n");
+        return -1;
+    }
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        unlink(imagePath);
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    bool ok = runPhase(platform, rom, ram, imagePath, false, 1, numRequests)
+        && runPhase(platform, rom, ram, imagePath, false, 64, numRequests)
+        && runPhase(platform, rom, ram, imagePath, true, 1, numRequests)
+        && runPhase(platform, rom, ram, imagePath, true, 64, numRequests)
+        && runPhase(platform, rom, ram, imagePath, true, 256, numRequests);
+
+    unlink(imagePath);
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
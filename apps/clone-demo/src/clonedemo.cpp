@@ -0,0 +1,262 @@
+/*
+Demonstrates copy-on-write cloning of a booted guest into many virtual
+machines.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "shared_memory.hpp"
+#include "utils.hpp"
+#include "vm_clone.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = 32 * 1024 * 1024;  // 32 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+const uint32_t resultAddr = 0x3000;
+
+// Table built by the guest during boot
+const uint32_t tableBase = 0x100000;
+const uint32_t tableEntries = 0x400000;
+const uint32_t entriesPerClone = 1024;
+
+const size_t defaultNumClones = 64;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Boot: fills a 16 MiB table with the squares of the indices and parks at
+    // a HLT. After that, each clone sums the 1024 entries starting at 1024
+    // times ECX and stores the sum at 0x3000.
+    addr = kernelBase;
+    emit(ram, "\xbf\x00\x00\x10\x00");             // [0x1000] mov    edi, 0x100000
+    emit(ram, "\x31\xc0");                         // [0x1005] xor    eax, eax
+    emit(ram, "\x89\xc2");                         // [0x1007] mov    edx, eax
+    emit(ram, "\x0f\xaf\xd0");                     // [0x1009] imul   edx, eax
+    emit(ram, "\x89\x14\x87");                     // [0x100c] mov    [edi+eax*4], edx
+    emit(ram, "\x40");                             // [0x100f] inc    eax
+    emit(ram, "\x3d\x00\x00\x40\x00");             // [0x1010] cmp    eax, 0x400000
+    emit(ram, "\x72\xf0");                         // [0x1015] jb     0x1007
+    emit(ram, "\xf4");                             // [0x1017] hlt
+    emit(ram, "\x89\xce");                         // [0x1018] mov    esi, ecx
+    emit(ram, "\xc1\xe6\x0c");                     // [0x101a] shl    esi, 12
+    emit(ram, "\x81\xc6\x00\x00\x10\x00");         // [0x101d] add    esi, 0x100000
+    emit(ram, "\x31\xdb");                         // [0x1023] xor    ebx, ebx
+    emit(ram, "\xba\x00\x04\x00\x00");             // [0x1025] mov    edx, 1024
+    emit(ram, "\x03\x1e");                         // [0x102a] add    ebx, [esi]
+    emit(ram, "\x83\xc6\x04");                     // [0x102c] add    esi, 4
+    emit(ram, "\x4a");                             // [0x102f] dec    edx
+    emit(ram, "\x75\xf8");                         // [0x1030] jnz    0x102a
+    emit(ram, "\x89\x1d\x00\x30\x00\x00");         // [0x1032] mov    [0x3000], ebx
+    emit(ram, "\xf4");                             // [0x1038] hlt
+#undef emit
+}
+
+static uint32_t expectedSum(uint32_t index) noexcept {
+    uint32_t sum = 0;
+    for (uint32_t i = index * entriesPerClone; i < (index + 1) * entriesPerClone; i++) {
+        sum += i * i;
+    }
+    return sum;
+}
+
+// Returns the amount of anonymous memory used by the process in KiB, which
+// includes the pages clones copied on write, or 0 if unknown.
+static uint64_t anonymousMemoryKiB() noexcept {
+#if defined(__linux__)
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[256];
+    uint64_t value = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "Anonymous: %" SCNu64 " kB", &value) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+#else
+    return 0;
+#endif
+}
+
+static bool runToHLT(VirtualProcessor& vp) {
+    if (vp.Run() != VPExecutionStatus::OK) {
+        printf("VCPU failed to run\n");
+        return false;
+    }
+    auto& exitInfo = vp.GetVMExitInfo();
+    if (exitInfo.reason != VMExitReason::HLT) {
+        printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+        return false;
+    }
+    return true;
+}
+
+static double microseconds(std::chrono::steady_clock::duration duration) noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    size_t numClones = defaultNumClones;
+    if (argc >= 2) {
+        numClones = strtoul(argv[1], NULL, 0);
+        if (numClones == 0 || numClones > tableEntries / entriesPerClone) {
+            printf("fatal: the number of clones must be between 1 and %u\n", tableEntries / entriesPerClone);
+            return -1;
+        }
+    }
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    SharedMemory ramFile;
+    uint8_t *ram = ramFile.Create(ramSize) ? ramFile.MapShared() : NULL;
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    writeGuest(ram);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    // ----- Template ---------------------------------------------------------------------------------------------------
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return -1;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    const MemoryFlags romFlags = MemoryFlags::Read | MemoryFlags::Execute;
+    const MemoryFlags ramFlags = MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute;
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, romFlags, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        return -1;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, ramFlags, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        return -1;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    auto start = std::chrono::steady_clock::now();
+    if (!runToHLT(vp)) {
+        return -1;
+    }
+    const double bootTime = microseconds(std::chrono::steady_clock::now() - start);
+    printf("Template booted in %.1f us\n", bootTime);
+
+    VMTemplate vmTemplate(vm);
+    vmTemplate.AddSharedRegion(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, rom, romFlags);
+    vmTemplate.AddPrivateRegion(ramBase, ramFile, ramFlags);
+    if (!vmTemplate.Capture()) {
+        printf("fatal: failed to read the template's processor state\n");
+        return -1;
+    }
+
+    // ----- Clones -----------------------------------------------------------------------------------------------------
+
+    const uint64_t memoryBefore = anonymousMemoryKiB();
+    std::vector<std::unique_ptr<VMClone>> clones;
+    double minCloneTime = 1e300, maxCloneTime = 0.0, totalCloneTime = 0.0;
+    for (size_t i = 0; i < numClones; i++) {
+        start = std::chrono::steady_clock::now();
+        auto clone = vmTemplate.Clone();
+        const double cloneTime = microseconds(std::chrono::steady_clock::now() - start);
+        if (clone == nullptr) {
+            printf("fatal: failed to create clone %zu\n", i);
+            return -1;
+        }
+        minCloneTime = std::min(minCloneTime, cloneTime);
+        maxCloneTime = std::max(maxCloneTime, cloneTime);
+        totalCloneTime += cloneTime;
+        clones.push_back(std::move(clone));
+    }
+    printf("Created %zu clones: %.1f us on average, %.1f us min, %.1f us max\n",
+        numClones, totalCloneTime / numClones, minCloneTime, maxCloneTime);
+
+    // Each clone works on its own part of the table
+    bool ok = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numClones && ok; i++) {
+        auto& clone = *clones[i];
+        RegValue ecx;
+        ecx.u32 = (uint32_t)i;
+        ok = clone.GetVP().RegWrite(Reg::ECX, ecx) == VPOperationStatus::OK && runToHLT(clone.GetVP());
+    }
+    const double runTime = microseconds(std::chrono::steady_clock::now() - start);
+
+    for (size_t i = 0; i < numClones && ok; i++) {
+        uint32_t result;
+        memcpy(&result, &clones[i]->GetMemory(0)[resultAddr], sizeof(result));
+        if (result != expectedSum((uint32_t)i)) {
+            printf("Clone %zu computed 0x%08x, expected 0x%08x\n", i, result, expectedSum((uint32_t)i));
+            ok = false;
+        }
+    }
+    uint32_t templateResult;
+    memcpy(&templateResult, &ram[resultAddr], sizeof(templateResult));
+    if (ok && templateResult != 0) {
+        printf("A clone's write reached the template's memory\n");
+        ok = false;
+    }
+    if (ok) {
+        printf("Ran all clones in %.1f us; every clone computed the correct result\n", runTime);
+    }
+
+    const uint64_t memoryAfter = anonymousMemoryKiB();
+    if (memoryBefore != 0 && memoryAfter != 0) {
+        printf("Private memory: %.1f KiB per clone (guest RAM is %u KiB)\n",
+            (double)(int64_t)(memoryAfter - memoryBefore) / numClones, ramSize / 1024);
+    }
+
+    clones.clear();
+    platform.FreeVM(vm);
+    ramFile.Unmap(ram);
+    alignedFree(rom);
+    return ok ? 0 : -1;
+}
@@ -28,6 +28,18 @@ SOFTWARE.
 #include <cinttypes>
 #include <stddef.h>
 
+// How the host backs an allocation made with alignedAlloc.
+enum class AllocMode {
+    Default,     // The system's regular page-aligned allocator
+    HugePages,   // Large pages (2 MiB on x86). On Linux, falls back to a 2 MiB aligned mapping
+                 // advised for transparent huge pages if none are preallocated, which the kernel
+                 // may still back with regular pages
+    Lazy,        // Anonymous mapping without reserved backing; pages are faulted in on first touch
+    FileBacked,  // Shared mapping of an unlinked temporary file
+};
 
 uint8_t *alignedAlloc(const size_t size) noexcept;
+uint8_t *alignedAlloc(const size_t size, const AllocMode mode) noexcept;
+
+// Frees memory allocated in any mode.
 bool alignedFree(void *memory) noexcept;
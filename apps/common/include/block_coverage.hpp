@@ -0,0 +1,105 @@
+/*
+Declares a basic-block code coverage collector based on one-shot software
+breakpoints.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "x86_decoder.hpp"
+
+#include <vector>
+
+// Collects basic-block coverage of guest code at the cost of one VM exit per
+// block ever executed.
+//
+// Basic blocks are found by recursively disassembling the guest image from a
+// set of entry points, following direct jumps, calls and fall-through paths.
+// Arming the collector plants an INT3 at the start of every block. When the
+// guest hits one, HandleBreakpoint records the block, restores its original
+// byte and lets the guest resume at the same instruction, so every block traps
+// at most once.
+//
+// Targets of indirect jumps and calls cannot be discovered statically; pass
+// them (interrupt handlers, jump table targets, ...) as extra entry points.
+// The guest must not read or modify its own code while the collector is armed.
+class BlockCoverage {
+public:
+    struct Block {
+        uint64_t address;
+        uint32_t size;
+        bool hit;
+        uint32_t hitOrder;  // Order in which blocks were first hit
+    };
+
+    explicit BlockCoverage(virt86::VirtualProcessor& vp) noexcept : m_vp(vp) {}
+    ~BlockCoverage() noexcept { Disarm(); }
+
+    // Finds the basic blocks reachable from the entry points within the guest
+    // address range [imageBase, imageBase + imageSize), backed by host memory
+    // at image. Returns the number of blocks found.
+    size_t Discover(uint8_t *image, uint64_t imageBase, size_t imageSize, X86Mode mode, const std::vector<uint64_t>& entryPoints) noexcept;
+
+    // Plants a breakpoint at every block that has not been hit yet.
+    bool Arm() noexcept;
+
+    // Handles a VMExitReason::SoftwareBreakpoint exit. Returns true if the
+    // breakpoint belonged to the collector, in which case the guest can simply
+    // be resumed. Returns false for breakpoints planted by someone else.
+    bool HandleBreakpoint() noexcept;
+
+    // Removes all remaining breakpoints.
+    void Disarm() noexcept;
+
+    // Marks the block starting at address as hit, for collecting coverage by
+    // other means such as single stepping. Returns false if no block starts
+    // at address.
+    bool MarkHit(uint64_t address) noexcept;
+
+    const std::vector<Block>& Blocks() const noexcept { return m_blocks; }
+    size_t HitCount() const noexcept { return m_hitCount; }
+
+    // Writes the blocks hit in drcov format, as a single module with the
+    // given name spanning the image. Readable by Lighthouse, bncov and others.
+    bool WriteDrcov(const char *path, const char *moduleName) const noexcept;
+
+    // Writes an lcov tracefile with one line per block, using the block's
+    // guest address as the line number.
+    bool WriteLcov(const char *path, const char *sourceName) const noexcept;
+
+private:
+    virt86::VirtualProcessor& m_vp;
+
+    uint8_t *m_image = nullptr;
+    uint64_t m_imageBase = 0;
+    size_t m_imageSize = 0;
+
+    std::vector<Block> m_blocks;          // Sorted by address
+    std::vector<uint8_t> m_originalBytes;
+    size_t m_hitCount = 0;
+    bool m_armed = false;
+
+    Block *FindBlock(uint64_t address) noexcept;
+};
@@ -0,0 +1,222 @@
+/*
+Declares a block device model whose requests are queued in guest memory and
+served asynchronously through io_uring.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include "event_loop.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "io_uring.hpp"
+
+#include <mutex>
+#include <vector>
+
+// A block device with 512-byte sectors whose requests and completions are
+// exchanged through a pair of rings in guest memory, in the style of NVMe.
+// The register interface spans 32 ports. All registers are 32 bits wide:
+//
+//   +0x00  CONTROL      (R/W)  bit 0: enable; writing it with the bit set
+//                              resets both queues
+//   +0x04  QUEUE_SIZE   (R/W)  entries in each queue, a power of two up to
+//                              MaxQueueSize
+//   +0x08  SQ_BASE      (R/W)  guest physical address of the submission queue
+//   +0x0C  CQ_BASE      (R/W)  guest physical address of the completion queue
+//   +0x10  SQ_TAIL      (W)    doorbell: index one past the last request
+//          SQ_HEAD      (R)    index one past the last request consumed
+//   +0x14  CQ_HEAD      (W)    index one past the last completion consumed
+//          CQ_TAIL      (R)    index one past the last completion posted;
+//                              reading it acknowledges the interrupt
+//   +0x18  CAPACITY_LO  (R)    number of sectors, low 32 bits
+//   +0x1C  CAPACITY_HI  (R)    number of sectors, high 32 bits
+//
+// Indices are free-running 32-bit counters; entry i lives in slot
+// i % QUEUE_SIZE. The queues cannot be reconfigured while requests are in
+// flight. The guest must not have more than QUEUE_SIZE requests outstanding,
+// counting from submission until the completion is consumed.
+//
+// A single doorbell write submits every new request at once. With io_uring,
+// they are all handed to the kernel with one system call and served
+// concurrently, so a single exit can keep many requests in flight. An event
+// loop thread reaps completions in batches, posts them to the completion
+// queue and then raises at most one interrupt, which stays outstanding until
+// the guest reads CQ_TAIL. Completions that arrive in the meantime are
+// coalesced into the same interrupt.
+//
+// Without io_uring, requests are served synchronously by the thread that
+// rings the doorbell.
+class BlockDevice : public IODevice {
+public:
+    static const uint16_t RegControl = 0x00;
+    static const uint16_t RegQueueSize = 0x04;
+    static const uint16_t RegSQBase = 0x08;
+    static const uint16_t RegCQBase = 0x0C;
+    static const uint16_t RegSQTail = 0x10;
+    static const uint16_t RegCQHead = 0x14;
+    static const uint16_t RegCapacityLo = 0x18;
+    static const uint16_t RegCapacityHi = 0x1C;
+    static const uint16_t NumPorts = 0x20;
+
+    static const uint32_t ControlEnable = (1 << 0);
+
+    static const uint32_t SectorSize = 512;
+    static const uint32_t MaxQueueSize = 1024;
+    static const uint32_t MaxRequestSectors = 8192;  // 4 MiB
+
+    enum Opcode : uint8_t {
+        OpRead = 0,
+        OpWrite = 1,
+        OpFlush = 2,
+    };
+
+    enum Status : uint32_t {
+        StatusOK = 0,
+        StatusIOError = 1,
+        StatusInvalid = 2,
+    };
+
+    // Submission queue entry
+    struct Request {
+        uint8_t opcode;
+        uint8_t reserved[3];
+        uint32_t numSectors;
+        uint64_t sector;
+        uint64_t buffer;  // Guest physical address
+        uint64_t tag;     // Returned in the completion
+    };
+
+    // Completion queue entry
+    struct Completion {
+        uint64_t tag;
+        uint32_t status;
+        uint32_t reserved;
+    };
+
+    struct Stats {
+        uint64_t requests;      // Requests consumed from the submission queue
+        uint64_t doorbells;     // Writes to SQ_TAIL
+        uint64_t submitCalls;   // io_uring_enter calls made to submit requests
+        uint64_t completions;   // Completions posted
+        uint64_t batches;       // Groups of completions posted together
+        uint64_t interrupts;    // Interrupts raised
+        uint64_t errors;        // Completions with a status other than StatusOK
+    };
+
+    // Guest memory must stay mapped for as long as the device exists.
+    BlockDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+    ~BlockDevice();
+
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+
+    // Opens the backing file. If direct is set, the file is opened with
+    // O_DIRECT to bypass the host page cache, falling back to buffered I/O if
+    // the file system does not support it. With O_DIRECT, requests whose
+    // guest buffer, starting offset or length are not aligned to the file's
+    // logical block size complete with StatusInvalid.
+    // Requests are served through io_uring when useIOUring is set and the
+    // kernel supports it. The event loop must not be running yet.
+    bool Open(const char *path, bool direct, bool useIOUring = true) noexcept;
+
+    bool IsValid() const noexcept { return m_fd >= 0; }
+    bool IsDirect() const noexcept { return m_direct; }
+    bool UsesIOUring() const noexcept { return m_ring.IsValid(); }
+    uint64_t Capacity() const noexcept { return m_capacity; }
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override;
+
+    Stats GetStats() noexcept;
+
+private:
+    EventLoop& m_loop;
+    InterruptQueue& m_irqs;
+    const uint8_t m_vector;
+    const uint16_t m_basePort;
+    uint8_t *m_ram;
+    const uint64_t m_ramBase;
+    const uint64_t m_ramSize;
+
+    int m_fd = -1;
+    bool m_direct = false;
+    uint32_t m_directAlignment = SectorSize;  // Alignment O_DIRECT transfers need
+    uint64_t m_capacity = 0;
+    IOUring m_ring;
+    int m_eventFD = -1;
+
+    // Serializes getting and submitting entries, which the ring only allows
+    // from one thread at a time. Taken before m_mutex and held while waiting
+    // for the kernel to accept entries, which the event loop never needs.
+    std::mutex m_submitMutex;
+
+    // Guards everything below, which is shared between the thread that
+    // accesses the registers and the event loop thread
+    std::mutex m_mutex;
+
+    uint32_t m_control = 0;
+    uint32_t m_queueSize = 0;
+    uint32_t m_sqBase = 0;
+    uint32_t m_cqBase = 0;
+    uint32_t m_sqHead = 0;
+    uint32_t m_sqTail = 0;
+    uint32_t m_cqHead = 0;
+    uint32_t m_cqTail = 0;
+    uint32_t m_cqTailRead = 0;  // CQ_TAIL as last read by the guest
+    bool m_irqOutstanding = false;
+
+    // Requests handed to io_uring, indexed by the user data of their entries
+    struct InFlight {
+        uint64_t tag;
+        uint32_t length;
+    };
+    std::vector<InFlight> m_inFlight;
+    std::vector<uint32_t> m_freeSlots;
+
+    Stats m_stats = { 0 };
+
+    void Enable(bool enable) noexcept;
+
+    // Consumes requests from the submission queue while there is room for
+    // their completions. Returns the number of entries queued on io_uring,
+    // which the caller must submit after releasing the lock.
+    size_t ProcessSubmissions(bool& raiseInterrupt) noexcept;
+
+    // Checks a request and locates its buffer in guest memory
+    Status Validate(const Request& request, uint8_t *& buffer, uint32_t& length) const noexcept;
+
+    // Serves a request synchronously
+    Status Execute(const Request& request, uint8_t *buffer, uint32_t length) noexcept;
+
+    // Writes a completion to the guest's completion queue
+    void PostCompletion(uint64_t tag, uint32_t status) noexcept;
+    bool ShouldRaiseInterrupt() noexcept;
+
+    // Invoked by the event loop when io_uring posts completions
+    void OnCompletions() noexcept;
+};
+
+#endif
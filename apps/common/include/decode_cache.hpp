@@ -0,0 +1,103 @@
+/*
+Declares a cache of decoded guest instructions keyed by guest physical
+address, kept coherent with the guest's code through dirty page tracking.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "x86_decoder.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+// Decodes the instruction a virtual processor stopped at, typically the one
+// that caused an MMIO exit, and remembers the result. Drivers that poll device
+// registers exit from the same few instructions over and over; those are
+// decoded once and then served from the cache.
+//
+// Instructions are cached only if they lie in the guest RAM region given to
+// the constructor, which must be mapped with MemoryFlags::DirtyPageTracking.
+// Code elsewhere (such as ROM) is decoded on every lookup. Refresh queries
+// the dirty page bitmap and drops every cached instruction on a page the guest
+// wrote to since the previous refresh; until then, lookups may return the old
+// decoding of modified code. The cache clears the dirty bitmap of the region
+// on every refresh, so it cannot share the region with other users of dirty
+// page tracking.
+class DecodeCache {
+public:
+    struct Stats {
+        uint64_t lookups;
+        uint64_t hits;
+        uint64_t decodes;          // Lookups that read and decoded guest memory
+        uint64_t refreshes;
+        uint64_t invalidatedPages; // Code pages dropped because they were written to
+    };
+
+    DecodeCache(virt86::VirtualMachine& vm, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+
+    // Returns the instruction at the processor's current CS:RIP, or NULL if it
+    // could not be read or decoded. The guest physical address of the
+    // instruction is written to physicalAddress if not NULL. The returned
+    // pointer is valid until the next call to Lookup, Refresh or Clear.
+    const X86Instruction *Lookup(virt86::VirtualProcessor& vp, uint64_t *physicalAddress = NULL) noexcept;
+
+    // Drops instructions on pages written to since the last refresh.
+    bool Refresh() noexcept;
+
+    void Clear() noexcept;
+
+    // When disabled, every lookup decodes the instruction from guest memory.
+    void SetEnabled(bool enabled) noexcept;
+
+    const Stats& GetStats() const noexcept { return m_stats; }
+
+private:
+    struct Entry {
+        X86Instruction insn;
+        X86Mode mode;
+        uint64_t lastPage;  // Last page the instruction touches; the first is its own
+    };
+
+    virt86::VirtualMachine& m_vm;
+    uint8_t *m_ram;
+    uint64_t m_ramBase;
+    uint64_t m_ramSize;
+    bool m_enabled = true;
+
+    std::unordered_map<uint64_t, Entry> m_entries;                   // Physical address -> instruction
+    std::unordered_map<uint64_t, std::vector<uint64_t>> m_codePages; // Page -> addresses of instructions touching it
+    std::vector<uint64_t> m_bitmap;
+    X86Instruction m_uncached;
+    Stats m_stats = { 0 };
+
+    bool Decode(virt86::VirtualProcessor& vp, uint64_t linear, uint64_t physical, X86Mode mode, X86Instruction& insn) noexcept;
+    void InvalidatePage(uint64_t page) noexcept;
+
+    // Adds or removes the instruction at the address to or from the lists of
+    // every page it spans
+    void LinkPages(uint64_t address, const Entry& entry) noexcept;
+    void UnlinkPages(uint64_t address, const Entry& entry) noexcept;
+};
@@ -0,0 +1,102 @@
+/*
+Declares an epoll-based event loop that multiplexes host-side device
+backends such as eventfds, timerfds, files and sockets. Linux only.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <cinttypes>
+
+#include <sys/epoll.h>
+
+// Dispatches readiness events on file descriptors to handlers.
+// Handlers run on the thread that calls Poll or Run. Descriptors may only be
+// added or removed from that thread or while the loop is not running.
+class EventLoop {
+public:
+    // Receives the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLHUP, ...)
+    using Handler = std::function<void(uint32_t events)>;
+
+    EventLoop() noexcept;
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool IsValid() const noexcept { return m_epollFD >= 0 && m_stopFD >= 0; }
+
+    // Starts watching the file descriptor for the given events.
+    bool Add(int fd, uint32_t events, Handler handler) noexcept;
+
+    // Changes the events watched on a file descriptor.
+    bool Modify(int fd, uint32_t events) noexcept;
+
+    // Stops watching a file descriptor. Does not close it.
+    bool Remove(int fd) noexcept;
+
+    // Waits up to timeoutMs milliseconds (-1 to wait indefinitely) for events
+    // and dispatches them. Returns the number of handlers invoked, or -1 on
+    // failure.
+    int Poll(int timeoutMs) noexcept;
+
+    // Dispatches events until Stop is called.
+    void Run() noexcept;
+
+    // Makes Run return. May be called from any thread, including handlers.
+    void Stop() noexcept;
+
+private:
+    int m_epollFD;
+    int m_stopFD;
+    std::atomic<bool> m_running{ false };
+    std::unordered_map<int, std::shared_ptr<Handler>> m_handlers;
+};
+
+// Creates a non-blocking eventfd. Returns -1 on failure.
+int createEventFD() noexcept;
+
+// Adds to the eventfd's counter, waking up anyone watching it.
+bool signalEventFD(int fd, uint64_t count = 1) noexcept;
+
+// Reads and resets the eventfd's counter. Returns 0 if it was not signaled.
+uint64_t drainEventFD(int fd) noexcept;
+
+// Creates a non-blocking timerfd on the monotonic clock that expires after
+// initialNs nanoseconds and then every intervalNs nanoseconds (0 for a one-shot
+// timer). An initialNs of 0 creates a disarmed timer. Returns -1 on failure.
+int createTimerFD(uint64_t initialNs, uint64_t intervalNs) noexcept;
+
+// Rearms or disarms (initialNs = 0) a timerfd.
+bool setTimerFD(int fd, uint64_t initialNs, uint64_t intervalNs) noexcept;
+
+// Reads the number of expirations since the last read. Returns 0 if none.
+uint64_t readTimerFD(int fd) noexcept;
+
+#endif
@@ -0,0 +1,71 @@
+/*
+Declares a minimal cross-platform stackful fiber.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stddef.h>
+
+// A fiber runs a function on its own stack and can suspend itself at any
+// point, including from deep inside virt86 callbacks, returning control to
+// whoever resumed it. Fibers must always be resumed from the same thread.
+class Fiber {
+public:
+    explicit Fiber(std::function<void()> func, size_t stackSize = 256 * 1024);
+    ~Fiber();
+
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+
+    // Switches to the fiber. Returns when the fiber suspends or finishes.
+    void Resume() noexcept;
+
+    // Switches back to the context that resumed the fiber. Must be invoked
+    // from within the fiber.
+    void Suspend() noexcept;
+
+    bool IsFinished() const noexcept { return m_finished; }
+
+    // A pointer private to the fiber, for state that would otherwise be kept
+    // in a thread_local variable but must follow the fiber across suspensions.
+    // Reserved for IOBus.
+    void *LocalData() const noexcept { return m_localData; }
+    void SetLocalData(void *data) noexcept { m_localData = data; }
+
+    // Returns the fiber running on the calling thread, or NULL if the thread
+    // is not running a fiber.
+    static Fiber *Current() noexcept;
+
+private:
+    struct Context;
+    friend struct FiberEntry;
+
+    std::function<void()> m_func;
+    std::unique_ptr<Context> m_context;
+    Fiber *m_previous = nullptr;
+    void *m_localData = nullptr;
+    bool m_finished = false;
+};
@@ -0,0 +1,51 @@
+/*
+Declares a helper that writes a minimal boot program for guests that run
+in flat 32-bit protected mode.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cinttypes>
+#include <stddef.h>
+
+// The boot ROM is 64 KiB long and must be mapped at the top of the 32-bit
+// address space.
+const uint64_t FLAT_GUEST_ROM_BASE = 0xFFFF0000;
+const uint32_t FLAT_GUEST_ROM_SIZE = 0x10000;
+
+// Code and data segment selectors loaded by the boot ROM.
+const uint16_t FLAT_GUEST_CODE_SEG = 0x0008;
+const uint16_t FLAT_GUEST_DATA_SEG = 0x0010;
+
+// Writes a boot program to the given ROM buffer that switches the virtual
+// processor from real mode to 32-bit protected mode with 4 GiB flat code and
+// data segments, loads ESP with stackPointer and jumps to entryPoint.
+// Paging and interrupts are left disabled, so guest code addresses physical
+// memory directly. All registers other than EAX and ESP are preserved, which
+// lets the host pass parameters to the guest before the first run.
+void writeFlatGuestROM(uint8_t *rom, uint32_t entryPoint, uint32_t stackPointer) noexcept;
+
+// Writes a 32-bit interrupt gate for the given vector into an IDT located at
+// idtBase in the guest's RAM. The handler runs with the flat code segment.
+void writeFlatGuestIDTEntry(uint8_t *ram, uint32_t idtBase, uint8_t vector, uint32_t handler) noexcept;
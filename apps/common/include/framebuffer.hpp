@@ -0,0 +1,179 @@
+/*
+Declares a linear framebuffer that finds the regions the guest changed
+through dirty page tracking.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cinttypes>
+
+// A rectangle of pixels, in pixels from the top left corner.
+struct DirtyRect {
+    uint32_t x, y;
+    uint32_t width, height;
+};
+
+// A linear 32 bits per pixel framebuffer (0x00RRGGBB, rows packed one after
+// the other) mapped into the guest as ordinary RAM. Guest stores never cause
+// VM exits; instead, the pages the guest wrote to are collected from the
+// hypervisor while its processors are stopped, and a refresh only looks at
+// the rows covered by the pages collected since the previous one.
+//
+// Each refresh compares the covered pixels against a host copy of the screen
+// to narrow them down to the ones that actually changed, copies those into
+// the host copy, and reports them as rectangles. Encoders read the host copy,
+// which the guest cannot tear while it is being encoded.
+//
+// When the hypervisor cannot track dirty pages, refreshes compare the whole
+// framebuffer instead, which finds the same rectangles at a higher cost.
+class Framebuffer {
+public:
+    // Changed pixels on a row that are closer than this are reported in the
+    // same rectangle; encoding a few unchanged pixels is cheaper than
+    // starting another rectangle.
+    static const uint32_t MergeGap = 32;
+
+    struct Stats {
+        uint64_t refreshes;
+        uint64_t dirtyPages;     // Pages reported dirty by the hypervisor
+        uint64_t pagesCompared;  // Pages compared against the host copy
+        uint64_t rects;          // Rectangles reported
+        uint64_t pixels;         // Pixels in the reported rectangles
+        std::chrono::nanoseconds refreshTime;  // Host time spent refreshing
+    };
+
+    // Invoked by the refresh thread with the rectangles that changed. Not
+    // invoked for refreshes that found no changes.
+    using RefreshFunc = std::function<void(const Framebuffer& fb, const std::vector<DirtyRect>& rects)>;
+
+    Framebuffer(uint32_t width, uint32_t height) noexcept;
+    ~Framebuffer() noexcept;
+
+    Framebuffer(const Framebuffer&) = delete;
+    Framebuffer& operator=(const Framebuffer&) = delete;
+
+    bool IsValid() const noexcept { return m_memory != nullptr; }
+
+    uint32_t Width() const noexcept { return m_width; }
+    uint32_t Height() const noexcept { return m_height; }
+
+    // The framebuffer as the guest sees it.
+    const uint32_t *Memory() const noexcept { return (const uint32_t *)m_memory; }
+
+    // Size of the guest mapping, rounded up to whole pages.
+    uint64_t Size() const noexcept { return m_size; }
+
+    // Maps the framebuffer into the virtual machine at a page-aligned
+    // address. Dirty page tracking is used if requested and the hypervisor
+    // supports it; IsTrackingDirtyPages tells which way refreshes work.
+    virt86::MemoryMappingStatus Map(virt86::VirtualMachine& vm, uint64_t address, bool trackDirtyPages = true) noexcept;
+
+    bool IsTrackingDirtyPages() const noexcept { return m_tracking; }
+
+    // Reads and clears the hypervisor's record of the pages written to, for
+    // the next refresh to compare. Must be called while no virtual processor
+    // is running, for example from an I/O handler on the thread of the only
+    // processor; a page written between reading and clearing the record
+    // would otherwise never be refreshed. Does nothing without dirty page
+    // tracking.
+    void CollectDirtyPages() noexcept;
+
+    // Finds the rectangles changed in the pages collected since the previous
+    // refresh and updates the host copy. The first refresh after mapping compares every pixel, so it
+    // reports everything that is not black. Must not be called while the
+    // refresh thread is running.
+    void Refresh(std::vector<DirtyRect>& rects) noexcept;
+
+    // The host copy of the screen as of the last refresh.
+    const uint32_t *Pixels() const noexcept { return m_shadow.data(); }
+
+    // Starts a thread that refreshes the framebuffer at the given interval.
+    void Start(std::chrono::milliseconds interval, RefreshFunc func) noexcept;
+
+    // Stops the refresh thread after one last refresh, which compares every
+    // pixel to pick up writes that were never collected.
+    void Stop() noexcept;
+
+    // Blocks until a refresh that started after this call has finished, so
+    // that everything the guest drew so far has been seen. Returns
+    // immediately if the refresh thread is not running.
+    void WaitForRefresh() noexcept;
+
+    Stats GetStats() noexcept;
+
+private:
+    const uint32_t m_width;
+    const uint32_t m_height;
+    const uint64_t m_size;
+    uint8_t *m_memory = nullptr;  // Guest memory
+
+    virt86::VirtualMachine *m_vm = nullptr;
+    uint64_t m_address = 0;
+    bool m_tracking = false;
+
+    // Only touched by whoever collects dirty pages
+    std::vector<uint64_t> m_bitmap;
+
+    // Only touched by whoever refreshes
+    std::vector<uint32_t> m_shadow;
+    std::vector<uint64_t> m_collected;  // Pages taken from m_pending
+    std::vector<uint32_t> m_rowFirst;  // Range of columns to compare on each row,
+    std::vector<uint32_t> m_rowLast;   // empty when first > last
+    bool m_scanAll = true;
+    std::vector<DirtyRect> m_spans;  // Changed pixels on the current row
+    std::vector<DirtyRect> m_open;   // Rectangles that reached the previous row
+    std::vector<DirtyRect> m_next;   // Rectangles that reach the current row
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<uint64_t> m_pending;  // Pages collected since the last refresh
+    Stats m_stats = { 0 };
+    uint64_t m_started = 0;    // Refreshes started by the refresh thread
+    uint64_t m_completed = 0;  // Refreshes finished by the refresh thread
+    bool m_running = false;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    // Marks the rows covered by the pages collected since the previous
+    // refresh, or every row without dirty page tracking.
+    void MarkDirtyRows() noexcept;
+
+    // Compares the marked columns of a row with the host copy, copies the
+    // changed pixels and returns them as one pixel high spans.
+    void UpdateRow(uint32_t y, std::vector<DirtyRect>& spans) noexcept;
+
+    void RefreshThread(std::chrono::milliseconds interval, RefreshFunc func) noexcept;
+};
+
+// Writes a rectangle of a 32 bits per pixel image to a binary PPM file.
+bool writePPM(const char *path, const uint32_t *pixels, uint32_t stride, const DirtyRect& rect) noexcept;
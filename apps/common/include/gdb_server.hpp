@@ -0,0 +1,173 @@
+/*
+Declares a GDB remote serial protocol server for debugging a virtual
+processor with gdb.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "vp_scheduler.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Register layout presented to gdb. Must match the architecture selected in
+// gdb with "set architecture i386" or "set architecture i386:x86-64".
+enum class GDBArch {
+    X86,     // 32-bit: eax..edi, eip, eflags, segment selectors
+    X86_64,  // 64-bit: rax..r15, rip, eflags, segment selectors
+};
+
+enum class GDBSessionEnd {
+    Detached,      // The debugger detached; the guest may keep running
+    Killed,        // The debugger asked to kill the guest
+    Disconnected,  // The connection was lost
+    Failed,        // The virtual processor failed to run
+};
+
+// Serves a single gdb connection, mapping remote protocol packets to the
+// virtual processor's debugging primitives:
+// - g/G, p/P: registers, read and written in a single batch
+// - m/M/X: memory, copied directly through host pointers when the guest
+//   physical address is backed by a region registered with AddMemoryRegion
+// - Z0/z0: software breakpoints (INT3)
+// - Z1-Z4/z1-z4: hardware breakpoints and watchpoints (up to 4)
+// - c, s, vCont with continue, step and range step actions
+//
+// Stop replies carry the program counter, stack pointer and frame pointer, so
+// gdb does not need to fetch the register file after every step. Range
+// stepping (used by gdb's "next" and "step" when "set range-stepping on" is in
+// effect) keeps stepping on the server until the program counter leaves the
+// range, reading nothing but the program counter in between.
+//
+// A running guest can be interrupted with Ctrl-C in gdb as long as it keeps
+// causing VM exits.
+class GDBServer {
+public:
+    GDBServer(virt86::VirtualProcessor& vp, GDBArch arch) noexcept;
+    ~GDBServer() noexcept;
+
+    // Registers host memory backing a range of guest physical memory.
+    void AddMemoryRegion(uint64_t guestBase, uint64_t size, uint8_t *hostMemory) noexcept;
+
+    // Handles VM exits other than breakpoints and steps while the guest runs.
+    // Return false to stop and report to the debugger. By default, only I/O,
+    // MMIO, cancellations and interrupt windows resume execution.
+    void SetExitHandler(VMExitHandler handler) noexcept { m_exitHandler = std::move(handler); }
+
+    // Listens for a debugger on the given TCP port on the loopback interface.
+    bool ListenTCP(uint16_t port) noexcept;
+
+    // Listens for a debugger on a Unix domain socket. Not available on Windows.
+    bool ListenUnix(const char *path) noexcept;
+
+    // Waits for a debugger to connect.
+    bool Accept() noexcept;
+
+    // Serves the connected debugger until the session ends. The guest only
+    // runs when the debugger resumes it.
+    GDBSessionEnd Serve() noexcept;
+
+private:
+    struct HostRegion {
+        uint64_t guestBase;
+        uint64_t size;
+        uint8_t *hostMemory;
+    };
+
+    struct HardwareBreakpointSlot {
+        bool used;
+        uint64_t address;
+        uint8_t type;    // gdb breakpoint type: 1 = execution, 2 = write, 3 = read, 4 = access
+        uint8_t length;
+    };
+
+    virt86::VirtualProcessor& m_vp;
+    const GDBArch m_arch;
+    VMExitHandler m_exitHandler;
+
+    intptr_t m_listenSocket;
+    intptr_t m_socket;
+    std::string m_unixPath;
+
+    std::vector<HostRegion> m_regions;
+    std::map<uint64_t, uint8_t> m_swBreakpoints;  // address -> original byte
+    HardwareBreakpointSlot m_hwBreakpoints[4] = {};
+
+    bool m_noAck = false;
+    std::string m_rxBuffer;
+
+    // Register file cache, fetched in one batch on first use after each stop
+    std::vector<virt86::RegValue> m_regCache;
+    bool m_regCacheValid = false;
+
+    // ----- Transport ------------------------------------------------------------------------------------------------------
+
+    // Receives the next packet. Returns false if the connection is lost.
+    bool ReceivePacket(std::string& packet) noexcept;
+    bool SendPacket(const std::string& payload) noexcept;
+    bool SendRaw(const char *data, size_t size) noexcept;
+    // Checks for a pending interrupt request (Ctrl-C) without blocking.
+    bool PollInterrupt() noexcept;
+
+    // ----- Guest access ---------------------------------------------------------------------------------------------------
+
+    size_t NumRegisters() const noexcept;
+    bool FetchRegisters() noexcept;
+    bool StoreRegisters() noexcept;
+    std::string EncodeRegister(size_t index) const noexcept;
+    bool DecodeRegister(size_t index, const char *hex, size_t hexLen) noexcept;
+    uint64_t ReadPC() noexcept;
+
+    uint8_t *HostPointer(uint64_t guestPhys, size_t size) noexcept;
+    bool ReadMemory(uint64_t address, size_t size, uint8_t *data) noexcept;
+    bool WriteMemory(uint64_t address, size_t size, const uint8_t *data) noexcept;
+
+    bool InsertBreakpoint(uint8_t type, uint64_t address, uint8_t length) noexcept;
+    bool RemoveBreakpoint(uint8_t type, uint64_t address, uint8_t length) noexcept;
+    bool ApplyHardwareBreakpoints() noexcept;
+    void RemoveAllBreakpoints() noexcept;
+
+    // ----- Execution ------------------------------------------------------------------------------------------------------
+
+    enum class ResumeMode { Continue, Step, RangeStep };
+
+    // Runs or steps the guest and builds the stop reply for the debugger.
+    // Returns false if the virtual processor failed to run.
+    bool Resume(std::string& reply, ResumeMode mode, uint64_t rangeStart = 0, uint64_t rangeEnd = 0) noexcept;
+    // Executes one instruction, stepping over a software breakpoint planted
+    // at the current instruction if necessary.
+    bool StepOnce(virt86::VMExitReason& reason) noexcept;
+    bool HandleExit(const virt86::VMExitInfo& exitInfo) noexcept;
+    std::string StopReply(int signal, const char *reason = nullptr, uint64_t address = 0) noexcept;
+    std::string HardwareBreakpointStopReply() noexcept;
+
+    // ----- Packet handlers ------------------------------------------------------------------------------------------------
+
+    std::string HandleQuery(const std::string& packet) noexcept;
+    // Returns false if the virtual processor failed to run.
+    bool HandleVCont(const std::string& packet, std::string& reply) noexcept;
+};
@@ -0,0 +1,184 @@
+/*
+Declares a recorder and replayer of the non-deterministic inputs of a virtual
+processor: I/O and MMIO reads, CPUID results and injected interrupts.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "io_bus.hpp"
+#include "x86_decoder.hpp"
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+// Log layout: "V86INPUT", u32 version, u32 mode (16/32/64), then one record
+// per input, each starting with a tag byte:
+//
+//   0x1s  I/O read:    LEB128 port, LEB128 value
+//   0x2s  MMIO read:   zigzag LEB128 address delta from the previous MMIO
+//                      read, LEB128 value
+//   0x30  CPUID:       LEB128 function, LEB128 EAX, EBX, ECX, EDX results
+//   0x40  Interrupt:   u8 vector, LEB128 synchronous input count delta from
+//                      the previous interrupt, LEB128 instruction pointer,
+//                      u32 register fingerprint
+//   0x00  End of log
+//
+// where s is log2 of the access size. A typical I/O or MMIO read takes 3 to 6
+// bytes, so the log can be left enabled in production.
+//
+// I/O, MMIO and CPUID inputs are synchronous: the guest receives them at the
+// same points in every run, so replaying them in order is enough. Interrupts
+// arrive between instructions at points chosen by the host; their position is
+// recorded as the number of synchronous inputs received before them plus the
+// instruction pointer and a hash of the general purpose registers and flags.
+// The replayer runs to the instruction pointer with an execution breakpoint
+// and injects the interrupt once the register hash matches, which pins down
+// the iteration of a loop as long as its counter lives in a register.
+enum class InputLogMode {
+    Off,
+    Record,
+    Replay,
+};
+
+// Handles CPUID exits while recording by writing the results to EAX, EBX,
+// ECX and EDX.
+typedef std::function<void(virt86::VirtualProcessor& vp)> CPUIDHandler;
+
+// Records or replays the inputs of one virtual processor. Attach interposes
+// the log between the virtual machine and the I/O bus; the guest must then be
+// run with Run and receive interrupts through EnqueueInterrupt, both from the
+// virtual processor's thread.
+//
+// While replaying, I/O and MMIO reads are served from the log without reaching
+// the devices, while writes still reach them so that the replayed guest
+// produces the same output. Interrupts come exclusively from the log, so
+// EnqueueInterrupt does nothing. Replaying requires guest debugging support.
+class InputLog {
+public:
+    InputLog(virt86::VirtualProcessor& vp, X86Mode mode) noexcept;
+    ~InputLog() noexcept { Close(); }
+
+    bool StartRecording(const char *path) noexcept;
+    bool StartReplay(const char *path) noexcept;
+    void Close() noexcept;
+
+    // Installs the log as the I/O and MMIO handler of the virtual machine,
+    // forwarding accesses to the bus.
+    void Attach(virt86::VirtualMachine& vm, IOBus& bus) noexcept;
+
+    void SetCPUIDHandler(CPUIDHandler handler) noexcept { m_cpuidHandler = std::move(handler); }
+
+    // Runs the virtual processor. CPUID exits are handled internally. While
+    // replaying, recorded interrupts are injected at their positions, and HLT
+    // exits only return once the log has no interrupt left to wake the guest.
+    virt86::VPExecutionStatus Run() noexcept;
+
+    // Enqueues an interrupt, recording its position.
+    bool EnqueueInterrupt(uint8_t vector) noexcept;
+
+    InputLogMode Mode() const noexcept { return m_mode; }
+
+    // Returns true if the replayed guest requested an input different from
+    // the one recorded, after which Run fails.
+    bool Diverged() const noexcept { return m_diverged; }
+
+    // Describes the first divergence, or returns NULL if there was none.
+    const char *DivergenceReason() const noexcept { return m_diverged ? m_divergenceReason : NULL; }
+
+    // Number of inputs replayed before the first divergence.
+    uint64_t DivergenceInput() const noexcept { return m_divergenceInput; }
+
+    // Returns true once every recorded input has been replayed.
+    bool ReplayComplete() const noexcept;
+
+    uint64_t InputCount() const noexcept { return m_syncCount + m_interruptCount; }
+    uint64_t BytesWritten() const noexcept { return m_bytesWritten; }
+
+private:
+    enum Tag : uint8_t {
+        TagEnd = 0x00,
+        TagIORead = 0x10,
+        TagMMIORead = 0x20,
+        TagCPUID = 0x30,
+        TagInterrupt = 0x40,
+    };
+
+    struct Position {
+        uint64_t ip;
+        uint32_t fingerprint;
+    };
+
+    struct PendingInterrupt {
+        bool valid;
+        uint8_t vector;
+        uint64_t syncCount;
+        Position position;
+    };
+
+    virt86::VirtualProcessor& m_vp;
+    const X86Mode m_cpuMode;
+    InputLogMode m_mode = InputLogMode::Off;
+    IOBus *m_bus = nullptr;
+    CPUIDHandler m_cpuidHandler;
+    FILE *m_file = NULL;
+
+    // Recording
+    std::vector<uint8_t> m_buffer;
+    uint64_t m_bytesWritten = 0;
+
+    // Replaying
+    std::vector<uint8_t> m_log;
+    size_t m_readPos = 0;
+    PendingInterrupt m_nextInterrupt = { false };
+    bool m_breakpointArmed = false;
+    bool m_diverged = false;
+    const char *m_divergenceReason = NULL;
+    uint64_t m_divergenceInput = 0;
+
+    uint64_t m_syncCount = 0;
+    uint64_t m_interruptCount = 0;
+    uint64_t m_lastInterruptSync = 0;
+    uint64_t m_lastMMIOAddress = 0;
+
+    bool ReadPosition(Position& position) noexcept;
+    bool ArmBreakpoint(uint64_t ip) noexcept;
+    void DisarmBreakpoint() noexcept;
+    void Flush() noexcept;
+    bool BeginRead(uint8_t tag) noexcept;
+    bool ReadVarint(uint64_t& value) noexcept;
+    void LoadNextInterrupt() noexcept;
+    bool HandleCPUID() noexcept;
+    bool ReplayInterrupts() noexcept;
+    // Records the first divergence; what must outlive the log, such as a
+    // string literal
+    void Diverge(const char *what) noexcept;
+
+    static uint32_t ioReadCallback(void *context, uint16_t port, size_t size) noexcept;
+    static void ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept;
+    static uint64_t mmioReadCallback(void *context, uint64_t address, size_t size) noexcept;
+    static void mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept;
+};
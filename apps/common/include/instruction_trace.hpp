@@ -0,0 +1,149 @@
+/*
+Declares a single-step instruction trace recorder with delta-compressed
+register state, and a reader for the traces it produces.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "x86_decoder.hpp"
+
+#include <cstdio>
+#include <vector>
+
+// Trace file layout (all integers little-endian):
+//
+//   Header:  "V86TRACE", u32 version, u32 mode (16/32/64), u32 register count,
+//            u32 keyframe interval
+//   Chunks:  u32 'CHNK', u64 first step, u32 entry count, u32 data size,
+//            u64 registers[register count] (state at the first step),
+//            data[data size] (one delta record per following step)
+//
+// A delta record holds a LEB128 bitmask of the registers that changed since
+// the previous step, followed by the change of each of those registers as a
+// zigzag-encoded LEB128 difference. The instruction pointer advances by a few
+// bytes and only one or two other registers change per instruction, so a step
+// typically takes 3 to 6 bytes instead of a full register dump.
+//
+// Every chunk starts with a keyframe, so a reader can seek to any step by
+// decoding at most one chunk.
+
+// Returns the number of registers recorded in traces of the given mode.
+size_t traceRegisterCount(X86Mode mode) noexcept;
+
+// Returns the name of a register recorded in traces of the given mode, or
+// NULL if the index is out of range.
+const char *traceRegisterName(X86Mode mode, size_t index) noexcept;
+
+// Returns the index of the instruction pointer in traces of the given mode.
+size_t traceIPIndex(X86Mode mode) noexcept;
+
+class TraceRecorder {
+public:
+    TraceRecorder(virt86::VirtualProcessor& vp, X86Mode mode, uint32_t keyframeInterval = 65536) noexcept;
+    ~TraceRecorder() noexcept { Close(); }
+
+    bool Open(const char *path) noexcept;
+    bool Close() noexcept;
+
+    // Records the current register state as the next step of the trace.
+    bool Capture() noexcept;
+
+    // Single-steps the virtual processor and records the resulting state.
+    virt86::VPExecutionStatus Step() noexcept;
+
+    uint64_t Steps() const noexcept { return m_steps; }
+    uint64_t BytesWritten() const noexcept { return m_bytesWritten; }
+
+private:
+    virt86::VirtualProcessor& m_vp;
+    const X86Mode m_mode;
+    const uint32_t m_keyframeInterval;
+    FILE *m_file = NULL;
+
+    std::vector<virt86::RegValue> m_values;
+    std::vector<uint64_t> m_current;
+    std::vector<uint64_t> m_previous;
+    std::vector<uint64_t> m_keyframe;
+    std::vector<uint8_t> m_chunk;
+    uint64_t m_chunkFirstStep = 0;
+    uint32_t m_chunkEntries = 0;
+
+    uint64_t m_steps = 0;
+    uint64_t m_bytesWritten = 0;
+    bool m_ok = true;
+
+    bool FlushChunk() noexcept;
+};
+
+class TraceReader {
+public:
+    ~TraceReader() noexcept { Close(); }
+
+    bool Open(const char *path) noexcept;
+    void Close() noexcept;
+
+    X86Mode Mode() const noexcept { return m_mode; }
+    size_t RegisterCount() const noexcept { return m_regs.size(); }
+    uint64_t TotalSteps() const noexcept { return m_totalSteps; }
+
+    // Advances to the next step. Returns false at the end of the trace. The
+    // first call positions the reader at step 0.
+    bool Next() noexcept;
+
+    // Positions the reader at the given step.
+    bool Seek(uint64_t step) noexcept;
+
+    uint64_t Step() const noexcept { return m_step; }
+    uint64_t Register(size_t index) const noexcept { return m_regs[index]; }
+    uint64_t IP() const noexcept { return m_regs[traceIPIndex(m_mode)]; }
+
+    // Bitmask of registers that changed in the current step.
+    uint64_t ChangedMask() const noexcept { return m_changed; }
+
+private:
+    struct ChunkInfo {
+        long offset;
+        uint64_t firstStep;
+        uint32_t entries;
+        uint32_t dataSize;
+    };
+
+    FILE *m_file = NULL;
+    X86Mode m_mode = X86Mode::Bits32;
+    std::vector<ChunkInfo> m_chunks;
+    uint64_t m_totalSteps = 0;
+
+    std::vector<uint64_t> m_regs;
+    std::vector<uint8_t> m_data;
+    size_t m_chunkIndex = 0;
+    size_t m_dataPos = 0;
+    uint32_t m_entryInChunk = 0;
+    bool m_positioned = false;
+    uint64_t m_step = 0;
+    uint64_t m_changed = 0;
+
+    bool LoadChunk(size_t index) noexcept;
+};
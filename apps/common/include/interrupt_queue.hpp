@@ -0,0 +1,60 @@
+/*
+Declares a queue of interrupts raised by device backends for a virtual
+processor, which also lets a halted processor sleep until one arrives.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "vp_scheduler.hpp"
+
+#include <mutex>
+#include <vector>
+
+// Interrupts may be raised from any thread, such as an event loop servicing
+// device backends. They are injected into the virtual processor from its own
+// thread by Deliver, typically after each VM exit.
+class InterruptQueue {
+public:
+    // Queues an interrupt and wakes up the virtual processor if it is waiting.
+    void Raise(uint8_t vector) noexcept;
+
+    bool HasPending() noexcept;
+
+    // Waits until an interrupt is pending. Use this when the virtual processor
+    // exits on HLT instead of running it again. On a VPScheduler this parks
+    // the processor and frees its thread; elsewhere it blocks the thread.
+    // Either way, an idle guest consumes no host CPU time.
+    void WaitForInterrupt() noexcept;
+
+    // Enqueues all pending interrupts into the virtual processor. Returns the
+    // number of interrupts enqueued.
+    size_t Deliver(virt86::VirtualProcessor& vp) noexcept;
+
+private:
+    std::mutex m_mutex;
+    std::vector<uint8_t> m_pending;
+    AsyncOperation *m_waiter = nullptr;
+};
@@ -0,0 +1,122 @@
+/*
+Declares the I/O bus, which routes port and MMIO accesses from a virtual
+machine to device models.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include <cinttypes>
+#include <vector>
+
+class ReferenceCPU;
+
+// Base class for device models attached to an IOBus.
+// Handlers receive the absolute port number or guest physical address of the
+// access. Unimplemented reads return all ones, like an open bus.
+class IODevice {
+public:
+    virtual ~IODevice() = default;
+
+    virtual uint32_t IORead(uint16_t port, size_t size) noexcept { return 0xFFFFFFFF; }
+    virtual void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {}
+
+    virtual uint64_t MMIORead(uint64_t address, size_t size) noexcept { return ~0ull; }
+    virtual void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept {}
+
+    // String I/O, such as the elements of REP OUTS and REP INS, as coalesced
+    // by IOBus::Run. Elements of the given size are packed in data.
+    //
+    // IOWriteString receives count elements written to the port. By default
+    // they are handed to IOWrite one at a time.
+    virtual void IOWriteString(uint16_t port, size_t size, const uint8_t *data, size_t count) noexcept;
+
+    // IOPeekString copies up to count elements that reads from the port
+    // would return without consuming them, and returns how many it copied.
+    // IOConsumeString then consumes the ones the guest actually read, which
+    // may be fewer. By default no elements are peeked, so reads are handed
+    // to IORead one at a time.
+    virtual size_t IOPeekString(uint16_t port, size_t size, uint8_t *data, size_t count) noexcept { return 0; }
+    virtual void IOConsumeString(uint16_t port, size_t size, size_t count) noexcept {}
+};
+
+// Routes I/O and MMIO accesses to the devices registered on address ranges.
+// Devices must be added before the virtual processors start running.
+class IOBus {
+public:
+    // Installs the bus as the I/O and MMIO handler of the virtual machine.
+    void Attach(virt86::VirtualMachine& vm) noexcept;
+    void Attach(ReferenceCPU& cpu) noexcept;
+
+    // Registers a device on a range of ports. Fails if the range overlaps
+    // another device.
+    bool AddPIODevice(uint16_t basePort, uint32_t numPorts, IODevice& device) noexcept;
+
+    // Registers a device on a range of guest physical addresses. Fails if the
+    // range overlaps another device.
+    bool AddMMIODevice(uint64_t baseAddress, uint64_t size, IODevice& device) noexcept;
+
+    // Runs the processor until the next VM exit, coalescing string I/O.
+    // Hypervisors hand every element of a string I/O instruction to the I/O
+    // callbacks one at a time within a single exit. While the bus runs a
+    // processor this way, consecutive writes to one port are buffered and
+    // handed to the device's IOWriteString at once, before any other access
+    // and by the time Run returns. The second consecutive read from one port
+    // within an exit peeks a page worth of elements with IOPeekString, and
+    // the rest of the reads are served from them.
+    //
+    // Call it in place of vp.Run(), or hand the bus to VPScheduler::AddVP.
+    // The coalescing state belongs to the call, so processors parked by
+    // awaitOperation in the middle of an exit don't disturb each other.
+    // A write may reach its device only once the exit that made it is over.
+    virt86::VPExecutionStatus Run(virt86::VirtualProcessor& vp) noexcept;
+
+    // Dispatches accesses to the registered devices.
+    uint32_t IORead(uint16_t port, size_t size) noexcept;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept;
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept;
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept;
+
+    IODevice *FindPIODevice(uint16_t port) const noexcept;
+    IODevice *FindMMIODevice(uint64_t address) const noexcept;
+
+private:
+    // Address ranges are kept sorted by base address
+    struct Range {
+        uint64_t base;
+        uint64_t size;
+        IODevice *device;
+    };
+    std::vector<Range> m_pioRanges;
+    std::vector<Range> m_mmioRanges;
+
+    static bool insertRange(std::vector<Range>& ranges, uint64_t base, uint64_t size, IODevice& device) noexcept;
+    static IODevice *findRange(const std::vector<Range>& ranges, uint64_t address) noexcept;
+
+    static uint32_t ioReadCallback(void *context, uint16_t port, size_t size) noexcept;
+    static void ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept;
+    static uint64_t mmioReadCallback(void *context, uint64_t address, size_t size) noexcept;
+    static void mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept;
+};
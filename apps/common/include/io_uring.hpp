@@ -0,0 +1,117 @@
+/*
+Declares a minimal io_uring wrapper built directly on the system calls.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+
+#include <cinttypes>
+#include <stddef.h>
+
+// Owns an io_uring instance and its shared rings. No library is needed; the
+// rings are mapped and driven with the raw system calls.
+//
+// Only one thread at a time may get and submit entries, and only one thread
+// at a time may reap completions, but these may be two different threads.
+class IOUring {
+public:
+    IOUring() noexcept = default;
+    ~IOUring() noexcept { Close(); }
+
+    IOUring(const IOUring&) = delete;
+    IOUring& operator=(const IOUring&) = delete;
+
+    // Creates a ring with room for the given number of submissions. The
+    // completion queue is twice as large. Fails if io_uring is not available,
+    // such as on kernels older than 5.1 or when it is blocked by a seccomp
+    // policy. Kernels that have io_uring may still lack the operations a user
+    // needs; check them with SupportsOpcode.
+    bool Setup(uint32_t entries) noexcept;
+    void Close() noexcept;
+
+    bool IsValid() const noexcept { return m_ringFD >= 0; }
+
+    // Returns a zeroed submission queue entry, or NULL if the queue is full.
+    // The entry is handed to the kernel by the next call to Submit.
+    io_uring_sqe *GetSQE() noexcept;
+
+    // Submits every entry obtained since the previous call, normally with a
+    // single system call. Returns the number of entries consumed by the
+    // kernel or a negative errno such as -EAGAIN or -EBUSY when the kernel is
+    // short of resources. Entries that were not consumed are retried on the
+    // next call.
+    int Submit() noexcept;
+
+    // Blocks until at least the given number of completions are available.
+    bool WaitForCompletions(uint32_t count) noexcept;
+
+    // Invokes func(const io_uring_cqe&) for every available completion, then
+    // releases them all at once. Returns the number of completions.
+    template<typename Func>
+    size_t ReapCompletions(Func func) noexcept {
+        uint32_t head = *m_cqHead;
+        const uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        const size_t count = tail - head;
+        for (; head != tail; head++) {
+            func(m_cqes[head & m_cqMask]);
+        }
+        __atomic_store_n(m_cqHead, tail, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Has the kernel signal an eventfd whenever completions are posted.
+    bool RegisterEventFD(int fd) noexcept;
+
+    // Asks the kernel whether it supports an IORING_OP_* operation. Kernels
+    // older than 5.6 cannot be asked and report nothing as supported.
+    bool SupportsOpcode(uint8_t opcode) const noexcept;
+
+private:
+    int m_ringFD = -1;
+
+    void *m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void *m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    uint32_t *m_sqHead = nullptr;
+    uint32_t *m_sqTail = nullptr;
+    uint32_t *m_sqArray = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+    uint32_t m_sqLocalTail = 0;  // Tail including entries not yet published to the kernel
+    uint32_t m_sqPending = 0;    // Entries published but not yet consumed by the kernel
+
+    uint32_t *m_cqHead = nullptr;
+    uint32_t *m_cqTail = nullptr;
+    uint32_t m_cqMask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*
+Declares an emulated local APIC for inter-processor interrupts between
+virtual processors running on separate host threads.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "io_bus.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#if !defined(__linux__)
+#  include <condition_variable>
+#  include <mutex>
+#endif
+
+const uint64_t LAPIC_BASE = 0xFEE00000;
+const uint64_t LAPIC_SIZE = 0x1000;
+
+// The interrupt state of a single virtual processor.
+//
+// Interrupts are posted to a lock-free mailbox (a 256-bit request register)
+// from any thread. Posting only wakes up the target processor if it is
+// waiting for interrupts, so senders never contend on a shared lock and never
+// disturb other processors. A processor that is running guest code picks up
+// posted interrupts on its next VM exit.
+class LocalAPIC {
+public:
+    explicit LocalAPIC(uint8_t id) noexcept : m_id(id) {}
+
+    uint8_t ID() const noexcept { return m_id; }
+
+    // Posts an interrupt to this processor and kicks it if it is waiting.
+    // Can be called from any thread.
+    void Post(uint8_t vector) noexcept;
+
+    // Wakes up the processor if it is waiting, without posting an interrupt.
+    // Can be called from any thread.
+    void Kick() noexcept;
+
+    bool HasPending() const noexcept;
+
+    // Waits until an interrupt is posted or the processor is kicked. Polls the
+    // mailbox up to spinIterations times before going to sleep, trading host
+    // CPU time for wakeup latency. Must be called from the processor's thread.
+    void WaitForInterrupt(uint32_t spinIterations = 0) noexcept;
+
+    // Enqueues all posted interrupts into the virtual processor, highest
+    // vector first. Returns the number of interrupts enqueued. Must be called
+    // from the processor's thread.
+    size_t Deliver(virt86::VirtualProcessor& vp) noexcept;
+
+    uint64_t IPIsSent() const noexcept { return m_ipisSent; }
+    uint64_t IPIsReceived() const noexcept { return m_ipisReceived; }
+
+private:
+    friend class APICBus;
+
+    const uint8_t m_id;
+    std::atomic<uint64_t> m_irr[4] = {};
+    std::atomic<uint32_t> m_sleeping{ 0 };
+#if !defined(__linux__)
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCond;
+#endif
+
+    std::atomic<uint64_t> m_ipisSent{ 0 };
+    std::atomic<uint64_t> m_ipisReceived{ 0 };
+
+    // Registers only accessed by the owning processor
+    uint32_t m_tpr = 0;
+    uint32_t m_svr = 0xFF;
+    uint32_t m_icrHigh = 0;
+};
+
+// Emulates the local APIC register page of every processor in a virtual
+// machine. Add it to an IOBus as an MMIO device at LAPIC_BASE.
+//
+// virt86 dispatches MMIO accesses without identifying the processor that made
+// them, so each processor thread must call BindCurrentThread before running
+// its processor. Register accesses then go to that processor's local APIC.
+//
+// Supported registers: ID, version, TPR, EOI, spurious vector and the
+// interrupt command register, with fixed delivery in physical destination
+// mode and all destination shorthands. In-service tracking is not modeled, so
+// writes to EOI are accepted and ignored.
+class APICBus : public IODevice {
+public:
+    explicit APICBus(size_t numProcessors) noexcept;
+
+    size_t Count() const noexcept { return m_apics.size(); }
+    LocalAPIC& Get(size_t index) noexcept { return *m_apics[index]; }
+
+    // Routes local APIC register accesses made on the calling thread to the
+    // specified processor.
+    void BindCurrentThread(size_t index) noexcept;
+
+    // Sends an interrupt from one processor to others, as if the source
+    // processor had written the interrupt command register.
+    void SendIPI(LocalAPIC& source, uint32_t icrLow, uint32_t icrHigh) noexcept;
+
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override;
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept override;
+
+private:
+    std::vector<std::unique_ptr<LocalAPIC>> m_apics;
+};
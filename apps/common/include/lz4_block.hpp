@@ -0,0 +1,42 @@
+/*
+Declares a compressor and decompressor for the LZ4 block format.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cinttypes>
+#include <stddef.h>
+
+// Returns the largest size a block of the given size can compress to.
+size_t lz4CompressBound(size_t size) noexcept;
+
+// Compresses src into an LZ4 block, as described in the LZ4 block format
+// specification. Each block is independent and can be decoded by any LZ4
+// implementation with LZ4_decompress_safe. Returns the compressed size, or 0
+// if the output does not fit in dstCapacity.
+size_t lz4Compress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity) noexcept;
+
+// Decompresses an LZ4 block that must expand to exactly dstSize bytes.
+// Returns false if the block is malformed.
+bool lz4Decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize) noexcept;
@@ -0,0 +1,183 @@
+/*
+Declares a pre-copy live migration engine that streams guest RAM and
+processor state while the virtual machine keeps running.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "vp_state.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A byte stream carrying a migration: a regular file or a connected Unix
+// domain socket. Unix sockets are not available on Windows.
+class MigrationChannel {
+public:
+    MigrationChannel() noexcept = default;
+    ~MigrationChannel() noexcept { Close(); }
+
+    MigrationChannel(const MigrationChannel&) = delete;
+    MigrationChannel& operator=(const MigrationChannel&) = delete;
+
+    // Opens a file for writing (creating or truncating it) or for reading.
+    bool OpenFile(const char *path, bool write) noexcept;
+
+    // Creates a Unix socket at the path and waits for one sender to connect.
+    bool ListenUnix(const char *path) noexcept;
+    bool ConnectUnix(const char *path) noexcept;
+
+    bool Write(const void *data, size_t size) noexcept;
+    bool Read(void *data, size_t size) noexcept;
+    void Close() noexcept;
+
+    uint64_t BytesWritten() const noexcept { return m_bytesWritten; }
+    uint64_t BytesRead() const noexcept { return m_bytesRead; }
+
+private:
+    intptr_t m_fd = -1;
+    bool m_socket = false;
+    std::string m_unixPath;
+    uint64_t m_bytesWritten = 0;
+    uint64_t m_bytesRead = 0;
+};
+
+// Sends the RAM and processor state of a running single-processor virtual
+// machine through a channel using pre-copy migration.
+//
+// The first round sends every page of RAM. Each following round briefly
+// pauses the virtual processor to collect and clear the pages the guest wrote
+// to since the previous round, then sends only those while the guest runs.
+// Once a round is small enough, or after too many rounds, the processor stays
+// paused for the final round, which sends the remaining dirty pages and the
+// register state. Apart from the brief pauses, the guest is down only during
+// that round.
+//
+// virt86 cannot interrupt a running processor from another thread, so the
+// pause is cooperative: the thread running the processor must call SafePoint
+// after every VM exit, and the guest must exit regularly. Migrate runs on a
+// different thread.
+//
+// RAM must be mapped with MemoryFlags::DirtyPageTracking. If the platform
+// does not track dirty pages, the entire RAM is sent again in the final round.
+class MigrationSource {
+public:
+    struct Options {
+        size_t maxRounds = 30;           // Rounds before the processor is paused regardless of progress
+        uint64_t stopThresholdPages = 64; // Dirty page count at which the processor is paused
+    };
+
+    struct Stats {
+        size_t rounds;                       // Including the first full round and the final round
+        std::vector<uint64_t> pagesPerRound;
+        uint64_t pagesSent;
+        uint64_t bytesSent;
+        uint64_t downtimeNs;                 // From the processor pausing until the final round was sent
+        uint64_t totalNs;
+        bool dirtyPageTracking;
+    };
+
+    MigrationSource(virt86::VirtualMachine& vm, virt86::VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+
+    // Migrates the virtual machine through the channel. Blocks until the final
+    // round is sent or the migration fails. If the migration succeeds, the
+    // processor must not run again.
+    bool Migrate(MigrationChannel& channel, const Options& options) noexcept;
+
+    // Called by the thread running the processor after every VM exit. Returns
+    // true if the virtual machine was migrated and the processor must stop.
+    // Returns false quickly when there is nothing to do.
+    bool SafePoint() noexcept;
+
+    // Called by the thread running the processor when it stops running the
+    // guest for any other reason, so that a pending migration fails instead
+    // of waiting for a safe point that will never come.
+    void Detach() noexcept;
+
+    const Stats& GetStats() const noexcept { return m_stats; }
+
+private:
+    enum class State { Idle, Running, PauseRequested, Paused, Done, Detached };
+
+    virt86::VirtualMachine& m_vm;
+    virt86::VirtualProcessor& m_vp;
+    uint8_t *m_ram;
+    uint64_t m_ramBase;
+    uint64_t m_ramSize;
+    uint64_t m_numPages;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::atomic<State> m_state{ State::Idle };
+    bool m_migrated = false;
+    std::chrono::steady_clock::time_point m_pauseStart;
+
+    // Registers read by the processor's thread when it pauses
+    VPState m_regs;
+    bool m_regsValid = false;
+
+    std::vector<uint64_t> m_bitmap;
+    std::vector<uint8_t> m_buffer;
+    Stats m_stats;
+
+    bool QueryDirty(std::vector<uint64_t>& pages) noexcept;
+    bool SendPages(MigrationChannel& channel, const std::vector<uint64_t>& pages) noexcept;
+    bool SendRegisters(MigrationChannel& channel) noexcept;
+    bool Pause() noexcept;
+    void Resume() noexcept;
+    void Finish(State state, bool migrated) noexcept;
+};
+
+// Receives a migration into a stopped virtual machine whose RAM is mapped at
+// the same address and with the same size as on the source.
+class MigrationTarget {
+public:
+    struct Stats {
+        size_t pageRecords;
+        uint64_t pagesReceived;
+        uint64_t bytesReceived;
+    };
+
+    MigrationTarget(virt86::VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+
+    // Reads the whole migration stream, copying pages into RAM and loading the
+    // registers into the processor. Returns false if the stream is malformed,
+    // truncated or does not match this virtual machine.
+    bool Receive(MigrationChannel& channel) noexcept;
+
+    const Stats& GetStats() const noexcept { return m_stats; }
+
+private:
+    virt86::VirtualProcessor& m_vp;
+    uint8_t *m_ram;
+    uint64_t m_ramBase;
+    uint64_t m_ramSize;
+    Stats m_stats = { 0 };
+};
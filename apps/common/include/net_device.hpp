@@ -0,0 +1,192 @@
+/*
+Declares a network device model with descriptor rings in guest memory,
+connected to its peer through a PacketLink.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include "event_loop.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "packet_link.hpp"
+
+#include <mutex>
+
+// A network device whose transmit and receive queues are rings of descriptors
+// in guest memory. The register interface spans 32 ports. All registers are
+// 32 bits wide:
+//
+//   +0x00  CONTROL     (R/W)  bit 0: enable; writing it with the bit set
+//                             resets both queues
+//   +0x04  QUEUE_SIZE  (R/W)  entries in each queue, a power of two up to
+//                             MaxQueueSize
+//   +0x08  TXQ_BASE    (R/W)  guest physical address of the transmit queue
+//   +0x0C  RXQ_BASE    (R/W)  guest physical address of the receive queue
+//   +0x10  TX_TAIL     (W)    doorbell: index one past the last packet to send
+//          TX_HEAD     (R)    index one past the last packet whose buffer may
+//                             be reused; reading it acknowledges the transmit
+//                             interrupt
+//   +0x14  RX_TAIL     (W)    index one past the last buffer posted
+//          RX_HEAD     (R)    index one past the last buffer filled; reading
+//                             it acknowledges the receive interrupt
+//   +0x18  INT_MASK    (R/W)  bit 0: receive interrupt, bit 1: transmit
+//                             interrupt
+//
+// Indices are free-running 32-bit counters; entry i lives in slot
+// i % QUEUE_SIZE. The queues cannot be reconfigured while packets are in
+// flight.
+//
+// A single write to TX_TAIL publishes every new packet to the link at once
+// and wakes up the receiving side only if it is asleep. Received packets are
+// copied straight from the sender's guest memory into the posted buffers, in
+// batches, by the event loop thread or by the thread posting buffers. Each
+// interrupt stays outstanding until the guest reads the matching head
+// register, and everything that happens in the meantime is coalesced into it.
+// The transmit interrupt signals that the receiving side consumed packets;
+// guests that reclaim transmit buffers lazily can leave it masked.
+class NetDevice : public IODevice {
+public:
+    static const uint16_t RegControl = 0x00;
+    static const uint16_t RegQueueSize = 0x04;
+    static const uint16_t RegTXQBase = 0x08;
+    static const uint16_t RegRXQBase = 0x0C;
+    static const uint16_t RegTXTail = 0x10;
+    static const uint16_t RegRXTail = 0x14;
+    static const uint16_t RegIntMask = 0x18;
+    static const uint16_t NumPorts = 0x20;
+
+    static const uint32_t ControlEnable = (1 << 0);
+
+    static const uint32_t IntRX = (1 << 0);
+    static const uint32_t IntTX = (1 << 1);
+
+    static const uint32_t MaxQueueSize = PacketLink::RingSize;
+    static const uint32_t MaxPacketSize = 65535;
+
+    // Receive descriptor flags
+    static const uint32_t RxFlagTruncated = (1 << 0);      // The packet did not fit in the buffer
+    static const uint32_t RxFlagInvalidBuffer = (1 << 1);  // The buffer is outside guest memory; the packet was dropped
+
+    // Transmit and receive queue entry. The device writes the length and
+    // flags of receive descriptors when it fills them.
+    struct Descriptor {
+        uint64_t address;  // Guest physical address of the buffer
+        uint32_t length;   // Packet length, or buffer size for posted receive buffers
+        uint32_t flags;
+    };
+
+    struct Stats {
+        uint64_t txPackets;    // Packets published to the link
+        uint64_t txDoorbells;  // Writes to TX_TAIL
+        uint64_t txKicks;      // Times the receiving side had to be woken up
+        uint64_t rxPackets;    // Packets delivered to the guest
+        uint64_t rxBatches;    // Groups of packets delivered together
+        uint64_t rxDropped;    // Packets rejected by either side
+        uint64_t interrupts;   // Interrupts raised
+    };
+
+    // Guest memory must stay mapped for as long as the device exists.
+    NetDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+    ~NetDevice();
+
+    NetDevice(const NetDevice&) = delete;
+    NetDevice& operator=(const NetDevice&) = delete;
+
+    // Connects the device to one side of a link. peerRam must map the guest
+    // memory of the device on the other side, which transmit descriptors
+    // point into. The link must outlive the device, and the event loop must
+    // not be running yet.
+    bool Attach(PacketLink& link, const uint8_t *peerRam, uint64_t peerRamBase, uint64_t peerRamSize) noexcept;
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override;
+
+    Stats GetStats() noexcept;
+
+private:
+    EventLoop& m_loop;
+    InterruptQueue& m_irqs;
+    const uint8_t m_vector;
+    const uint16_t m_basePort;
+    uint8_t *m_ram;
+    const uint64_t m_ramBase;
+    const uint64_t m_ramSize;
+
+    PacketLink *m_link = nullptr;
+    const uint8_t *m_peerRam = nullptr;
+    uint64_t m_peerRamBase = 0;
+    uint64_t m_peerRamSize = 0;
+
+    // Guards everything below, which is shared between the thread that
+    // accesses the registers and the event loop thread
+    std::mutex m_mutex;
+
+    uint32_t m_control = 0;
+    uint32_t m_queueSize = 0;
+    uint32_t m_txqBase = 0;
+    uint32_t m_rxqBase = 0;
+    uint32_t m_intMask = 0;
+
+    uint32_t m_txTail = 0;
+    uint32_t m_txNext = 0;      // Next transmit descriptor to publish
+    uint32_t m_txLinkBase = 0;  // Link consumption count when the queues were enabled
+    uint32_t m_txHeadRead = 0;  // TX_HEAD as last read by the guest
+    uint32_t m_rxHead = 0;
+    uint32_t m_rxTail = 0;
+    uint32_t m_rxHeadRead = 0;  // RX_HEAD as last read by the guest
+    bool m_txIrqOutstanding = false;
+    bool m_rxIrqOutstanding = false;
+
+    Stats m_stats = { 0 };
+
+    void Enable(bool enable) noexcept;
+    uint32_t TxHead() const noexcept;
+
+    // Publishes transmit descriptors while the link has room, and asks the
+    // link for a wake-up if some are held back or the guest wants the
+    // transmit interrupt. Returns whether an interrupt must be raised.
+    bool Transmit() noexcept;
+
+    // Delivers packets while the guest has buffers posted, and asks the link
+    // for a wake-up once they run out. Returns whether an interrupt must be
+    // raised.
+    bool Receive() noexcept;
+
+    // Returns false if the other side consumed more descriptors than
+    // consumed in the meantime, in which case the link was not armed.
+    bool ArmTx(uint32_t consumed) noexcept;
+
+    bool CheckTxInterrupt() noexcept;
+    bool CheckRxInterrupt() noexcept;
+
+    static bool contains(uint64_t base, uint64_t size, uint64_t address, uint64_t length) noexcept;
+
+    // Invoked by the event loop when the link rings our doorbells
+    void OnRxDoorbell() noexcept;
+    void OnTxDoorbell() noexcept;
+};
+
+#endif
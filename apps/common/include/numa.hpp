@@ -0,0 +1,52 @@
+/*
+Declares cross-platform functions for NUMA-aware memory placement and thread
+pinning.
+
+Hosts without NUMA support (or with a single memory node) are presented as a
+single node containing every processor, so callers never need a separate
+code path for them.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cinttypes>
+#include <stddef.h>
+#include <vector>
+
+// Returns the number of NUMA nodes available to this process. Always at least 1.
+size_t numaNodeCount() noexcept;
+
+// Retrieves the host processor numbers that belong to the specified node.
+bool numaNodeCPUs(const size_t node, std::vector<uint32_t>& cpus) noexcept;
+
+// Allocates page-aligned memory whose pages are placed on the specified node.
+// The memory must be released with alignedFree.
+uint8_t *alignedAllocOnNode(const size_t size, const size_t node) noexcept;
+
+// Binds the pages of a page-aligned memory block to the specified node,
+// migrating any pages that were already touched.
+bool numaBindMemory(void *memory, const size_t size, const size_t node) noexcept;
+
+// Restricts the calling thread to the processors of the specified node.
+bool numaPinCurrentThread(const size_t node) noexcept;
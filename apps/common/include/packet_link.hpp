@@ -0,0 +1,140 @@
+/*
+Declares a point-to-point packet link built on shared-memory rings, which
+connects two network devices in the same process or in different processes.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include "shared_memory.hpp"
+
+#include <cinttypes>
+
+struct PacketLinkShared;
+
+// A packet in the sender's guest memory
+struct PacketDescriptor {
+    uint64_t address;   // Guest physical address in the sender's memory
+    uint32_t length;    // Zero for packets the sender rejected
+    uint32_t reserved;
+};
+
+// Two single-producer, single-consumer rings of packet descriptors in shared
+// memory, one for each direction. Descriptors point into the sender's guest
+// memory, which the receiver must have mapped as well, so packets are copied
+// once, straight from the sender's buffer into the receiver's.
+//
+// Each ring has two eventfd doorbells. The producer rings the first one when
+// it publishes packets while the consumer sleeps, and the consumer rings the
+// second one when it frees entries while the producer waits for them. Either
+// side only pays for a system call when the other side asked to be woken up,
+// so a busy link moves batches of packets without any.
+class PacketLink {
+public:
+    static const uint32_t RingSize = 1024;
+
+    PacketLink() noexcept = default;
+    ~PacketLink() noexcept;
+
+    PacketLink(const PacketLink&) = delete;
+    PacketLink& operator=(const PacketLink&) = delete;
+
+    // Creates the rings and doorbells. The creator is the first side.
+    bool Create() noexcept;
+
+    // Opens the second side of a link created in this process, such as for
+    // two virtual machines in one process. The creator must outlive it.
+    bool OpenPeer(const PacketLink& creator) noexcept;
+
+    // Sends the second side to the process at the other end of a connected
+    // Unix domain socket, which must call ReceivePeer. The other process also
+    // needs this process' guest memory, which can be sent with
+    // SharedMemory::SendTo.
+    bool SendPeer(int sock) noexcept;
+    bool ReceivePeer(int sock) noexcept;
+
+    bool IsValid() const noexcept { return m_shared != nullptr; }
+
+    // ----- Transmit side ----------------------------------------------------------------------------------------------------
+
+    // Returns the number of descriptors that can be queued.
+    uint32_t TxFree() const noexcept;
+
+    // Queues a descriptor. It is published by the next call to Kick.
+    void Transmit(const PacketDescriptor& descriptor) noexcept;
+
+    // Publishes all queued descriptors and rings the other side's doorbell if
+    // it is asleep. Returns whether the doorbell was rung.
+    bool Kick() noexcept;
+
+    // Returns the free-running count of descriptors consumed by the other side.
+    uint32_t TxConsumed() const noexcept;
+
+    // Asks to be woken up through TxDoorbell when the other side consumes
+    // more descriptors. Returns false if it already consumed more than
+    // consumed, in which case the doorbell may not be rung.
+    bool ArmTx(uint32_t consumed) noexcept;
+
+    int TxDoorbell() const noexcept { return m_txSpaceFD; }
+
+    // ----- Receive side -----------------------------------------------------------------------------------------------------
+
+    // Returns the number of descriptors waiting to be received.
+    uint32_t RxAvailable() const noexcept;
+
+    // Returns the descriptor at the given position among those available.
+    PacketDescriptor RxPeek(uint32_t index) const noexcept;
+
+    // Frees received descriptors, ringing the other side's doorbell if it is
+    // waiting for room.
+    void RxRelease(uint32_t count) noexcept;
+
+    // Asks to be woken up through RxDoorbell when packets arrive. Returns
+    // false if packets are already waiting.
+    bool ArmRx() noexcept;
+
+    int RxDoorbell() const noexcept { return m_rxDataFD; }
+
+private:
+    SharedMemory m_memory;
+    PacketLinkShared *m_shared = nullptr;
+    bool m_ownsMapping = false;
+    uint32_t m_side = 0;
+
+    // Doorbells are named after the ring they belong to
+    int m_txDataFD = -1;   // Rung by us when publishing packets
+    int m_txSpaceFD = -1;  // Rung by the other side when it frees entries
+    int m_rxDataFD = -1;   // Rung by the other side when it publishes packets
+    int m_rxSpaceFD = -1;  // Rung by us when freeing entries
+
+    uint32_t m_txLocalTail = 0;  // Tail including descriptors not yet published
+
+    // Takes the doorbells of both rings, in the order they are sent to the
+    // other side
+    bool Bind(uint32_t side, const int fds[4]) noexcept;
+    void CloseDoorbells() noexcept;
+};
+
+#endif
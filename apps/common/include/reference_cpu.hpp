@@ -0,0 +1,268 @@
+/*
+Declares a software x86 interpreter that runs guests without a hypervisor,
+for testing on hosts without virtualization support and as a reference for
+comparing platforms.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "x86_decoder.hpp"
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Interprets x86 code in real mode, 32-bit protected mode and IA-32e mode
+// (64-bit and compatibility submodes), with 32-bit, PAE and 4-level paging
+// (no permission checks). It covers the general purpose instruction set used
+// by the guests in this repository; privilege levels, task switching,
+// SYSCALL/SYSRET and the FPU/SIMD units are not implemented.
+//
+// The interface mirrors the parts of virt86::VirtualProcessor the demos use,
+// so code can be written once against either:
+// - Run executes until an exit, Step executes a single instruction.
+// - Port I/O and accesses outside mapped memory go to the registered I/O
+//   callbacks and exit with PIO or MMIO after the instruction completes.
+// - HLT exits with RIP past the HLT. Interrupts queued with EnqueueInterrupt
+//   are delivered through the IVT or IDT when IF allows.
+// - CPUID returns built-in results unless the function was configured to exit,
+//   in which case the host sets EAX-EDX after the exit. Long mode is reported;
+//   MMX, SSE and later extensions are not.
+// - RDMSR and WRMSR support EFER, TSC and the FS, GS and kernel GS bases.
+// - INT3 exits with SoftwareBreakpoint, RIP at the INT3, while software
+//   breakpoints are enabled.
+// - Breakpoints enabled in DR7, by the host or the guest, exit with
+//   HardwareBreakpoint and the hits in DR6. Instruction breakpoints exit
+//   before the instruction unless RF is set; data breakpoints exit after it.
+//   I/O breakpoints are not supported.
+// - CPU exceptions are not delivered to the guest; they exit with Exception
+//   and the registers as they were before the faulting instruction. Valid
+//   instructions the interpreter does not implement exit with Unhandled.
+//
+// ReferencePlatform wraps it in the virt86 interfaces for code that needs a
+// virt86::VirtualProcessor.
+//
+// Decoded instructions are cached per guest physical page. Guest writes to a
+// page drop its cached instructions, and a cached instruction is only reused
+// while its bytes still match memory, so code modified by the host or by
+// other processors is decoded again.
+class ReferenceCPU {
+public:
+    struct Stats {
+        uint64_t instructions;
+        uint64_t decodes;        // Instructions decoded from memory
+        uint64_t cacheHits;      // Instructions served from the decode cache
+        uint64_t invalidations;  // Code pages dropped from the decode cache
+    };
+
+    ReferenceCPU() noexcept;
+
+    // Puts the processor in its power-on state: real mode, executing from
+    // F000:FFF0 with the code segment based at 0xFFFF0000.
+    void Reset() noexcept;
+
+    // Maps host memory into the guest physical address space. Memory mapped
+    // without MemoryFlags::Write is read-only; writes to it go to the bus.
+    bool MapGuestMemory(uint64_t base, uint64_t size, virt86::MemoryFlags flags, void *memory) noexcept;
+    bool UnmapGuestMemory(uint64_t base, uint64_t size) noexcept;
+
+    // Registers the handlers of port I/O and accesses outside mapped memory,
+    // like the VirtualMachine methods of the same names. IOBus::Attach
+    // registers a bus.
+    void RegisterIOContext(void *context) noexcept { m_ioContext = context; }
+    void RegisterIOReadCallback(virt86::IOReadFunc_t func) noexcept { m_ioRead = func; }
+    void RegisterIOWriteCallback(virt86::IOWriteFunc_t func) noexcept { m_ioWrite = func; }
+    void RegisterMMIOReadCallback(virt86::MMIOReadFunc_t func) noexcept { m_mmioRead = func; }
+    void RegisterMMIOWriteCallback(virt86::MMIOWriteFunc_t func) noexcept { m_mmioWrite = func; }
+
+    void SetCPUIDExits(std::vector<uint32_t> functions) noexcept { m_cpuidExits = std::move(functions); }
+    virt86::VPOperationStatus EnableSoftwareBreakpoints(bool enable) noexcept;
+    virt86::VPOperationStatus SetHardwareBreakpoints(const virt86::HardwareBreakpoints& breakpoints) noexcept;
+    virt86::VPOperationStatus ClearHardwareBreakpoints() noexcept;
+    bool EnqueueInterrupt(uint8_t vector) noexcept;
+
+    virt86::VPExecutionStatus Run() noexcept;
+    virt86::VPExecutionStatus Step() noexcept;
+    const virt86::VMExitInfo& GetVMExitInfo() const noexcept { return m_exitInfo; }
+
+    // Vector of the exception that caused the last Exception exit.
+    uint8_t ExceptionVector() const noexcept { return m_faultVector; }
+
+    virt86::VPOperationStatus RegRead(const virt86::Reg reg, virt86::RegValue& value) noexcept;
+    virt86::VPOperationStatus RegWrite(const virt86::Reg reg, const virt86::RegValue& value) noexcept;
+    virt86::VPOperationStatus RegRead(const virt86::Reg regs[], virt86::RegValue values[], const size_t numRegs) noexcept;
+    virt86::VPOperationStatus RegWrite(const virt86::Reg regs[], const virt86::RegValue values[], const size_t numRegs) noexcept;
+
+    // Accesses the MSRs RDMSR and WRMSR support. Other MSRs fail.
+    virt86::VPOperationStatus GetMSR(const uint64_t msr, uint64_t& value) noexcept;
+    virt86::VPOperationStatus SetMSR(const uint64_t msr, const uint64_t value) noexcept;
+
+    // Accesses guest memory through the current paging structures. Only
+    // mapped memory can be accessed.
+    bool LMemRead(const uint64_t address, const size_t size, void *buffer) noexcept;
+    bool LMemWrite(const uint64_t address, const size_t size, const void *buffer) noexcept;
+    bool LinearToPhysical(const uint64_t address, uint64_t *physical) noexcept;
+
+    // Drops cached decodings of code in the guest physical range.
+    void InvalidateCode(uint64_t address, uint64_t size) noexcept;
+
+    const Stats& GetStats() const noexcept { return m_stats; }
+
+private:
+    struct Segment {
+        uint16_t selector;
+        uint64_t base;
+        uint32_t limit;
+        uint16_t attributes;  // Access byte in bits 0-7, flags in bits 12-15
+    };
+
+    struct Table {
+        uint64_t base;
+        uint16_t limit;
+    };
+
+    struct Region {
+        uint64_t base;
+        uint64_t size;
+        uint8_t *memory;
+        bool writable;
+    };
+
+    struct CachedInstruction {
+        X86Instruction insn;
+        uint8_t bytes[15];
+        X86Mode mode;
+    };
+
+    // Decoded instructions of one physical page, indexed by page offset
+    struct CodePage {
+        uint16_t slots[PAGE_SIZE];  // Index + 1 into entries, or 0 if not decoded
+        std::vector<CachedInstruction> entries;
+    };
+
+    // Architectural state
+    uint64_t m_gpr[16];
+    uint64_t m_rip;
+    uint32_t m_eflags;
+    Segment m_seg[6];  // ES, CS, SS, DS, FS, GS
+    Segment m_ldtr;
+    Segment m_tr;
+    Table m_gdtr;
+    Table m_idtr;
+    uint64_t m_cr0, m_cr2, m_cr3, m_cr4, m_cr8;
+    uint64_t m_efer;
+    uint64_t m_kernelGSBase;
+    uint64_t m_dr[8];
+    uint64_t m_tsc;
+    bool m_interruptShadow;
+    std::deque<uint8_t> m_pendingInterrupts;
+
+    // Environment
+    std::vector<Region> m_regions;
+    size_t m_lastRegion = 0;
+    void *m_ioContext = nullptr;
+    virt86::IOReadFunc_t m_ioRead = nullptr;
+    virt86::IOWriteFunc_t m_ioWrite = nullptr;
+    virt86::MMIOReadFunc_t m_mmioRead = nullptr;
+    virt86::MMIOWriteFunc_t m_mmioWrite = nullptr;
+    std::vector<uint32_t> m_cpuidExits;
+    bool m_softwareBreakpoints = false;
+
+    // State of the instruction being executed
+    uint64_t m_nextRip;
+    uint64_t m_ea;      // Effective address of the memory operand
+    int m_eaSegment;
+    uint8_t m_rex;      // REX prefix, which changes the meaning of byte registers 4-7
+    bool m_fault;
+    uint8_t m_faultVector;
+    bool m_pioAccess;
+    bool m_mmioAccess;
+    uint8_t m_dataBreakpointHits;  // DR6 B0-B3 bits of data breakpoints hit
+
+    virt86::VMExitInfo m_exitInfo;
+    std::unordered_map<uint64_t, std::unique_ptr<CodePage>> m_codePages;
+    CachedInstruction m_uncached;  // Instructions that cross a page boundary
+    Stats m_stats;
+
+    // ----- Execution ----------------------------------------------------------------------------------------------------
+
+    bool ExecuteOne() noexcept;
+    const CachedInstruction *Fetch() noexcept;
+    bool Execute(const CachedInstruction& ci) noexcept;
+    bool ExecuteGroup3(const X86Instruction& insn, uint64_t imm) noexcept;
+    bool ExecuteString(const X86Instruction& insn) noexcept;
+    bool ExecuteTwoByte(const X86Instruction& insn, const uint8_t *bytes, uint64_t imm) noexcept;
+    bool ExecuteIRET(size_t osize, X86Mode mode) noexcept;
+    void RaiseFault(uint8_t vector) noexcept;
+    bool DeliverInterrupt(uint8_t vector, uint64_t returnRip) noexcept;
+    void CPUID() noexcept;
+    bool ReadMSR(uint32_t msr, uint64_t& value) noexcept;
+    bool WriteMSR(uint32_t msr, uint64_t value) noexcept;
+
+    bool Protected() const noexcept { return (m_cr0 & 1) != 0; }
+    bool LongModeActive() const noexcept { return (m_efer & (1 << 10)) != 0; }
+    void UpdateLongMode() noexcept;
+    X86Mode CodeMode() const noexcept;
+    size_t StackSize() const noexcept;
+
+    // ----- Registers and flags ------------------------------------------------------------------------------------------
+
+    uint64_t GetReg(unsigned index, size_t size) const noexcept;
+    void SetReg(unsigned index, size_t size, uint64_t value) noexcept;
+    void SetFlag(uint32_t flag, bool set) noexcept;
+    void SetFlags(uint64_t value, size_t size) noexcept;
+    void SetResultFlags(uint64_t result, size_t size) noexcept;
+    bool Condition(uint8_t cc) const noexcept;
+    uint64_t Arith(unsigned op, uint64_t a, uint64_t b, size_t size) noexcept;
+    uint64_t Shift(unsigned op, uint64_t value, uint8_t count, size_t size) noexcept;
+    uint64_t IMul(uint64_t a, uint64_t b, size_t size) noexcept;
+    bool LoadSegment(unsigned index, uint16_t selector) noexcept;
+
+    // ----- Memory and I/O -----------------------------------------------------------------------------------------------
+
+    uint8_t *RamPointer(uint64_t address, size_t size, bool write) noexcept;
+    uint64_t ReadTableEntry(uint64_t address, size_t size) noexcept;
+    bool Translate(uint64_t linear, uint64_t& physical) noexcept;
+    void PageFault(uint64_t linear) noexcept;
+    uint64_t ReadPhysical(uint64_t address, size_t size) noexcept;
+    void WritePhysical(uint64_t address, size_t size, uint64_t value) noexcept;
+    uint64_t ReadLinear(uint64_t address, size_t size) noexcept;
+    void WriteLinear(uint64_t address, size_t size, uint64_t value) noexcept;
+    uint64_t Linear(unsigned segment, uint64_t offset) const noexcept;
+    uint64_t Read(unsigned segment, uint64_t offset, size_t size) noexcept;
+    void Write(unsigned segment, uint64_t offset, size_t size, uint64_t value) noexcept;
+    uint8_t ExecutionBreakpointHits(uint64_t linear) const noexcept;
+    void CheckDataBreakpoints(uint64_t linear, size_t size, bool write) noexcept;
+    void ComputeEffectiveAddress(const X86Instruction& insn, const uint8_t *bytes) noexcept;
+    uint64_t ReadRM(const X86Instruction& insn, size_t size) noexcept;
+    void WriteRM(const X86Instruction& insn, size_t size, uint64_t value) noexcept;
+    void Push(uint64_t value, size_t size) noexcept;
+    uint64_t Pop(size_t size) noexcept;
+    uint32_t PortRead(uint16_t port, size_t size) noexcept;
+    void PortWrite(uint16_t port, size_t size, uint32_t value) noexcept;
+    void InvalidatePage(uint64_t page) noexcept;
+};
@@ -0,0 +1,112 @@
+/*
+Declares a virt86 platform backed by the software x86 interpreter, so the
+demos can run without a hypervisor.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "reference_cpu.hpp"
+
+// Exposes ReferenceCPU through the virt86 Platform, VirtualMachine and
+// VirtualProcessor interfaces. Each virtual processor owns an interpreter;
+// memory mappings are applied to all of them and I/O goes to the callbacks
+// registered on the virtual machine.
+//
+// Dirty page tracking, memory protection, I/O breakpoints, custom CPUID
+// results and the FPU/SIMD registers are not supported.
+class ReferencePlatform : public virt86::Platform {
+public:
+    ~ReferencePlatform() noexcept final = default;
+
+    static virt86::Platform& Instance() noexcept;
+
+protected:
+    std::unique_ptr<virt86::VirtualMachine> CreateVMImpl(const virt86::VMSpecifications& specifications) override;
+
+private:
+    ReferencePlatform() noexcept;
+};
+
+class ReferenceVirtualMachine : public virt86::VirtualMachine {
+public:
+    ReferenceVirtualMachine(ReferencePlatform& platform, const virt86::VMSpecifications& specifications) noexcept;
+    ~ReferenceVirtualMachine() noexcept final = default;
+
+protected:
+    virt86::MemoryMappingStatus MapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size, const virt86::MemoryFlags flags, void *memory) noexcept override;
+    virt86::MemoryMappingStatus UnmapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size) noexcept override;
+
+private:
+    friend class ReferenceVirtualProcessor;
+
+    static uint32_t ioReadCallback(void *context, uint16_t port, size_t size) noexcept;
+    static void ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept;
+    static uint64_t mmioReadCallback(void *context, uint64_t address, size_t size) noexcept;
+    static void mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept;
+};
+
+class ReferenceVirtualProcessor : public virt86::VirtualProcessor {
+public:
+    ReferenceVirtualProcessor(ReferenceVirtualMachine& vm) noexcept;
+    ~ReferenceVirtualProcessor() noexcept final = default;
+
+    ReferenceCPU& CPU() noexcept { return m_cpu; }
+
+    bool PrepareInterrupt(uint8_t vector) noexcept override;
+    virt86::VPOperationStatus InjectInterrupt(uint8_t vector) noexcept override;
+    bool CanInjectInterrupt() const noexcept override;
+    void RequestInterruptWindow() noexcept override;
+
+    virt86::VPOperationStatus RegRead(const virt86::Reg reg, virt86::RegValue& value) noexcept override;
+    virt86::VPOperationStatus RegWrite(const virt86::Reg reg, const virt86::RegValue& value) noexcept override;
+    virt86::VPOperationStatus RegRead(const virt86::Reg regs[], virt86::RegValue values[], const size_t numRegs) noexcept override;
+    virt86::VPOperationStatus RegWrite(const virt86::Reg regs[], const virt86::RegValue values[], const size_t numRegs) noexcept override;
+
+    virt86::VPOperationStatus GetFPUControl(virt86::FPUControl& value) noexcept override;
+    virt86::VPOperationStatus SetFPUControl(const virt86::FPUControl& value) noexcept override;
+    virt86::VPOperationStatus GetMXCSR(virt86::MXCSR& value) noexcept override;
+    virt86::VPOperationStatus SetMXCSR(const virt86::MXCSR& value) noexcept override;
+    virt86::VPOperationStatus GetMXCSRMask(virt86::MXCSR& value) noexcept override;
+    virt86::VPOperationStatus SetMXCSRMask(const virt86::MXCSR& value) noexcept override;
+
+    virt86::VPOperationStatus GetMSR(const uint64_t msr, uint64_t& value) noexcept override;
+    virt86::VPOperationStatus SetMSR(const uint64_t msr, const uint64_t value) noexcept override;
+
+    virt86::VPOperationStatus EnableSoftwareBreakpoints(bool enable) noexcept override;
+    virt86::VPOperationStatus SetHardwareBreakpoints(virt86::HardwareBreakpoints breakpoints) noexcept override;
+    virt86::VPOperationStatus ClearHardwareBreakpoints() noexcept override;
+    virt86::VPOperationStatus GetBreakpointAddress(uint64_t *address) const noexcept override;
+
+protected:
+    virt86::VPExecutionStatus RunImpl() noexcept override;
+    virt86::VPExecutionStatus StepImpl() noexcept override;
+
+private:
+    ReferenceCPU m_cpu;
+    uint64_t m_breakpointAddress = 0;
+
+    void UpdateExitInfo() noexcept;
+};
@@ -0,0 +1,176 @@
+/*
+Declares a protocol that forwards I/O and MMIO accesses to a device model
+running in another process through shared-memory rings.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include "io_bus.hpp"
+#include "shared_memory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+
+struct RemoteRings;
+
+// Waits for a condition by spinning for a while before blocking. The spin
+// budget adapts to the peer: it doubles whenever the condition came true
+// while spinning and halves whenever the waiter had to block, so that a busy
+// peer is met with low latency and an idle one costs little CPU time.
+class AdaptiveSpinner {
+public:
+    AdaptiveSpinner(uint64_t minSpinNs = 500, uint64_t maxSpinNs = 200000) noexcept
+        : m_minSpinNs(minSpinNs)
+        , m_maxSpinNs(maxSpinNs)
+        , m_spinNs(minSpinNs)
+    {}
+
+    // Spins until ready returns true or the budget runs out. Returns whether
+    // the condition came true. If not, the caller should block and then call
+    // Blocked.
+    template<typename Func>
+    bool Spin(Func ready) noexcept {
+        if (ready()) {
+            return true;
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(m_spinNs);
+        for (;;) {
+            // Reading the clock is far more expensive than checking the condition
+            for (int i = 0; i < 64; i++) {
+                cpuRelax();
+                if (ready()) {
+                    m_spinNs = std::min(m_spinNs * 2, m_maxSpinNs);
+                    return true;
+                }
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+        }
+    }
+
+    void Blocked() noexcept { m_spinNs = std::max(m_spinNs / 2, m_minSpinNs); }
+
+    uint64_t SpinNs() const noexcept { return m_spinNs; }
+
+private:
+    uint64_t m_minSpinNs;
+    uint64_t m_maxSpinNs;
+    uint64_t m_spinNs;
+
+    static void cpuRelax() noexcept {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+};
+
+// Counters shared by both ends of the protocol
+struct RemoteDeviceStats {
+    uint64_t requests;    // Requests sent or served
+    uint64_t spinWaits;   // Waits that ended while spinning
+    uint64_t blockWaits;  // Waits that blocked on the doorbell
+};
+
+// Forwards accesses to a device in another process. Register it on an IOBus
+// for the port and MMIO ranges served by the other process.
+//
+// Requests go through a single-producer, single-consumer ring in shared
+// memory and responses come back through another. Each ring has an eventfd
+// doorbell that is only rung when the consumer is blocked on it. Writes are
+// posted: they return as soon as they are queued, and later reads wait for
+// them to complete since the device serves requests in order. Reads wait
+// for their response.
+//
+// If the device process dies, reads return all ones and writes are dropped.
+// Only one thread may access the device at a time.
+class RemoteIODevice : public IODevice {
+public:
+    RemoteIODevice() noexcept = default;
+    ~RemoteIODevice() noexcept;
+
+    RemoteIODevice(const RemoteIODevice&) = delete;
+    RemoteIODevice& operator=(const RemoteIODevice&) = delete;
+
+    // Creates the rings and doorbells and sends them to the device process at
+    // the other end of a connected Unix domain socket, which must call
+    // RemoteDeviceServer::Connect. The socket must stay open; it is used to
+    // detect the death of the device process.
+    bool Connect(int sock) noexcept;
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override;
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override;
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept override;
+
+    bool Alive() const noexcept { return m_alive; }
+    const RemoteDeviceStats& GetStats() const noexcept { return m_stats; }
+
+private:
+    SharedMemory m_memory;
+    RemoteRings *m_rings = nullptr;
+    int m_requestFD = -1;   // Rung to wake up the device process
+    int m_responseFD = -1;  // Rung by the device process to wake us up
+    int m_sock = -1;
+    bool m_alive = false;
+    uint32_t m_nextSeq = 0;
+    AdaptiveSpinner m_spinner;
+    RemoteDeviceStats m_stats = { 0 };
+
+    bool Post(uint8_t type, uint8_t size, uint64_t address, uint64_t value, uint32_t& seq) noexcept;
+    bool Complete(uint32_t seq, uint64_t& value) noexcept;
+};
+
+// Serves the requests of a RemoteIODevice with a device in this process.
+class RemoteDeviceServer {
+public:
+    RemoteDeviceServer() noexcept = default;
+    ~RemoteDeviceServer() noexcept;
+
+    RemoteDeviceServer(const RemoteDeviceServer&) = delete;
+    RemoteDeviceServer& operator=(const RemoteDeviceServer&) = delete;
+
+    // Receives the rings and doorbells from the virtual machine process.
+    bool Connect(int sock) noexcept;
+
+    // Dispatches requests to the device until the virtual machine process
+    // closes the socket or exits.
+    void Serve(IODevice& device) noexcept;
+
+    const RemoteDeviceStats& GetStats() const noexcept { return m_stats; }
+
+private:
+    SharedMemory m_memory;
+    RemoteRings *m_rings = nullptr;
+    int m_requestFD = -1;
+    int m_responseFD = -1;
+    int m_sock = -1;
+    AdaptiveSpinner m_spinner;
+    RemoteDeviceStats m_stats = { 0 };
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*
+Declares a declarative test scenario engine that runs independent scenarios
+in parallel, each on its own virtual machine.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "io_bus.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// State available to the steps of a running scenario.
+struct ScenarioContext {
+    virt86::Platform& platform;
+    virt86::VirtualMachine& vm;
+    virt86::VirtualProcessor& vp;
+    IOBus bus;
+
+    // Returns a host pointer to guest physical memory mapped by the scenario,
+    // or nullptr if the range [address, address + size) is not mapped.
+    uint8_t *HostPointer(uint64_t address, size_t size) noexcept;
+
+    struct Region {
+        uint64_t base;
+        uint64_t size;
+        uint8_t *memory;
+    };
+    std::vector<Region> regions;
+    std::vector<std::unique_ptr<IODevice>> devices;
+};
+
+// A step returns false and describes the problem in error when it fails.
+typedef std::function<bool(ScenarioContext& ctx, std::string& error)> ScenarioAction;
+
+typedef std::function<uint64_t(uint64_t addressOrPort, size_t size)> ScenarioReadHandler;
+typedef std::function<void(uint64_t addressOrPort, size_t size, uint64_t value)> ScenarioWriteHandler;
+
+// A named list of steps run in order on a fresh virtual machine. Steps are
+// added with the builder methods below, which describe themselves in the
+// report. The first failing step ends the scenario.
+//
+//   Scenario("PIO")
+//       .Memory(0x0, 0x10000, flags, [](uint8_t *ram) { ... })
+//       .IOHandler(0x1234, 1, readFn, writeFn)
+//       .RunUntil(VMExitReason::HLT)
+//       .ExpectReg(Reg::EAX, 0xCAFE);
+class Scenario {
+public:
+    explicit Scenario(std::string name) noexcept : m_name(std::move(name)) {}
+
+    // ----- Setup --------------------------------------------------------------------------------------------------------
+
+    // Skips the scenario unless the platform satisfies the predicate.
+    Scenario& Require(std::string what, std::function<bool(const virt86::PlatformFeatures&)> predicate);
+
+    // Adjusts the specifications of the virtual machine.
+    Scenario& Specs(std::function<void(virt86::VMSpecifications&)> setup);
+
+    // Maps zeroed, page-aligned host memory at a guest physical address and
+    // lets init fill it before the virtual machine starts.
+    Scenario& Memory(uint64_t base, uint64_t size, virt86::MemoryFlags flags, std::function<void(uint8_t *memory)> init = nullptr);
+
+    // ----- Steps --------------------------------------------------------------------------------------------------------
+
+    // Runs the virtual processor once and expects the given exit reason.
+    Scenario& Run(virt86::VMExitReason expected);
+
+    // Runs the virtual processor until it exits with the given reason,
+    // resuming after I/O and MMIO exits. Fails on any other exit, or after
+    // maxExits exits.
+    Scenario& RunUntil(virt86::VMExitReason expected, size_t maxExits = 1000);
+
+    // Single-steps the virtual processor the given number of times.
+    Scenario& Step(size_t count = 1);
+
+    Scenario& SetReg(virt86::Reg reg, uint64_t value);
+
+    // Compares the register's value, masked to the given number of bytes.
+    Scenario& ExpectReg(virt86::Reg reg, uint64_t value, size_t size = 4);
+    Scenario& ExpectMemory(uint64_t address, std::vector<uint8_t> bytes);
+    Scenario& ExpectMemory32(uint64_t address, uint32_t value);
+
+    // Installs handlers for a range of ports or guest physical addresses.
+    // Either handler may be null.
+    Scenario& IOHandler(uint16_t basePort, uint32_t numPorts, ScenarioReadHandler read, ScenarioWriteHandler write);
+    Scenario& MMIOHandler(uint64_t baseAddress, uint64_t size, ScenarioReadHandler read, ScenarioWriteHandler write);
+
+    Scenario& EnableSoftwareBreakpoints(bool enable = true);
+    Scenario& Interrupt(uint8_t vector);
+
+    // Adds a custom step.
+    Scenario& Do(std::string description, ScenarioAction action);
+
+    const std::string& Name() const noexcept { return m_name; }
+
+private:
+    friend class ScenarioRunner;
+
+    struct MemorySetup {
+        uint64_t base;
+        uint64_t size;
+        virt86::MemoryFlags flags;
+        std::function<void(uint8_t *)> init;
+    };
+    struct StepDef {
+        std::string description;
+        ScenarioAction action;
+    };
+
+    std::string m_name;
+    std::vector<std::pair<std::string, std::function<bool(const virt86::PlatformFeatures&)>>> m_requirements;
+    std::vector<std::function<void(virt86::VMSpecifications&)>> m_specs;
+    std::vector<MemorySetup> m_memory;
+    std::vector<StepDef> m_steps;
+};
+
+enum class ScenarioStatus {
+    Passed,
+    Failed,
+    Skipped,
+};
+
+struct StepResult {
+    std::string description;
+    bool passed;
+    std::string error;
+    double milliseconds;
+};
+
+struct ScenarioResult {
+    std::string name;
+    ScenarioStatus status;
+    std::string error;  // Setup failures and reasons for skipping
+    std::vector<StepResult> steps;
+    double milliseconds;
+};
+
+// Runs scenarios on a platform, several at a time.
+class ScenarioRunner {
+public:
+    explicit ScenarioRunner(virt86::Platform& platform) noexcept : m_platform(platform) {}
+
+    void Add(Scenario scenario) { m_scenarios.push_back(std::move(scenario)); }
+
+    // Runs every scenario on its own virtual machine, using up to maxParallel
+    // threads (0 picks the number of host processors). Results are returned in
+    // the order the scenarios were added.
+    std::vector<ScenarioResult> RunAll(size_t maxParallel = 0);
+
+    // Prints every scenario with its steps and timings, followed by a summary.
+    // Returns true if no scenario failed.
+    static bool PrintReport(const std::vector<ScenarioResult>& results, double wallMilliseconds) noexcept;
+
+private:
+    virt86::Platform& m_platform;
+    std::vector<Scenario> m_scenarios;
+
+    ScenarioResult RunScenario(const Scenario& scenario);
+};
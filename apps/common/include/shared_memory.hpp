@@ -0,0 +1,88 @@
+/*
+Declares a block of memory backed by an anonymous file that can be mapped
+several times, either shared or copy-on-write.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cinttypes>
+#include <stddef.h>
+
+// Memory backed by an anonymous file: a memfd on Linux, an unlinked POSIX
+// shared memory object on macOS and a paging file section on Windows.
+//
+// Shared mappings all see the same contents. Private mappings are
+// copy-on-write: they start out sharing the file's pages and receive a
+// private copy of each page on the first write to it. Pages of a private
+// mapping that were never written to keep reflecting the file, so writes made
+// through shared mappings while private mappings exist show through to them.
+//
+// Mappings stay valid after Close and must be released with Unmap.
+//
+// On Linux and macOS, the file can be passed to another process over a Unix
+// domain socket, which lets a separate process such as a device model map
+// guest memory directly. On Linux, the file can be sealed first so that the
+// other process cannot shrink it; accessing a mapping past the end of a
+// shrunk file would crash the process that owns the virtual machine.
+class SharedMemory {
+public:
+    SharedMemory() noexcept = default;
+    ~SharedMemory() noexcept { Close(); }
+
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    // Creates a zero-filled file of the given size. The name is only used for
+    // debugging, such as in /proc/<pid>/maps on Linux.
+    bool Create(size_t size, const char *name = "virt86-guest") noexcept;
+    void Close() noexcept;
+
+    // Prevents the size of the file from ever changing, in this process or
+    // any other. Only supported on Linux.
+    bool Seal() noexcept;
+
+    // Sends the file to the process at the other end of a connected Unix
+    // domain socket, which must call ReceiveFrom. Not supported on Windows.
+    bool SendTo(int sock) noexcept;
+
+    // Replaces this object's file with one sent by SendTo.
+    bool ReceiveFrom(int sock) noexcept;
+
+    // Returns page-aligned mappings of the whole file, or NULL on failure.
+    uint8_t *MapShared() noexcept;
+    uint8_t *MapPrivate() noexcept;
+
+    bool Unmap(void *memory) noexcept;
+
+    size_t Size() const noexcept { return m_size; }
+
+    // Returns the file descriptor, or the section handle on Windows.
+    intptr_t Handle() const noexcept { return m_handle; }
+
+private:
+    intptr_t m_handle = -1;  // File descriptor or section handle
+    size_t m_size = 0;
+
+    uint8_t *Map(bool copyOnWrite) noexcept;
+};
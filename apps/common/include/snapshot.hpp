@@ -0,0 +1,68 @@
+/*
+Declares functions that save and load compressed snapshots of a virtual
+machine's memory and processor state.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include <vector>
+
+// A block of guest memory included in a snapshot. The size must be a multiple
+// of the page size.
+struct SnapshotRegion {
+    uint64_t guestBase;
+    uint64_t size;
+    uint8_t *memory;
+};
+
+struct SnapshotStats {
+    uint64_t pages;
+    uint64_t zeroPages;    // Pages that were all zeros and not stored
+    uint64_t chunks;
+    uint64_t memoryBytes;  // Size of the memory regions
+    uint64_t fileBytes;    // Size of the snapshot file
+    uint64_t elapsedNs;
+    size_t threads;
+};
+
+// Saves the contents of the memory regions and the state of a stopped virtual
+// processor to a file.
+//
+// Memory is split into chunks of 64 pages that are compressed independently
+// by numThreads threads, or one per host processor if zero. Pages that contain
+// only zeros are left out of their chunk; the other pages of a chunk are
+// stored as a single LZ4 block, or uncompressed if that is smaller.
+bool saveSnapshot(const char *path, virt86::VirtualProcessor& vp, const std::vector<SnapshotRegion>& regions,
+    size_t numThreads = 0, SnapshotStats *stats = NULL) noexcept;
+
+// Loads a snapshot into memory regions that have the same base addresses and
+// sizes as the ones it was saved from, and loads the processor state into the
+// virtual processor. Chunks are decompressed by numThreads threads, or one per
+// host processor if zero. The processor is only modified once all memory was
+// loaded; if the file turns out to be truncated or corrupted, the function
+// fails and the contents of the regions are undefined.
+bool loadSnapshot(const char *path, virt86::VirtualProcessor& vp, const std::vector<SnapshotRegion>& regions,
+    size_t numThreads = 0, SnapshotStats *stats = NULL) noexcept;
@@ -0,0 +1,110 @@
+/*
+Declares a programmable interval timer device backed by a timerfd.
+Linux only.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__)
+
+#include "event_loop.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+// A timer with an HPET-like register interface on a block of 16 ports.
+// All registers are 32 bits wide:
+//
+//   +0x0  CONTROL  (R/W)  bit 0: enable, bit 1: periodic (clear for one-shot)
+//   +0x4  PERIOD   (R/W)  period or one-shot delay in microseconds
+//   +0x8  PENDING  (R)    ticks elapsed since the last read; reading it
+//                         acknowledges the interrupt
+//   +0xC  COUNTER  (R)    free-running microsecond counter
+//
+// Writing CONTROL with the enable bit set (re)starts the timer. A one-shot
+// timer disables itself after it fires, so a tickless guest simply rearms it
+// with the delay to its next deadline.
+//
+// Ticks are coalesced: at most one interrupt is outstanding at a time, and
+// ticks that expire before the guest reads PENDING are added to it instead of
+// being injected individually. The guest keeps accurate time by accounting
+// for every tick reported by PENDING, no matter how many interrupts it took.
+class TimerDevice : public IODevice {
+public:
+    static const uint16_t RegControl = 0x0;
+    static const uint16_t RegPeriod = 0x4;
+    static const uint16_t RegPending = 0x8;
+    static const uint16_t RegCounter = 0xC;
+    static const uint16_t NumPorts = 0x10;
+
+    static const uint32_t ControlEnable = (1 << 0);
+    static const uint32_t ControlPeriodic = (1 << 1);
+
+    struct Stats {
+        uint64_t ticks;               // Total timer expirations
+        uint64_t injections;          // Total interrupts raised
+        double injectionsPerSecond;   // Interrupts raised per second since the previous sample
+    };
+
+    // The device watches its timerfd on the event loop, so it must be created
+    // before the loop starts running.
+    TimerDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort) noexcept;
+    ~TimerDevice();
+
+    bool IsValid() const noexcept { return m_timerFD >= 0; }
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override;
+
+    // Returns the statistics collected so far and starts a new rate sample.
+    Stats SampleStats() noexcept;
+
+private:
+    EventLoop& m_loop;
+    InterruptQueue& m_irqs;
+    const uint8_t m_vector;
+    const uint16_t m_basePort;
+    int m_timerFD;
+
+    std::atomic<uint32_t> m_control{ 0 };
+    std::atomic<uint32_t> m_period{ 0 };
+    std::atomic<uint64_t> m_pendingTicks{ 0 };
+    std::atomic<bool> m_irqOutstanding{ false };
+    const std::chrono::steady_clock::time_point m_resetTime;
+
+    std::atomic<uint64_t> m_ticks{ 0 };
+    std::atomic<uint64_t> m_injections{ 0 };
+
+    std::mutex m_sampleMutex;
+    std::chrono::steady_clock::time_point m_sampleTime;
+    uint64_t m_sampleInjections = 0;
+
+    // Invoked by the event loop when the timerfd expires
+    void OnExpire() noexcept;
+};
+
+#endif
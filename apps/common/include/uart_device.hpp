@@ -0,0 +1,206 @@
+/*
+Declares a 16550 UART model whose output is written to the host by a
+background thread.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A 16550 UART for guest console output. Bytes written to the transmitter
+// are appended to a large ring in host memory, and a background thread writes
+// the ring out to a file descriptor with as few system calls as possible. A
+// VM exit on the transmitter only copies a byte, so a guest logging heavily
+// pays for the exit and nothing else.
+//
+// The guest sees the usual 16-byte transmit FIFO. It is reported empty
+// whenever the ring has room for a full FIFO, so drivers that write 16 bytes
+// per empty-transmitter check never wait on the host. When the ring fills up
+// the transmitter reports busy until the writer catches up, and bytes written
+// anyway are dropped, like on real hardware. Enabling the transmitter holding
+// register empty interrupt raises it after each burst of writes, once the
+// guest has read IIR.
+//
+// Input queued by the host with Receive is read from RBR. LSR reports data
+// ready while any is left, and RBR reads as zero once it runs out. Receive
+// interrupts are not implemented, so guests poll LSR.
+//
+// The device can also present paravirtual bulk transmit registers past the
+// standard eight, which send a whole buffer from guest memory with one exit.
+// Both registers are 32 bits wide:
+//
+//   +0x08  BULK_ADDRESS  (R/W)  guest physical address of the buffer
+//   +0x0C  BULK_LENGTH   (W)    transmits that many bytes from the buffer
+//                        (R)    bytes accepted by the last transmission,
+//                               which is fewer if the ring was short of room
+//
+// Guests detect them by writing BULK_ADDRESS and reading it back; without
+// them the ports read as all ones.
+class UartDevice : public IODevice {
+public:
+    // Register offsets from the base port. The first two access the divisor
+    // latch instead while LCR.DLAB is set.
+    static const uint16_t RegData = 0;           // RBR (R), THR (W)
+    static const uint16_t RegIntEnable = 1;      // IER
+    static const uint16_t RegIntId = 2;          // IIR (R), FCR (W)
+    static const uint16_t RegLineControl = 3;    // LCR
+    static const uint16_t RegModemControl = 4;   // MCR
+    static const uint16_t RegLineStatus = 5;     // LSR
+    static const uint16_t RegModemStatus = 6;    // MSR
+    static const uint16_t RegScratch = 7;        // SCR
+    static const uint16_t NumPorts = 8;
+
+    static const uint16_t RegBulkAddress = 8;
+    static const uint16_t RegBulkLength = 12;
+    static const uint16_t NumPortsWithBulk = 16;
+
+    static const uint8_t IerTHRE = 0x02;   // Transmitter holding register empty interrupt
+    static const uint8_t IirNone = 0x01;   // No interrupt pending
+    static const uint8_t IirTHRE = 0x02;
+    static const uint8_t IirFifos = 0xC0;  // FIFOs enabled
+    static const uint8_t FcrEnable = 0x01;
+    static const uint8_t LcrDLAB = 0x80;
+    static const uint8_t LsrDR = 0x01;     // Data ready
+    static const uint8_t LsrTHRE = 0x20;   // Transmitter holding register empty
+    static const uint8_t LsrTEMT = 0x40;   // Transmitter empty
+    static const uint8_t MsrReady = 0xB0;  // DCD, DSR and CTS asserted
+
+    static const uint32_t FifoSize = 16;
+    static const size_t DefaultBufferSize = 1024 * 1024;
+
+    struct Stats {
+        uint64_t bytes;          // Bytes accepted from the guest
+        uint64_t dataWrites;     // Writes to THR
+        uint64_t stringWrites;   // String I/O runs written to THR
+        uint64_t bulkTransmits;  // Writes to BULK_LENGTH
+        uint64_t received;       // Bytes of input read by the guest
+        uint64_t dataReads;      // Reads from RBR
+        uint64_t stringReads;    // String I/O runs read from RBR
+        uint64_t dropped;        // Bytes lost because the ring was full
+        uint64_t hostWrites;     // System calls made by the writer thread
+        uint64_t interrupts;
+    };
+
+    // Output goes to the file descriptor, which must stay open for as long as
+    // the device exists. The ring size is rounded up to a power of two. The
+    // writer lets output accumulate for up to flushInterval after the first
+    // byte, or until the ring is a quarter full, before writing it out.
+    UartDevice(InterruptQueue& irqs, uint8_t vector, uint16_t basePort, int outputFD,
+        size_t bufferSize = DefaultBufferSize, std::chrono::milliseconds flushInterval = std::chrono::milliseconds(10)) noexcept;
+
+    // Writes out any remaining output and stops the writer thread.
+    ~UartDevice();
+
+    UartDevice(const UartDevice&) = delete;
+    UartDevice& operator=(const UartDevice&) = delete;
+
+    // Presents the bulk transmit registers, which read from the given guest
+    // memory. Must be called before the guest runs, and the device must be
+    // registered with NumPortsWithBulk ports.
+    void EnableBulkTransmit(const uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+
+    // Blocks until everything the guest wrote so far has been written out.
+    void Flush() noexcept;
+
+    // Queues input for the guest to read from RBR.
+    void Receive(const uint8_t *data, size_t length) noexcept;
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override;
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override;
+
+    // Byte-sized string writes to THR, as coalesced by IOBus::Run, are copied
+    // into the ring at once.
+    void IOWriteString(uint16_t port, size_t size, const uint8_t *data, size_t count) noexcept override;
+
+    // Byte-sized string reads from RBR, as coalesced by IOBus::Run, are served
+    // from the queued input at once.
+    size_t IOPeekString(uint16_t port, size_t size, uint8_t *data, size_t count) noexcept override;
+    void IOConsumeString(uint16_t port, size_t size, size_t count) noexcept override;
+
+    Stats GetStats() noexcept;
+
+private:
+    InterruptQueue& m_irqs;
+    const uint8_t m_vector;
+    const uint16_t m_basePort;
+    const int m_outputFD;
+    const std::chrono::milliseconds m_flushInterval;
+
+    const uint8_t *m_ram = nullptr;
+    uint64_t m_ramBase = 0;
+    uint64_t m_ramSize = 0;
+
+    // Guards everything below, which is shared between the threads running
+    // virtual processors and the writer thread
+    std::mutex m_mutex;
+    std::condition_variable m_writerCond;   // Wakes up the writer
+    std::condition_variable m_flushedCond;  // Signaled whenever the writer finishes a batch
+
+    // Output ring. The writer advances the head only after writing a batch
+    // out, so the ring never overwrites bytes being written.
+    std::vector<uint8_t> m_ring;
+    uint64_t m_head = 0;
+    uint64_t m_tail = 0;
+    size_t m_flushWaiters = 0;
+    bool m_stop = false;
+
+    // Input not yet read by the guest starts at m_inputPos
+    std::vector<uint8_t> m_input;
+    size_t m_inputPos = 0;
+
+    uint8_t m_ier = 0;
+    uint8_t m_fcr = 0;
+    uint8_t m_lcr = 0;
+    uint8_t m_mcr = 0;
+    uint8_t m_scratch = 0;
+    uint16_t m_divisor = 12;  // 9600 baud
+    bool m_threPending = false;  // THRE interrupt visible in IIR
+    uint32_t m_bulkAddress = 0;
+    uint32_t m_bulkAccepted = 0;
+
+    Stats m_stats = { 0 };
+
+    std::thread m_writer;
+
+    size_t Room() const noexcept { return m_ring.size() - (size_t)(m_tail - m_head); }
+    size_t InputPending() const noexcept { return m_input.size() - m_inputPos; }
+
+    // Appends bytes to the ring. Returns the number of bytes that fit.
+    size_t Append(const uint8_t *data, size_t length) noexcept;
+
+    // Sets the THRE interrupt pending if it is enabled and the transmitter
+    // has room. Returns whether the interrupt must be raised.
+    bool SignalTHRE() noexcept;
+
+    // Writes the data to the output. Returns the number of system calls made.
+    size_t WriteOut(const uint8_t *data, size_t length) noexcept;
+    void WriterThread() noexcept;
+};
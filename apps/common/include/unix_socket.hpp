@@ -0,0 +1,45 @@
+/*
+Declares functions that pass file descriptors between processes over Unix
+domain sockets.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(__linux__) || defined(__APPLE__)
+
+#include <stddef.h>
+
+// Maximum number of descriptors passed in one message
+const size_t maxPassedFDs = 16;
+
+// Sends a message with file descriptors attached over a connected Unix domain
+// socket. The receiving process gets its own duplicates of the descriptors.
+bool sendWithFDs(int sock, const void *data, size_t size, const int *fds, size_t numFDs) noexcept;
+
+// Receives a message of exactly the given size sent with sendWithFDs, along
+// with exactly numFDs descriptors, which are created close-on-exec. Fails and
+// closes any descriptors received if the message does not match.
+bool receiveWithFDs(int sock, void *data, size_t size, int *fds, size_t numFDs) noexcept;
+
+#endif
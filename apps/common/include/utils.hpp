@@ -27,9 +27,29 @@ SOFTWARE.
 
 #include "virt86/virt86.hpp"
 
+#include <vector>
+
 template<class T, size_t N>
 constexpr size_t array_size(T(&)[N]) {
     return N;
 }
 
 const char *reason_str(virt86::VMExitReason reason) noexcept;
+
+// Removes the platform options from the command line, leaving the program's
+// own arguments in place. --reference makes loadFirstPlatform and
+// loadAllPlatforms return the software interpreter (ReferencePlatform)
+// instead of the hypervisor platforms, or nothing if the build left the
+// reference platform out.
+void parsePlatformOptions(int& argc, char *argv[]) noexcept;
+
+// Returns true if --reference was given on the command line.
+bool referencePlatformSelected() noexcept;
+
+// Picks the first hypervisor platform that is available and properly
+// initialized on this system. Returns NULL if there are none.
+virt86::Platform *loadFirstPlatform() noexcept;
+
+// Loads every hypervisor platform that is available and properly initialized
+// on this system.
+std::vector<virt86::Platform *> loadAllPlatforms() noexcept;
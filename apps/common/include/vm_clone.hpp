@@ -0,0 +1,117 @@
+/*
+Declares copy-on-write cloning of a stopped virtual machine into new virtual
+machines that share its unmodified memory.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "shared_memory.hpp"
+#include "vp_state.hpp"
+
+#include <memory>
+#include <vector>
+
+class VMTemplate;
+
+// A virtual machine created by VMTemplate::Clone. Destroying the clone frees
+// its virtual machine and releases its memory.
+class VMClone {
+public:
+    ~VMClone() noexcept;
+
+    virt86::VirtualMachine& GetVM() noexcept { return m_vm; }
+    virt86::VirtualProcessor& GetVP() noexcept { return m_vp; }
+
+    // Returns the clone's copy of the template's private region with the
+    // given index, in the order the regions were added.
+    uint8_t *GetMemory(size_t privateRegion) noexcept { return m_mappings[privateRegion]; }
+
+private:
+    friend class VMTemplate;
+
+    VMClone(VMTemplate& source, virt86::VirtualMachine& vm, virt86::VirtualProcessor& vp) noexcept;
+
+    VMTemplate& m_template;
+    virt86::VirtualMachine& m_vm;
+    virt86::VirtualProcessor& m_vp;
+    std::vector<uint8_t *> m_mappings;
+};
+
+// Turns a single-processor virtual machine that is stopped, typically parked
+// at a HLT after booting, into a template for any number of clones.
+//
+// Each clone is a new virtual machine on the same platform with the same
+// specifications. Its writable memory is a private, copy-on-write mapping of
+// the template's SharedMemory, so clones only consume host memory for the
+// pages they write to. The processor state is copied with a single batched
+// register write; floating point and vector registers and MSRs other than
+// EFER are not copied.
+//
+// The template must not run while it has clones: the pages a clone has not
+// written to yet still show the template's memory. I/O and MMIO callbacks are
+// not copied either; register them on each clone's virtual machine.
+class VMTemplate {
+public:
+    VMTemplate(virt86::VirtualMachine& vm) noexcept;
+
+    // Memory that every clone maps as is, such as ROM. The guest must not be
+    // able to write to it.
+    void AddSharedRegion(uint64_t guestBase, uint64_t size, uint8_t *memory, virt86::MemoryFlags flags) noexcept;
+
+    // Memory that every clone receives a copy-on-write mapping of. The
+    // template's guest memory must be a shared mapping of the object.
+    void AddPrivateRegion(uint64_t guestBase, SharedMemory& memory, virt86::MemoryFlags flags) noexcept;
+
+    // Reads the state of the template's processor. Must be called before
+    // cloning and again whenever the template ran in between.
+    bool Capture() noexcept;
+
+    // Creates a clone ready to resume where the template stopped. Returns
+    // NULL on failure.
+    std::unique_ptr<VMClone> Clone() noexcept;
+
+private:
+    friend class VMClone;
+
+    struct SharedRegion {
+        uint64_t guestBase;
+        uint64_t size;
+        uint8_t *memory;
+        virt86::MemoryFlags flags;
+    };
+
+    struct PrivateRegion {
+        uint64_t guestBase;
+        SharedMemory *memory;
+        virt86::MemoryFlags flags;
+    };
+
+    virt86::VirtualMachine& m_vm;
+    std::vector<SharedRegion> m_sharedRegions;
+    std::vector<PrivateRegion> m_privateRegions;
+    VPState m_state;
+    bool m_captured = false;
+};
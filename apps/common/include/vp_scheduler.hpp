@@ -0,0 +1,105 @@
+/*
+Declares a scheduler that multiplexes virtual processors on a small pool of
+threads, and the asynchronous operations device models use to wait for host
+I/O without blocking those threads.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "fiber.hpp"
+#include "io_bus.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Thread of a VPScheduler and the fibers it runs. Defined in vp_scheduler.cpp.
+struct VPWorker;
+
+// A host operation that completes asynchronously, such as a disk read or a
+// timer expiration, carrying a 64-bit result.
+class AsyncOperation {
+public:
+    // Marks the operation as complete and wakes up whoever is waiting for it.
+    // May be called from any thread, before or after the wait begins.
+    void Complete(uint64_t result) noexcept;
+
+    bool IsComplete() const noexcept { return m_complete.load(std::memory_order_acquire); }
+    uint64_t Result() const noexcept { return m_result; }
+
+private:
+    friend uint64_t awaitOperation(AsyncOperation& op) noexcept;
+
+    std::atomic<bool> m_complete{ false };
+    uint64_t m_result = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    VPWorker *m_worker = nullptr;
+    Fiber *m_waiter = nullptr;
+};
+
+// Waits for the operation to complete and returns its result.
+//
+// When called from a device handler running on a virtual processor managed by
+// a VPScheduler, the virtual processor is parked in the middle of the I/O
+// access while its thread goes on to run other virtual processors. The access
+// completes with the operation's result once the processor is resumed.
+// Anywhere else, this simply blocks the calling thread.
+uint64_t awaitOperation(AsyncOperation& op) noexcept;
+
+// Handles a VM exit. Return false to stop running the virtual processor.
+using VMExitHandler = std::function<bool(virt86::VirtualProcessor& vp, const virt86::VMExitInfo& exitInfo)>;
+
+// Runs virtual processors cooperatively on a fixed number of threads.
+// Each virtual processor runs on its own fiber and always on the same thread.
+// A processor yields its thread after every VM exit and whenever a device
+// handler waits for an asynchronous operation.
+class VPScheduler {
+public:
+    explicit VPScheduler(size_t numThreads) noexcept;
+
+    // Adds a virtual processor to be run. Must be called before Run.
+    // If a bus is given, the processor is run through IOBus::Run so that its
+    // string I/O is coalesced.
+    void AddVP(virt86::VirtualProcessor& vp, VMExitHandler handler, IOBus *bus = nullptr);
+
+    // Runs all virtual processors until their handlers return false or they
+    // fail to run. Blocks until every processor has stopped.
+    void Run();
+
+private:
+    struct VPEntry {
+        virt86::VirtualProcessor *vp;
+        VMExitHandler handler;
+        IOBus *bus;
+    };
+
+    size_t m_numThreads;
+    std::vector<VPEntry> m_vps;
+};
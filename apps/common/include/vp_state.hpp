@@ -0,0 +1,52 @@
+/*
+Declares functions that save and restore the register state of a virtual
+processor.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include <vector>
+
+// The registers a stopped guest needs to resume on another virtual processor:
+// general purpose registers, segment and descriptor table registers, control
+// registers, EFER and debug registers. Floating point and vector state is not
+// included.
+//
+// The set depends on the processor's execution mode: processors in IA-32e
+// mode save the 64-bit registers, all others save the 32-bit registers.
+struct VPState {
+    bool longMode;
+    std::vector<virt86::RegValue> values;
+};
+
+// Returns the number of registers in the state of the given mode.
+size_t vpStateRegisterCount(bool longMode) noexcept;
+
+bool readVPState(virt86::VirtualProcessor& vp, VPState& state) noexcept;
+
+// Loads a state into a processor. Fails if the state has the wrong number of
+// registers for its mode.
+bool writeVPState(virt86::VirtualProcessor& vp, const VPState& state) noexcept;
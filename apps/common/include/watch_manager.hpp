@@ -0,0 +1,156 @@
+/*
+Declares a watchpoint manager that multiplexes any number of watches over the
+four hardware breakpoint slots, page protection and software breakpoints.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/virt86.hpp"
+
+#include "io_bus.hpp"
+
+#include <functional>
+#include <map>
+#include <vector>
+
+enum class WatchType {
+    Execute,  // Instruction fetch at the address
+    Write,    // Data writes to the range
+    Access,   // Data reads or writes to the range
+};
+
+enum class WatchMechanism {
+    DebugRegister,       // One of DR0-DR3; traps only on actual hits
+    PageProtection,      // Traps every access to the page that could hit
+    SoftwareBreakpoint,  // INT3 planted at the instruction (execute watches)
+};
+
+// Invoked on every hit with the watch ID and the guest physical address of
+// the access, or the watch address when hit through a debug register.
+typedef std::function<void(size_t id, uint64_t address)> WatchHitHandler;
+
+// Manages any number of execute, write and access watches on one virtual
+// processor.
+//
+// The four hottest watches (by hits, decayed on every rebalance) that fit the
+// debug registers' constraints (1, 2, 4 or 8 bytes, naturally aligned) live in
+// DR0-DR3. The rest fall back to slower mechanisms:
+// - Write watches make their page read-only. Writes to the page exit as MMIO
+//   and are emulated by the manager.
+// - Access watches unmap their page. Every access to the page exits as MMIO
+//   and is emulated by the manager, so the page must not contain code.
+// - Execute watches plant an INT3 at the instruction.
+// A debug register is not spent on a watch whose page is protected anyway on
+// behalf of another watch. Accesses to a protected page that miss its watches
+// count as exits (overhead) for them, but not as hits.
+//
+// Watch addresses are guest linear addresses, translated to physical addresses
+// once when the watch is added. Watched data must lie in the guest RAM region
+// given to the constructor, which must be mapped readable, writable and
+// executable. The manager must receive MMIO accesses to that region: register
+// it with IOBus::AddMMIODevice over the whole RAM region.
+// Call HandleExit after every VM exit.
+class WatchManager : public IODevice {
+public:
+    struct Stats {
+        WatchMechanism mechanism;
+        uint64_t hits;        // Accesses that matched the watch
+        uint64_t exits;       // VM exits taken on behalf of the watch
+        uint64_t overheadNs;  // Host time spent handling those exits
+    };
+
+    WatchManager(virt86::VirtualMachine& vm, virt86::VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept;
+    ~WatchManager() noexcept { RemoveAll(); }
+
+    // Adds a watch over [address, address + length). Returns the watch ID, or
+    // -1 if the watch could not be installed.
+    int Add(WatchType type, uint64_t address, uint32_t length) noexcept;
+    bool Remove(int id) noexcept;
+    void RemoveAll() noexcept;
+
+    void SetHitHandler(WatchHitHandler handler) noexcept { m_hitHandler = std::move(handler); }
+
+    // Reassigns the debug registers after this many hits. 0 disables automatic
+    // rebalancing; watches then keep the mechanism they got when added.
+    void SetRebalanceInterval(uint32_t hits) noexcept { m_rebalanceInterval = hits; }
+
+    // Moves the hottest watches into the debug registers and protects the
+    // pages of the others.
+    bool Rebalance() noexcept;
+
+    // Handles hardware and software breakpoint exits caused by the watches and
+    // applies pending rebalances. Returns true if the guest can be resumed;
+    // false if the exit is unrelated to the watches.
+    bool HandleExit(const virt86::VMExitInfo& exitInfo) noexcept;
+
+    bool GetStats(int id, Stats& stats) const noexcept;
+    uint64_t TotalExits() const noexcept { return m_totalExits; }
+
+    // Emulated accesses to protected pages
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override;
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept override;
+
+private:
+    enum class Protection { None, ReadOnly, NoAccess };
+
+    struct Watch {
+        bool active;
+        WatchType type;
+        uint64_t address;    // Linear
+        uint64_t physical;
+        uint32_t length;
+        uint8_t original;    // Byte replaced by INT3
+        Stats stats;
+        uint64_t recentHits; // Since the last rebalance
+        uint64_t score;
+    };
+
+    virt86::VirtualMachine& m_vm;
+    virt86::VirtualProcessor& m_vp;
+    uint8_t *m_ram;
+    uint64_t m_ramBase;
+    uint64_t m_ramSize;
+
+    std::vector<Watch> m_watches;
+    int m_slots[4] = { -1, -1, -1, -1 };
+    std::map<uint64_t, Protection> m_pages;                  // Protected pages
+    std::multimap<uint64_t, size_t> m_pageWatches;           // Page -> protected watches
+    std::map<uint64_t, size_t> m_breakpoints;                // Physical address -> watch
+    bool m_softwareBreakpoints = false;
+
+    WatchHitHandler m_hitHandler;
+    uint32_t m_rebalanceInterval = 1024;
+    uint64_t m_hitsSinceRebalance = 0;
+    bool m_rebalancePending = false;
+    uint64_t m_totalExits = 0;
+
+    void Hit(size_t id, uint64_t address) noexcept;
+    bool SetPageProtection(uint64_t page, Protection from, Protection to) noexcept;
+    bool PlantBreakpoint(size_t id) noexcept;
+    void LiftBreakpoint(size_t id) noexcept;
+    bool ApplyDebugRegisters() noexcept;
+    bool HandleHardwareBreakpoint() noexcept;
+    bool HandleSoftwareBreakpoint() noexcept;
+    void TrapAccess(uint64_t address, size_t size, bool write, uint64_t elapsedNs) noexcept;
+};
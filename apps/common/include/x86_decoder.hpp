@@ -0,0 +1,87 @@
+/*
+Declares a lightweight x86 instruction decoder that determines instruction
+boundaries, operand layout and control flow without fully disassembling.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cinttypes>
+#include <stddef.h>
+
+enum class X86Mode {
+    Bits16,
+    Bits32,
+    Bits64,
+};
+
+// How an instruction affects control flow.
+enum class X86Flow {
+    Sequential,       // Continues with the next instruction
+    Jump,             // Direct unconditional jump to target
+    ConditionalJump,  // Direct jump to target or continues with the next instruction
+    Call,             // Direct call to target; returns to the next instruction
+    IndirectJump,     // Jump to a computed or far address
+    IndirectCall,     // Call to a computed or far address; returns to the next instruction
+    Return,           // Returns to a computed address
+    Interrupt,        // Software interrupt or system call; returns to the next instruction
+    Halt,             // Stops until an interrupt; resumes with the next instruction
+    Terminate,        // Never continues with the next instruction (UD2, SYSRET, ...)
+};
+
+struct X86Instruction {
+    uint8_t length;
+
+    // Prefixes
+    uint8_t operandSize;   // 2, 4 or 8 bytes
+    uint8_t addressSize;   // 2, 4 or 8 bytes
+    uint8_t segment;       // Segment override prefix byte, or 0 if none
+    uint8_t rex;           // REX prefix byte, or 0 if none
+    bool lock;
+    bool rep;              // F3
+    bool repne;            // F2
+    bool vex;
+
+    // Opcode
+    uint8_t opcodeMap;     // 0 = one-byte, 1 = 0F, 2 = 0F 38, 3 = 0F 3A
+    uint8_t opcode;
+    uint8_t opcodeOffset;
+
+    // Operands; offsets are relative to the start of the instruction
+    bool hasModRM;
+    uint8_t modrm;
+    bool hasSIB;
+    uint8_t sib;
+    uint8_t dispOffset;
+    uint8_t dispSize;
+    uint8_t immOffset;
+    uint8_t immSize;
+
+    X86Flow flow;
+    uint64_t target;       // Destination of direct jumps and calls
+};
+
+// Decodes the instruction at the start of code, which is located at the given
+// guest address. Returns false if the bytes do not form a valid instruction
+// or the instruction extends beyond size bytes.
+bool decodeX86(const uint8_t *code, size_t size, uint64_t address, X86Mode mode, X86Instruction& insn) noexcept;
@@ -27,16 +27,35 @@ SOFTWARE.
 
 #include "virt86/vp/vp.hpp"
 
+#include <mutex>
+#include <unordered_map>
+
 #if defined(_WIN32)
 #  include <Windows.h>
-#elif defined(__linux__)
-#  include <stdlib.h>
-#elif defined(__APPLE__)
+#elif defined(__linux__) || defined(__APPLE__)
 #  include <stdlib.h>
+#  include <stdio.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
 #else
 #  error Unsupported platform
 #endif
 
+#if defined(__linux__)
+const size_t hugePageSize = 2 * 1024 * 1024;
+#endif
+
+// Memory obtained from a mapping rather than the regular allocator, along with
+// the size needed to release it
+static std::mutex mappingsMutex;
+static std::unordered_map<void *, size_t> mappings;
+
+static uint8_t *trackMapping(void *memory, size_t size) noexcept {
+    std::lock_guard<std::mutex> lock(mappingsMutex);
+    mappings[memory] = size;
+    return (uint8_t *)memory;
+}
+
 uint8_t *alignedAlloc(const size_t size) noexcept {
 #if defined(_WIN32)
     LPVOID mem = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
@@ -61,7 +80,113 @@ uint8_t *alignedAlloc(const size_t size) noexcept {
 #endif
 }
 
+uint8_t *alignedAlloc(const size_t size, const AllocMode mode) noexcept {
+    if (mode == AllocMode::Default) {
+        return alignedAlloc(size);
+    }
+#if defined(_WIN32)
+    switch (mode) {
+    case AllocMode::HugePages: {
+        // Requires the SeLockMemoryPrivilege
+        const SIZE_T largePage = GetLargePageMinimum();
+        if (largePage == 0) {
+            return NULL;
+        }
+        const SIZE_T roundedSize = (size + largePage - 1) & ~(largePage - 1);
+        return (uint8_t *)VirtualAlloc(NULL, roundedSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+    case AllocMode::Lazy:
+        // Committed memory is only backed by physical pages on first touch
+        return (uint8_t *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    case AllocMode::FileBacked: {
+        // Backed by the paging file; there is no way to map an unnamed regular file
+        HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+        if (section == NULL) {
+            return NULL;
+        }
+        void *view = MapViewOfFile(section, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        // The view keeps the section alive
+        CloseHandle(section);
+        return (view != NULL) ? trackMapping(view, size) : NULL;
+    }
+    default:
+        return NULL;
+    }
+#else
+    void *mem = MAP_FAILED;
+    switch (mode) {
+    case AllocMode::HugePages: {
+#if defined(__linux__)
+        const size_t roundedSize = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+        mem = mmap(NULL, roundedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            return trackMapping(mem, roundedSize);
+        }
+        // No preallocated huge pages; fall back to transparent huge pages on a
+        // 2 MiB aligned range
+        uint8_t *raw = (uint8_t *)mmap(NULL, roundedSize + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        uint8_t *aligned = (uint8_t *)(((uintptr_t)raw + hugePageSize - 1) & ~(uintptr_t)(hugePageSize - 1));
+        if (aligned > raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + roundedSize, (raw + roundedSize + hugePageSize) - (aligned + roundedSize));
+        if (madvise(aligned, roundedSize, MADV_HUGEPAGE) != 0) {
+            munmap(aligned, roundedSize);
+            return NULL;
+        }
+        return trackMapping(aligned, roundedSize);
+#else
+        return NULL;
+#endif
+    }
+    case AllocMode::Lazy:
+#if defined(__linux__)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+        break;
+    case AllocMode::FileBacked: {
+        // tmpfile() returns a file that is already unlinked; the mapping keeps
+        // it alive after the stream is closed
+        FILE *fp = tmpfile();
+        if (fp == NULL) {
+            return NULL;
+        }
+        if (ftruncate(fileno(fp), (off_t)size) == 0) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+        }
+        fclose(fp);
+        break;
+    }
+    default:
+        break;
+    }
+    return (mem != MAP_FAILED) ? trackMapping(mem, size) : NULL;
+#endif
+}
+
 bool alignedFree(void *memory) noexcept {
+    if (memory == NULL) {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mappingsMutex);
+        auto it = mappings.find(memory);
+        if (it != mappings.end()) {
+            const size_t size = it->second;
+            mappings.erase(it);
+#if defined(_WIN32)
+            (void)size;
+            return UnmapViewOfFile(memory) == TRUE;
+#else
+            return munmap(memory, size) == 0;
+#endif
+        }
+    }
 #if defined(_WIN32)
     return VirtualFree(memory, 0, MEM_RELEASE) == TRUE;
 #elif defined(__linux__)
@@ -0,0 +1,273 @@
+/*
+Defines a basic-block code coverage collector based on one-shot software
+breakpoints.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "block_coverage.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <set>
+
+using namespace virt86;
+
+const uint8_t int3 = 0xCC;
+
+size_t BlockCoverage::Discover(uint8_t *image, uint64_t imageBase, size_t imageSize, X86Mode mode, const std::vector<uint64_t>& entryPoints) noexcept {
+    Disarm();
+    m_image = image;
+    m_imageBase = imageBase;
+    m_imageSize = imageSize;
+    m_blocks.clear();
+    m_originalBytes.clear();
+    m_hitCount = 0;
+
+    auto inImage = [&](uint64_t address) {
+        return address >= imageBase && address < imageBase + imageSize;
+    };
+    auto decodeAt = [&](uint64_t address, X86Instruction& insn) {
+        const size_t offset = (size_t)(address - imageBase);
+        return decodeX86(&image[offset], imageSize - offset, address, mode, insn);
+    };
+
+    // Recursive traversal: decode from each block leader until control flow
+    // leaves the straight line, queuing every statically known successor
+    std::set<uint64_t> leaders;
+    std::map<uint64_t, uint8_t> instructions;  // address -> length
+    std::vector<uint64_t> work(entryPoints.begin(), entryPoints.end());
+    while (!work.empty()) {
+        const uint64_t leader = work.back();
+        work.pop_back();
+        if (!inImage(leader) || !leaders.insert(leader).second) {
+            continue;
+        }
+
+        uint64_t address = leader;
+        X86Instruction insn;
+        while (inImage(address) && decodeAt(address, insn)) {
+            const bool seen = !instructions.emplace(address, insn.length).second;
+            const uint64_t next = address + insn.length;
+            bool endOfBlock = true;
+            switch (insn.flow) {
+            case X86Flow::Sequential:
+                endOfBlock = seen;
+                break;
+            case X86Flow::Jump:
+                work.push_back(insn.target);
+                break;
+            case X86Flow::ConditionalJump:
+            case X86Flow::Call:
+                work.push_back(insn.target);
+                work.push_back(next);
+                break;
+            case X86Flow::IndirectCall:
+            case X86Flow::Interrupt:
+            case X86Flow::Halt:
+                work.push_back(next);
+                break;
+            case X86Flow::IndirectJump:
+            case X86Flow::Return:
+            case X86Flow::Terminate:
+                break;
+            }
+            if (endOfBlock) {
+                break;
+            }
+            address = next;
+        }
+    }
+
+    // Drop leaders that fall inside another instruction; planting a
+    // breakpoint there would corrupt it
+    for (auto it = leaders.begin(); it != leaders.end();) {
+        auto insn = instructions.upper_bound(*it);
+        bool overlaps = false;
+        if (insn != instructions.begin()) {
+            --insn;
+            overlaps = insn->first < *it && insn->first + insn->second > *it;
+        }
+        if (overlaps || instructions.count(*it) == 0) {
+            it = leaders.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // A block extends until its terminating instruction or the next leader
+    for (uint64_t leader : leaders) {
+        uint64_t address = leader;
+        for (;;) {
+            auto insn = instructions.find(address);
+            if (insn == instructions.end()) {
+                break;
+            }
+            address += insn->second;
+            X86Instruction decoded;
+            decodeAt(insn->first, decoded);
+            if (decoded.flow != X86Flow::Sequential || leaders.count(address)) {
+                break;
+            }
+        }
+        m_blocks.push_back({ leader, (uint32_t)(address - leader), false, 0 });
+    }
+    return m_blocks.size();
+}
+
+BlockCoverage::Block *BlockCoverage::FindBlock(uint64_t address) noexcept {
+    auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), address,
+        [](const Block& block, uint64_t addr) { return block.address < addr; });
+    if (it == m_blocks.end() || it->address != address) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+bool BlockCoverage::Arm() noexcept {
+    if (m_armed) {
+        return true;
+    }
+    if (m_vp.EnableSoftwareBreakpoints(true) != VPOperationStatus::OK) {
+        return false;
+    }
+    m_originalBytes.resize(m_blocks.size());
+    for (size_t i = 0; i < m_blocks.size(); i++) {
+        if (!m_blocks[i].hit) {
+            uint8_t& code = m_image[m_blocks[i].address - m_imageBase];
+            m_originalBytes[i] = code;
+            code = int3;
+        }
+    }
+    m_armed = true;
+    return true;
+}
+
+bool BlockCoverage::HandleBreakpoint() noexcept {
+    if (!m_armed) {
+        return false;
+    }
+    uint64_t address;
+    if (m_vp.GetBreakpointAddress(&address) != VPOperationStatus::OK) {
+        return false;
+    }
+    Block *block = FindBlock(address);
+    if (block == nullptr || block->hit) {
+        return false;
+    }
+    // The guest stops at the breakpoint, so restoring the original byte is
+    // enough to resume at the original instruction
+    m_image[address - m_imageBase] = m_originalBytes[block - m_blocks.data()];
+    block->hit = true;
+    block->hitOrder = (uint32_t)m_hitCount++;
+    return true;
+}
+
+void BlockCoverage::Disarm() noexcept {
+    if (!m_armed) {
+        return;
+    }
+    for (size_t i = 0; i < m_blocks.size(); i++) {
+        if (!m_blocks[i].hit) {
+            m_image[m_blocks[i].address - m_imageBase] = m_originalBytes[i];
+        }
+    }
+    m_vp.EnableSoftwareBreakpoints(false);
+    m_armed = false;
+}
+
+bool BlockCoverage::MarkHit(uint64_t address) noexcept {
+    Block *block = FindBlock(address);
+    if (block == nullptr) {
+        return false;
+    }
+    if (!block->hit) {
+        if (m_armed) {
+            m_image[address - m_imageBase] = m_originalBytes[block - m_blocks.data()];
+        }
+        block->hit = true;
+        block->hitOrder = (uint32_t)m_hitCount++;
+    }
+    return true;
+}
+
+bool BlockCoverage::WriteDrcov(const char *path, const char *moduleName) const noexcept {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    fprintf(fp, "DRCOV VERSION: 2\n");
+    fprintf(fp, "DRCOV FLAVOR: virt86\n");
+    fprintf(fp, "Module Table: version 2, count 1\n");
+    fprintf(fp, "Columns: id, base, end, entry, checksum, timestamp, path\n");
+    fprintf(fp, " 0, 0x%016" PRIx64 ", 0x%016" PRIx64 ", 0x0000000000000000, 0x00000000, 0x00000000, %s\n",
+        m_imageBase, m_imageBase + m_imageSize, moduleName);
+
+    // Blocks are listed in the order they were first hit
+    std::vector<const Block *> hits;
+    for (auto& block : m_blocks) {
+        if (block.hit) {
+            hits.push_back(&block);
+        }
+    }
+    std::sort(hits.begin(), hits.end(), [](const Block *lhs, const Block *rhs) { return lhs->hitOrder < rhs->hitOrder; });
+
+    fprintf(fp, "BB Table: %zu bbs\n", hits.size());
+    for (auto block : hits) {
+        // struct { uint32_t start; uint16_t size; uint16_t mod_id; }
+        uint8_t entry[8];
+        const uint32_t start = (uint32_t)(block->address - m_imageBase);
+        const uint16_t size = (uint16_t)std::min<uint32_t>(block->size, 0xFFFF);
+        for (int i = 0; i < 4; i++) entry[i] = (uint8_t)(start >> (i * 8));
+        for (int i = 0; i < 2; i++) entry[4 + i] = (uint8_t)(size >> (i * 8));
+        entry[6] = entry[7] = 0;
+        fwrite(entry, sizeof(entry), 1, fp);
+    }
+
+    const bool ok = ferror(fp) == 0;
+    fclose(fp);
+    return ok;
+}
+
+bool BlockCoverage::WriteLcov(const char *path, const char *sourceName) const noexcept {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    fprintf(fp, "TN:\n");
+    fprintf(fp, "SF:%s\n", sourceName);
+    for (auto& block : m_blocks) {
+        fprintf(fp, "DA:%" PRIu64 ",%d\n", block.address, block.hit ? 1 : 0);
+    }
+    fprintf(fp, "LF:%zu\n", m_blocks.size());
+    fprintf(fp, "LH:%zu\n", m_hitCount);
+    fprintf(fp, "end_of_record\n");
+
+    const bool ok = ferror(fp) == 0;
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,419 @@
+/*
+Implements a block device model whose requests are queued in guest memory and
+served asynchronously through io_uring.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "block_device.hpp"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include <cstring>
+
+BlockDevice::BlockDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_loop(loop)
+    , m_irqs(irqs)
+    , m_vector(vector)
+    , m_basePort(basePort)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+    , m_inFlight(MaxQueueSize)
+{
+    m_freeSlots.reserve(MaxQueueSize);
+    for (uint32_t slot = MaxQueueSize; slot > 0; slot--) {
+        m_freeSlots.push_back(slot - 1);
+    }
+}
+
+BlockDevice::~BlockDevice() {
+    if (m_eventFD >= 0) {
+        m_loop.Remove(m_eventFD);
+    }
+    if (m_ring.IsValid()) {
+        // Requests still in flight would write to guest memory after the
+        // device is gone
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while (m_freeSlots.size() < MaxQueueSize && m_ring.WaitForCompletions(1)) {
+            m_ring.ReapCompletions([this](const io_uring_cqe& cqe) {
+                m_freeSlots.push_back((uint32_t)cqe.user_data);
+            });
+        }
+        m_ring.Close();
+    }
+    if (m_eventFD >= 0) {
+        close(m_eventFD);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool BlockDevice::Open(const char *path, bool direct, bool useIOUring) noexcept {
+    if (m_fd >= 0) {
+        return false;
+    }
+    int fd = -1;
+    if (direct) {
+        fd = open(path, O_RDWR | O_CLOEXEC | O_DIRECT);
+    }
+    m_direct = fd >= 0;
+    if (fd < 0) {
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+    }
+
+    struct stat st;
+    uint64_t size;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    m_directAlignment = SectorSize;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+            close(fd);
+            return false;
+        }
+        int blockSize;
+        if (m_direct && ioctl(fd, BLKSSZGET, &blockSize) == 0 && blockSize > (int)SectorSize) {
+            m_directAlignment = (uint32_t)blockSize;
+        }
+    }
+    else {
+        size = (uint64_t)st.st_size;
+    }
+    m_fd = fd;
+    m_capacity = size / SectorSize;
+
+    if (useIOUring && m_ring.Setup(MaxQueueSize)) {
+        // Kernels before 5.6 set up the ring but fail every read and write
+        const bool supported = m_ring.SupportsOpcode(IORING_OP_READ) && m_ring.SupportsOpcode(IORING_OP_WRITE) && m_ring.SupportsOpcode(IORING_OP_FSYNC);
+        if (supported) {
+            m_eventFD = createEventFD();
+        }
+        if (!supported || m_eventFD < 0 || !m_ring.RegisterEventFD(m_eventFD) || !m_loop.Add(m_eventFD, EPOLLIN, [this](uint32_t) { OnCompletions(); })) {
+            // Serve requests synchronously instead
+            if (m_eventFD >= 0) {
+                close(m_eventFD);
+                m_eventFD = -1;
+            }
+            m_ring.Close();
+        }
+    }
+    return true;
+}
+
+uint32_t BlockDevice::IORead(uint16_t port, size_t size) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    switch (port - m_basePort) {
+    case RegControl:
+        return m_control;
+    case RegQueueSize:
+        return m_queueSize;
+    case RegSQBase:
+        return m_sqBase;
+    case RegCQBase:
+        return m_cqBase;
+    case RegSQTail:
+        return m_sqHead;
+    case RegCQHead:
+        // Acknowledge the interrupt; completions posted after this read will
+        // raise a new one
+        m_irqOutstanding = false;
+        m_cqTailRead = m_cqTail;
+        return m_cqTail;
+    case RegCapacityLo:
+        return (uint32_t)m_capacity;
+    case RegCapacityHi:
+        return (uint32_t)(m_capacity >> 32);
+    default:
+        return 0xFFFFFFFF;
+    }
+}
+
+void BlockDevice::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    bool raise = false;
+    size_t queued = 0;
+    // Entries filled by this thread must be submitted before another thread
+    // gets any
+    std::lock_guard<std::mutex> submitLock(m_submitMutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const bool enabled = (m_control & ControlEnable) != 0;
+        switch (port - m_basePort) {
+        case RegControl:
+            Enable((value & ControlEnable) != 0);
+            break;
+        case RegQueueSize:
+            if (!enabled) {
+                m_queueSize = value;
+            }
+            break;
+        case RegSQBase:
+            if (!enabled) {
+                m_sqBase = value;
+            }
+            break;
+        case RegCQBase:
+            if (!enabled) {
+                m_cqBase = value;
+            }
+            break;
+        case RegSQTail:
+            m_stats.doorbells++;
+            if (enabled && value - m_sqHead <= m_queueSize) {
+                m_sqTail = value;
+                queued = ProcessSubmissions(raise);
+            }
+            break;
+        case RegCQHead:
+            if (enabled && value - m_cqHead <= m_cqTail - m_cqHead) {
+                m_cqHead = value;
+                // Requests held back for lack of room can go now
+                queued = ProcessSubmissions(raise);
+            }
+            break;
+        }
+        if (queued > 0) {
+            m_stats.submitCalls++;
+        }
+    }
+
+    // The kernel may refuse new requests until the event loop reaps some
+    // completions
+    if (queued > 0) {
+        int result;
+        while ((result = m_ring.Submit()) == -EAGAIN || result == -EBUSY) {
+            sched_yield();
+        }
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+BlockDevice::Stats BlockDevice::GetStats() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void BlockDevice::Enable(bool enable) noexcept {
+    if (m_freeSlots.size() < MaxQueueSize) {
+        return;
+    }
+    m_control = 0;
+    if (!enable) {
+        return;
+    }
+    if (m_queueSize == 0 || m_queueSize > MaxQueueSize || (m_queueSize & (m_queueSize - 1)) != 0) {
+        return;
+    }
+    const uint64_t sqSize = (uint64_t)m_queueSize * sizeof(Request);
+    const uint64_t cqSize = (uint64_t)m_queueSize * sizeof(Completion);
+    if (m_sqBase < m_ramBase || m_sqBase - m_ramBase > m_ramSize || sqSize > m_ramSize - (m_sqBase - m_ramBase)) {
+        return;
+    }
+    if (m_cqBase < m_ramBase || m_cqBase - m_ramBase > m_ramSize || cqSize > m_ramSize - (m_cqBase - m_ramBase)) {
+        return;
+    }
+    m_sqHead = m_sqTail = 0;
+    m_cqHead = m_cqTail = m_cqTailRead = 0;
+    m_irqOutstanding = false;
+    m_control = ControlEnable;
+}
+
+size_t BlockDevice::ProcessSubmissions(bool& raiseInterrupt) noexcept {
+    const uint32_t mask = m_queueSize - 1;
+    size_t queued = 0;
+    bool posted = false;
+    while (m_sqHead != m_sqTail) {
+        // Reserve a completion slot for every request consumed so that the
+        // completion queue never overflows
+        const uint32_t inFlight = MaxQueueSize - (uint32_t)m_freeSlots.size();
+        if ((m_cqTail - m_cqHead) + inFlight >= m_queueSize) {
+            break;
+        }
+        Request request;
+        memcpy(&request, &m_ram[m_sqBase - m_ramBase + (m_sqHead & mask) * sizeof(Request)], sizeof(request));
+        m_sqHead++;
+        m_stats.requests++;
+
+        uint8_t *buffer;
+        uint32_t length;
+        Status status = Validate(request, buffer, length);
+        if (status != StatusOK || !m_ring.IsValid()) {
+            if (status == StatusOK) {
+                status = Execute(request, buffer, length);
+            }
+            PostCompletion(request.tag, status);
+            posted = true;
+            continue;
+        }
+
+        io_uring_sqe *sqe = m_ring.GetSQE();
+        if (sqe == NULL) {
+            PostCompletion(request.tag, StatusIOError);
+            posted = true;
+            continue;
+        }
+        const uint32_t slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        m_inFlight[slot].tag = request.tag;
+        m_inFlight[slot].length = length;
+
+        sqe->fd = m_fd;
+        sqe->user_data = slot;
+        switch (request.opcode) {
+        case OpRead:
+        case OpWrite:
+            sqe->opcode = (request.opcode == OpRead) ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->addr = (uint64_t)(uintptr_t)buffer;
+            sqe->len = length;
+            sqe->off = request.sector * SectorSize;
+            break;
+        case OpFlush:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+        }
+        queued++;
+    }
+    if (posted) {
+        m_stats.batches++;
+        raiseInterrupt = ShouldRaiseInterrupt();
+    }
+    return queued;
+}
+
+BlockDevice::Status BlockDevice::Validate(const Request& request, uint8_t *& buffer, uint32_t& length) const noexcept {
+    buffer = NULL;
+    length = 0;
+    switch (request.opcode) {
+    case OpFlush:
+        return StatusOK;
+    case OpRead:
+    case OpWrite:
+        break;
+    default:
+        return StatusInvalid;
+    }
+    if (request.numSectors == 0 || request.numSectors > MaxRequestSectors) {
+        return StatusInvalid;
+    }
+    if (request.sector >= m_capacity || request.numSectors > m_capacity - request.sector) {
+        return StatusInvalid;
+    }
+    // Never trust addresses coming from the guest
+    length = request.numSectors * SectorSize;
+    if (request.buffer < m_ramBase || request.buffer - m_ramBase > m_ramSize || length > m_ramSize - (request.buffer - m_ramBase)) {
+        return StatusInvalid;
+    }
+    buffer = &m_ram[request.buffer - m_ramBase];
+
+    // O_DIRECT fails misaligned transfers with EINVAL, which would look like
+    // a device error to the guest
+    if (m_direct) {
+        const uint64_t mask = m_directAlignment - 1;
+        if (((uintptr_t)buffer & mask) != 0 || ((request.sector * SectorSize) & mask) != 0 || (length & mask) != 0) {
+            buffer = NULL;
+            length = 0;
+            return StatusInvalid;
+        }
+    }
+    return StatusOK;
+}
+
+BlockDevice::Status BlockDevice::Execute(const Request& request, uint8_t *buffer, uint32_t length) noexcept {
+    if (request.opcode == OpFlush) {
+        return (fdatasync(m_fd) == 0) ? StatusOK : StatusIOError;
+    }
+    const off_t offset = (off_t)(request.sector * SectorSize);
+    for (uint32_t done = 0; done < length; ) {
+        const ssize_t result = (request.opcode == OpRead)
+            ? pread(m_fd, buffer + done, length - done, offset + done)
+            : pwrite(m_fd, buffer + done, length - done, offset + done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return StatusIOError;
+        }
+        done += (uint32_t)result;
+    }
+    return StatusOK;
+}
+
+void BlockDevice::PostCompletion(uint64_t tag, uint32_t status) noexcept {
+    Completion completion = { tag, status, 0 };
+    memcpy(&m_ram[m_cqBase - m_ramBase + (m_cqTail & (m_queueSize - 1)) * sizeof(Completion)], &completion, sizeof(completion));
+    m_cqTail++;
+    m_stats.completions++;
+    if (status != StatusOK) {
+        m_stats.errors++;
+    }
+}
+
+bool BlockDevice::ShouldRaiseInterrupt() noexcept {
+    // Only raise an interrupt if the guest has acknowledged the previous one
+    if (m_irqOutstanding || m_cqTail == m_cqTailRead) {
+        return false;
+    }
+    m_irqOutstanding = true;
+    m_stats.interrupts++;
+    return true;
+}
+
+void BlockDevice::OnCompletions() noexcept {
+    // Drain first so that completions posted while reaping signal again
+    drainEventFD(m_eventFD);
+    bool raise = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t count = m_ring.ReapCompletions([this](const io_uring_cqe& cqe) {
+            const uint32_t slot = (uint32_t)cqe.user_data;
+            const InFlight& request = m_inFlight[slot];
+            PostCompletion(request.tag, (cqe.res >= 0 && (uint32_t)cqe.res == request.length) ? StatusOK : StatusIOError);
+            m_freeSlots.push_back(slot);
+        });
+        if (count > 0) {
+            m_stats.batches++;
+            raise = ShouldRaiseInterrupt();
+        }
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+#endif
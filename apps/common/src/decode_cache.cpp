@@ -0,0 +1,207 @@
+/*
+Defines a cache of decoded guest instructions keyed by guest physical
+address, kept coherent with the guest's code through dirty page tracking.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "decode_cache.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace virt86;
+
+const uint64_t cr0PE = 1ull << 0;
+const uint64_t cr0PG = 1ull << 31;
+const uint64_t eferLMA = 1ull << 10;
+const uint16_t csL = 1 << 13;
+const uint16_t csDB = 1 << 14;
+const size_t maxInstructionLength = 15;
+
+DecodeCache::DecodeCache(VirtualMachine& vm, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_vm(vm)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+    , m_bitmap((ramSize / PAGE_SIZE + 63) / 64)
+{
+}
+
+const X86Instruction *DecodeCache::Lookup(VirtualProcessor& vp, uint64_t *physicalAddress) noexcept {
+    static const Reg regs[] = { Reg::CS, Reg::RIP, Reg::CR0, Reg::EFER };
+    RegValue values[array_size(regs)];
+    if (vp.RegRead(regs, values, array_size(regs)) != VPOperationStatus::OK) {
+        return NULL;
+    }
+    const auto& cs = values[0].segment;
+    const uint64_t cr0 = values[2].u64;
+    X86Mode mode;
+    uint64_t linear;
+    if ((values[3].u64 & eferLMA) && (cs.attributes & csL)) {
+        mode = X86Mode::Bits64;
+        linear = values[1].u64;
+    }
+    else {
+        mode = ((cr0 & cr0PE) && (cs.attributes & csDB)) ? X86Mode::Bits32 : X86Mode::Bits16;
+        linear = (uint32_t)(cs.base + values[1].u32);
+    }
+
+    uint64_t physical = linear;
+    if ((cr0 & cr0PG) && !vp.LinearToPhysical(linear, &physical)) {
+        return NULL;
+    }
+    if (physicalAddress != NULL) {
+        *physicalAddress = physical;
+    }
+    m_stats.lookups++;
+
+    if (m_enabled) {
+        auto it = m_entries.find(physical);
+        if (it != m_entries.end() && it->second.mode == mode) {
+            m_stats.hits++;
+            return &it->second.insn;
+        }
+    }
+
+    X86Instruction insn;
+    if (!Decode(vp, linear, physical, mode, insn)) {
+        return NULL;
+    }
+    const bool inRAM = physical >= m_ramBase && physical - m_ramBase + insn.length <= m_ramSize;
+    if (!m_enabled || !inRAM) {
+        m_uncached = insn;
+        return &m_uncached;
+    }
+
+    const uint64_t lastPage = (physical + insn.length - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    auto result = m_entries.emplace(physical, Entry{ insn, mode, lastPage });
+    Entry& entry = result.first->second;
+    if (!result.second) {
+        // Same code reached in another mode, possibly with another length
+        UnlinkPages(physical, entry);
+        entry = Entry{ insn, mode, lastPage };
+    }
+    LinkPages(physical, entry);
+    return &entry.insn;
+}
+
+void DecodeCache::LinkPages(uint64_t address, const Entry& entry) noexcept {
+    for (uint64_t page = address & ~(uint64_t)(PAGE_SIZE - 1); page <= entry.lastPage; page += PAGE_SIZE) {
+        m_codePages[page].push_back(address);
+    }
+}
+
+void DecodeCache::UnlinkPages(uint64_t address, const Entry& entry) noexcept {
+    for (uint64_t page = address & ~(uint64_t)(PAGE_SIZE - 1); page <= entry.lastPage; page += PAGE_SIZE) {
+        auto it = m_codePages.find(page);
+        if (it == m_codePages.end()) {
+            continue;
+        }
+        auto& addresses = it->second;
+        addresses.erase(std::remove(addresses.begin(), addresses.end(), address), addresses.end());
+        if (addresses.empty()) {
+            m_codePages.erase(it);
+        }
+    }
+}
+
+bool DecodeCache::Decode(VirtualProcessor& vp, uint64_t linear, uint64_t physical, X86Mode mode, X86Instruction& insn) noexcept {
+    uint8_t bytes[maxInstructionLength];
+    size_t size = 0;
+    if (physical >= m_ramBase && physical < m_ramBase + m_ramSize) {
+        // Read straight from host memory, stopping at the end of the page in
+        // case the next one maps elsewhere
+        const uint64_t offset = physical - m_ramBase;
+        const uint64_t pageLeft = PAGE_SIZE - (physical & (PAGE_SIZE - 1));
+        size = (size_t)std::min<uint64_t>({ sizeof(bytes), m_ramSize - offset, pageLeft });
+        memcpy(bytes, &m_ram[offset], size);
+    }
+    if (size < sizeof(bytes)) {
+        // The instruction may continue into memory that is not in the RAM
+        // region; read byte by byte until the first unreadable address
+        while (size < sizeof(bytes) && vp.LMemRead(linear + size, 1, &bytes[size])) {
+            size++;
+        }
+    }
+    m_stats.decodes++;
+    return size > 0 && decodeX86(bytes, size, linear, mode, insn);
+}
+
+bool DecodeCache::Refresh() noexcept {
+    m_stats.refreshes++;
+    if (m_codePages.empty()) {
+        return true;
+    }
+    memset(m_bitmap.data(), 0, m_bitmap.size() * sizeof(uint64_t));
+    if (m_vm.QueryDirtyPages(m_ramBase, m_ramSize, m_bitmap.data(), m_bitmap.size() * sizeof(uint64_t)) != DirtyPageTrackingStatus::OK) {
+        // Without dirty page information, nothing can be trusted
+        m_stats.invalidatedPages += m_codePages.size();
+        Clear();
+        return false;
+    }
+    m_vm.ClearDirtyPages(m_ramBase, m_ramSize);
+
+    for (size_t i = 0; i < m_bitmap.size(); i++) {
+        uint64_t bits = m_bitmap[i];
+        while (bits != 0) {
+            size_t bit = 0;
+            while (!(bits & (1ull << bit))) {
+                bit++;
+            }
+            bits &= ~(1ull << bit);
+            InvalidatePage(m_ramBase + (i * 64 + bit) * PAGE_SIZE);
+        }
+    }
+    return true;
+}
+
+void DecodeCache::InvalidatePage(uint64_t page) noexcept {
+    auto it = m_codePages.find(page);
+    if (it == m_codePages.end()) {
+        return;
+    }
+    const std::vector<uint64_t> addresses = std::move(it->second);
+    m_codePages.erase(it);
+    for (uint64_t address : addresses) {
+        // Instructions crossing into a neighboring page leave its list too
+        auto entry = m_entries.find(address);
+        if (entry != m_entries.end()) {
+            UnlinkPages(address, entry->second);
+            m_entries.erase(entry);
+        }
+    }
+    m_stats.invalidatedPages++;
+}
+
+void DecodeCache::Clear() noexcept {
+    m_entries.clear();
+    m_codePages.clear();
+}
+
+void DecodeCache::SetEnabled(bool enabled) noexcept {
+    m_enabled = enabled;
+    if (!enabled) {
+        Clear();
+    }
+}
@@ -0,0 +1,182 @@
+/*
+Defines an epoll-based event loop that multiplexes host-side device
+backends such as eventfds, timerfds, files and sockets. Linux only.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "event_loop.hpp"
+
+#if defined(__linux__)
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const int maxEventsPerPoll = 64;
+
+EventLoop::EventLoop() noexcept
+    : m_epollFD(epoll_create1(EPOLL_CLOEXEC))
+    , m_stopFD(createEventFD())
+{
+    if (m_epollFD >= 0 && m_stopFD >= 0) {
+        epoll_event ev = { 0 };
+        ev.events = EPOLLIN;
+        ev.data.fd = m_stopFD;
+        if (epoll_ctl(m_epollFD, EPOLL_CTL_ADD, m_stopFD, &ev) != 0) {
+            close(m_stopFD);
+            m_stopFD = -1;
+        }
+    }
+}
+
+EventLoop::~EventLoop() {
+    if (m_stopFD >= 0) {
+        close(m_stopFD);
+    }
+    if (m_epollFD >= 0) {
+        close(m_epollFD);
+    }
+}
+
+bool EventLoop::Add(int fd, uint32_t events, Handler handler) noexcept {
+    if (fd < 0 || fd == m_stopFD || m_handlers.count(fd) != 0) {
+        return false;
+    }
+    epoll_event ev = { 0 };
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epollFD, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        return false;
+    }
+    m_handlers[fd] = std::make_shared<Handler>(std::move(handler));
+    return true;
+}
+
+bool EventLoop::Modify(int fd, uint32_t events) noexcept {
+    if (m_handlers.count(fd) == 0) {
+        return false;
+    }
+    epoll_event ev = { 0 };
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(m_epollFD, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+bool EventLoop::Remove(int fd) noexcept {
+    if (m_handlers.erase(fd) == 0) {
+        return false;
+    }
+    return epoll_ctl(m_epollFD, EPOLL_CTL_DEL, fd, NULL) == 0;
+}
+
+int EventLoop::Poll(int timeoutMs) noexcept {
+    epoll_event events[maxEventsPerPoll];
+    int count = epoll_wait(m_epollFD, events, maxEventsPerPoll, timeoutMs);
+    if (count < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    int dispatched = 0;
+    for (int i = 0; i < count; i++) {
+        const int fd = events[i].data.fd;
+        if (fd == m_stopFD) {
+            drainEventFD(m_stopFD);
+            m_running = false;
+            continue;
+        }
+        // The handler may have been removed by a previous handler in this batch.
+        // Keep a reference in case it removes itself.
+        auto it = m_handlers.find(fd);
+        if (it == m_handlers.end()) {
+            continue;
+        }
+        auto handler = it->second;
+        (*handler)(events[i].events);
+        dispatched++;
+    }
+    return dispatched;
+}
+
+void EventLoop::Run() noexcept {
+    m_running = true;
+    while (m_running) {
+        if (Poll(-1) < 0) {
+            break;
+        }
+    }
+}
+
+void EventLoop::Stop() noexcept {
+    m_running = false;
+    signalEventFD(m_stopFD);
+}
+
+// ----- File descriptor helpers ----------------------------------------------------------------------------------------------
+
+int createEventFD() noexcept {
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+bool signalEventFD(int fd, uint64_t count) noexcept {
+    return write(fd, &count, sizeof(count)) == sizeof(count);
+}
+
+uint64_t drainEventFD(int fd) noexcept {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+int createTimerFD(uint64_t initialNs, uint64_t intervalNs) noexcept {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!setTimerFD(fd, initialNs, intervalNs)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool setTimerFD(int fd, uint64_t initialNs, uint64_t intervalNs) noexcept {
+    itimerspec spec = { 0 };
+    spec.it_value.tv_sec = initialNs / 1000000000ull;
+    spec.it_value.tv_nsec = initialNs % 1000000000ull;
+    spec.it_interval.tv_sec = intervalNs / 1000000000ull;
+    spec.it_interval.tv_nsec = intervalNs % 1000000000ull;
+    return timerfd_settime(fd, 0, &spec, NULL) == 0;
+}
+
+uint64_t readTimerFD(int fd) noexcept {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+    return expirations;
+}
+
+#endif
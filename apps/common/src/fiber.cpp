@@ -0,0 +1,145 @@
+/*
+Defines a minimal cross-platform stackful fiber.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "fiber.hpp"
+
+#if defined(_WIN32)
+#  include <Windows.h>
+#elif defined(__linux__)
+#  include <ucontext.h>
+#  include <stdlib.h>
+#elif defined(__APPLE__)
+#  define _XOPEN_SOURCE 600
+#  include <ucontext.h>
+#  include <stdlib.h>
+#else
+#  error Unsupported platform
+#endif
+
+static thread_local Fiber *t_currentFiber = nullptr;
+
+// Runs the fiber function on the fiber's own stack
+struct FiberEntry {
+    static void Run(Fiber *fiber) noexcept;
+};
+
+#if defined(_WIN32)
+
+// Fiber handle of the thread itself, converted on first use
+static thread_local LPVOID t_threadFiber = NULL;
+
+struct Fiber::Context {
+    LPVOID fiber = NULL;
+    LPVOID caller = NULL;
+};
+
+static VOID CALLBACK fiberProc(LPVOID param) {
+    FiberEntry::Run((Fiber *)param);
+}
+
+#else
+
+struct Fiber::Context {
+    ucontext_t context;
+    ucontext_t caller;
+    void *stack = nullptr;
+};
+
+// makecontext only passes int arguments, so the fiber being started is handed
+// over through this variable instead
+static thread_local Fiber *t_startingFiber = nullptr;
+
+static void fiberProc() {
+    FiberEntry::Run(t_startingFiber);
+}
+
+#endif
+
+Fiber::Fiber(std::function<void()> func, size_t stackSize)
+    : m_func(std::move(func))
+    , m_context(new Context())
+{
+#if defined(_WIN32)
+    m_context->fiber = CreateFiber(stackSize, fiberProc, this);
+#else
+    m_context->stack = malloc(stackSize);
+    getcontext(&m_context->context);
+    m_context->context.uc_stack.ss_sp = m_context->stack;
+    m_context->context.uc_stack.ss_size = stackSize;
+    m_context->context.uc_link = &m_context->caller;
+    makecontext(&m_context->context, fiberProc, 0);
+#endif
+}
+
+Fiber::~Fiber() {
+#if defined(_WIN32)
+    if (m_context->fiber != NULL) {
+        DeleteFiber(m_context->fiber);
+    }
+#else
+    free(m_context->stack);
+#endif
+}
+
+void Fiber::Resume() noexcept {
+    if (m_finished) {
+        return;
+    }
+    m_previous = t_currentFiber;
+    t_currentFiber = this;
+#if defined(_WIN32)
+    if (t_threadFiber == NULL) {
+        t_threadFiber = ConvertThreadToFiber(NULL);
+    }
+    m_context->caller = GetCurrentFiber();
+    SwitchToFiber(m_context->fiber);
+#else
+    t_startingFiber = this;
+    swapcontext(&m_context->caller, &m_context->context);
+#endif
+    t_currentFiber = m_previous;
+}
+
+void Fiber::Suspend() noexcept {
+#if defined(_WIN32)
+    SwitchToFiber(m_context->caller);
+#else
+    swapcontext(&m_context->context, &m_context->caller);
+#endif
+}
+
+Fiber *Fiber::Current() noexcept {
+    return t_currentFiber;
+}
+
+void FiberEntry::Run(Fiber *fiber) noexcept {
+    fiber->m_func();
+    fiber->m_finished = true;
+#if defined(_WIN32)
+    // Windows fibers must never return from their entry point
+    SwitchToFiber(fiber->m_context->caller);
+#endif
+    // On POSIX systems, returning resumes uc_link, which is the caller
+}
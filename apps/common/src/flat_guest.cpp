@@ -0,0 +1,88 @@
+/*
+Defines a helper that writes a minimal boot program for guests that run
+in flat 32-bit protected mode.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "flat_guest.hpp"
+
+#include <cstring>
+
+void writeFlatGuestROM(uint8_t *rom, uint32_t entryPoint, uint32_t stackPointer) noexcept {
+    // Fill ROM with HLT instructions
+    memset(rom, 0xf4, FLAT_GUEST_ROM_SIZE);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+#define emit32(buf, value) {memcpy(&buf[addr], &value, sizeof(uint32_t)); addr += sizeof(uint32_t);}
+
+    // GDT table
+    addr = 0xff80;
+    emit(rom, "\x00\x00\x00\x00\x00\x00\x00\x00"); // [0xff80] GDT entry 0: null
+    emit(rom, "\xff\xff\x00\x00\x00\x9b\xcf\x00"); // [0xff88] GDT entry 1: code (full access to 4 GB linear space)
+    emit(rom, "\xff\xff\x00\x00\x00\x93\xcf\x00"); // [0xff90] GDT entry 2: data (full access to 4 GB linear space)
+    emit(rom, "\x17\x00\x80\xff\xff\xff");         // [0xff98] GDT pointer: 0xffffff80:0x0017
+
+    // --- 16-bit real mode transition to 32-bit protected mode ---------------------------------------------------------------
+
+    addr = 0xffa0;
+    emit(rom, "\xfa");                             // [0xffa0] cli
+    emit(rom, "\x66\x2e\x0f\x01\x16\x98\xff");     // [0xffa1] lgdt   [cs:0xff98]
+    emit(rom, "\x0f\x20\xc0");                     // [0xffa8] mov    eax, cr0
+    emit(rom, "\x0c\x01");                         // [0xffab] or      al, 1
+    emit(rom, "\x0f\x22\xc0");                     // [0xffad] mov    cr0, eax
+    emit(rom, "\x66\xea\xc0\xff\xff\xff\x08\x00"); // [0xffb0] jmp    dword 0x8:0xffffffc0
+
+    // --- 32-bit protected mode ----------------------------------------------------------------------------------------------
+
+    addr = 0xffc0;
+    emit(rom, "\x66\xb8\x10\x00");                 // [0xffc0] mov     ax, 0x10
+    emit(rom, "\x8e\xd8");                         // [0xffc4] mov     ds, eax
+    emit(rom, "\x8e\xc0");                         // [0xffc6] mov     es, eax
+    emit(rom, "\x8e\xe0");                         // [0xffc8] mov     fs, eax
+    emit(rom, "\x8e\xe8");                         // [0xffca] mov     gs, eax
+    emit(rom, "\x8e\xd0");                         // [0xffcc] mov     ss, eax
+    emit(rom, "\xbc"); emit32(rom, stackPointer);  // [0xffce] mov    esp, <stackPointer>
+    emit(rom, "\xb8"); emit32(rom, entryPoint);    // [0xffd3] mov    eax, <entryPoint>
+    emit(rom, "\xff\xe0");                         // [0xffd8] jmp    eax
+
+    // --- 16-bit real mode start ---------------------------------------------------------------------------------------------
+
+    addr = 0xfff0;
+    emit(rom, "\xeb\xae");                         // [0xfff0] jmp    short 0xffa0
+
+#undef emit32
+#undef emit
+}
+
+void writeFlatGuestIDTEntry(uint8_t *ram, uint32_t idtBase, uint8_t vector, uint32_t handler) noexcept {
+    uint8_t *entry = &ram[idtBase + vector * 8];
+    entry[0] = (uint8_t)handler;
+    entry[1] = (uint8_t)(handler >> 8);
+    entry[2] = (uint8_t)FLAT_GUEST_CODE_SEG;
+    entry[3] = (uint8_t)(FLAT_GUEST_CODE_SEG >> 8);
+    entry[4] = 0x00;
+    entry[5] = 0x8e;  // Present, DPL 0, 32-bit interrupt gate
+    entry[6] = (uint8_t)(handler >> 16);
+    entry[7] = (uint8_t)(handler >> 24);
+}
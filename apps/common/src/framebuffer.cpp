@@ -0,0 +1,320 @@
+/*
+Implements a linear framebuffer that finds the regions the guest changed
+through dirty page tracking.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "framebuffer.hpp"
+#include "align_alloc.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace virt86;
+
+Framebuffer::Framebuffer(uint32_t width, uint32_t height) noexcept
+    : m_width(width)
+    , m_height(height)
+    , m_size(((uint64_t)width * height * sizeof(uint32_t) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+{
+    if (m_size == 0) {
+        return;
+    }
+    m_memory = alignedAlloc((size_t)m_size);
+    if (m_memory == nullptr) {
+        return;
+    }
+    memset(m_memory, 0, (size_t)m_size);
+    m_shadow.resize((size_t)width * height, 0);
+    m_bitmap.resize((size_t)((m_size / PAGE_SIZE + 63) / 64));
+    m_collected.resize(m_bitmap.size());
+    m_pending.resize(m_bitmap.size());
+    m_rowFirst.resize(height, width);
+    m_rowLast.resize(height, 0);
+}
+
+Framebuffer::~Framebuffer() noexcept {
+    Stop();
+    if (m_memory != nullptr) {
+        alignedFree(m_memory);
+    }
+}
+
+MemoryMappingStatus Framebuffer::Map(VirtualMachine& vm, uint64_t address, bool trackDirtyPages) noexcept {
+    const bool tracking = trackDirtyPages && vm.GetPlatform().GetFeatures().dirtyPageTracking;
+    MemoryFlags flags = MemoryFlags::Read | MemoryFlags::Write;
+    if (tracking) {
+        flags |= MemoryFlags::DirtyPageTracking;
+    }
+    const auto status = vm.MapGuestMemory(address, m_size, flags, m_memory);
+    if (status == MemoryMappingStatus::OK) {
+        m_vm = &vm;
+        m_address = address;
+        m_tracking = tracking;
+        m_scanAll = true;
+    }
+    return status;
+}
+
+void Framebuffer::MarkDirtyRows() noexcept {
+    const uint64_t numPixels = (uint64_t)m_width * m_height;
+    auto markPixels = [this](uint64_t first, uint64_t end) {
+        const uint32_t firstRow = (uint32_t)(first / m_width);
+        const uint32_t lastRow = (uint32_t)((end - 1) / m_width);
+        for (uint32_t y = firstRow; y <= lastRow; y++) {
+            const uint32_t x0 = (y == firstRow) ? (uint32_t)(first % m_width) : 0;
+            const uint32_t x1 = (y == lastRow) ? (uint32_t)((end - 1) % m_width) : m_width - 1;
+            m_rowFirst[y] = std::min(m_rowFirst[y], x0);
+            m_rowLast[y] = std::max(m_rowLast[y], x1);
+        }
+    };
+
+    if (m_tracking) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_collected.swap(m_pending);
+        std::fill(m_pending.begin(), m_pending.end(), 0);
+    }
+
+    if (m_tracking && !m_scanAll) {
+        uint64_t dirtyPages = 0;
+        const uint64_t pixelsPerPage = PAGE_SIZE / sizeof(uint32_t);
+        for (size_t i = 0; i < m_collected.size(); i++) {
+            uint64_t bits = m_collected[i];
+            while (bits != 0) {
+                size_t bit = 0;
+                while ((bits & (1ull << bit)) == 0) {
+                    bit++;
+                }
+                bits &= ~(1ull << bit);
+                const uint64_t first = (i * 64 + bit) * pixelsPerPage;
+                if (first < numPixels) {
+                    markPixels(first, std::min(first + pixelsPerPage, numPixels));
+                    dirtyPages++;
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.dirtyPages += dirtyPages;
+        m_stats.pagesCompared += dirtyPages;
+        return;
+    }
+
+    // Compare everything, either because there is nothing to go by or
+    // because the pages written before mapping were never reported
+    m_scanAll = false;
+    if (numPixels != 0) {
+        markPixels(0, numPixels);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.pagesCompared += m_size / PAGE_SIZE;
+}
+
+void Framebuffer::CollectDirtyPages() noexcept {
+    if (!m_tracking) {
+        return;
+    }
+    std::fill(m_bitmap.begin(), m_bitmap.end(), 0);
+    if (m_vm->QueryDirtyPages(m_address, m_size, m_bitmap.data(), m_bitmap.size() * sizeof(uint64_t)) == DirtyPageTrackingStatus::OK) {
+        m_vm->ClearDirtyPages(m_address, m_size);
+    }
+    else {
+        // Nothing to go by; have the next refresh compare everything
+        std::fill(m_bitmap.begin(), m_bitmap.end(), ~0ull);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_bitmap.size(); i++) {
+        m_pending[i] |= m_bitmap[i];
+    }
+}
+
+void Framebuffer::UpdateRow(uint32_t y, std::vector<DirtyRect>& spans) noexcept {
+    spans.clear();
+    const uint32_t x0 = m_rowFirst[y];
+    const uint32_t x1 = m_rowLast[y];
+    m_rowFirst[y] = m_width;
+    m_rowLast[y] = 0;
+    if (x0 > x1) {
+        return;
+    }
+
+    // Copy each pixel as it is compared; the guest may still be drawing
+    const uint32_t *pixels = (const uint32_t *)m_memory + (size_t)y * m_width;
+    uint32_t *shadow = &m_shadow[(size_t)y * m_width];
+    for (uint32_t x = x0; x <= x1; x++) {
+        const uint32_t pixel = pixels[x];
+        if (pixel == shadow[x]) {
+            continue;
+        }
+        shadow[x] = pixel;
+        if (!spans.empty() && x - (spans.back().x + spans.back().width) < MergeGap) {
+            spans.back().width = x + 1 - spans.back().x;
+        }
+        else {
+            spans.push_back({ x, y, 1, 1 });
+        }
+    }
+}
+
+void Framebuffer::Refresh(std::vector<DirtyRect>& rects) noexcept {
+    rects.clear();
+    if (m_vm == nullptr) {
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    MarkDirtyRows();
+
+    // Grow rectangles downwards for as long as the next row has changed
+    // pixels below them
+    auto overlaps = [](const DirtyRect& rect, const DirtyRect& span) {
+        return span.x <= rect.x + rect.width && rect.x <= span.x + span.width;
+    };
+    auto extend = [](DirtyRect& rect, const DirtyRect& span) {
+        const uint32_t left = std::min(rect.x, span.x);
+        const uint32_t right = std::max(rect.x + rect.width, span.x + span.width);
+        rect.x = left;
+        rect.width = right - left;
+        rect.height = span.y + 1 - rect.y;
+    };
+    m_open.clear();
+    for (uint32_t y = 0; y < m_height; y++) {
+        UpdateRow(y, m_spans);
+        m_next.clear();
+        for (auto& span : m_spans) {
+            auto next = std::find_if(m_next.begin(), m_next.end(), [&](const DirtyRect& rect) { return overlaps(rect, span); });
+            if (next != m_next.end()) {
+                extend(*next, span);
+                continue;
+            }
+            auto open = std::find_if(m_open.begin(), m_open.end(), [&](const DirtyRect& rect) { return overlaps(rect, span); });
+            if (open != m_open.end()) {
+                extend(*open, span);
+                m_next.push_back(*open);
+                m_open.erase(open);
+                continue;
+            }
+            m_next.push_back(span);
+        }
+        // Whatever did not reach this row is complete
+        rects.insert(rects.end(), m_open.begin(), m_open.end());
+        std::swap(m_open, m_next);
+    }
+    rects.insert(rects.end(), m_open.begin(), m_open.end());
+
+    uint64_t pixels = 0;
+    for (auto& rect : rects) {
+        pixels += (uint64_t)rect.width * rect.height;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.refreshes++;
+    m_stats.rects += rects.size();
+    m_stats.pixels += pixels;
+    m_stats.refreshTime += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+}
+
+void Framebuffer::Start(std::chrono::milliseconds interval, RefreshFunc func) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running) {
+        return;
+    }
+    m_running = true;
+    m_stop = false;
+    m_thread = std::thread([this, interval, func]() { RefreshThread(interval, func); });
+}
+
+void Framebuffer::Stop() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_cond.notify_all();
+    }
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void Framebuffer::WaitForRefresh() noexcept {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_running) {
+        return;
+    }
+    const uint64_t target = m_started + 1;
+    m_cond.wait(lock, [this, target] { return m_completed >= target || !m_running; });
+}
+
+Framebuffer::Stats Framebuffer::GetStats() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void Framebuffer::RefreshThread(std::chrono::milliseconds interval, RefreshFunc func) noexcept {
+    std::vector<DirtyRect> rects;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        // One last refresh compares everything to pick up whatever was drawn
+        // before stopping, collected or not
+        const bool stop = m_stop;
+        m_started++;
+        lock.unlock();
+        if (stop) {
+            m_scanAll = true;
+        }
+        Refresh(rects);
+        if (!rects.empty() && func) {
+            func(*this, rects);
+        }
+        lock.lock();
+        m_completed = m_started;
+        m_cond.notify_all();
+        if (stop) {
+            break;
+        }
+        m_cond.wait_for(lock, interval, [this] { return m_stop; });
+    }
+    m_running = false;
+    m_cond.notify_all();
+}
+
+bool writePPM(const char *path, const uint32_t *pixels, uint32_t stride, const DirtyRect& rect) noexcept {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    fprintf(fp, "P6\n%" PRIu32 " %" PRIu32 "\n255\n", rect.width, rect.height);
+
+    std::vector<uint8_t> row((size_t)rect.width * 3);
+    bool ok = true;
+    for (uint32_t y = 0; y < rect.height && ok; y++) {
+        const uint32_t *src = pixels + (size_t)(rect.y + y) * stride + rect.x;
+        for (uint32_t x = 0; x < rect.width; x++) {
+            row[x * 3 + 0] = (uint8_t)(src[x] >> 16);
+            row[x * 3 + 1] = (uint8_t)(src[x] >> 8);
+            row[x * 3 + 2] = (uint8_t)src[x];
+        }
+        ok = fwrite(row.data(), 1, row.size(), fp) == row.size();
+    }
+    return (fclose(fp) == 0) && ok;
+}
@@ -0,0 +1,1014 @@
+/*
+Defines a GDB remote serial protocol server for debugging a virtual
+processor with gdb.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "gdb_server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#  include <WinSock2.h>
+#  include <WS2tcpip.h>
+#elif defined(__linux__) || defined(__APPLE__)
+#  include <arpa/inet.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <sys/select.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#else
+#  error Unsupported platform
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#  define MSG_NOSIGNAL 0
+#endif
+
+using namespace virt86;
+
+const intptr_t invalidSocket = -1;
+
+// How often a running guest checks for an interrupt request from the debugger
+const auto interruptPollInterval = std::chrono::milliseconds(20);
+
+const int sigINT = 2;
+const int sigTRAP = 5;
+
+// Largest packet the debugger may send, as advertised in qSupported
+const size_t maxPacketSize = 0x4000;
+
+// ----- Register layouts -------------------------------------------------------------------------------------------------
+
+struct RegLayout {
+    const Reg *regs;
+    size_t count;
+    size_t wideCount;     // Number of leading 64-bit registers; the rest are 32-bit
+    size_t firstSegment;  // Index of the first segment register
+    uint8_t pc, sp, fp;   // gdb register numbers for the stop reply
+};
+
+static const Reg x86Regs[] = {
+    Reg::EAX, Reg::ECX, Reg::EDX, Reg::EBX, Reg::ESP, Reg::EBP, Reg::ESI, Reg::EDI,
+    Reg::EIP, Reg::EFLAGS,
+    Reg::CS, Reg::SS, Reg::DS, Reg::ES, Reg::FS, Reg::GS,
+};
+
+static const Reg x64Regs[] = {
+    Reg::RAX, Reg::RBX, Reg::RCX, Reg::RDX, Reg::RSI, Reg::RDI, Reg::RBP, Reg::RSP,
+    Reg::R8, Reg::R9, Reg::R10, Reg::R11, Reg::R12, Reg::R13, Reg::R14, Reg::R15,
+    Reg::RIP, Reg::RFLAGS,
+    Reg::CS, Reg::SS, Reg::DS, Reg::ES, Reg::FS, Reg::GS,
+};
+
+static const RegLayout x86Layout = { x86Regs, sizeof(x86Regs) / sizeof(x86Regs[0]), 0, 10, 8, 4, 5 };
+static const RegLayout x64Layout = { x64Regs, sizeof(x64Regs) / sizeof(x64Regs[0]), 17, 18, 16, 7, 6 };
+
+static const RegLayout& layoutFor(GDBArch arch) noexcept {
+    return (arch == GDBArch::X86_64) ? x64Layout : x86Layout;
+}
+
+// ----- Encoding helpers -------------------------------------------------------------------------------------------------
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static int hexValue(char c) noexcept {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void appendHex(std::string& out, const uint8_t *data, size_t size) noexcept {
+    for (size_t i = 0; i < size; i++) {
+        out += hexDigits[data[i] >> 4];
+        out += hexDigits[data[i] & 0xF];
+    }
+}
+
+static bool decodeHex(const char *hex, size_t hexLen, uint8_t *data) noexcept {
+    for (size_t i = 0; i + 1 < hexLen; i += 2) {
+        const int hi = hexValue(hex[i]);
+        const int lo = hexValue(hex[i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        data[i / 2] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+// Parses a big-endian hexadecimal number, advancing the pointer past it.
+static uint64_t parseHex(const char *& ptr) noexcept {
+    uint64_t value = 0;
+    int digit;
+    while ((digit = hexValue(*ptr)) >= 0) {
+        value = (value << 4) | (uint64_t)digit;
+        ptr++;
+    }
+    return value;
+}
+
+// ----- Construction -----------------------------------------------------------------------------------------------------
+
+GDBServer::GDBServer(VirtualProcessor& vp, GDBArch arch) noexcept
+    : m_vp(vp)
+    , m_arch(arch)
+    , m_listenSocket(invalidSocket)
+    , m_socket(invalidSocket)
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+}
+
+static void closeSocket(intptr_t sock) noexcept {
+#if defined(_WIN32)
+    closesocket((SOCKET)sock);
+#else
+    close((int)sock);
+#endif
+}
+
+GDBServer::~GDBServer() noexcept {
+    if (m_socket != invalidSocket) {
+        closeSocket(m_socket);
+    }
+    if (m_listenSocket != invalidSocket) {
+        closeSocket(m_listenSocket);
+    }
+#if defined(_WIN32)
+    WSACleanup();
+#else
+    if (!m_unixPath.empty()) {
+        unlink(m_unixPath.c_str());
+    }
+#endif
+}
+
+void GDBServer::AddMemoryRegion(uint64_t guestBase, uint64_t size, uint8_t *hostMemory) noexcept {
+    m_regions.push_back({ guestBase, size, hostMemory });
+}
+
+// ----- Transport --------------------------------------------------------------------------------------------------------
+
+bool GDBServer::ListenTCP(uint16_t port) noexcept {
+    const auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if ((intptr_t)sock == invalidSocket) {
+        return false;
+    }
+    const int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0) {
+        closeSocket((intptr_t)sock);
+        return false;
+    }
+    m_listenSocket = (intptr_t)sock;
+    return true;
+}
+
+bool GDBServer::ListenUnix(const char *path) noexcept {
+#if defined(_WIN32)
+    (void)path;
+    return false;
+#else
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    unlink(path);
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0) {
+        close(sock);
+        return false;
+    }
+    m_listenSocket = sock;
+    m_unixPath = path;
+    return true;
+#endif
+}
+
+bool GDBServer::Accept() noexcept {
+    if (m_listenSocket == invalidSocket) {
+        return false;
+    }
+#if defined(_WIN32)
+    const auto sock = accept((SOCKET)m_listenSocket, NULL, NULL);
+#else
+    const auto sock = accept((int)m_listenSocket, NULL, NULL);
+#endif
+    if ((intptr_t)sock == invalidSocket) {
+        return false;
+    }
+    // Packets are small and latency-sensitive
+    const int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+
+    m_socket = (intptr_t)sock;
+    m_noAck = false;
+    m_rxBuffer.clear();
+    return true;
+}
+
+bool GDBServer::SendRaw(const char *data, size_t size) noexcept {
+    while (size > 0) {
+        const auto sent = send(m_socket, data, (int)size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool GDBServer::SendPacket(const std::string& payload) noexcept {
+    uint8_t checksum = 0;
+    for (char c : payload) {
+        checksum += (uint8_t)c;
+    }
+    std::string packet;
+    packet.reserve(payload.size() + 4);
+    packet += '$';
+    packet += payload;
+    packet += '#';
+    appendHex(packet, &checksum, 1);
+    return SendRaw(packet.data(), packet.size());
+}
+
+bool GDBServer::ReceivePacket(std::string& packet) noexcept {
+    for (;;) {
+        while (!m_rxBuffer.empty()) {
+            const char c = m_rxBuffer[0];
+            if (c == '\x03') {
+                m_rxBuffer.erase(0, 1);
+                packet = "\x03";
+                return true;
+            }
+            if (c != '$') {
+                // Acknowledgments and line noise
+                m_rxBuffer.erase(0, 1);
+                continue;
+            }
+            const size_t hash = m_rxBuffer.find('#');
+            if (hash == std::string::npos || hash + 2 >= m_rxBuffer.size()) {
+                break;
+            }
+            packet = m_rxBuffer.substr(1, hash - 1);
+            const int hi = hexValue(m_rxBuffer[hash + 1]);
+            const int lo = hexValue(m_rxBuffer[hash + 2]);
+            m_rxBuffer.erase(0, hash + 3);
+
+            if (!m_noAck) {
+                uint8_t checksum = 0;
+                for (char pc : packet) {
+                    checksum += (uint8_t)pc;
+                }
+                const bool valid = hi >= 0 && lo >= 0 && checksum == (uint8_t)((hi << 4) | lo);
+                if (!SendRaw(valid ? "+" : "-", 1)) {
+                    return false;
+                }
+                if (!valid) {
+                    continue;
+                }
+            }
+            return true;
+        }
+
+        char buf[4096];
+        const auto received = recv(m_socket, buf, sizeof(buf), 0);
+        if (received <= 0) {
+            return false;
+        }
+        m_rxBuffer.append(buf, (size_t)received);
+    }
+}
+
+bool GDBServer::PollInterrupt() noexcept {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(m_socket, &readSet);
+    timeval timeout = { 0, 0 };
+    if (select((int)m_socket + 1, &readSet, NULL, NULL, &timeout) <= 0) {
+        return false;
+    }
+    char buf[4096];
+    const auto received = recv(m_socket, buf, sizeof(buf), 0);
+    if (received <= 0) {
+        return false;
+    }
+    m_rxBuffer.append(buf, (size_t)received);
+    const size_t pos = m_rxBuffer.find('\x03');
+    if (pos == std::string::npos) {
+        return false;
+    }
+    m_rxBuffer.erase(pos, 1);
+    return true;
+}
+
+// ----- Registers --------------------------------------------------------------------------------------------------------
+
+size_t GDBServer::NumRegisters() const noexcept {
+    return layoutFor(m_arch).count;
+}
+
+bool GDBServer::FetchRegisters() noexcept {
+    if (m_regCacheValid) {
+        return true;
+    }
+    const RegLayout& layout = layoutFor(m_arch);
+    m_regCache.resize(layout.count);
+    m_regCacheValid = m_vp.RegRead(layout.regs, m_regCache.data(), layout.count) == VPOperationStatus::OK;
+    return m_regCacheValid;
+}
+
+bool GDBServer::StoreRegisters() noexcept {
+    // Segment registers are read-only to the debugger; loading a selector
+    // would require the descriptor tables to be walked by the hypervisor
+    const RegLayout& layout = layoutFor(m_arch);
+    return m_vp.RegWrite(layout.regs, m_regCache.data(), layout.firstSegment) == VPOperationStatus::OK;
+}
+
+std::string GDBServer::EncodeRegister(size_t index) const noexcept {
+    const RegLayout& layout = layoutFor(m_arch);
+    uint64_t value;
+    if (index >= layout.firstSegment) {
+        value = m_regCache[index].segment.selector;
+    }
+    else {
+        value = m_regCache[index].u64;
+    }
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(value >> (i * 8));
+    }
+    std::string out;
+    appendHex(out, bytes, (index < layout.wideCount) ? 8 : 4);
+    return out;
+}
+
+bool GDBServer::DecodeRegister(size_t index, const char *hex, size_t hexLen) noexcept {
+    const RegLayout& layout = layoutFor(m_arch);
+    const size_t size = (index < layout.wideCount) ? 8 : 4;
+    if (hexLen < size * 2) {
+        return false;
+    }
+    uint8_t bytes[8];
+    if (!decodeHex(hex, size * 2, bytes)) {
+        return false;
+    }
+    if (index >= layout.firstSegment) {
+        return true;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    m_regCache[index] = value;
+    return true;
+}
+
+uint64_t GDBServer::ReadPC() noexcept {
+    const RegLayout& layout = layoutFor(m_arch);
+    if (m_regCacheValid) {
+        return m_regCache[layout.pc].u64;
+    }
+    RegValue pc;
+    if (m_vp.RegRead(layout.regs[layout.pc], pc) != VPOperationStatus::OK) {
+        return 0;
+    }
+    return (m_arch == GDBArch::X86_64) ? pc.u64 : pc.u32;
+}
+
+// ----- Memory -----------------------------------------------------------------------------------------------------------
+
+uint8_t *GDBServer::HostPointer(uint64_t guestPhys, size_t size) noexcept {
+    for (auto& region : m_regions) {
+        if (guestPhys >= region.guestBase && guestPhys + size <= region.guestBase + region.size) {
+            return region.hostMemory + (guestPhys - region.guestBase);
+        }
+    }
+    return nullptr;
+}
+
+bool GDBServer::ReadMemory(uint64_t address, size_t size, uint8_t *data) noexcept {
+    // Translate once per page and copy straight from host memory when possible
+    while (size > 0) {
+        const size_t chunk = std::min<size_t>(size, PAGE_SIZE - (address & (PAGE_SIZE - 1)));
+        uint64_t phys;
+        uint8_t *host = m_vp.LinearToPhysical(address, &phys) ? HostPointer(phys, chunk) : nullptr;
+        if (host != nullptr) {
+            memcpy(data, host, chunk);
+        }
+        else if (!m_vp.LMemRead(address, chunk, data)) {
+            return false;
+        }
+        address += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool GDBServer::WriteMemory(uint64_t address, size_t size, const uint8_t *data) noexcept {
+    while (size > 0) {
+        const size_t chunk = std::min<size_t>(size, PAGE_SIZE - (address & (PAGE_SIZE - 1)));
+        uint64_t phys;
+        uint8_t *host = m_vp.LinearToPhysical(address, &phys) ? HostPointer(phys, chunk) : nullptr;
+        if (host != nullptr) {
+            memcpy(host, data, chunk);
+        }
+        else if (!m_vp.LMemWrite(address, chunk, data)) {
+            return false;
+        }
+        address += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// ----- Breakpoints ------------------------------------------------------------------------------------------------------
+
+bool GDBServer::InsertBreakpoint(uint8_t type, uint64_t address, uint8_t length) noexcept {
+    if (type == 0) {
+        if (m_swBreakpoints.count(address)) {
+            return true;
+        }
+        uint8_t original;
+        if (!ReadMemory(address, 1, &original)) {
+            return false;
+        }
+        if (m_swBreakpoints.empty() && m_vp.EnableSoftwareBreakpoints(true) != VPOperationStatus::OK) {
+            return false;
+        }
+        const uint8_t int3 = 0xCC;
+        if (!WriteMemory(address, 1, &int3)) {
+            if (m_swBreakpoints.empty()) {
+                m_vp.EnableSoftwareBreakpoints(false);
+            }
+            return false;
+        }
+        m_swBreakpoints[address] = original;
+        return true;
+    }
+
+    for (auto& slot : m_hwBreakpoints) {
+        if (!slot.used) {
+            slot = { true, address, type, length };
+            if (ApplyHardwareBreakpoints()) {
+                return true;
+            }
+            slot.used = false;
+            ApplyHardwareBreakpoints();
+            return false;
+        }
+    }
+    return false;
+}
+
+bool GDBServer::RemoveBreakpoint(uint8_t type, uint64_t address, uint8_t length) noexcept {
+    if (type == 0) {
+        auto it = m_swBreakpoints.find(address);
+        if (it == m_swBreakpoints.end()) {
+            return false;
+        }
+        const bool restored = WriteMemory(address, 1, &it->second);
+        m_swBreakpoints.erase(it);
+        if (m_swBreakpoints.empty()) {
+            m_vp.EnableSoftwareBreakpoints(false);
+        }
+        return restored;
+    }
+
+    for (auto& slot : m_hwBreakpoints) {
+        if (slot.used && slot.type == type && slot.address == address && slot.length == length) {
+            slot.used = false;
+            return ApplyHardwareBreakpoints();
+        }
+    }
+    return false;
+}
+
+bool GDBServer::ApplyHardwareBreakpoints() noexcept {
+    // The trigger and length enumerations follow the encoding of the R/W and
+    // LEN fields of DR7
+    static const uint8_t triggerBits[] = { 0, 0b00, 0b01, 0b11, 0b11 };
+
+    HardwareBreakpoints bps = { 0 };
+    bool any = false;
+    for (int i = 0; i < 4; i++) {
+        auto& slot = m_hwBreakpoints[i];
+        if (!slot.used) {
+            continue;
+        }
+        uint8_t lengthBits;
+        switch (slot.type == 1 ? 1 : slot.length) {
+        case 1: lengthBits = 0b00; break;
+        case 2: lengthBits = 0b01; break;
+        case 8: lengthBits = 0b10; break;
+        default: lengthBits = 0b11; break;
+        }
+        bps.bp[i].address = slot.address;
+        bps.bp[i].localEnable = true;
+        bps.bp[i].globalEnable = false;
+        bps.bp[i].trigger = static_cast<HardwareBreakpointTrigger>(triggerBits[slot.type]);
+        bps.bp[i].length = static_cast<HardwareBreakpointLength>(lengthBits);
+        any = true;
+    }
+    if (!any) {
+        return m_vp.ClearHardwareBreakpoints() == VPOperationStatus::OK;
+    }
+    return m_vp.SetHardwareBreakpoints(bps) == VPOperationStatus::OK;
+}
+
+void GDBServer::RemoveAllBreakpoints() noexcept {
+    for (auto& bp : m_swBreakpoints) {
+        WriteMemory(bp.first, 1, &bp.second);
+    }
+    if (!m_swBreakpoints.empty()) {
+        m_vp.EnableSoftwareBreakpoints(false);
+    }
+    m_swBreakpoints.clear();
+
+    bool anyHardware = false;
+    for (auto& slot : m_hwBreakpoints) {
+        anyHardware |= slot.used;
+        slot.used = false;
+    }
+    if (anyHardware) {
+        m_vp.ClearHardwareBreakpoints();
+    }
+}
+
+// ----- Execution --------------------------------------------------------------------------------------------------------
+
+std::string GDBServer::StopReply(int signal, const char *reason, uint64_t address) noexcept {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "T%02x", signal);
+    std::string reply = buf;
+    if (reason != nullptr) {
+        reply += reason;
+        reply += ':';
+        if (address != 0) {
+            snprintf(buf, sizeof(buf), "%" PRIx64, address);
+            reply += buf;
+        }
+        reply += ';';
+    }
+
+    // Expedite the registers gdb needs to show where the guest stopped
+    if (FetchRegisters()) {
+        const RegLayout& layout = layoutFor(m_arch);
+        for (uint8_t index : { layout.pc, layout.sp, layout.fp }) {
+            snprintf(buf, sizeof(buf), "%02x:", index);
+            reply += buf;
+            reply += EncodeRegister(index);
+            reply += ';';
+        }
+    }
+    reply += "thread:1;";
+    return reply;
+}
+
+std::string GDBServer::HardwareBreakpointStopReply() noexcept {
+    RegValue dr6;
+    if (m_vp.RegRead(Reg::DR6, dr6) == VPOperationStatus::OK) {
+        for (int i = 0; i < 4; i++) {
+            auto& slot = m_hwBreakpoints[i];
+            if (slot.used && (dr6.u64 & (1ull << i))) {
+                switch (slot.type) {
+                case 2: return StopReply(sigTRAP, "watch", slot.address);
+                case 3: return StopReply(sigTRAP, "rwatch", slot.address);
+                case 4: return StopReply(sigTRAP, "awatch", slot.address);
+                }
+                break;
+            }
+        }
+    }
+    return StopReply(sigTRAP, "hwbreak");
+}
+
+bool GDBServer::HandleExit(const VMExitInfo& exitInfo) noexcept {
+    if (m_exitHandler) {
+        return m_exitHandler(m_vp, exitInfo);
+    }
+    switch (exitInfo.reason) {
+    case VMExitReason::PIO:
+    case VMExitReason::MMIO:
+    case VMExitReason::Cancelled:
+    case VMExitReason::Interrupt:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool GDBServer::StepOnce(VMExitReason& reason) noexcept {
+    // Lift a breakpoint planted at the current instruction for the duration
+    // of the step so that the original instruction executes
+    auto it = m_swBreakpoints.end();
+    if (!m_swBreakpoints.empty()) {
+        it = m_swBreakpoints.find(ReadPC());
+        if (it != m_swBreakpoints.end()) {
+            WriteMemory(it->first, 1, &it->second);
+        }
+    }
+    m_regCacheValid = false;
+    const auto status = m_vp.Step();
+    if (it != m_swBreakpoints.end()) {
+        const uint8_t int3 = 0xCC;
+        WriteMemory(it->first, 1, &int3);
+    }
+    reason = m_vp.GetVMExitInfo().reason;
+    return status == VPExecutionStatus::OK;
+}
+
+bool GDBServer::Resume(std::string& reply, ResumeMode mode, uint64_t rangeStart, uint64_t rangeEnd) noexcept {
+    auto lastPoll = std::chrono::steady_clock::now();
+    auto interrupted = [&]() {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastPoll < interruptPollInterval) {
+            return false;
+        }
+        lastPoll = now;
+        return PollInterrupt();
+    };
+
+    // Step until an instruction completes. When continuing, this also gets
+    // past a breakpoint planted at the current instruction.
+    if (mode != ResumeMode::Continue || m_swBreakpoints.count(ReadPC())) {
+        for (;;) {
+            VMExitReason reason;
+            if (!StepOnce(reason)) {
+                return false;
+            }
+            switch (reason) {
+            case VMExitReason::Step:
+                break;
+            case VMExitReason::SoftwareBreakpoint:
+                reply = StopReply(sigTRAP, "swbreak");
+                return true;
+            case VMExitReason::HardwareBreakpoint:
+                reply = HardwareBreakpointStopReply();
+                return true;
+            default:
+                if (!HandleExit(m_vp.GetVMExitInfo())) {
+                    reply = StopReply(sigTRAP);
+                    return true;
+                }
+                continue;
+            }
+
+            if (mode == ResumeMode::Continue) {
+                break;
+            }
+            if (mode == ResumeMode::Step) {
+                reply = StopReply(sigTRAP);
+                return true;
+            }
+            // Range step: only the program counter is read between steps
+            const uint64_t pc = ReadPC();
+            if (pc < rangeStart || pc >= rangeEnd) {
+                reply = StopReply(sigTRAP);
+                return true;
+            }
+            if (m_swBreakpoints.count(pc)) {
+                reply = StopReply(sigTRAP, "swbreak");
+                return true;
+            }
+            if (interrupted()) {
+                reply = StopReply(sigINT);
+                return true;
+            }
+        }
+    }
+
+    m_regCacheValid = false;
+    for (;;) {
+        if (m_vp.Run() != VPExecutionStatus::OK) {
+            return false;
+        }
+        auto& exitInfo = m_vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::SoftwareBreakpoint:
+            reply = StopReply(sigTRAP, m_swBreakpoints.count(ReadPC()) ? "swbreak" : nullptr);
+            return true;
+        case VMExitReason::HardwareBreakpoint:
+            reply = HardwareBreakpointStopReply();
+            return true;
+        case VMExitReason::Step:
+            reply = StopReply(sigTRAP);
+            return true;
+        default:
+            if (!HandleExit(exitInfo)) {
+                reply = StopReply(sigTRAP);
+                return true;
+            }
+            break;
+        }
+        if (interrupted()) {
+            reply = StopReply(sigINT);
+            return true;
+        }
+    }
+}
+
+// ----- Packet handlers --------------------------------------------------------------------------------------------------
+
+std::string GDBServer::HandleQuery(const std::string& packet) noexcept {
+    if (packet.compare(0, 10, "qSupported") == 0) {
+        char reply[96];
+        snprintf(reply, sizeof(reply), "PacketSize=%zx;QStartNoAckMode+;swbreak+;hwbreak+;vContSupported+", maxPacketSize);
+        return reply;
+    }
+    if (packet == "QStartNoAckMode") {
+        return "OK";
+    }
+    if (packet == "qAttached") {
+        return "1";
+    }
+    if (packet == "qC") {
+        return "QC1";
+    }
+    if (packet == "qfThreadInfo") {
+        return "m1";
+    }
+    if (packet == "qsThreadInfo") {
+        return "l";
+    }
+    if (packet == "qOffsets") {
+        return "Text=0;Data=0;Bss=0";
+    }
+    if (packet.compare(0, 7, "qSymbol") == 0) {
+        return "OK";
+    }
+    return "";
+}
+
+bool GDBServer::HandleVCont(const std::string& packet, std::string& reply) noexcept {
+    if (packet == "vCont?") {
+        reply = "vCont;c;C;s;S;r";
+        return true;
+    }
+    if (packet.compare(0, 6, "vCont;") != 0) {
+        reply = "";
+        return true;
+    }
+    // There is a single thread, so only the first action matters
+    const char *ptr = packet.c_str() + 6;
+    switch (*ptr) {
+    case 'c':
+    case 'C':
+        return Resume(reply, ResumeMode::Continue);
+    case 's':
+    case 'S':
+        return Resume(reply, ResumeMode::Step);
+    case 'r':
+    {
+        ptr++;
+        const uint64_t start = parseHex(ptr);
+        if (*ptr == ',') {
+            ptr++;
+        }
+        const uint64_t end = parseHex(ptr);
+        return Resume(reply, ResumeMode::RangeStep, start, end);
+    }
+    default:
+        reply = "E01";
+        return true;
+    }
+}
+
+GDBSessionEnd GDBServer::Serve() noexcept {
+    if (m_socket == invalidSocket) {
+        return GDBSessionEnd::Disconnected;
+    }
+    m_regCacheValid = false;
+
+    std::string packet;
+    while (ReceivePacket(packet)) {
+        std::string reply;
+        const char *ptr = packet.c_str() + 1;
+        switch (packet[0]) {
+        case '\x03':
+        case '?':
+            reply = StopReply(packet[0] == '?' ? sigTRAP : sigINT);
+            break;
+
+        case 'g':
+            if (FetchRegisters()) {
+                for (size_t i = 0; i < NumRegisters(); i++) {
+                    reply += EncodeRegister(i);
+                }
+            }
+            else {
+                reply = "E01";
+            }
+            break;
+        case 'G':
+        {
+            reply = "E01";
+            if (!FetchRegisters()) {
+                break;
+            }
+            size_t offset = 1;
+            bool ok = true;
+            for (size_t i = 0; i < NumRegisters() && offset < packet.size(); i++) {
+                const size_t hexLen = ((i < layoutFor(m_arch).wideCount) ? 8 : 4) * 2;
+                ok &= DecodeRegister(i, packet.c_str() + offset, packet.size() - offset);
+                offset += hexLen;
+            }
+            if (ok && StoreRegisters()) {
+                reply = "OK";
+            }
+            else {
+                m_regCacheValid = false;
+            }
+            break;
+        }
+        case 'p':
+        {
+            const size_t index = (size_t)parseHex(ptr);
+            reply = (index < NumRegisters() && FetchRegisters()) ? EncodeRegister(index) : "E01";
+            break;
+        }
+        case 'P':
+        {
+            const size_t index = (size_t)parseHex(ptr);
+            reply = "E01";
+            if (*ptr == '=' && index < NumRegisters() && FetchRegisters()) {
+                ptr++;
+                if (DecodeRegister(index, ptr, strlen(ptr)) && StoreRegisters()) {
+                    reply = "OK";
+                }
+                else {
+                    m_regCacheValid = false;
+                }
+            }
+            break;
+        }
+
+        case 'm':
+        {
+            const uint64_t address = parseHex(ptr);
+            ptr++;
+            const size_t size = std::min<size_t>((size_t)parseHex(ptr), 0x1000);
+            std::vector<uint8_t> data(size);
+            if (!ReadMemory(address, size, data.data())) {
+                reply = "E14";
+                break;
+            }
+            // Hide planted breakpoints from the debugger
+            for (auto it = m_swBreakpoints.lower_bound(address); it != m_swBreakpoints.end() && it->first < address + size; ++it) {
+                data[it->first - address] = it->second;
+            }
+            appendHex(reply, data.data(), size);
+            break;
+        }
+        case 'M':
+        case 'X':
+        {
+            const uint64_t address = parseHex(ptr);
+            ptr++;
+            const size_t size = (size_t)parseHex(ptr);
+            ptr++;
+            const size_t dataOffset = ptr - packet.c_str();
+            // The length comes from the debugger; make sure the packet holds
+            // that much data before allocating anything
+            const size_t available = (dataOffset <= packet.size()) ? packet.size() - dataOffset : 0;
+            if (size > maxPacketSize || (packet[0] == 'M' ? size * 2 > available : size > available)) {
+                reply = "E14";
+                break;
+            }
+            std::vector<uint8_t> data(size);
+            bool ok = true;
+            if (packet[0] == 'M') {
+                ok = decodeHex(ptr, size * 2, data.data());
+            }
+            else {
+                size_t pos = dataOffset;
+                for (size_t i = 0; i < size && ok; i++) {
+                    if (pos >= packet.size()) {
+                        ok = false;
+                        break;
+                    }
+                    uint8_t b = (uint8_t)packet[pos++];
+                    if (b == '}' && pos < packet.size()) {
+                        b = (uint8_t)packet[pos++] ^ 0x20;
+                    }
+                    data[i] = b;
+                }
+            }
+            // Writes over planted breakpoints update the saved instruction bytes
+            for (auto it = m_swBreakpoints.lower_bound(address); ok && it != m_swBreakpoints.end() && it->first < address + size; ++it) {
+                it->second = data[it->first - address];
+                data[it->first - address] = 0xCC;
+            }
+            reply = (ok && WriteMemory(address, size, data.data())) ? "OK" : "E14";
+            break;
+        }
+
+        case 'Z':
+        case 'z':
+        {
+            const uint8_t type = (uint8_t)parseHex(ptr);
+            ptr++;
+            const uint64_t address = parseHex(ptr);
+            ptr++;
+            const uint8_t length = (uint8_t)parseHex(ptr);
+            // x86 cannot trap on reads alone
+            if (type > 4 || type == 3) {
+                reply = "";
+                break;
+            }
+            const bool ok = (packet[0] == 'Z') ? InsertBreakpoint(type, address, length) : RemoveBreakpoint(type, address, length);
+            reply = ok ? "OK" : "E01";
+            break;
+        }
+
+        case 'c':
+        case 's':
+            if (*ptr != '\0') {
+                const RegLayout& layout = layoutFor(m_arch);
+                m_vp.RegWrite(layout.regs[layout.pc], parseHex(ptr));
+            }
+            m_regCacheValid = false;
+            if (!Resume(reply, (packet[0] == 'c') ? ResumeMode::Continue : ResumeMode::Step)) {
+                return GDBSessionEnd::Failed;
+            }
+            break;
+        case 'v':
+            if (!HandleVCont(packet, reply)) {
+                return GDBSessionEnd::Failed;
+            }
+            break;
+
+        case 'q':
+        case 'Q':
+            reply = HandleQuery(packet);
+            break;
+        case 'H':
+        case 'T':
+            reply = "OK";
+            break;
+
+        case 'D':
+            RemoveAllBreakpoints();
+            SendPacket("OK");
+            return GDBSessionEnd::Detached;
+        case 'k':
+            RemoveAllBreakpoints();
+            return GDBSessionEnd::Killed;
+        }
+
+        if (!SendPacket(reply)) {
+            break;
+        }
+        if (packet == "QStartNoAckMode") {
+            m_noAck = true;
+        }
+    }
+    return GDBSessionEnd::Disconnected;
+}
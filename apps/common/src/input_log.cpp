@@ -0,0 +1,536 @@
+/*
+Defines a recorder and replayer of the non-deterministic inputs of a virtual
+processor: I/O and MMIO reads, CPUID results and injected interrupts.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "input_log.hpp"
+
+#include <cstring>
+
+using namespace virt86;
+
+const char logMagic[8] = { 'V', '8', '6', 'I', 'N', 'P', 'U', 'T' };
+const uint32_t logVersion = 1;
+const size_t flushThreshold = 64 * 1024;
+const uint64_t rflagsRF = 1ull << 16;
+
+static void putVarint(std::vector<uint8_t>& out, uint64_t value) noexcept {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+static void putLE32(std::vector<uint8_t>& out, uint32_t value) noexcept {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((uint8_t)(value >> (i * 8)));
+    }
+}
+
+static uint32_t getLE32(const uint8_t *in) noexcept {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static inline uint64_t zigzag(int64_t value) noexcept {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) noexcept {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint8_t sizeLog2(size_t size) noexcept {
+    switch (size) {
+    case 1: return 0;
+    case 2: return 1;
+    case 4: return 2;
+    default: return 3;
+    }
+}
+
+InputLog::InputLog(VirtualProcessor& vp, X86Mode mode) noexcept
+    : m_vp(vp)
+    , m_cpuMode(mode)
+{
+}
+
+bool InputLog::StartRecording(const char *path) noexcept {
+    Close();
+    m_file = fopen(path, "wb");
+    if (m_file == NULL) {
+        return false;
+    }
+    m_buffer.assign(logMagic, logMagic + sizeof(logMagic));
+    putLE32(m_buffer, logVersion);
+    putLE32(m_buffer, (m_cpuMode == X86Mode::Bits64) ? 64 : (m_cpuMode == X86Mode::Bits16) ? 16 : 32);
+    m_bytesWritten = 0;
+    m_syncCount = m_interruptCount = m_lastInterruptSync = m_lastMMIOAddress = 0;
+    m_mode = InputLogMode::Record;
+    return true;
+}
+
+bool InputLog::StartReplay(const char *path) noexcept {
+    Close();
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    m_log.resize(size > 0 ? (size_t)size : 0);
+    const bool ok = size >= 16 && fread(m_log.data(), m_log.size(), 1, fp) == 1;
+    fclose(fp);
+    if (!ok || memcmp(m_log.data(), logMagic, sizeof(logMagic)) != 0 || getLE32(&m_log[8]) != logVersion) {
+        m_log.clear();
+        return false;
+    }
+
+    m_readPos = 16;
+    m_syncCount = m_interruptCount = m_lastInterruptSync = m_lastMMIOAddress = 0;
+    m_diverged = false;
+    m_divergenceReason = NULL;
+    m_divergenceInput = 0;
+    m_mode = InputLogMode::Replay;
+    LoadNextInterrupt();
+    return true;
+}
+
+void InputLog::Close() noexcept {
+    if (m_mode == InputLogMode::Record) {
+        m_buffer.push_back(TagEnd);
+        Flush();
+        fclose(m_file);
+        m_file = NULL;
+    }
+    if (m_breakpointArmed) {
+        DisarmBreakpoint();
+    }
+    m_log.clear();
+    m_nextInterrupt.valid = false;
+    m_mode = InputLogMode::Off;
+}
+
+void InputLog::Attach(VirtualMachine& vm, IOBus& bus) noexcept {
+    m_bus = &bus;
+    vm.RegisterIOContext(this);
+    vm.RegisterIOReadCallback(ioReadCallback);
+    vm.RegisterIOWriteCallback(ioWriteCallback);
+    vm.RegisterMMIOReadCallback(mmioReadCallback);
+    vm.RegisterMMIOWriteCallback(mmioWriteCallback);
+}
+
+bool InputLog::ReplayComplete() const noexcept {
+    return m_mode == InputLogMode::Replay && !m_nextInterrupt.valid && m_readPos < m_log.size() && m_log[m_readPos] == TagEnd;
+}
+
+void InputLog::Flush() noexcept {
+    if (!m_buffer.empty()) {
+        fwrite(m_buffer.data(), m_buffer.size(), 1, m_file);
+        m_bytesWritten += m_buffer.size();
+        m_buffer.clear();
+    }
+}
+
+void InputLog::Diverge(const char *what) noexcept {
+    if (!m_diverged) {
+        m_divergenceReason = what;
+        m_divergenceInput = InputCount();
+        m_diverged = true;
+    }
+}
+
+// ----- Positions --------------------------------------------------------------------------------------------------------
+
+bool InputLog::ReadPosition(Position& position) noexcept {
+    static const Reg regs32[] = {
+        Reg::EIP, Reg::EFLAGS, Reg::EAX, Reg::ECX, Reg::EDX, Reg::EBX, Reg::ESP, Reg::EBP, Reg::ESI, Reg::EDI,
+    };
+    static const Reg regs64[] = {
+        Reg::RIP, Reg::RFLAGS, Reg::RAX, Reg::RCX, Reg::RDX, Reg::RBX, Reg::RSP, Reg::RBP, Reg::RSI, Reg::RDI,
+        Reg::R8, Reg::R9, Reg::R10, Reg::R11, Reg::R12, Reg::R13, Reg::R14, Reg::R15,
+    };
+    const bool is64 = m_cpuMode == X86Mode::Bits64;
+    const Reg *regs = is64 ? regs64 : regs32;
+    const size_t count = is64 ? sizeof(regs64) / sizeof(regs64[0]) : sizeof(regs32) / sizeof(regs32[0]);
+
+    RegValue values[sizeof(regs64) / sizeof(regs64[0])];
+    if (m_vp.RegRead(regs, values, count) != VPOperationStatus::OK) {
+        return false;
+    }
+
+    // FNV-1a over the flags and general purpose registers. RF is left out as
+    // the replayer sets it to get past its own breakpoint.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 1; i < count; i++) {
+        uint64_t value = is64 ? values[i].u64 : values[i].u32;
+        if (i == 1) {
+            value &= ~rflagsRF;
+        }
+        for (int b = 0; b < 8; b++) {
+            hash = (hash ^ (uint8_t)(value >> (b * 8))) * 16777619u;
+        }
+    }
+    position.ip = is64 ? values[0].u64 : values[0].u32;
+    position.fingerprint = hash;
+    return true;
+}
+
+bool InputLog::ArmBreakpoint(uint64_t ip) noexcept {
+    // Breakpoints take linear addresses
+    uint64_t address = ip;
+    if (m_cpuMode != X86Mode::Bits64) {
+        RegValue cs;
+        if (m_vp.RegRead(Reg::CS, cs) != VPOperationStatus::OK) {
+            return false;
+        }
+        address += cs.segment.base;
+    }
+    HardwareBreakpoints bps = { 0 };
+    bps.bp[0].address = address;
+    bps.bp[0].localEnable = true;
+    bps.bp[0].globalEnable = false;
+    bps.bp[0].trigger = static_cast<HardwareBreakpointTrigger>(0b00);  // Execution
+    bps.bp[0].length = static_cast<HardwareBreakpointLength>(0b00);
+    if (m_vp.SetHardwareBreakpoints(bps) != VPOperationStatus::OK) {
+        return false;
+    }
+    m_breakpointArmed = true;
+    return true;
+}
+
+void InputLog::DisarmBreakpoint() noexcept {
+    m_vp.ClearHardwareBreakpoints();
+    m_breakpointArmed = false;
+}
+
+// ----- Replay -----------------------------------------------------------------------------------------------------------
+
+bool InputLog::ReadVarint(uint64_t& value) noexcept {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_readPos >= m_log.size()) {
+            return false;
+        }
+        const uint8_t b = m_log[m_readPos++];
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool InputLog::BeginRead(uint8_t tag) noexcept {
+    if (m_diverged) {
+        return false;
+    }
+    if (m_nextInterrupt.valid) {
+        Diverge("guest requested an input before reaching the position of an interrupt");
+        return false;
+    }
+    if (m_readPos >= m_log.size() || m_log[m_readPos] != tag) {
+        Diverge("guest requested a different input");
+        return false;
+    }
+    m_readPos++;
+    return true;
+}
+
+void InputLog::LoadNextInterrupt() noexcept {
+    m_nextInterrupt.valid = false;
+    if (m_readPos >= m_log.size() || m_log[m_readPos] != TagInterrupt) {
+        return;
+    }
+    uint64_t delta, ip;
+    m_readPos++;
+    if (m_readPos >= m_log.size()) {
+        Diverge("truncated log");
+        return;
+    }
+    m_nextInterrupt.vector = m_log[m_readPos++];
+    if (!ReadVarint(delta) || !ReadVarint(ip) || m_readPos + 4 > m_log.size()) {
+        Diverge("truncated log");
+        return;
+    }
+    m_nextInterrupt.syncCount = m_lastInterruptSync + delta;
+    m_nextInterrupt.position.ip = ip;
+    m_nextInterrupt.position.fingerprint = getLE32(&m_log[m_readPos]);
+    m_readPos += 4;
+    m_nextInterrupt.valid = true;
+    if (m_nextInterrupt.syncCount != m_syncCount) {
+        Diverge("interrupt recorded at an inconsistent position");
+    }
+}
+
+bool InputLog::ReplayInterrupts() noexcept {
+    while (m_nextInterrupt.valid && !m_diverged) {
+        Position position;
+        if (!ReadPosition(position)) {
+            return false;
+        }
+        if (position.ip != m_nextInterrupt.position.ip || position.fingerprint != m_nextInterrupt.position.fingerprint) {
+            if (!m_breakpointArmed) {
+                return ArmBreakpoint(m_nextInterrupt.position.ip);
+            }
+            if (m_vp.GetVMExitInfo().reason == VMExitReason::HardwareBreakpoint && position.ip == m_nextInterrupt.position.ip) {
+                // Right instruction, wrong iteration; let it execute
+                RegValue flags;
+                const Reg flagsReg = (m_cpuMode == X86Mode::Bits64) ? Reg::RFLAGS : Reg::EFLAGS;
+                if (m_vp.RegRead(flagsReg, flags) != VPOperationStatus::OK) {
+                    return false;
+                }
+                flags.u64 |= rflagsRF;
+                return m_vp.RegWrite(flagsReg, flags) == VPOperationStatus::OK;
+            }
+            return true;
+        }
+
+        if (m_breakpointArmed) {
+            DisarmBreakpoint();
+        }
+        m_vp.EnqueueInterrupt(m_nextInterrupt.vector);
+        m_interruptCount++;
+        m_lastInterruptSync = m_syncCount;
+        LoadNextInterrupt();
+    }
+    return !m_diverged;
+}
+
+// ----- Execution --------------------------------------------------------------------------------------------------------
+
+bool InputLog::HandleCPUID() noexcept {
+    static const Reg regs[] = { Reg::EAX, Reg::EBX, Reg::ECX, Reg::EDX };
+    RegValue values[4];
+    RegValue function;
+    if (m_vp.RegRead(Reg::EAX, function) != VPOperationStatus::OK) {
+        return false;
+    }
+
+    switch (m_mode) {
+    case InputLogMode::Replay:
+    {
+        uint64_t fields[5];
+        if (!BeginRead(TagCPUID)) {
+            return false;
+        }
+        for (auto& field : fields) {
+            if (!ReadVarint(field)) {
+                Diverge("truncated log");
+                return false;
+            }
+        }
+        if (fields[0] != function.u32) {
+            Diverge("guest requested a different CPUID function");
+            return false;
+        }
+        for (int i = 0; i < 4; i++) {
+            values[i].u64 = fields[i + 1];
+        }
+        m_syncCount++;
+        LoadNextInterrupt();
+        return m_vp.RegWrite(regs, values, 4) == VPOperationStatus::OK;
+    }
+    case InputLogMode::Record:
+        if (m_cpuidHandler) {
+            m_cpuidHandler(m_vp);
+        }
+        if (m_vp.RegRead(regs, values, 4) != VPOperationStatus::OK) {
+            return false;
+        }
+        m_buffer.push_back(TagCPUID);
+        putVarint(m_buffer, function.u32);
+        for (auto& value : values) {
+            putVarint(m_buffer, value.u32);
+        }
+        m_syncCount++;
+        return true;
+    default:
+        if (m_cpuidHandler) {
+            m_cpuidHandler(m_vp);
+        }
+        m_syncCount++;
+        return true;
+    }
+}
+
+VPExecutionStatus InputLog::Run() noexcept {
+    for (;;) {
+        if (m_mode == InputLogMode::Replay && !ReplayInterrupts()) {
+            return VPExecutionStatus::Failed;
+        }
+        const auto status = m_vp.Run();
+        if (status != VPExecutionStatus::OK) {
+            return status;
+        }
+        if (m_diverged) {
+            return VPExecutionStatus::Failed;
+        }
+        if (m_mode == InputLogMode::Record && m_buffer.size() >= flushThreshold) {
+            Flush();
+        }
+
+        switch (m_vp.GetVMExitInfo().reason) {
+        case VMExitReason::CPUID:
+            if (!HandleCPUID()) {
+                return VPExecutionStatus::Failed;
+            }
+            continue;
+        case VMExitReason::HardwareBreakpoint:
+            if (m_breakpointArmed) {
+                continue;
+            }
+            break;
+        case VMExitReason::HLT:
+            if (m_mode == InputLogMode::Replay && m_nextInterrupt.valid) {
+                // The recorded run woke the guest up right here
+                Position position;
+                if (!ReadPosition(position)) {
+                    return VPExecutionStatus::Failed;
+                }
+                if (position.ip != m_nextInterrupt.position.ip || position.fingerprint != m_nextInterrupt.position.fingerprint) {
+                    Diverge("guest halted before reaching the position of an interrupt");
+                    return VPExecutionStatus::Failed;
+                }
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+        return status;
+    }
+}
+
+bool InputLog::EnqueueInterrupt(uint8_t vector) noexcept {
+    switch (m_mode) {
+    case InputLogMode::Replay:
+        // Interrupts come from the log
+        return true;
+    case InputLogMode::Record:
+    {
+        Position position;
+        if (!ReadPosition(position)) {
+            return false;
+        }
+        m_buffer.push_back(TagInterrupt);
+        m_buffer.push_back(vector);
+        putVarint(m_buffer, m_syncCount - m_lastInterruptSync);
+        putVarint(m_buffer, position.ip);
+        putLE32(m_buffer, position.fingerprint);
+        m_lastInterruptSync = m_syncCount;
+        m_interruptCount++;
+        break;
+    }
+    default:
+        m_interruptCount++;
+        break;
+    }
+    return m_vp.EnqueueInterrupt(vector);
+}
+
+// ----- I/O callbacks ----------------------------------------------------------------------------------------------------
+
+uint32_t InputLog::ioReadCallback(void *context, uint16_t port, size_t size) noexcept {
+    InputLog& log = *(InputLog *)context;
+    switch (log.m_mode) {
+    case InputLogMode::Replay:
+    {
+        uint64_t loggedPort, value;
+        if (!log.BeginRead(TagIORead | sizeLog2(size))) {
+            return 0xFFFFFFFF;
+        }
+        if (!log.ReadVarint(loggedPort) || !log.ReadVarint(value)) {
+            log.Diverge("truncated log");
+            return 0xFFFFFFFF;
+        }
+        if (loggedPort != port) {
+            log.Diverge("guest read from a different port");
+            return 0xFFFFFFFF;
+        }
+        log.m_syncCount++;
+        log.LoadNextInterrupt();
+        return (uint32_t)value;
+    }
+    case InputLogMode::Record:
+    {
+        const uint32_t value = log.m_bus->IORead(port, size);
+        log.m_buffer.push_back(TagIORead | sizeLog2(size));
+        putVarint(log.m_buffer, port);
+        putVarint(log.m_buffer, value);
+        log.m_syncCount++;
+        return value;
+    }
+    default:
+        log.m_syncCount++;
+        return log.m_bus->IORead(port, size);
+    }
+}
+
+void InputLog::ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept {
+    ((InputLog *)context)->m_bus->IOWrite(port, size, value);
+}
+
+uint64_t InputLog::mmioReadCallback(void *context, uint64_t address, size_t size) noexcept {
+    InputLog& log = *(InputLog *)context;
+    switch (log.m_mode) {
+    case InputLogMode::Replay:
+    {
+        uint64_t delta, value;
+        if (!log.BeginRead(TagMMIORead | sizeLog2(size))) {
+            return ~0ull;
+        }
+        if (!log.ReadVarint(delta) || !log.ReadVarint(value)) {
+            log.Diverge("truncated log");
+            return ~0ull;
+        }
+        if (log.m_lastMMIOAddress + unzigzag(delta) != address) {
+            log.Diverge("guest read from a different MMIO address");
+            return ~0ull;
+        }
+        log.m_lastMMIOAddress = address;
+        log.m_syncCount++;
+        log.LoadNextInterrupt();
+        return value;
+    }
+    case InputLogMode::Record:
+    {
+        const uint64_t value = log.m_bus->MMIORead(address, size);
+        log.m_buffer.push_back(TagMMIORead | sizeLog2(size));
+        putVarint(log.m_buffer, zigzag((int64_t)(address - log.m_lastMMIOAddress)));
+        putVarint(log.m_buffer, value);
+        log.m_lastMMIOAddress = address;
+        log.m_syncCount++;
+        return value;
+    }
+    default:
+        log.m_syncCount++;
+        return log.m_bus->MMIORead(address, size);
+    }
+}
+
+void InputLog::mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept {
+    ((InputLog *)context)->m_bus->MMIOWrite(address, size, value);
+}
@@ -0,0 +1,415 @@
+/*
+Defines a single-step instruction trace recorder with delta-compressed
+register state, and a reader for the traces it produces.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "instruction_trace.hpp"
+
+#include <cstring>
+
+using namespace virt86;
+
+const char traceMagic[8] = { 'V', '8', '6', 'T', 'R', 'A', 'C', 'E' };
+const uint32_t traceVersion = 1;
+const uint32_t chunkMagic = 0x4B4E4843;  // "CHNK"
+
+// ----- Register layouts -------------------------------------------------------------------------------------------------
+
+struct TraceReg {
+    Reg reg;
+    const char *name;
+    bool segment;
+};
+
+static const TraceReg x86Regs[] = {
+    { Reg::EAX, "eax", false }, { Reg::ECX, "ecx", false }, { Reg::EDX, "edx", false }, { Reg::EBX, "ebx", false },
+    { Reg::ESP, "esp", false }, { Reg::EBP, "ebp", false }, { Reg::ESI, "esi", false }, { Reg::EDI, "edi", false },
+    { Reg::EIP, "eip", false }, { Reg::EFLAGS, "eflags", false },
+    { Reg::CS, "cs", true }, { Reg::SS, "ss", true }, { Reg::DS, "ds", true },
+    { Reg::ES, "es", true }, { Reg::FS, "fs", true }, { Reg::GS, "gs", true },
+    { Reg::CR0, "cr0", false }, { Reg::CR2, "cr2", false }, { Reg::CR3, "cr3", false }, { Reg::CR4, "cr4", false },
+};
+
+static const TraceReg x64Regs[] = {
+    { Reg::RAX, "rax", false }, { Reg::RCX, "rcx", false }, { Reg::RDX, "rdx", false }, { Reg::RBX, "rbx", false },
+    { Reg::RSP, "rsp", false }, { Reg::RBP, "rbp", false }, { Reg::RSI, "rsi", false }, { Reg::RDI, "rdi", false },
+    { Reg::R8, "r8", false }, { Reg::R9, "r9", false }, { Reg::R10, "r10", false }, { Reg::R11, "r11", false },
+    { Reg::R12, "r12", false }, { Reg::R13, "r13", false }, { Reg::R14, "r14", false }, { Reg::R15, "r15", false },
+    { Reg::RIP, "rip", false }, { Reg::RFLAGS, "rflags", false },
+    { Reg::CS, "cs", true }, { Reg::SS, "ss", true }, { Reg::DS, "ds", true },
+    { Reg::ES, "es", true }, { Reg::FS, "fs", true }, { Reg::GS, "gs", true },
+    { Reg::CR0, "cr0", false }, { Reg::CR2, "cr2", false }, { Reg::CR3, "cr3", false }, { Reg::CR4, "cr4", false },
+    { Reg::CR8, "cr8", false }, { Reg::EFER, "efer", false },
+};
+
+static const TraceReg *traceRegs(X86Mode mode) noexcept {
+    return (mode == X86Mode::Bits64) ? x64Regs : x86Regs;
+}
+
+size_t traceRegisterCount(X86Mode mode) noexcept {
+    return (mode == X86Mode::Bits64) ? sizeof(x64Regs) / sizeof(x64Regs[0]) : sizeof(x86Regs) / sizeof(x86Regs[0]);
+}
+
+const char *traceRegisterName(X86Mode mode, size_t index) noexcept {
+    return (index < traceRegisterCount(mode)) ? traceRegs(mode)[index].name : NULL;
+}
+
+size_t traceIPIndex(X86Mode mode) noexcept {
+    return (mode == X86Mode::Bits64) ? 16 : 8;
+}
+
+static uint32_t modeBits(X86Mode mode) noexcept {
+    switch (mode) {
+    case X86Mode::Bits16: return 16;
+    case X86Mode::Bits64: return 64;
+    default: return 32;
+    }
+}
+
+// ----- Encoding ---------------------------------------------------------------------------------------------------------
+
+static void putLE(std::vector<uint8_t>& out, uint64_t value, size_t size) noexcept {
+    for (size_t i = 0; i < size; i++) {
+        out.push_back((uint8_t)(value >> (i * 8)));
+    }
+}
+
+static uint64_t getLE(const uint8_t *in, size_t size) noexcept {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t)in[i] << (i * 8);
+    }
+    return value;
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint64_t value) noexcept {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+static bool getVarint(const std::vector<uint8_t>& in, size_t& pos, uint64_t& value) noexcept {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) {
+            return false;
+        }
+        const uint8_t b = in[pos++];
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t zigzag(int64_t value) noexcept {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) noexcept {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// ----- TraceRecorder ----------------------------------------------------------------------------------------------------
+
+TraceRecorder::TraceRecorder(VirtualProcessor& vp, X86Mode mode, uint32_t keyframeInterval) noexcept
+    : m_vp(vp)
+    , m_mode(mode)
+    , m_keyframeInterval(keyframeInterval > 0 ? keyframeInterval : 1)
+{
+    const size_t count = traceRegisterCount(mode);
+    m_values.resize(count);
+    m_current.resize(count);
+    m_previous.resize(count);
+    m_keyframe.resize(count);
+}
+
+bool TraceRecorder::Open(const char *path) noexcept {
+    Close();
+    m_file = fopen(path, "wb");
+    if (m_file == NULL) {
+        return false;
+    }
+    setvbuf(m_file, NULL, _IOFBF, 1 << 20);
+
+    std::vector<uint8_t> header(traceMagic, traceMagic + sizeof(traceMagic));
+    putLE(header, traceVersion, 4);
+    putLE(header, modeBits(m_mode), 4);
+    putLE(header, traceRegisterCount(m_mode), 4);
+    putLE(header, m_keyframeInterval, 4);
+    m_ok = fwrite(header.data(), header.size(), 1, m_file) == 1;
+
+    m_steps = 0;
+    m_bytesWritten = header.size();
+    m_chunkEntries = 0;
+    m_chunk.clear();
+    return m_ok;
+}
+
+bool TraceRecorder::FlushChunk() noexcept {
+    if (m_chunkEntries == 0) {
+        return true;
+    }
+    std::vector<uint8_t> header;
+    putLE(header, chunkMagic, 4);
+    putLE(header, m_chunkFirstStep, 8);
+    putLE(header, m_chunkEntries, 4);
+    putLE(header, m_chunk.size(), 4);
+    for (auto value : m_keyframe) {
+        putLE(header, value, 8);
+    }
+    m_ok &= fwrite(header.data(), header.size(), 1, m_file) == 1;
+    if (!m_chunk.empty()) {
+        m_ok &= fwrite(m_chunk.data(), m_chunk.size(), 1, m_file) == 1;
+    }
+    m_bytesWritten += header.size() + m_chunk.size();
+    m_chunk.clear();
+    m_chunkEntries = 0;
+    return m_ok;
+}
+
+bool TraceRecorder::Close() noexcept {
+    if (m_file == NULL) {
+        return false;
+    }
+    FlushChunk();
+    m_ok &= fclose(m_file) == 0;
+    m_file = NULL;
+    return m_ok;
+}
+
+bool TraceRecorder::Capture() noexcept {
+    if (m_file == NULL || !m_ok) {
+        return false;
+    }
+
+    // One batched read per step, regardless of how many registers changed
+    const size_t count = m_current.size();
+    const TraceReg *regs = traceRegs(m_mode);
+    Reg ids[32];
+    for (size_t i = 0; i < count; i++) {
+        ids[i] = regs[i].reg;
+    }
+    if (m_vp.RegRead(ids, m_values.data(), count) != VPOperationStatus::OK) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (regs[i].segment) {
+            m_current[i] = m_values[i].segment.selector;
+        }
+        else if (m_mode == X86Mode::Bits64) {
+            m_current[i] = m_values[i].u64;
+        }
+        else {
+            m_current[i] = m_values[i].u32;
+        }
+    }
+
+    if (m_chunkEntries >= m_keyframeInterval) {
+        FlushChunk();
+    }
+    if (m_chunkEntries == 0) {
+        m_keyframe = m_current;
+        m_chunkFirstStep = m_steps;
+    }
+    else {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (m_current[i] != m_previous[i]) {
+                mask |= 1ull << i;
+            }
+        }
+        putVarint(m_chunk, mask);
+        for (size_t i = 0; i < count; i++) {
+            if (mask & (1ull << i)) {
+                putVarint(m_chunk, zigzag((int64_t)(m_current[i] - m_previous[i])));
+            }
+        }
+    }
+    m_previous.swap(m_current);
+    m_chunkEntries++;
+    m_steps++;
+    return m_ok;
+}
+
+VPExecutionStatus TraceRecorder::Step() noexcept {
+    const auto status = m_vp.Step();
+    if (status == VPExecutionStatus::OK && !Capture()) {
+        return VPExecutionStatus::Failed;
+    }
+    return status;
+}
+
+// ----- TraceReader ------------------------------------------------------------------------------------------------------
+
+bool TraceReader::Open(const char *path) noexcept {
+    Close();
+    m_file = fopen(path, "rb");
+    if (m_file == NULL) {
+        return false;
+    }
+
+    uint8_t header[24];
+    if (fread(header, sizeof(header), 1, m_file) != 1 || memcmp(header, traceMagic, sizeof(traceMagic)) != 0
+        || getLE(&header[8], 4) != traceVersion) {
+        Close();
+        return false;
+    }
+    switch (getLE(&header[12], 4)) {
+    case 16: m_mode = X86Mode::Bits16; break;
+    case 64: m_mode = X86Mode::Bits64; break;
+    default: m_mode = X86Mode::Bits32; break;
+    }
+    const size_t regCount = (size_t)getLE(&header[16], 4);
+    if (regCount != traceRegisterCount(m_mode)) {
+        Close();
+        return false;
+    }
+    m_regs.assign(regCount, 0);
+
+    // Index the chunks so that seeking only decodes a single chunk
+    const long keyframeSize = (long)(regCount * 8);
+    for (;;) {
+        uint8_t chunkHeader[20];
+        const long offset = ftell(m_file);
+        if (fread(chunkHeader, sizeof(chunkHeader), 1, m_file) != 1 || getLE(chunkHeader, 4) != chunkMagic) {
+            break;
+        }
+        ChunkInfo info;
+        info.offset = offset;
+        info.firstStep = getLE(&chunkHeader[4], 8);
+        info.entries = (uint32_t)getLE(&chunkHeader[12], 4);
+        info.dataSize = (uint32_t)getLE(&chunkHeader[16], 4);
+        m_chunks.push_back(info);
+        m_totalSteps = info.firstStep + info.entries;
+        if (fseek(m_file, keyframeSize + info.dataSize, SEEK_CUR) != 0) {
+            break;
+        }
+    }
+    m_positioned = false;
+    return true;
+}
+
+void TraceReader::Close() noexcept {
+    if (m_file != NULL) {
+        fclose(m_file);
+        m_file = NULL;
+    }
+    m_chunks.clear();
+    m_totalSteps = 0;
+    m_positioned = false;
+}
+
+bool TraceReader::LoadChunk(size_t index) noexcept {
+    if (index >= m_chunks.size()) {
+        return false;
+    }
+    const ChunkInfo& info = m_chunks[index];
+    const size_t keyframeSize = m_regs.size() * 8;
+    std::vector<uint8_t> keyframe(keyframeSize);
+    m_data.resize(info.dataSize);
+    if (fseek(m_file, info.offset + 20, SEEK_SET) != 0
+        || fread(keyframe.data(), keyframeSize, 1, m_file) != 1
+        || (info.dataSize > 0 && fread(m_data.data(), info.dataSize, 1, m_file) != 1)) {
+        return false;
+    }
+    for (size_t i = 0; i < m_regs.size(); i++) {
+        m_regs[i] = getLE(&keyframe[i * 8], 8);
+    }
+    m_chunkIndex = index;
+    m_dataPos = 0;
+    m_entryInChunk = 0;
+    m_step = info.firstStep;
+    m_changed = (m_regs.size() < 64) ? (1ull << m_regs.size()) - 1 : ~0ull;
+    m_positioned = true;
+    return true;
+}
+
+bool TraceReader::Next() noexcept {
+    if (!m_positioned) {
+        return LoadChunk(0);
+    }
+    if (m_entryInChunk + 1 >= m_chunks[m_chunkIndex].entries) {
+        // Report the changes relative to the last step of the previous chunk
+        // rather than the whole keyframe
+        const std::vector<uint64_t> previous = m_regs;
+        if (!LoadChunk(m_chunkIndex + 1)) {
+            return false;
+        }
+        m_changed = 0;
+        for (size_t i = 0; i < m_regs.size(); i++) {
+            if (m_regs[i] != previous[i]) {
+                m_changed |= 1ull << i;
+            }
+        }
+        return true;
+    }
+
+    uint64_t mask;
+    if (!getVarint(m_data, m_dataPos, mask)) {
+        return false;
+    }
+    for (size_t i = 0; i < m_regs.size(); i++) {
+        if (mask & (1ull << i)) {
+            uint64_t delta;
+            if (!getVarint(m_data, m_dataPos, delta)) {
+                return false;
+            }
+            m_regs[i] += (uint64_t)unzigzag(delta);
+        }
+    }
+    m_changed = mask;
+    m_entryInChunk++;
+    m_step++;
+    return true;
+}
+
+bool TraceReader::Seek(uint64_t step) noexcept {
+    if (step >= m_totalSteps) {
+        return false;
+    }
+    // Find the last chunk starting at or before the step
+    size_t lo = 0, hi = m_chunks.size();
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (m_chunks[mid].firstStep <= step) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (!LoadChunk(lo)) {
+        return false;
+    }
+    while (m_step < step) {
+        if (!Next()) {
+            return false;
+        }
+    }
+    return true;
+}
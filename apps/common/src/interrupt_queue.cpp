@@ -0,0 +1,69 @@
+/*
+Defines a queue of interrupts raised by device backends for a virtual
+processor, which also lets a halted processor sleep until one arrives.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "interrupt_queue.hpp"
+
+void InterruptQueue::Raise(uint8_t vector) noexcept {
+    AsyncOperation *waiter;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(vector);
+        waiter = m_waiter;
+        m_waiter = nullptr;
+    }
+    if (waiter != nullptr) {
+        waiter->Complete(vector);
+    }
+}
+
+bool InterruptQueue::HasPending() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_pending.empty();
+}
+
+void InterruptQueue::WaitForInterrupt() noexcept {
+    AsyncOperation op;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_pending.empty()) {
+            return;
+        }
+        m_waiter = &op;
+    }
+    awaitOperation(op);
+}
+
+size_t InterruptQueue::Deliver(virt86::VirtualProcessor& vp) noexcept {
+    std::vector<uint8_t> pending;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending.swap(m_pending);
+    }
+    for (auto vector : pending) {
+        vp.EnqueueInterrupt(vector);
+    }
+    return pending.size();
+}
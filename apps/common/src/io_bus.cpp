@@ -0,0 +1,280 @@
+/*
+Defines the I/O bus, which routes port and MMIO accesses from a virtual
+machine to device models.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "io_bus.hpp"
+
+#include "fiber.hpp"
+#include "reference_cpu.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// String I/O being coalesced by IOBus::Run for one virtual processor
+struct StringIO {
+    enum class Mode { None, Write, Read };
+
+    IOBus *bus = nullptr;
+    Mode mode = Mode::None;
+    IODevice *device = nullptr;
+    uint16_t port = 0;
+    size_t size = 0;
+    size_t count = 0;  // Elements buffered for writing or peeked for reading
+    size_t next = 0;   // Next peeked element to return
+
+    // The previous access of this exit, if it was a read
+    bool lastRead = false;
+    uint16_t lastReadPort = 0;
+    size_t lastReadSize = 0;
+
+    uint8_t buffer[4096];
+
+    bool Matches(Mode mode, IODevice *device, uint16_t port, size_t size) const noexcept {
+        return this->mode == mode && this->device == device && this->port == port && this->size == size;
+    }
+
+    // Hands buffered writes to the device or consumes the elements read
+    void Finish() noexcept {
+        if (mode == Mode::Write) {
+            device->IOWriteString(port, size, buffer, count);
+        }
+        else if (mode == Mode::Read && next > 0) {
+            device->IOConsumeString(port, size, next);
+        }
+        mode = Mode::None;
+        count = 0;
+        next = 0;
+    }
+};
+
+// String I/O state of the virtual processor running on the calling thread.
+// A processor run by a VPScheduler may park on a fiber in the middle of an
+// exit while another processor runs on the same thread, so the state follows
+// the fiber instead of the thread when there is one.
+static thread_local StringIO *t_stringIO = nullptr;
+
+static StringIO *currentStringIO() noexcept {
+    Fiber *fiber = Fiber::Current();
+    return (fiber != nullptr) ? (StringIO *)fiber->LocalData() : t_stringIO;
+}
+
+static void setCurrentStringIO(StringIO *stringIO) noexcept {
+    Fiber *fiber = Fiber::Current();
+    if (fiber != nullptr) {
+        fiber->SetLocalData(stringIO);
+    }
+    else {
+        t_stringIO = stringIO;
+    }
+}
+
+void IODevice::IOWriteString(uint16_t port, size_t size, const uint8_t *data, size_t count) noexcept {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t value = 0;
+        memcpy(&value, &data[i * size], size);
+        IOWrite(port, size, value);
+    }
+}
+
+void IOBus::Attach(virt86::VirtualMachine& vm) noexcept {
+    vm.RegisterIOContext(this);
+    vm.RegisterIOReadCallback(ioReadCallback);
+    vm.RegisterIOWriteCallback(ioWriteCallback);
+    vm.RegisterMMIOReadCallback(mmioReadCallback);
+    vm.RegisterMMIOWriteCallback(mmioWriteCallback);
+}
+
+void IOBus::Attach(ReferenceCPU& cpu) noexcept {
+    cpu.RegisterIOContext(this);
+    cpu.RegisterIOReadCallback(ioReadCallback);
+    cpu.RegisterIOWriteCallback(ioWriteCallback);
+    cpu.RegisterMMIOReadCallback(mmioReadCallback);
+    cpu.RegisterMMIOWriteCallback(mmioWriteCallback);
+}
+
+virt86::VPExecutionStatus IOBus::Run(virt86::VirtualProcessor& vp) noexcept {
+    StringIO stringIO;
+    stringIO.bus = this;
+    StringIO *previous = currentStringIO();
+    setCurrentStringIO(&stringIO);
+    const auto status = vp.Run();
+    stringIO.Finish();
+    setCurrentStringIO(previous);
+    return status;
+}
+
+bool IOBus::AddPIODevice(uint16_t basePort, uint32_t numPorts, IODevice& device) noexcept {
+    if (numPorts == 0 || basePort + numPorts > 0x10000) {
+        return false;
+    }
+    return insertRange(m_pioRanges, basePort, numPorts, device);
+}
+
+bool IOBus::AddMMIODevice(uint64_t baseAddress, uint64_t size, IODevice& device) noexcept {
+    if (size == 0 || baseAddress + size < baseAddress) {
+        return false;
+    }
+    return insertRange(m_mmioRanges, baseAddress, size, device);
+}
+
+uint32_t IOBus::IORead(uint16_t port, size_t size) noexcept {
+    IODevice *device = FindPIODevice(port);
+    StringIO *current = currentStringIO();
+    if (current == nullptr || current->bus != this) {
+        return (device != nullptr) ? device->IORead(port, size) : 0xFFFFFFFF;
+    }
+    auto& stringIO = *current;
+    if (stringIO.Matches(StringIO::Mode::Read, device, port, size) && stringIO.next < stringIO.count) {
+        uint32_t value = 0;
+        memcpy(&value, &stringIO.buffer[stringIO.next++ * size], size);
+        return value;
+    }
+    stringIO.Finish();
+    if (device == nullptr) {
+        stringIO.lastRead = false;
+        return 0xFFFFFFFF;
+    }
+
+    // A second read from the same port within one exit comes from a string
+    // instruction, which is likely to read many more
+    if (stringIO.lastRead && stringIO.lastReadPort == port && stringIO.lastReadSize == size) {
+        const size_t count = device->IOPeekString(port, size, stringIO.buffer, sizeof(stringIO.buffer) / size);
+        if (count > 0) {
+            stringIO.mode = StringIO::Mode::Read;
+            stringIO.device = device;
+            stringIO.port = port;
+            stringIO.size = size;
+            stringIO.count = count;
+            stringIO.next = 1;
+            uint32_t value = 0;
+            memcpy(&value, stringIO.buffer, size);
+            return value;
+        }
+    }
+    stringIO.lastRead = true;
+    stringIO.lastReadPort = port;
+    stringIO.lastReadSize = size;
+    return device->IORead(port, size);
+}
+
+void IOBus::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    IODevice *device = FindPIODevice(port);
+    StringIO *current = currentStringIO();
+    if (current == nullptr || current->bus != this) {
+        if (device != nullptr) {
+            device->IOWrite(port, size, value);
+        }
+        return;
+    }
+    auto& stringIO = *current;
+    stringIO.lastRead = false;
+    if (!stringIO.Matches(StringIO::Mode::Write, device, port, size) || (stringIO.count + 1) * size > sizeof(stringIO.buffer)) {
+        stringIO.Finish();
+        if (device == nullptr) {
+            return;
+        }
+        stringIO.mode = StringIO::Mode::Write;
+        stringIO.device = device;
+        stringIO.port = port;
+        stringIO.size = size;
+    }
+    memcpy(&stringIO.buffer[stringIO.count++ * size], &value, size);
+}
+
+uint64_t IOBus::MMIORead(uint64_t address, size_t size) noexcept {
+    StringIO *stringIO = currentStringIO();
+    if (stringIO != nullptr && stringIO->bus == this) {
+        stringIO->Finish();
+        stringIO->lastRead = false;
+    }
+    IODevice *device = FindMMIODevice(address);
+    if (device == nullptr) {
+        return ~0ull;
+    }
+    return device->MMIORead(address, size);
+}
+
+void IOBus::MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept {
+    StringIO *stringIO = currentStringIO();
+    if (stringIO != nullptr && stringIO->bus == this) {
+        stringIO->Finish();
+        stringIO->lastRead = false;
+    }
+    IODevice *device = FindMMIODevice(address);
+    if (device != nullptr) {
+        device->MMIOWrite(address, size, value);
+    }
+}
+
+IODevice *IOBus::FindPIODevice(uint16_t port) const noexcept {
+    return findRange(m_pioRanges, port);
+}
+
+IODevice *IOBus::FindMMIODevice(uint64_t address) const noexcept {
+    return findRange(m_mmioRanges, address);
+}
+
+bool IOBus::insertRange(std::vector<Range>& ranges, uint64_t base, uint64_t size, IODevice& device) noexcept {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), base, [](uint64_t addr, const Range& range) { return addr < range.base; });
+    if (it != ranges.begin()) {
+        auto& prev = *(it - 1);
+        if (prev.base + prev.size > base) {
+            return false;
+        }
+    }
+    if (it != ranges.end() && base + size > it->base) {
+        return false;
+    }
+    ranges.insert(it, Range{ base, size, &device });
+    return true;
+}
+
+IODevice *IOBus::findRange(const std::vector<Range>& ranges, uint64_t address) noexcept {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), address, [](uint64_t addr, const Range& range) { return addr < range.base; });
+    if (it == ranges.begin()) {
+        return nullptr;
+    }
+    auto& range = *(it - 1);
+    if (address - range.base >= range.size) {
+        return nullptr;
+    }
+    return range.device;
+}
+
+uint32_t IOBus::ioReadCallback(void *context, uint16_t port, size_t size) noexcept {
+    return ((IOBus *)context)->IORead(port, size);
+}
+
+void IOBus::ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept {
+    ((IOBus *)context)->IOWrite(port, size, value);
+}
+
+uint64_t IOBus::mmioReadCallback(void *context, uint64_t address, size_t size) noexcept {
+    return ((IOBus *)context)->MMIORead(address, size);
+}
+
+void IOBus::mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept {
+    ((IOBus *)context)->MMIOWrite(address, size, value);
+}
@@ -0,0 +1,187 @@
+/*
+Implements a minimal io_uring wrapper built directly on the system calls.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "io_uring.hpp"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <cstring>
+#include <vector>
+
+static int ioUringSetup(uint32_t entries, io_uring_params *params) noexcept {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) noexcept {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int fd, uint32_t opcode, const void *arg, uint32_t numArgs) noexcept {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+
+bool IOUring::Setup(uint32_t entries) noexcept {
+    Close();
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = ioUringSetup(entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+    m_ringFD = fd;
+
+    // The submission and completion rings share one mapping on kernels that
+    // support it
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        m_sqRingSize = m_cqRingSize = (m_sqRingSize > m_cqRingSize) ? m_sqRingSize : m_cqRingSize;
+    }
+    m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        Close();
+        return false;
+    }
+    if (singleMap) {
+        m_cqRing = m_sqRing;
+    }
+    else {
+        m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            Close();
+            return false;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        Close();
+        return false;
+    }
+    m_sqes = (io_uring_sqe *)sqes;
+
+    uint8_t *sq = (uint8_t *)m_sqRing;
+    m_sqHead = (uint32_t *)(sq + params.sq_off.head);
+    m_sqTail = (uint32_t *)(sq + params.sq_off.tail);
+    m_sqArray = (uint32_t *)(sq + params.sq_off.array);
+    m_sqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = *m_sqTail;
+    m_sqPending = 0;
+
+    uint8_t *cq = (uint8_t *)m_cqRing;
+    m_cqHead = (uint32_t *)(cq + params.cq_off.head);
+    m_cqTail = (uint32_t *)(cq + params.cq_off.tail);
+    m_cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void IOUring::Close() noexcept {
+    if (m_sqes != nullptr) {
+        munmap(m_sqes, m_sqesSize);
+        m_sqes = nullptr;
+    }
+    if (m_cqRing != nullptr && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    m_cqRing = nullptr;
+    if (m_sqRing != nullptr) {
+        munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = nullptr;
+    }
+    if (m_ringFD >= 0) {
+        close(m_ringFD);
+        m_ringFD = -1;
+    }
+}
+
+io_uring_sqe *IOUring::GetSQE() noexcept {
+    if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+        return NULL;
+    }
+    const uint32_t index = m_sqLocalTail & m_sqMask;
+    m_sqLocalTail++;
+    io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    return sqe;
+}
+
+int IOUring::Submit() noexcept {
+    const uint32_t tail = *m_sqTail;
+    m_sqPending += m_sqLocalTail - tail;
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    while (m_sqPending > 0) {
+        const int result = ioUringEnter(m_ringFD, m_sqPending, 0, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            break;
+        }
+        m_sqPending -= (uint32_t)result;
+        submitted += result;
+    }
+    return submitted;
+}
+
+bool IOUring::WaitForCompletions(uint32_t count) noexcept {
+    int result;
+    do {
+        result = ioUringEnter(m_ringFD, 0, count, IORING_ENTER_GETEVENTS);
+    } while (result < 0 && errno == EINTR);
+    return result >= 0;
+}
+
+bool IOUring::RegisterEventFD(int fd) noexcept {
+    return ioUringRegister(m_ringFD, IORING_REGISTER_EVENTFD, &fd, 1) == 0;
+}
+
+bool IOUring::SupportsOpcode(uint8_t opcode) const noexcept {
+    const uint32_t numOps = 256;
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + numOps * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *probe = (io_uring_probe *)buffer.data();
+    if (ioUringRegister(m_ringFD, IORING_REGISTER_PROBE, probe, numOps) != 0) {
+        return false;
+    }
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+#endif
@@ -0,0 +1,229 @@
+/*
+Defines an emulated local APIC for inter-processor interrupts between
+virtual processors running on separate host threads.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "local_apic.hpp"
+
+#if defined(_WIN32)
+#  include <intrin.h>
+#elif defined(__linux__)
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+// Register offsets
+const uint32_t regID = 0x020;
+const uint32_t regVersion = 0x030;
+const uint32_t regTPR = 0x080;
+const uint32_t regEOI = 0x0B0;
+const uint32_t regSVR = 0x0F0;
+const uint32_t regICRLow = 0x300;
+const uint32_t regICRHigh = 0x310;
+
+// Interrupt command register fields
+const uint32_t icrDeliveryModeMask = 7 << 8;
+const uint32_t icrDeliveryModeFixed = 0 << 8;
+const uint32_t icrShorthandShift = 18;
+const uint32_t icrShorthandNone = 0;
+const uint32_t icrShorthandSelf = 1;
+const uint32_t icrShorthandAll = 2;
+const uint32_t icrShorthandOthers = 3;
+const uint8_t icrBroadcast = 0xFF;
+
+static thread_local LocalAPIC *t_currentAPIC = nullptr;
+
+static inline void cpuRelax() noexcept {
+#if defined(_WIN32) || defined(__i386__) || defined(__x86_64__)
+    _mm_pause();
+#endif
+}
+
+static inline int clz64(uint64_t value) noexcept {
+#if defined(_WIN32)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63 - (int)index;
+#else
+    return __builtin_clzll(value);
+#endif
+}
+
+// ----- LocalAPIC --------------------------------------------------------------------------------------------------------
+
+void LocalAPIC::Post(uint8_t vector) noexcept {
+    m_irr[vector >> 6].fetch_or(1ull << (vector & 63));
+    Kick();
+}
+
+void LocalAPIC::Kick() noexcept {
+    if (m_sleeping.exchange(0) == 0) {
+        return;
+    }
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_sleeping), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    std::lock_guard<std::mutex> lock(m_sleepMutex);
+    m_sleepCond.notify_one();
+#endif
+}
+
+bool LocalAPIC::HasPending() const noexcept {
+    for (auto& word : m_irr) {
+        if (word.load(std::memory_order_relaxed) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LocalAPIC::WaitForInterrupt(uint32_t spinIterations) noexcept {
+    for (uint32_t i = 0; i < spinIterations; i++) {
+        if (HasPending()) {
+            return;
+        }
+        cpuRelax();
+    }
+
+    // Announce that we are going to sleep before checking the mailbox one
+    // last time; a sender that posts after the check will see the flag. The
+    // fence keeps the relaxed loads in HasPending from being ordered before
+    // the store, pairing with the sequentially consistent fetch_or and
+    // exchange in Post and Kick.
+    m_sleeping = 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (HasPending()) {
+        m_sleeping = 0;
+        return;
+    }
+#if defined(__linux__)
+    while (m_sleeping.load() == 1) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_sleeping), FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+#else
+    std::unique_lock<std::mutex> lock(m_sleepMutex);
+    m_sleepCond.wait(lock, [this]() { return m_sleeping.load() == 0; });
+#endif
+}
+
+size_t LocalAPIC::Deliver(virt86::VirtualProcessor& vp) noexcept {
+    size_t count = 0;
+    for (int word = 3; word >= 0; word--) {
+        uint64_t bits = m_irr[word].exchange(0);
+        while (bits != 0) {
+            const int bit = 63 - clz64(bits);
+            bits &= ~(1ull << bit);
+            vp.EnqueueInterrupt((uint8_t)(word * 64 + bit));
+            count++;
+        }
+    }
+    return count;
+}
+
+// ----- APICBus ----------------------------------------------------------------------------------------------------------
+
+APICBus::APICBus(size_t numProcessors) noexcept {
+    for (size_t i = 0; i < numProcessors; i++) {
+        m_apics.emplace_back(new LocalAPIC((uint8_t)i));
+    }
+}
+
+void APICBus::BindCurrentThread(size_t index) noexcept {
+    t_currentAPIC = m_apics[index].get();
+}
+
+void APICBus::SendIPI(LocalAPIC& source, uint32_t icrLow, uint32_t icrHigh) noexcept {
+    // Only fixed interrupts are emulated
+    if ((icrLow & icrDeliveryModeMask) != icrDeliveryModeFixed) {
+        return;
+    }
+    const uint8_t vector = (uint8_t)icrLow;
+    const uint32_t shorthand = (icrLow >> icrShorthandShift) & 3;
+    const uint8_t dest = (uint8_t)(icrHigh >> 24);
+
+    auto send = [&](LocalAPIC& target) {
+        target.m_ipisReceived.fetch_add(1, std::memory_order_relaxed);
+        source.m_ipisSent.fetch_add(1, std::memory_order_relaxed);
+        target.Post(vector);
+    };
+
+    switch (shorthand) {
+    case icrShorthandNone:
+        if (dest == icrBroadcast) {
+            for (auto& apic : m_apics) {
+                send(*apic);
+            }
+        }
+        else if (dest < m_apics.size()) {
+            send(*m_apics[dest]);
+        }
+        break;
+    case icrShorthandSelf:
+        send(source);
+        break;
+    case icrShorthandAll:
+    case icrShorthandOthers:
+        for (auto& apic : m_apics) {
+            if (shorthand == icrShorthandAll || apic.get() != &source) {
+                send(*apic);
+            }
+        }
+        break;
+    }
+}
+
+uint64_t APICBus::MMIORead(uint64_t address, size_t size) noexcept {
+    LocalAPIC *apic = t_currentAPIC;
+    if (apic == nullptr) {
+        return ~0ull;
+    }
+    switch ((address - LAPIC_BASE) & 0xFF0) {
+    case regID: return (uint32_t)apic->m_id << 24;
+    case regVersion: return 0x00050014;  // Version 0x14, 6 LVT entries
+    case regTPR: return apic->m_tpr;
+    case regSVR: return apic->m_svr;
+    case regICRLow: return 0;  // Delivery is always complete
+    case regICRHigh: return apic->m_icrHigh;
+    default: return 0;
+    }
+}
+
+void APICBus::MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept {
+    LocalAPIC *apic = t_currentAPIC;
+    if (apic == nullptr) {
+        return;
+    }
+    switch ((address - LAPIC_BASE) & 0xFF0) {
+    case regTPR: apic->m_tpr = (uint32_t)value & 0xFF; break;
+    case regEOI: break;
+    case regSVR: apic->m_svr = (uint32_t)value; break;
+    case regICRLow: SendIPI(*apic, (uint32_t)value, apic->m_icrHigh); break;
+    case regICRHigh: apic->m_icrHigh = (uint32_t)value; break;
+    }
+}
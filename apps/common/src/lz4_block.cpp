@@ -0,0 +1,208 @@
+/*
+Implements a compressor and decompressor for the LZ4 block format.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "lz4_block.hpp"
+
+#include <cstring>
+
+// Format limits
+const size_t minMatch = 4;       // Shortest match that can be encoded
+const size_t lastLiterals = 5;   // The last bytes of a block are always literals
+const size_t matchFindLimit = 12; // The last match starts at least this far from the end
+const size_t maxOffset = 65535;
+
+const unsigned hashBits = 12;
+
+static inline uint32_t read32(const uint8_t *ptr) noexcept {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash(uint32_t sequence) noexcept {
+    return (sequence * 2654435761u) >> (32 - hashBits);
+}
+
+// Writes a length that did not fit in the token as a run of 255s followed by
+// the remainder
+static inline bool writeLength(uint8_t *&op, const uint8_t *oend, size_t length) noexcept {
+    while (length >= 255) {
+        if (op >= oend) {
+            return false;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= oend) {
+        return false;
+    }
+    *op++ = (uint8_t)length;
+    return true;
+}
+
+// Writes a sequence of literals optionally followed by a match. A matchLength
+// of zero writes the final, literals-only sequence of a block.
+static bool writeSequence(uint8_t *&op, const uint8_t *oend, const uint8_t *literals, size_t literalLength, size_t offset, size_t matchLength) noexcept {
+    if (op >= oend) {
+        return false;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && !writeLength(op, oend, literalLength - 15)) {
+        return false;
+    }
+    if ((size_t)(oend - op) < literalLength) {
+        return false;
+    }
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+    if (matchLength == 0) {
+        return true;
+    }
+
+    if (oend - op < 2) {
+        return false;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    const size_t length = matchLength - minMatch;
+    *token |= (uint8_t)(length >= 15 ? 15 : length);
+    return length < 15 || writeLength(op, oend, length - 15);
+}
+
+size_t lz4CompressBound(size_t size) noexcept {
+    return size + size / 255 + 16;
+}
+
+size_t lz4Compress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity) noexcept {
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + dstCapacity;
+    size_t anchor = 0;
+
+    if (srcSize > matchFindLimit) {
+        // Positions plus one of recently seen 4-byte sequences; zero is empty
+        uint32_t table[1 << hashBits];
+        memset(table, 0, sizeof(table));
+
+        const size_t matchLimit = srcSize - lastLiterals;
+        const size_t inputLimit = srcSize - matchFindLimit;
+        size_t ip = 0;
+        while (ip <= inputLimit) {
+            const uint32_t sequence = read32(src + ip);
+            const uint32_t h = hash(sequence);
+            const size_t candidate = table[h];
+            table[h] = (uint32_t)(ip + 1);
+            if (candidate == 0 || ip - (candidate - 1) > maxOffset || read32(src + candidate - 1) != sequence) {
+                // Skip ahead faster the longer no match is found, so that
+                // incompressible data goes by quickly
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t match = candidate - 1;
+            while (ip > anchor && match > 0 && src[ip - 1] == src[match - 1]) {
+                ip--;
+                match--;
+            }
+            size_t length = minMatch;
+            while (ip + length < matchLimit && src[ip + length] == src[match + length]) {
+                length++;
+            }
+            if (!writeSequence(op, oend, src + anchor, ip - anchor, ip - match, length)) {
+                return 0;
+            }
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    if (!writeSequence(op, oend, src + anchor, srcSize - anchor, 0, 0)) {
+        return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+bool lz4Decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize) noexcept {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srcSize;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + dstSize;
+
+    // Reads a length extension of a token field
+    auto readLength = [&](size_t& length) -> bool {
+        uint8_t byte;
+        do {
+            if (ip >= iend) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(literalLength)) {
+            return false;
+        }
+        if ((size_t)(iend - ip) < literalLength || (size_t)(oend - op) < literalLength) {
+            return false;
+        }
+        memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == iend) {
+            // The last sequence has no match
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return false;
+        }
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(matchLength)) {
+            return false;
+        }
+        matchLength += minMatch;
+        if ((size_t)(oend - op) < matchLength) {
+            return false;
+        }
+        // Matches may overlap the bytes they produce, so copy byte by byte
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < matchLength; i++) {
+            op[i] = match[i];
+        }
+        op += matchLength;
+    }
+    return op == oend;
+}
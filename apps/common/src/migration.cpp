@@ -0,0 +1,534 @@
+/*
+Implements a pre-copy live migration engine that streams guest RAM and
+processor state while the virtual machine keeps running.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "migration.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#  include <io.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#elif defined(__linux__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#else
+#  error Unsupported platform
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#  define MSG_NOSIGNAL 0
+#endif
+
+using namespace virt86;
+
+// ----- Stream format ----------------------------------------------------------------------------------------------------
+//
+// A migration stream starts with a StreamHeader followed by records, each
+// starting with a RecordHeader:
+// - RecordPages: count little-endian 64-bit page numbers relative to the start
+//   of RAM, followed by the contents of those pages in the same order.
+//   Pages may be sent several times; the last copy wins.
+// - RecordRegs32/RecordRegs64: count RegValues making up a VPState of a
+//   processor outside or in IA-32e mode.
+// - RecordEnd: no payload. Marks a complete migration.
+
+static const char streamMagic[8] = { 'V', '8', '6', 'M', 'I', 'G', 'R', 'T' };
+const uint32_t streamVersion = 1;
+
+struct StreamHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint64_t ramBase;
+    uint64_t ramSize;
+    uint32_t regValueSize;
+    uint32_t reserved;
+};
+
+enum RecordType : uint32_t {
+    RecordPages = 1,
+    RecordRegs32 = 2,
+    RecordRegs64 = 3,
+    RecordEnd = 4,
+};
+
+struct RecordHeader {
+    uint32_t type;
+    uint32_t count;
+};
+
+// Maximum number of pages in a single record
+const uint32_t pagesPerRecord = 256;
+
+// ----- Channel ----------------------------------------------------------------------------------------------------------
+
+bool MigrationChannel::OpenFile(const char *path, bool write) noexcept {
+    Close();
+#if defined(_WIN32)
+    const int flags = write ? (_O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY) : (_O_RDONLY | _O_BINARY);
+    const int fd = _open(path, flags, _S_IREAD | _S_IWRITE);
+#else
+    const int fd = write ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+#endif
+    if (fd < 0) {
+        return false;
+    }
+    m_fd = fd;
+    m_socket = false;
+    return true;
+}
+
+bool MigrationChannel::ListenUnix(const char *path) noexcept {
+    Close();
+#if defined(_WIN32)
+    (void)path;
+    return false;
+#else
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    const int listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSock < 0) {
+        return false;
+    }
+    unlink(path);
+    if (bind(listenSock, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenSock, 1) != 0) {
+        close(listenSock);
+        return false;
+    }
+    m_unixPath = path;
+    const int sock = accept(listenSock, NULL, NULL);
+    close(listenSock);
+    if (sock < 0) {
+        unlink(path);
+        m_unixPath.clear();
+        return false;
+    }
+    m_fd = sock;
+    m_socket = true;
+    return true;
+#endif
+}
+
+bool MigrationChannel::ConnectUnix(const char *path) noexcept {
+    Close();
+#if defined(_WIN32)
+    (void)path;
+    return false;
+#else
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return false;
+    }
+    m_fd = sock;
+    m_socket = true;
+    return true;
+#endif
+}
+
+bool MigrationChannel::Write(const void *data, size_t size) noexcept {
+    if (m_fd < 0) {
+        return false;
+    }
+    const uint8_t *ptr = (const uint8_t *)data;
+    while (size > 0) {
+#if defined(_WIN32)
+        const auto written = _write((int)m_fd, ptr, (unsigned int)std::min<size_t>(size, 0x40000000));
+#else
+        const auto written = m_socket ? send((int)m_fd, ptr, size, MSG_NOSIGNAL) : write((int)m_fd, ptr, size);
+#endif
+        if (written <= 0) {
+            return false;
+        }
+        ptr += written;
+        size -= (size_t)written;
+        m_bytesWritten += (uint64_t)written;
+    }
+    return true;
+}
+
+bool MigrationChannel::Read(void *data, size_t size) noexcept {
+    if (m_fd < 0) {
+        return false;
+    }
+    uint8_t *ptr = (uint8_t *)data;
+    while (size > 0) {
+#if defined(_WIN32)
+        const auto bytesRead = _read((int)m_fd, ptr, (unsigned int)std::min<size_t>(size, 0x40000000));
+#else
+        const auto bytesRead = read((int)m_fd, ptr, size);
+#endif
+        if (bytesRead <= 0) {
+            return false;
+        }
+        ptr += bytesRead;
+        size -= (size_t)bytesRead;
+        m_bytesRead += (uint64_t)bytesRead;
+    }
+    return true;
+}
+
+void MigrationChannel::Close() noexcept {
+    if (m_fd >= 0) {
+#if defined(_WIN32)
+        _close((int)m_fd);
+#else
+        close((int)m_fd);
+#endif
+        m_fd = -1;
+    }
+#if !defined(_WIN32)
+    if (!m_unixPath.empty()) {
+        unlink(m_unixPath.c_str());
+        m_unixPath.clear();
+    }
+#endif
+}
+
+// ----- Source -----------------------------------------------------------------------------------------------------------
+
+MigrationSource::MigrationSource(VirtualMachine& vm, VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_vm(vm)
+    , m_vp(vp)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+    , m_numPages((ramSize + PAGE_SIZE - 1) / PAGE_SIZE)
+    , m_bitmap((size_t)((m_numPages + 63) / 64))
+{
+    m_stats = Stats{ 0 };
+}
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) noexcept {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool MigrationSource::Migrate(MigrationChannel& channel, const Options& options) noexcept {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state != State::Idle) {
+            return false;
+        }
+        m_state = State::Running;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    m_stats = Stats{ 0 };
+
+    StreamHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, streamMagic, sizeof(header.magic));
+    header.version = streamVersion;
+    header.pageSize = PAGE_SIZE;
+    header.ramBase = m_ramBase;
+    header.ramSize = m_ramSize;
+    header.regValueSize = sizeof(RegValue);
+    if (!channel.Write(&header, sizeof(header))) {
+        Finish(State::Idle, false);
+        return false;
+    }
+
+    // First round: clear the dirty bitmap so that it collects writes made
+    // while the whole RAM is sent
+    m_stats.dirtyPageTracking = m_vm.ClearDirtyPages(m_ramBase, m_ramSize) == DirtyPageTrackingStatus::OK;
+    std::vector<uint64_t> pages(m_numPages);
+    for (uint64_t page = 0; page < m_numPages; page++) {
+        pages[page] = page;
+    }
+    if (!SendPages(channel, pages)) {
+        Finish(State::Idle, false);
+        return false;
+    }
+
+    // Iterative rounds: resend pages dirtied during the previous round until
+    // few enough are left. The dirty bitmap is read and cleared with the
+    // processor paused, otherwise a page written between the two would lose
+    // its dirty bit and never be sent again. The processor resumes while the
+    // pages are sent. Once a round meets the threshold it stays paused for
+    // the final round; nothing can be dirtied after its query.
+    pages.clear();
+    if (m_stats.dirtyPageTracking) {
+        for (;;) {
+            if (!Pause() || !QueryDirty(pages)) {
+                Finish(State::Idle, false);
+                return false;
+            }
+            if (pages.size() <= options.stopThresholdPages || m_stats.rounds + 1 >= options.maxRounds) {
+                break;
+            }
+            Resume();
+            if (!SendPages(channel, pages)) {
+                Finish(State::Idle, false);
+                return false;
+            }
+        }
+    }
+    else {
+        if (!Pause()) {
+            Finish(State::Idle, false);
+            return false;
+        }
+        pages.resize(m_numPages);
+        for (uint64_t page = 0; page < m_numPages; page++) {
+            pages[page] = page;
+        }
+    }
+
+    // Final round
+    if (!m_regsValid) {
+        Finish(State::Idle, false);
+        return false;
+    }
+    const RecordHeader end = { RecordEnd, 0 };
+    if (!SendPages(channel, pages) || !SendRegisters(channel) || !channel.Write(&end, sizeof(end))) {
+        Finish(State::Idle, false);
+        return false;
+    }
+
+    m_stats.downtimeNs = elapsedNs(m_pauseStart);
+    m_stats.totalNs = elapsedNs(start);
+    m_stats.bytesSent = channel.BytesWritten();
+    Finish(State::Done, true);
+    return true;
+}
+
+bool MigrationSource::SafePoint() noexcept {
+    if (m_state.load(std::memory_order_acquire) != State::PauseRequested) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_state != State::PauseRequested) {
+        return false;
+    }
+    m_pauseStart = std::chrono::steady_clock::now();
+
+    // Registers are read here because some hypervisors only allow the thread
+    // that runs a processor to access its state
+    m_regsValid = readVPState(m_vp, m_regs);
+
+    m_state = State::Paused;
+    m_cond.notify_all();
+    m_cond.wait(lock, [this] { return m_state != State::Paused; });
+    return m_migrated;
+}
+
+void MigrationSource::Detach() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state != State::Done) {
+        m_state = State::Detached;
+        m_cond.notify_all();
+    }
+}
+
+bool MigrationSource::Pause() noexcept {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_state != State::Running) {
+        return false;
+    }
+    m_state = State::PauseRequested;
+    m_cond.wait(lock, [this] { return m_state != State::PauseRequested; });
+    return m_state == State::Paused;
+}
+
+void MigrationSource::Resume() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state == State::Paused) {
+        m_state = State::Running;
+        m_cond.notify_all();
+    }
+}
+
+void MigrationSource::Finish(State state, bool migrated) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // A processor that detached stays detached
+    if (m_state != State::Detached) {
+        m_state = state;
+    }
+    m_migrated = migrated;
+    m_cond.notify_all();
+}
+
+bool MigrationSource::QueryDirty(std::vector<uint64_t>& pages) noexcept {
+    pages.clear();
+    std::fill(m_bitmap.begin(), m_bitmap.end(), 0);
+    if (m_vm.QueryDirtyPages(m_ramBase, m_ramSize, m_bitmap.data(), m_bitmap.size() * sizeof(uint64_t)) != DirtyPageTrackingStatus::OK) {
+        return false;
+    }
+    // Clear before copying: a page written to after this point is reported
+    // again in the next round
+    if (m_vm.ClearDirtyPages(m_ramBase, m_ramSize) != DirtyPageTrackingStatus::OK) {
+        return false;
+    }
+    for (size_t i = 0; i < m_bitmap.size(); i++) {
+        uint64_t bits = m_bitmap[i];
+        while (bits != 0) {
+            size_t bit = 0;
+            while ((bits & (1ull << bit)) == 0) {
+                bit++;
+            }
+            bits &= ~(1ull << bit);
+            const uint64_t page = i * 64 + bit;
+            if (page < m_numPages) {
+                pages.push_back(page);
+            }
+        }
+    }
+    return true;
+}
+
+bool MigrationSource::SendPages(MigrationChannel& channel, const std::vector<uint64_t>& pages) noexcept {
+    m_stats.rounds++;
+    m_stats.pagesPerRound.push_back(pages.size());
+    m_buffer.resize(pagesPerRecord * (sizeof(uint64_t) + PAGE_SIZE));
+
+    for (size_t first = 0; first < pages.size(); first += pagesPerRecord) {
+        const uint32_t count = (uint32_t)std::min<size_t>(pagesPerRecord, pages.size() - first);
+        const RecordHeader record = { RecordPages, count };
+        uint8_t *indices = m_buffer.data();
+        uint8_t *contents = indices + count * sizeof(uint64_t);
+        for (uint32_t i = 0; i < count; i++) {
+            const uint64_t page = pages[first + i];
+            const uint64_t offset = page * PAGE_SIZE;
+            const size_t size = (size_t)std::min<uint64_t>(PAGE_SIZE, m_ramSize - offset);
+            memcpy(indices + i * sizeof(uint64_t), &page, sizeof(uint64_t));
+            memcpy(contents + i * PAGE_SIZE, m_ram + offset, size);
+            if (size < PAGE_SIZE) {
+                memset(contents + i * PAGE_SIZE + size, 0, PAGE_SIZE - size);
+            }
+        }
+        if (!channel.Write(&record, sizeof(record)) || !channel.Write(m_buffer.data(), count * (sizeof(uint64_t) + PAGE_SIZE))) {
+            return false;
+        }
+        m_stats.pagesSent += count;
+    }
+    return true;
+}
+
+bool MigrationSource::SendRegisters(MigrationChannel& channel) noexcept {
+    const RecordHeader record = { m_regs.longMode ? RecordRegs64 : RecordRegs32, (uint32_t)m_regs.values.size() };
+    return channel.Write(&record, sizeof(record)) && channel.Write(m_regs.values.data(), record.count * sizeof(RegValue));
+}
+
+// ----- Target -----------------------------------------------------------------------------------------------------------
+
+MigrationTarget::MigrationTarget(VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_vp(vp)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+{
+}
+
+bool MigrationTarget::Receive(MigrationChannel& channel) noexcept {
+    m_stats = Stats{ 0 };
+
+    StreamHeader header;
+    if (!channel.Read(&header, sizeof(header))) {
+        return false;
+    }
+    if (memcmp(header.magic, streamMagic, sizeof(header.magic)) != 0 || header.version != streamVersion) {
+        return false;
+    }
+    if (header.pageSize != PAGE_SIZE || header.ramBase != m_ramBase || header.ramSize != m_ramSize || header.regValueSize != sizeof(RegValue)) {
+        return false;
+    }
+
+    const uint64_t numPages = (m_ramSize + PAGE_SIZE - 1) / PAGE_SIZE;
+    std::vector<uint64_t> indices;
+    std::vector<uint8_t> page(PAGE_SIZE);
+    VPState regs;
+    bool regsLoaded = false;
+    for (;;) {
+        RecordHeader record;
+        if (!channel.Read(&record, sizeof(record))) {
+            return false;
+        }
+        switch (record.type) {
+        case RecordPages: {
+            if (record.count == 0 || record.count > pagesPerRecord) {
+                return false;
+            }
+            indices.resize(record.count);
+            if (!channel.Read(indices.data(), record.count * sizeof(uint64_t))) {
+                return false;
+            }
+            for (uint64_t index : indices) {
+                if (index >= numPages || !channel.Read(page.data(), PAGE_SIZE)) {
+                    return false;
+                }
+                const uint64_t offset = index * PAGE_SIZE;
+                memcpy(m_ram + offset, page.data(), (size_t)std::min<uint64_t>(PAGE_SIZE, m_ramSize - offset));
+            }
+            m_stats.pageRecords++;
+            m_stats.pagesReceived += record.count;
+            break;
+        }
+        case RecordRegs32:
+        case RecordRegs64: {
+            regs.longMode = record.type == RecordRegs64;
+            if (record.count != vpStateRegisterCount(regs.longMode)) {
+                return false;
+            }
+            regs.values.resize(record.count);
+            if (!channel.Read(regs.values.data(), record.count * sizeof(RegValue))) {
+                return false;
+            }
+            if (!writeVPState(m_vp, regs)) {
+                return false;
+            }
+            regsLoaded = true;
+            break;
+        }
+        case RecordEnd:
+            m_stats.bytesReceived = channel.BytesRead();
+            return regsLoaded;
+        default:
+            return false;
+        }
+    }
+}
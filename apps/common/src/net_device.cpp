@@ -0,0 +1,359 @@
+/*
+Defines a network device model with descriptor rings in guest memory,
+connected to its peer through a PacketLink.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "net_device.hpp"
+
+#if defined(__linux__)
+
+#include <cstring>
+
+NetDevice::NetDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_loop(loop)
+    , m_irqs(irqs)
+    , m_vector(vector)
+    , m_basePort(basePort)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+{
+}
+
+NetDevice::~NetDevice() {
+    if (m_link != nullptr) {
+        m_loop.Remove(m_link->RxDoorbell());
+        m_loop.Remove(m_link->TxDoorbell());
+    }
+}
+
+bool NetDevice::Attach(PacketLink& link, const uint8_t *peerRam, uint64_t peerRamBase, uint64_t peerRamSize) noexcept {
+    if (m_link != nullptr || !link.IsValid()) {
+        return false;
+    }
+    if (!m_loop.Add(link.RxDoorbell(), EPOLLIN, [this](uint32_t) { OnRxDoorbell(); })) {
+        return false;
+    }
+    if (!m_loop.Add(link.TxDoorbell(), EPOLLIN, [this](uint32_t) { OnTxDoorbell(); })) {
+        m_loop.Remove(link.RxDoorbell());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_link = &link;
+    m_peerRam = peerRam;
+    m_peerRamBase = peerRamBase;
+    m_peerRamSize = peerRamSize;
+    return true;
+}
+
+uint32_t NetDevice::IORead(uint16_t port, size_t size) noexcept {
+    uint32_t value = 0xFFFFFFFF;
+    bool raise = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        switch (port - m_basePort) {
+        case RegControl:
+            value = m_control;
+            break;
+        case RegQueueSize:
+            value = m_queueSize;
+            break;
+        case RegTXQBase:
+            value = m_txqBase;
+            break;
+        case RegRXQBase:
+            value = m_rxqBase;
+            break;
+        case RegTXTail:
+            // Acknowledge the interrupt, and ask for a new one if the guest
+            // still wants to know when packets are consumed
+            m_txIrqOutstanding = false;
+            value = m_txHeadRead = TxHead();
+            raise = Transmit();
+            break;
+        case RegRXTail:
+            // Acknowledge the interrupt; packets delivered after this read
+            // will raise a new one
+            m_rxIrqOutstanding = false;
+            value = m_rxHeadRead = m_rxHead;
+            break;
+        case RegIntMask:
+            value = m_intMask;
+            break;
+        }
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+    return value;
+}
+
+void NetDevice::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    bool raise = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const bool enabled = (m_control & ControlEnable) != 0;
+        switch (port - m_basePort) {
+        case RegControl:
+            Enable((value & ControlEnable) != 0);
+            break;
+        case RegQueueSize:
+            if (!enabled) {
+                m_queueSize = value;
+            }
+            break;
+        case RegTXQBase:
+            if (!enabled) {
+                m_txqBase = value;
+            }
+            break;
+        case RegRXQBase:
+            if (!enabled) {
+                m_rxqBase = value;
+            }
+            break;
+        case RegTXTail:
+            m_stats.txDoorbells++;
+            if (enabled && value - TxHead() <= m_queueSize && value - m_txNext <= m_queueSize) {
+                m_txTail = value;
+                raise = Transmit();
+            }
+            break;
+        case RegRXTail:
+            if (enabled && value - m_rxHead <= m_queueSize && value - m_rxTail <= m_queueSize) {
+                m_rxTail = value;
+                raise = Receive();
+            }
+            break;
+        case RegIntMask:
+            m_intMask = value & (IntRX | IntTX);
+            // Anything that happened while masked raises an interrupt now
+            if (Transmit()) {
+                raise = true;
+            }
+            if (Receive()) {
+                raise = true;
+            }
+            break;
+        }
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+NetDevice::Stats NetDevice::GetStats() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void NetDevice::Enable(bool enable) noexcept {
+    // The other side may still read from buffers the guest would reuse
+    if (m_link == nullptr || m_txNext != TxHead()) {
+        return;
+    }
+    m_control = 0;
+    if (!enable) {
+        return;
+    }
+    if (m_queueSize == 0 || m_queueSize > MaxQueueSize || (m_queueSize & (m_queueSize - 1)) != 0) {
+        return;
+    }
+    const uint64_t queueBytes = (uint64_t)m_queueSize * sizeof(Descriptor);
+    if (!contains(m_ramBase, m_ramSize, m_txqBase, queueBytes) || !contains(m_ramBase, m_ramSize, m_rxqBase, queueBytes)) {
+        return;
+    }
+    m_txLinkBase = m_link->TxConsumed();
+    m_txTail = m_txNext = m_txHeadRead = 0;
+    m_rxHead = m_rxTail = m_rxHeadRead = 0;
+    m_txIrqOutstanding = m_rxIrqOutstanding = false;
+    m_control = ControlEnable;
+}
+
+uint32_t NetDevice::TxHead() const noexcept {
+    return (m_link != nullptr) ? m_link->TxConsumed() - m_txLinkBase : 0;
+}
+
+bool NetDevice::Transmit() noexcept {
+    if ((m_control & ControlEnable) == 0) {
+        return false;
+    }
+    const uint32_t mask = m_queueSize - 1;
+    bool raise = false;
+    uint32_t consumed;
+    do {
+        // Read before checking for room so that consumption racing with us
+        // makes the link refuse to arm
+        consumed = m_link->TxConsumed();
+        const uint32_t room = m_link->TxFree();
+        uint32_t count = 0;
+        while (m_txNext != m_txTail && count < room) {
+            Descriptor descriptor;
+            memcpy(&descriptor, &m_ram[m_txqBase - m_ramBase + (m_txNext & mask) * sizeof(Descriptor)], sizeof(descriptor));
+            PacketDescriptor packet = { descriptor.address, descriptor.length, 0 };
+            // Never trust addresses coming from the guest. Bad packets still
+            // take their place in the link, so that the transmit head keeps
+            // counting every descriptor, but the other side drops them.
+            if (descriptor.length == 0 || descriptor.length > MaxPacketSize || !contains(m_ramBase, m_ramSize, descriptor.address, descriptor.length)) {
+                packet.address = 0;
+                packet.length = 0;
+            }
+            m_link->Transmit(packet);
+            m_txNext++;
+            count++;
+        }
+        if (count > 0) {
+            m_stats.txPackets += count;
+            if (m_link->Kick()) {
+                m_stats.txKicks++;
+            }
+        }
+        if (CheckTxInterrupt()) {
+            raise = true;
+        }
+    } while (!ArmTx(consumed));
+    return raise;
+}
+
+bool NetDevice::ArmTx(uint32_t consumed) noexcept {
+    // Wait for room if packets are held back, or for consumption if the
+    // guest wants to be interrupted when it happens
+    const bool heldBack = m_txNext != m_txTail;
+    const bool wantsInterrupt = (m_intMask & IntTX) != 0 && !m_txIrqOutstanding && m_txNext != consumed - m_txLinkBase;
+    if (!heldBack && !wantsInterrupt) {
+        return true;
+    }
+    return m_link->ArmTx(consumed);
+}
+
+bool NetDevice::Receive() noexcept {
+    if ((m_control & ControlEnable) == 0) {
+        return false;
+    }
+    const uint32_t mask = m_queueSize - 1;
+    while (m_rxHead != m_rxTail) {
+        const uint32_t available = m_link->RxAvailable();
+        if (available == 0) {
+            // Sleep until the other side publishes more, unless it just did.
+            // When the guest runs out of buffers instead, it resumes delivery
+            // by posting more.
+            if (m_link->ArmRx()) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t consumed = 0;
+        uint32_t delivered = 0;
+        while (consumed < available && m_rxHead != m_rxTail) {
+            const PacketDescriptor packet = m_link->RxPeek(consumed++);
+            if (packet.length == 0 || packet.length > MaxPacketSize || !contains(m_peerRamBase, m_peerRamSize, packet.address, packet.length)) {
+                m_stats.rxDropped++;
+                continue;
+            }
+
+            uint8_t *slot = &m_ram[m_rxqBase - m_ramBase + (m_rxHead & mask) * sizeof(Descriptor)];
+            Descriptor descriptor;
+            memcpy(&descriptor, slot, sizeof(descriptor));
+            uint32_t length = packet.length;
+            uint32_t flags = 0;
+            if (length > descriptor.length) {
+                length = descriptor.length;
+                flags = RxFlagTruncated;
+            }
+            if (contains(m_ramBase, m_ramSize, descriptor.address, length)) {
+                // The only copy the packet goes through
+                memcpy(&m_ram[descriptor.address - m_ramBase], &m_peerRam[packet.address - m_peerRamBase], length);
+            }
+            else {
+                m_stats.rxDropped++;
+                length = 0;
+                flags = RxFlagInvalidBuffer;
+            }
+            descriptor.length = length;
+            descriptor.flags = flags;
+            memcpy(slot, &descriptor, sizeof(descriptor));
+            m_rxHead++;
+            delivered++;
+        }
+
+        // The other side may reuse the buffers once they are released
+        m_link->RxRelease(consumed);
+        if (delivered > 0) {
+            m_stats.rxPackets += delivered;
+            m_stats.rxBatches++;
+        }
+    }
+    return CheckRxInterrupt();
+}
+
+bool NetDevice::CheckTxInterrupt() noexcept {
+    // Only raise an interrupt if the guest has acknowledged the previous one
+    if ((m_intMask & IntTX) == 0 || m_txIrqOutstanding || TxHead() == m_txHeadRead) {
+        return false;
+    }
+    m_txIrqOutstanding = true;
+    m_stats.interrupts++;
+    return true;
+}
+
+bool NetDevice::CheckRxInterrupt() noexcept {
+    if ((m_intMask & IntRX) == 0 || m_rxIrqOutstanding || m_rxHead == m_rxHeadRead) {
+        return false;
+    }
+    m_rxIrqOutstanding = true;
+    m_stats.interrupts++;
+    return true;
+}
+
+bool NetDevice::contains(uint64_t base, uint64_t size, uint64_t address, uint64_t length) noexcept {
+    return address >= base && address - base <= size && length <= size - (address - base);
+}
+
+void NetDevice::OnRxDoorbell() noexcept {
+    // Drain first so that packets published while receiving ring again
+    drainEventFD(m_link->RxDoorbell());
+    bool raise;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        raise = Receive();
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+void NetDevice::OnTxDoorbell() noexcept {
+    drainEventFD(m_link->TxDoorbell());
+    bool raise;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        raise = Transmit();
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+#endif
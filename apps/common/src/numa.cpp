@@ -0,0 +1,219 @@
+/*
+Defines cross-platform functions for NUMA-aware memory placement and thread
+pinning.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "numa.hpp"
+#include "align_alloc.hpp"
+
+#if defined(_WIN32)
+#  include <Windows.h>
+#elif defined(__linux__)
+#  include <sched.h>
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#  include <linux/mempolicy.h>
+#  include <cstdio>
+#  include <cstdlib>
+#  include <cstring>
+#elif defined(__APPLE__)
+#  include <unistd.h>
+#else
+#  error Unsupported platform
+#endif
+
+#if defined(__linux__)
+
+// Parses a kernel CPU/node list such as "0-3,8,10-11" into individual numbers.
+static bool parseList(const char *path, std::vector<uint32_t>& values) noexcept {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char buf[4096];
+    const bool ok = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+
+    char *ptr = buf;
+    while (*ptr != '\0' && *ptr != '\n') {
+        char *end;
+        const uint32_t first = (uint32_t)strtoul(ptr, &end, 10);
+        if (end == ptr) {
+            return false;
+        }
+        uint32_t last = first;
+        ptr = end;
+        if (*ptr == '-') {
+            ptr++;
+            last = (uint32_t)strtoul(ptr, &end, 10);
+            if (end == ptr) {
+                return false;
+            }
+            ptr = end;
+        }
+        for (uint32_t value = first; value <= last; value++) {
+            values.push_back(value);
+        }
+        if (*ptr == ',') {
+            ptr++;
+        }
+    }
+    return true;
+}
+
+#endif
+
+size_t numaNodeCount() noexcept {
+#if defined(_WIN32)
+    ULONG highestNode;
+    if (!GetNumaHighestNodeNumber(&highestNode)) {
+        return 1;
+    }
+    return (size_t)highestNode + 1;
+#elif defined(__linux__)
+    std::vector<uint32_t> nodes;
+    if (!parseList("/sys/devices/system/node/online", nodes) || nodes.empty()) {
+        return 1;
+    }
+    return (size_t)nodes.back() + 1;
+#elif defined(__APPLE__)
+    return 1;
+#endif
+}
+
+bool numaNodeCPUs(const size_t node, std::vector<uint32_t>& cpus) noexcept {
+    cpus.clear();
+    if (node >= numaNodeCount()) {
+        return false;
+    }
+#if defined(_WIN32)
+    ULONGLONG mask;
+    if (!GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+        return false;
+    }
+    for (uint32_t cpu = 0; cpu < 64; cpu++) {
+        if (mask & (1ull << cpu)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return true;
+#elif defined(__linux__)
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    if (parseList(path, cpus)) {
+        return true;
+    }
+    // No NUMA information exposed by the kernel; every CPU belongs to node 0
+    const long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < numCPUs; cpu++) {
+        cpus.push_back((uint32_t)cpu);
+    }
+    return numCPUs > 0;
+#elif defined(__APPLE__)
+    const long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < numCPUs; cpu++) {
+        cpus.push_back((uint32_t)cpu);
+    }
+    return numCPUs > 0;
+#endif
+}
+
+uint8_t *alignedAllocOnNode(const size_t size, const size_t node) noexcept {
+    if (node >= numaNodeCount()) {
+        return NULL;
+    }
+#if defined(_WIN32)
+    return (uint8_t *)VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)node);
+#else
+    uint8_t *mem = alignedAlloc(size);
+    if (mem == NULL) {
+        return NULL;
+    }
+    if (!numaBindMemory(mem, size, node)) {
+        alignedFree(mem);
+        return NULL;
+    }
+    return mem;
+#endif
+}
+
+bool numaBindMemory(void *memory, const size_t size, const size_t node) noexcept {
+    const size_t numNodes = numaNodeCount();
+    if (node >= numNodes) {
+        return false;
+    }
+    // Nothing to do on single node hosts
+    if (numNodes == 1) {
+        return true;
+    }
+#if defined(_WIN32)
+    // Windows can only choose the preferred node when memory is allocated;
+    // use alignedAllocOnNode instead
+    return false;
+#elif defined(__linux__)
+    unsigned long nodeMask[1024 / (8 * sizeof(unsigned long))];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    if (node >= sizeof(nodeMask) * 8) {
+        return false;
+    }
+    nodeMask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, memory, size, MPOL_BIND, nodeMask, sizeof(nodeMask) * 8, MPOL_MF_MOVE) == 0;
+#elif defined(__APPLE__)
+    (void)memory;
+    (void)size;
+    return true;
+#endif
+}
+
+bool numaPinCurrentThread(const size_t node) noexcept {
+#if defined(_WIN32)
+    if (node >= numaNodeCount()) {
+        return false;
+    }
+    ULONGLONG mask;
+    if (!GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0) {
+        return false;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask) != 0;
+#elif defined(__linux__)
+    std::vector<uint32_t> cpus;
+    if (!numaNodeCPUs(node, cpus) || cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(__APPLE__)
+    // macOS does not support hard thread affinity and has a single node
+    return node == 0;
+#endif
+}
@@ -0,0 +1,238 @@
+/*
+Implements a point-to-point packet link built on shared-memory rings, which
+connects two network devices in the same process or in different processes.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "packet_link.hpp"
+
+#if defined(__linux__)
+
+#include "event_loop.hpp"
+#include "unix_socket.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+// ----- Shared memory layout -------------------------------------------------------------------------------------------------
+
+static const uint32_t packetLinkMagic = 0x4B4E4C50;  // 'PLNK'
+
+// Each index and flag lives on its own cache line so that the two sides do
+// not bounce a line back and forth on every access
+struct PacketRing {
+    alignas(64) std::atomic<uint32_t> head;             // Next entry to consume; written by the consumer
+    alignas(64) std::atomic<uint32_t> tail;             // Next entry to produce; written by the producer
+    alignas(64) std::atomic<uint32_t> consumerWaiting;  // Set while the consumer waits for packets
+    alignas(64) std::atomic<uint32_t> producerWaiting;  // Set while the producer waits for entries to be consumed
+    alignas(64) PacketDescriptor entries[PacketLink::RingSize];
+};
+
+struct PacketLinkShared {
+    uint32_t magic;
+    PacketRing rings[2];  // Ring 0 carries packets from the first side to the second
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Ring indices must be lock-free to be shared between processes");
+
+// ----- Setup ----------------------------------------------------------------------------------------------------------------
+
+PacketLink::~PacketLink() noexcept {
+    if (m_shared != nullptr && m_ownsMapping) {
+        m_memory.Unmap(m_shared);
+    }
+    CloseDoorbells();
+}
+
+bool PacketLink::Create() noexcept {
+    if (m_shared != nullptr) {
+        return false;
+    }
+    if (!m_memory.Create(sizeof(PacketLinkShared), "virt86-packet-link")) {
+        return false;
+    }
+    uint8_t *memory = m_memory.MapShared();
+    if (memory == nullptr) {
+        return false;
+    }
+    m_shared = new (memory) PacketLinkShared();
+    m_shared->magic = packetLinkMagic;
+    m_ownsMapping = true;
+    m_memory.Seal();
+
+    int fds[4];
+    for (int i = 0; i < 4; i++) {
+        fds[i] = createEventFD();
+    }
+    return Bind(0, fds);
+}
+
+bool PacketLink::OpenPeer(const PacketLink& creator) noexcept {
+    if (m_shared != nullptr || creator.m_shared == nullptr || creator.m_side != 0) {
+        return false;
+    }
+    // Both sides share the creator's mapping, but each has its own doorbells
+    const int creatorFDs[4] = { creator.m_txDataFD, creator.m_txSpaceFD, creator.m_rxDataFD, creator.m_rxSpaceFD };
+    int fds[4];
+    for (int i = 0; i < 4; i++) {
+        fds[i] = fcntl(creatorFDs[i], F_DUPFD_CLOEXEC, 0);
+    }
+    m_shared = creator.m_shared;
+    m_ownsMapping = false;
+    return Bind(1, fds);
+}
+
+bool PacketLink::SendPeer(int sock) noexcept {
+    if (m_shared == nullptr || m_side != 0) {
+        return false;
+    }
+    const int fds[4] = { m_txDataFD, m_txSpaceFD, m_rxDataFD, m_rxSpaceFD };
+    return m_memory.SendTo(sock) && sendWithFDs(sock, &packetLinkMagic, sizeof(packetLinkMagic), fds, 4);
+}
+
+bool PacketLink::ReceivePeer(int sock) noexcept {
+    if (m_shared != nullptr) {
+        return false;
+    }
+    if (!m_memory.ReceiveFrom(sock) || m_memory.Size() < sizeof(PacketLinkShared)) {
+        return false;
+    }
+    uint32_t magic;
+    int fds[4];
+    if (!receiveWithFDs(sock, &magic, sizeof(magic), fds, 4)) {
+        return false;
+    }
+    PacketLinkShared *shared = (PacketLinkShared *)m_memory.MapShared();
+    if (magic != packetLinkMagic || shared == nullptr || shared->magic != packetLinkMagic) {
+        if (shared != nullptr) {
+            m_memory.Unmap(shared);
+        }
+        for (int i = 0; i < 4; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    m_shared = shared;
+    m_ownsMapping = true;
+    return Bind(1, fds);
+}
+
+// The doorbells of ring r are fds[2 * r] (data) and fds[2 * r + 1] (space)
+bool PacketLink::Bind(uint32_t side, const int fds[4]) noexcept {
+    m_side = side;
+    const int tx = (int)side * 2;
+    const int rx = (1 - (int)side) * 2;
+    m_txDataFD = fds[tx];
+    m_txSpaceFD = fds[tx + 1];
+    m_rxDataFD = fds[rx];
+    m_rxSpaceFD = fds[rx + 1];
+    m_txLocalTail = m_shared->rings[side].tail.load(std::memory_order_relaxed);
+    if (m_txDataFD < 0 || m_txSpaceFD < 0 || m_rxDataFD < 0 || m_rxSpaceFD < 0) {
+        if (m_ownsMapping) {
+            m_memory.Unmap(m_shared);
+        }
+        m_shared = nullptr;
+        CloseDoorbells();
+        return false;
+    }
+    return true;
+}
+
+void PacketLink::CloseDoorbells() noexcept {
+    int *fds[4] = { &m_txDataFD, &m_txSpaceFD, &m_rxDataFD, &m_rxSpaceFD };
+    for (int *fd : fds) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+// ----- Transmit side --------------------------------------------------------------------------------------------------------
+
+uint32_t PacketLink::TxFree() const noexcept {
+    const PacketRing& ring = m_shared->rings[m_side];
+    return RingSize - (m_txLocalTail - ring.head.load(std::memory_order_acquire));
+}
+
+void PacketLink::Transmit(const PacketDescriptor& descriptor) noexcept {
+    PacketRing& ring = m_shared->rings[m_side];
+    ring.entries[m_txLocalTail % RingSize] = descriptor;
+    m_txLocalTail++;
+}
+
+bool PacketLink::Kick() noexcept {
+    PacketRing& ring = m_shared->rings[m_side];
+    if (ring.tail.load(std::memory_order_relaxed) == m_txLocalTail) {
+        return false;
+    }
+    // The consumer sets its flag before checking the ring one last time, so
+    // either it sees the new packets or we see the flag
+    ring.tail.store(m_txLocalTail, std::memory_order_seq_cst);
+    if (ring.consumerWaiting.load(std::memory_order_seq_cst) && ring.consumerWaiting.exchange(0)) {
+        signalEventFD(m_txDataFD);
+        return true;
+    }
+    return false;
+}
+
+uint32_t PacketLink::TxConsumed() const noexcept {
+    return m_shared->rings[m_side].head.load(std::memory_order_acquire);
+}
+
+bool PacketLink::ArmTx(uint32_t consumed) noexcept {
+    PacketRing& ring = m_shared->rings[m_side];
+    ring.producerWaiting.store(1, std::memory_order_seq_cst);
+    return ring.head.load(std::memory_order_seq_cst) == consumed;
+}
+
+// ----- Receive side ---------------------------------------------------------------------------------------------------------
+
+uint32_t PacketLink::RxAvailable() const noexcept {
+    const PacketRing& ring = m_shared->rings[1 - m_side];
+    return ring.tail.load(std::memory_order_acquire) - ring.head.load(std::memory_order_relaxed);
+}
+
+PacketDescriptor PacketLink::RxPeek(uint32_t index) const noexcept {
+    const PacketRing& ring = m_shared->rings[1 - m_side];
+    return ring.entries[(ring.head.load(std::memory_order_relaxed) + index) % RingSize];
+}
+
+void PacketLink::RxRelease(uint32_t count) noexcept {
+    PacketRing& ring = m_shared->rings[1 - m_side];
+    ring.head.store(ring.head.load(std::memory_order_relaxed) + count, std::memory_order_seq_cst);
+    if (ring.producerWaiting.load(std::memory_order_seq_cst) && ring.producerWaiting.exchange(0)) {
+        signalEventFD(m_rxSpaceFD);
+    }
+}
+
+bool PacketLink::ArmRx() noexcept {
+    PacketRing& ring = m_shared->rings[1 - m_side];
+    ring.consumerWaiting.store(1, std::memory_order_seq_cst);
+    return ring.tail.load(std::memory_order_seq_cst) == ring.head.load(std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,2248 @@
+/*
+Defines a software x86 interpreter that runs guests without a hypervisor,
+for testing on hosts without virtualization support and as a reference for
+comparing platforms.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "reference_cpu.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace virt86;
+
+enum { regEAX, regECX, regEDX, regEBX, regESP, regEBP, regESI, regEDI };
+enum { segES, segCS, segSS, segDS, segFS, segGS };
+
+const uint32_t flagCF = 1u << 0;
+const uint32_t flagPF = 1u << 2;
+const uint32_t flagAF = 1u << 4;
+const uint32_t flagZF = 1u << 6;
+const uint32_t flagSF = 1u << 7;
+const uint32_t flagTF = 1u << 8;
+const uint32_t flagIF = 1u << 9;
+const uint32_t flagDF = 1u << 10;
+const uint32_t flagOF = 1u << 11;
+const uint32_t flagNT = 1u << 14;
+const uint32_t flagRF = 1u << 16;
+const uint32_t flagsWritable = 0x00257FD5;  // Bits POPF and IRET may change
+
+const uint16_t attrL = 1 << 13;   // 64-bit code segment
+const uint16_t attrDB = 1 << 14;  // Default operation size of code and stack segments
+
+const uint64_t cr0PG = 1ull << 31;
+const uint64_t cr4PSE = 1 << 4;
+const uint64_t cr4PAE = 1 << 5;
+const uint64_t eferLME = 1 << 8;
+const uint64_t eferLMA = 1 << 10;
+const uint64_t eferWritable = 0xD01;  // SCE, LME, NXE, SVME
+
+const uint64_t dr7Reserved = 0x400;      // Bit 10 always reads as 1
+const uint64_t dr7EnableMask = 0xFF;     // L0-L3 and G0-G3
+
+const uint32_t msrTSC = 0x10;
+const uint32_t msrEFER = 0xC0000080;
+const uint32_t msrFSBase = 0xC0000100;
+const uint32_t msrGSBase = 0xC0000101;
+const uint32_t msrKernelGSBase = 0xC0000102;
+
+// Physical address bits of PAE and 4-level paging structure entries
+const uint64_t pageAddressMask = 0x000FFFFFFFFFF000ull;
+
+const uint8_t vectorDE = 0;   // Divide error
+const uint8_t vectorUD = 6;   // Invalid opcode
+const uint8_t vectorNP = 11;  // Segment not present
+const uint8_t vectorGP = 13;  // General protection
+const uint8_t vectorPF = 14;  // Page fault
+
+static inline uint64_t sizeMask(size_t size) noexcept {
+    return (size >= 8) ? ~0ull : (1ull << (size * 8)) - 1;
+}
+
+static inline uint64_t signBit(size_t size) noexcept {
+    return 1ull << (size * 8 - 1);
+}
+
+static inline int64_t signExtend(uint64_t value, size_t size) noexcept {
+    switch (size) {
+    case 1: return (int8_t)value;
+    case 2: return (int16_t)value;
+    case 4: return (int32_t)value;
+    default: return (int64_t)value;
+    }
+}
+
+static inline bool evenParity(uint8_t value) noexcept {
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return (value & 1) == 0;
+}
+
+static inline uint64_t readBytes(const uint8_t *bytes, size_t size) noexcept {
+    uint64_t value = 0;
+    memcpy(&value, bytes, size);
+    return value;
+}
+
+// Returns the immediate operand of the instruction, sign-extended to 64 bits
+// unless it is a full 64-bit immediate
+static inline uint64_t immediate(const X86Instruction& insn, const uint8_t *bytes) noexcept {
+    if (insn.immSize >= 8) {
+        return readBytes(&bytes[insn.immOffset], 8);
+    }
+    const size_t size = std::min<size_t>(insn.immSize, 4);
+    return (uint64_t)signExtend(readBytes(&bytes[insn.immOffset], size), size);
+}
+
+// Multiplies two unsigned 64-bit values, returning the high half of the
+// product and storing the low half in low
+static uint64_t multiply128(uint64_t a, uint64_t b, uint64_t& low) noexcept {
+    const uint64_t p0 = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    const uint64_t p1 = (a & 0xFFFFFFFF) * (b >> 32);
+    const uint64_t p2 = (a >> 32) * (b & 0xFFFFFFFF);
+    const uint64_t p3 = (a >> 32) * (b >> 32);
+    const uint64_t middle = (p0 >> 32) + (p1 & 0xFFFFFFFF) + (p2 & 0xFFFFFFFF);
+    low = (middle << 32) | (p0 & 0xFFFFFFFF);
+    return p3 + (p1 >> 32) + (p2 >> 32) + (middle >> 32);
+}
+
+// Multiplies two signed 64-bit values, returning the high half of the product
+static uint64_t signedMultiply128(uint64_t a, uint64_t b, uint64_t& low) noexcept {
+    uint64_t high = multiply128(a, b, low);
+    if ((int64_t)a < 0) {
+        high -= b;
+    }
+    if ((int64_t)b < 0) {
+        high -= a;
+    }
+    return high;
+}
+
+// Divides the unsigned 128-bit value high:low by divisor. The quotient must
+// fit in 64 bits, that is, high must be less than divisor.
+static uint64_t divide128(uint64_t high, uint64_t low, uint64_t divisor, uint64_t& remainder) noexcept {
+    uint64_t quotient = 0;
+    for (int i = 63; i >= 0; i--) {
+        const bool carry = (high >> 63) != 0;
+        high = (high << 1) | ((low >> i) & 1);
+        quotient <<= 1;
+        if (carry || high >= divisor) {
+            high -= divisor;
+            quotient |= 1;
+        }
+    }
+    remainder = high;
+    return quotient;
+}
+
+static unsigned segmentFromPrefix(uint8_t prefix, unsigned defaultSegment) noexcept {
+    switch (prefix) {
+    case 0x26: return segES;
+    case 0x2E: return segCS;
+    case 0x36: return segSS;
+    case 0x3E: return segDS;
+    case 0x64: return segFS;
+    case 0x65: return segGS;
+    default: return defaultSegment;
+    }
+}
+
+ReferenceCPU::ReferenceCPU() noexcept {
+    memset(&m_stats, 0, sizeof(m_stats));
+    memset(&m_uncached, 0, sizeof(m_uncached));
+    Reset();
+}
+
+void ReferenceCPU::Reset() noexcept {
+    memset(m_gpr, 0, sizeof(m_gpr));
+    m_rip = 0xFFF0;
+    m_eflags = 0x2;
+    for (auto& seg : m_seg) {
+        seg = Segment{ 0, 0, 0xFFFF, 0x93 };
+    }
+    m_seg[segCS] = Segment{ 0xF000, 0xFFFF0000, 0xFFFF, 0x9B };
+    m_ldtr = Segment{ 0, 0, 0xFFFF, 0x82 };
+    m_tr = Segment{ 0, 0, 0xFFFF, 0x8B };
+    m_gdtr = Table{ 0, 0xFFFF };
+    m_idtr = Table{ 0, 0xFFFF };
+    m_cr0 = 0x60000010;
+    m_cr2 = m_cr3 = m_cr4 = m_cr8 = 0;
+    m_efer = 0;
+    m_kernelGSBase = 0;
+    memset(m_dr, 0, sizeof(m_dr));
+    m_dr[6] = 0xFFFF0FF0;
+    m_dr[7] = 0x400;
+    m_tsc = 0;
+    m_interruptShadow = false;
+    m_pendingInterrupts.clear();
+    m_rex = 0;
+    m_fault = false;
+    m_faultVector = 0;
+    m_exitInfo = VMExitInfo();
+    m_exitInfo.reason = VMExitReason::Normal;
+}
+
+bool ReferenceCPU::MapGuestMemory(uint64_t base, uint64_t size, MemoryFlags flags, void *memory) noexcept {
+    if (size == 0 || memory == nullptr) {
+        return false;
+    }
+    for (auto& region : m_regions) {
+        if (base < region.base + region.size && region.base < base + size) {
+            return false;
+        }
+    }
+    m_regions.push_back(Region{ base, size, (uint8_t *)memory, BitmaskEnum(flags).AnyOf(MemoryFlags::Write) });
+    InvalidateCode(base, size);
+    return true;
+}
+
+bool ReferenceCPU::UnmapGuestMemory(uint64_t base, uint64_t size) noexcept {
+    for (auto it = m_regions.begin(); it != m_regions.end(); ++it) {
+        if (it->base == base && it->size == size) {
+            m_regions.erase(it);
+            m_lastRegion = 0;
+            InvalidateCode(base, size);
+            return true;
+        }
+    }
+    return false;
+}
+
+VPOperationStatus ReferenceCPU::EnableSoftwareBreakpoints(bool enable) noexcept {
+    m_softwareBreakpoints = enable;
+    return VPOperationStatus::OK;
+}
+
+// Loads the breakpoints into DR0-DR3 and DR7. The trigger and length
+// enumerations follow the encoding of the R/W and LEN fields of DR7.
+VPOperationStatus ReferenceCPU::SetHardwareBreakpoints(const HardwareBreakpoints& breakpoints) noexcept {
+    uint64_t dr7 = dr7Reserved;
+    for (int i = 0; i < 4; i++) {
+        const auto& bp = breakpoints.bp[i];
+        if (!bp.localEnable && !bp.globalEnable) {
+            continue;
+        }
+        const uint64_t trigger = static_cast<uint64_t>(bp.trigger) & 3;
+        if (trigger == 0b10) {
+            return VPOperationStatus::Unsupported;
+        }
+        dr7 |= (bp.localEnable ? 1ull : 0) << (i * 2);
+        dr7 |= (bp.globalEnable ? 1ull : 0) << (i * 2 + 1);
+        dr7 |= trigger << (16 + i * 4);
+        dr7 |= (static_cast<uint64_t>(bp.length) & 3) << (18 + i * 4);
+    }
+    for (int i = 0; i < 4; i++) {
+        m_dr[i] = breakpoints.bp[i].address;
+    }
+    m_dr[7] = dr7;
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus ReferenceCPU::ClearHardwareBreakpoints() noexcept {
+    m_dr[7] = dr7Reserved;
+    return VPOperationStatus::OK;
+}
+
+bool ReferenceCPU::EnqueueInterrupt(uint8_t vector) noexcept {
+    m_pendingInterrupts.push_back(vector);
+    return true;
+}
+
+VPExecutionStatus ReferenceCPU::Run() noexcept {
+    while (!ExecuteOne()) {
+    }
+    return VPExecutionStatus::OK;
+}
+
+VPExecutionStatus ReferenceCPU::Step() noexcept {
+    if (!ExecuteOne()) {
+        m_exitInfo.reason = VMExitReason::Step;
+    }
+    return VPExecutionStatus::OK;
+}
+
+void ReferenceCPU::InvalidateCode(uint64_t address, uint64_t size) noexcept {
+    if (m_codePages.empty() || size == 0) {
+        return;
+    }
+    const uint64_t first = address & ~(uint64_t)(PAGE_SIZE - 1);
+    const uint64_t last = (address + size - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if ((last - first) / PAGE_SIZE > m_codePages.size()) {
+        for (auto it = m_codePages.begin(); it != m_codePages.end();) {
+            if (it->first >= first && it->first <= last) {
+                it = m_codePages.erase(it);
+                m_stats.invalidations++;
+            }
+            else {
+                ++it;
+            }
+        }
+        return;
+    }
+    for (uint64_t page = first; page <= last; page += PAGE_SIZE) {
+        InvalidatePage(page);
+    }
+}
+
+void ReferenceCPU::InvalidatePage(uint64_t page) noexcept {
+    if (m_codePages.erase(page) != 0) {
+        m_stats.invalidations++;
+    }
+}
+
+// ----- Execution --------------------------------------------------------------------------------------------------------
+
+// IA-32e mode becomes active when paging is enabled with EFER.LME set
+void ReferenceCPU::UpdateLongMode() noexcept {
+    if ((m_cr0 & cr0PG) && (m_efer & eferLME)) {
+        m_efer |= eferLMA;
+    }
+    else {
+        m_efer &= ~eferLMA;
+    }
+}
+
+X86Mode ReferenceCPU::CodeMode() const noexcept {
+    if (LongModeActive() && (m_seg[segCS].attributes & attrL)) {
+        return X86Mode::Bits64;
+    }
+    return (Protected() && (m_seg[segCS].attributes & attrDB)) ? X86Mode::Bits32 : X86Mode::Bits16;
+}
+
+size_t ReferenceCPU::StackSize() const noexcept {
+    if (CodeMode() == X86Mode::Bits64) {
+        return 8;
+    }
+    return (Protected() && (m_seg[segSS].attributes & attrDB)) ? 4 : 2;
+}
+
+// Executes one instruction, delivering a pending interrupt first if possible.
+// Returns true if the instruction caused an exit.
+bool ReferenceCPU::ExecuteOne() noexcept {
+    uint64_t savedGPR[16];
+    uint64_t savedRip;
+    uint32_t savedEflags;
+    Segment savedSeg[6];
+
+    m_rex = 0;
+    m_fault = false;
+    m_pioAccess = false;
+    m_mmioAccess = false;
+    m_exitInfo.reason = VMExitReason::Normal;
+
+    const bool shadow = m_interruptShadow;
+    m_interruptShadow = false;
+    if (!shadow && !m_pendingInterrupts.empty() && (m_eflags & flagIF)) {
+        const uint8_t vector = m_pendingInterrupts.front();
+        m_pendingInterrupts.pop_front();
+        memcpy(savedGPR, m_gpr, sizeof(m_gpr));
+        memcpy(savedSeg, m_seg, sizeof(m_seg));
+        savedRip = m_rip;
+        savedEflags = m_eflags;
+        if (!DeliverInterrupt(vector, m_rip) || m_fault) {
+            memcpy(m_gpr, savedGPR, sizeof(m_gpr));
+            memcpy(m_seg, savedSeg, sizeof(m_seg));
+            m_rip = savedRip;
+            m_eflags = savedEflags;
+            m_exitInfo.reason = VMExitReason::Exception;
+            return true;
+        }
+        m_rip = m_nextRip;
+    }
+
+    // Instruction breakpoints are faults. RF suppresses them for one
+    // instruction so that the host can resume from one.
+    if ((m_dr[7] & dr7EnableMask) != 0 && (m_eflags & flagRF) == 0) {
+        const uint8_t hits = ExecutionBreakpointHits(Linear(segCS, m_rip));
+        if (hits != 0) {
+            m_dr[6] |= hits;
+            m_exitInfo.reason = VMExitReason::HardwareBreakpoint;
+            return true;
+        }
+    }
+
+    const CachedInstruction *fetched = Fetch();
+    if (fetched == nullptr) {
+        if (m_fault) {
+            m_exitInfo.reason = VMExitReason::Exception;
+        }
+        return true;
+    }
+    // The instruction may invalidate its own cache entry
+    const CachedInstruction ci = *fetched;
+
+    memcpy(savedGPR, m_gpr, sizeof(m_gpr));
+    memcpy(savedSeg, m_seg, sizeof(m_seg));
+    savedRip = m_rip;
+    savedEflags = m_eflags;
+
+    m_dataBreakpointHits = 0;
+    const bool implemented = Execute(ci);
+    m_rex = 0;
+    if (m_fault || !implemented) {
+        memcpy(m_gpr, savedGPR, sizeof(m_gpr));
+        memcpy(m_seg, savedSeg, sizeof(m_seg));
+        m_rip = savedRip;
+        m_eflags = savedEflags;
+        m_exitInfo.reason = m_fault ? VMExitReason::Exception : VMExitReason::Unhandled;
+        return true;
+    }
+
+    m_rip = m_nextRip;
+    m_tsc++;
+    m_stats.instructions++;
+
+    // RF is cleared once an instruction completes, except when IRET loads it
+    if (ci.insn.opcodeMap != 0 || ci.insn.opcode != 0xCF) {
+        m_eflags &= ~flagRF;
+    }
+
+    // Data breakpoints are traps, reported after the instruction. They take
+    // precedence over PIO and MMIO exits, whose accesses were already handled
+    if (m_dataBreakpointHits != 0) {
+        m_dr[6] |= m_dataBreakpointHits;
+        if (m_exitInfo.reason == VMExitReason::Normal) {
+            m_exitInfo.reason = VMExitReason::HardwareBreakpoint;
+        }
+    }
+    if (m_exitInfo.reason != VMExitReason::Normal) {
+        return true;
+    }
+    if (m_pioAccess) {
+        m_exitInfo.reason = VMExitReason::PIO;
+        return true;
+    }
+    if (m_mmioAccess) {
+        m_exitInfo.reason = VMExitReason::MMIO;
+        return true;
+    }
+    return false;
+}
+
+// Returns the instruction at CS:RIP, decoding it if it is not cached. Returns
+// nullptr and sets the exit reason if the instruction cannot be fetched.
+const ReferenceCPU::CachedInstruction *ReferenceCPU::Fetch() noexcept {
+    const X86Mode mode = CodeMode();
+    const uint64_t linear = Linear(segCS, m_rip);
+    uint64_t physical;
+    if (!Translate(linear, physical)) {
+        return nullptr;
+    }
+    const uint64_t page = physical & ~(uint64_t)(PAGE_SIZE - 1);
+    const uint32_t offset = (uint32_t)(physical & (PAGE_SIZE - 1));
+
+    CodePage *codePage = nullptr;
+    auto it = m_codePages.find(page);
+    if (it != m_codePages.end()) {
+        codePage = it->second.get();
+        // Memory may have changed behind the cache's back: the host, another
+        // processor or a debugger can write to guest code without going
+        // through this processor, so a hit must still match memory
+        const uint16_t slot = codePage->slots[offset];
+        if (slot != 0) {
+            const CachedInstruction& cached = codePage->entries[slot - 1];
+            const uint8_t *current = RamPointer(physical, cached.insn.length, false);
+            if (cached.mode == mode && current != nullptr && memcmp(current, cached.bytes, cached.insn.length) == 0) {
+                m_stats.cacheHits++;
+                return &cached;
+            }
+        }
+    }
+
+    // Gather up to 15 bytes of mapped memory; the instruction may end before
+    // the first unmapped byte
+    uint8_t bytes[15];
+    size_t available = 0;
+    while (available < sizeof(bytes)) {
+        uint64_t address = physical + available;
+        if (((offset + available) & ~(PAGE_SIZE - 1)) != 0) {
+            const bool fault = m_fault;
+            if (!Translate(linear + available, address)) {
+                m_fault = fault;
+                break;
+            }
+        }
+        const uint8_t *ptr = RamPointer(address, 1, false);
+        if (ptr == nullptr) {
+            break;
+        }
+        bytes[available++] = *ptr;
+    }
+    if (available == 0) {
+        // Executing from MMIO is not supported
+        m_exitInfo.reason = VMExitReason::Unhandled;
+        return nullptr;
+    }
+
+    X86Instruction insn;
+    if (!decodeX86(bytes, available, m_rip, mode, insn)) {
+        RaiseFault(vectorUD);
+        return nullptr;
+    }
+    m_stats.decodes++;
+
+    CachedInstruction *entry = &m_uncached;
+    if (offset + insn.length <= PAGE_SIZE) {
+        if (codePage == nullptr) {
+            std::unique_ptr<CodePage> newPage(new CodePage);
+            memset(newPage->slots, 0, sizeof(newPage->slots));
+            codePage = newPage.get();
+            m_codePages.emplace(page, std::move(newPage));
+        }
+        uint16_t& slot = codePage->slots[offset];
+        if (slot == 0) {
+            codePage->entries.emplace_back();
+            slot = (uint16_t)codePage->entries.size();
+        }
+        entry = &codePage->entries[slot - 1];
+    }
+    entry->insn = insn;
+    memcpy(entry->bytes, bytes, available);
+    entry->mode = mode;
+    return entry;
+}
+
+void ReferenceCPU::RaiseFault(uint8_t vector) noexcept {
+    if (!m_fault) {
+        m_fault = true;
+        m_faultVector = vector;
+    }
+}
+
+// Transfers control to the handler of the vector through the IVT in real mode
+// or an interrupt or trap gate in protected and IA-32e modes. Sets m_nextRip
+// to the handler's address.
+bool ReferenceCPU::DeliverInterrupt(uint8_t vector, uint64_t returnRip) noexcept {
+    if (!Protected()) {
+        if ((uint32_t)vector * 4 + 3 > m_idtr.limit) {
+            RaiseFault(vectorGP);
+            return false;
+        }
+        const uint32_t entry = (uint32_t)ReadLinear(m_idtr.base + vector * 4, 4);
+        Push(m_eflags, 2);
+        Push(m_seg[segCS].selector, 2);
+        Push(returnRip, 2);
+        if (m_fault) {
+            return false;
+        }
+        m_eflags &= ~(flagIF | flagTF);
+        LoadSegment(segCS, (uint16_t)(entry >> 16));
+        m_nextRip = entry & 0xFFFF;
+        return true;
+    }
+
+    // IA-32e mode gates take 16 bytes
+    const bool longMode = LongModeActive();
+    const uint32_t gateBytes = longMode ? 16 : 8;
+    if ((uint32_t)vector * gateBytes + gateBytes - 1 > m_idtr.limit) {
+        RaiseFault(vectorGP);
+        return false;
+    }
+    const uint64_t gate = m_idtr.base + (uint64_t)vector * gateBytes;
+    const uint32_t low = (uint32_t)ReadLinear(gate, 4);
+    const uint32_t high = (uint32_t)ReadLinear(gate + 4, 4);
+    const uint64_t upper = longMode ? ReadLinear(gate + 8, 4) : 0;
+    if (m_fault) {
+        return false;
+    }
+    const uint8_t type = (high >> 8) & 0x1F;
+    if (!(high & 0x8000)) {
+        RaiseFault(vectorNP);
+        return false;
+    }
+    // Only interrupt and trap gates are supported
+    if ((type & 7) != 6 && (type & 7) != 7) {
+        RaiseFault(vectorGP);
+        return false;
+    }
+    const uint64_t offset = (upper << 32) | (high & 0xFFFF0000) | (low & 0xFFFF);
+    if (longMode) {
+        // The stack is aligned and SS:RSP is always saved
+        const uint64_t frame[] = { m_seg[segSS].selector, m_gpr[regESP], m_eflags, m_seg[segCS].selector, returnRip };
+        uint64_t rsp = m_gpr[regESP] & ~0xFull;
+        for (const uint64_t value : frame) {
+            rsp -= 8;
+            WriteLinear(rsp, 8, value);
+        }
+        if (m_fault) {
+            return false;
+        }
+        m_gpr[regESP] = rsp;
+    }
+    else {
+        const size_t gateSize = (type & 8) ? 4 : 2;
+        Push(m_eflags, gateSize);
+        Push(m_seg[segCS].selector, gateSize);
+        Push(returnRip, gateSize);
+        if (m_fault) {
+            return false;
+        }
+    }
+    if ((type & 1) == 0) {
+        m_eflags &= ~flagIF;
+    }
+    m_eflags &= ~(flagTF | flagNT | flagRF);
+    if (!LoadSegment(segCS, (uint16_t)(low >> 16))) {
+        return false;
+    }
+    m_nextRip = (!longMode && !(type & 8)) ? (offset & 0xFFFF) : offset;
+    return true;
+}
+
+// Returns from an interrupt. In 64-bit mode SS:RSP is always restored.
+bool ReferenceCPU::ExecuteIRET(size_t osize, X86Mode mode) noexcept {
+    const uint64_t rip = Pop(osize);
+    const uint16_t cs = (uint16_t)Pop(osize);
+    const uint64_t flags = Pop(osize);
+    if (mode != X86Mode::Bits64) {
+        if (LoadSegment(segCS, cs)) {
+            m_nextRip = rip & ((osize == 2) ? 0xFFFF : 0xFFFFFFFF);
+            SetFlags(flags, osize);
+        }
+        return true;
+    }
+    const uint64_t rsp = Pop(osize);
+    const uint16_t ss = (uint16_t)Pop(osize);
+    if (m_fault || !LoadSegment(segCS, cs) || !LoadSegment(segSS, ss)) {
+        return true;
+    }
+    m_nextRip = rip & sizeMask(osize);
+    SetFlags(flags, osize);
+    m_gpr[regESP] = rsp & sizeMask(osize);
+    return true;
+}
+
+void ReferenceCPU::CPUID() noexcept {
+    const uint32_t function = (uint32_t)m_gpr[regEAX];
+    if (std::find(m_cpuidExits.begin(), m_cpuidExits.end(), function) != m_cpuidExits.end()) {
+        m_exitInfo.reason = VMExitReason::CPUID;
+        return;
+    }
+    uint32_t regs[4] = { 0, 0, 0, 0 };  // EAX, EBX, ECX, EDX
+    switch (function) {
+    case 0:
+        regs[0] = 1;
+        memcpy(&regs[1], "virt", 4);
+        memcpy(&regs[3], "86re", 4);
+        memcpy(&regs[2], "fcpu", 4);
+        break;
+    case 1:
+        regs[0] = 0x00000600;  // Family 6
+        regs[3] = (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 13) | (1 << 15);  // PSE, TSC, MSR, PAE, PGE, CMOV
+        break;
+    case 0x80000000:
+        regs[0] = 0x80000001;
+        break;
+    case 0x80000001:
+        regs[3] = 1u << 29;  // Long mode
+        break;
+    }
+    m_gpr[regEAX] = regs[0];
+    m_gpr[regEBX] = regs[1];
+    m_gpr[regECX] = regs[2];
+    m_gpr[regEDX] = regs[3];
+}
+
+bool ReferenceCPU::ReadMSR(uint32_t msr, uint64_t& value) noexcept {
+    switch (msr) {
+    case msrTSC: value = m_tsc; return true;
+    case msrEFER: value = m_efer; return true;
+    case msrFSBase: value = m_seg[segFS].base; return true;
+    case msrGSBase: value = m_seg[segGS].base; return true;
+    case msrKernelGSBase: value = m_kernelGSBase; return true;
+    default: return false;
+    }
+}
+
+bool ReferenceCPU::WriteMSR(uint32_t msr, uint64_t value) noexcept {
+    switch (msr) {
+    case msrTSC: m_tsc = value; return true;
+    case msrEFER:
+        m_efer = (value & eferWritable) | (m_efer & eferLMA);
+        UpdateLongMode();
+        return true;
+    case msrFSBase: m_seg[segFS].base = value; return true;
+    case msrGSBase: m_seg[segGS].base = value; return true;
+    case msrKernelGSBase: m_kernelGSBase = value; return true;
+    default: return false;
+    }
+}
+
+bool ReferenceCPU::Execute(const CachedInstruction& ci) noexcept {
+    const X86Instruction& insn = ci.insn;
+    const uint8_t *bytes = ci.bytes;
+    const bool long64 = ci.mode == X86Mode::Bits64;
+    const size_t osize = insn.operandSize;
+    // Stack operations default to 64 bits in 64-bit mode; near branches are
+    // always 64-bit
+    const size_t ssize = (long64 && osize == 4) ? 8 : osize;
+    const size_t bsize = long64 ? 8 : osize;
+    const uint8_t op = insn.opcode;
+    const unsigned ext = (insn.modrm >> 3) & 7;                // Opcode extension of group instructions
+    const unsigned reg = ext | ((insn.rex & 4) << 1);          // Register operand in ModR/M
+    const unsigned opReg = (op & 7) | ((insn.rex & 1) << 3);   // Register operand in the opcode
+    const uint64_t ipMask = long64 ? ~0ull : (osize == 2) ? 0xFFFF : 0xFFFFFFFF;
+    const uint64_t imm = immediate(insn, bytes);
+
+    m_rex = insn.rex;
+    m_nextRip = (m_rip + insn.length) & ((ci.mode == X86Mode::Bits16) ? 0xFFFF : long64 ? ~0ull : 0xFFFFFFFF);
+    ComputeEffectiveAddress(insn, bytes);
+
+    if (insn.vex || insn.opcodeMap >= 2) {
+        return false;
+    }
+    if (insn.opcodeMap == 1) {
+        return ExecuteTwoByte(insn, bytes, imm);
+    }
+
+    // ALU operations: 00-05, 08-0D, ..., 38-3D
+    if (op < 0x40 && (op & 7) < 6) {
+        const unsigned aluOp = op >> 3;
+        const size_t size = (op & 1) ? osize : 1;
+        uint64_t result;
+        switch (op & 6) {
+        case 0:
+            result = Arith(aluOp, ReadRM(insn, size), GetReg(reg, size), size);
+            if (aluOp != 7) {
+                WriteRM(insn, size, result);
+            }
+            break;
+        case 2:
+            result = Arith(aluOp, GetReg(reg, size), ReadRM(insn, size), size);
+            if (aluOp != 7) {
+                SetReg(reg, size, result);
+            }
+            break;
+        default:
+            result = Arith(aluOp, GetReg(regEAX, size), imm, size);
+            if (aluOp != 7) {
+                SetReg(regEAX, size, result);
+            }
+            break;
+        }
+        return true;
+    }
+
+    switch (op) {
+    case 0x06: case 0x0E: case 0x16: case 0x1E:  // PUSH sreg
+        Push(m_seg[op >> 3].selector, osize);
+        return true;
+    case 0x07: case 0x17: case 0x1F:  // POP sreg
+        LoadSegment(op >> 3, (uint16_t)Pop(osize));
+        if (op == 0x17) {
+            m_interruptShadow = true;
+        }
+        return true;
+
+    case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:  // INC r
+    case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F: { // DEC r
+        const uint32_t carry = m_eflags & flagCF;
+        SetReg(op & 7, osize, Arith((op < 0x48) ? 0 : 5, GetReg(op & 7, osize), 1, osize));
+        m_eflags = (m_eflags & ~flagCF) | carry;
+        return true;
+    }
+
+    case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:  // PUSH r
+        Push(GetReg(opReg, ssize), ssize);
+        return true;
+    case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F: { // POP r
+        const uint64_t value = Pop(ssize);
+        SetReg(opReg, ssize, value);
+        return true;
+    }
+
+    case 0x60: { // PUSHA
+        const uint64_t sp = GetReg(regESP, osize);
+        for (unsigned i = 0; i < 8; i++) {
+            Push((i == regESP) ? sp : GetReg(i, osize), osize);
+        }
+        return true;
+    }
+    case 0x61:  // POPA
+        for (int i = 7; i >= 0; i--) {
+            const uint64_t value = Pop(osize);
+            if (i != regESP) {
+                SetReg(i, osize, value);
+            }
+        }
+        return true;
+    case 0x63:  // MOVSXD; ARPL outside 64-bit mode is not implemented
+        if (!long64) {
+            return false;
+        }
+        SetReg(reg, osize, (uint64_t)signExtend(ReadRM(insn, 4), 4));
+        return true;
+
+    case 0x68: case 0x6A:  // PUSH imm
+        Push(imm, ssize);
+        return true;
+    case 0x69: case 0x6B:  // IMUL r, r/m, imm
+        SetReg(reg, osize, IMul(ReadRM(insn, osize), imm, osize));
+        return true;
+
+    case 0x6C: case 0x6D: case 0x6E: case 0x6F:
+    case 0xA4: case 0xA5: case 0xA6: case 0xA7:
+    case 0xAA: case 0xAB: case 0xAC: case 0xAD: case 0xAE: case 0xAF:
+        return ExecuteString(insn);
+
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:  // Jcc rel8
+    case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+        if (Condition(op & 0xF)) {
+            m_nextRip = (m_nextRip + imm) & ipMask;
+        }
+        return true;
+
+    case 0x80: case 0x81: case 0x82: case 0x83: { // Group 1
+        const size_t size = (op & 1) ? osize : 1;
+        const uint64_t result = Arith(ext, ReadRM(insn, size), imm, size);
+        if (ext != 7) {
+            WriteRM(insn, size, result);
+        }
+        return true;
+    }
+    case 0x84: case 0x85: { // TEST r/m, r
+        const size_t size = (op & 1) ? osize : 1;
+        Arith(4, ReadRM(insn, size), GetReg(reg, size), size);
+        return true;
+    }
+    case 0x86: case 0x87: { // XCHG r/m, r
+        const size_t size = (op & 1) ? osize : 1;
+        const uint64_t value = ReadRM(insn, size);
+        WriteRM(insn, size, GetReg(reg, size));
+        SetReg(reg, size, value);
+        return true;
+    }
+    case 0x88: case 0x89:  // MOV r/m, r
+        WriteRM(insn, (op & 1) ? osize : 1, GetReg(reg, (op & 1) ? osize : 1));
+        return true;
+    case 0x8A: case 0x8B:  // MOV r, r/m
+        SetReg(reg, (op & 1) ? osize : 1, ReadRM(insn, (op & 1) ? osize : 1));
+        return true;
+    case 0x8C:  // MOV r/m, sreg
+        if (ext > segGS) {
+            RaiseFault(vectorUD);
+            return true;
+        }
+        WriteRM(insn, ((insn.modrm >> 6) == 3) ? osize : 2, m_seg[ext].selector);
+        return true;
+    case 0x8D:  // LEA
+        if ((insn.modrm >> 6) == 3) {
+            RaiseFault(vectorUD);
+            return true;
+        }
+        SetReg(reg, osize, m_ea);
+        return true;
+    case 0x8E:  // MOV sreg, r/m
+        if (ext > segGS || ext == segCS) {
+            RaiseFault(vectorUD);
+            return true;
+        }
+        LoadSegment(ext, (uint16_t)ReadRM(insn, 2));
+        if (ext == segSS) {
+            m_interruptShadow = true;
+        }
+        return true;
+    case 0x8F: { // POP r/m
+        const uint64_t value = Pop(ssize);
+        WriteRM(insn, ssize, value);
+        return true;
+    }
+
+    case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: { // XCHG rAX, r
+        if (opReg == regEAX) {
+            // NOP, PAUSE
+            return true;
+        }
+        const uint64_t value = GetReg(opReg, osize);
+        SetReg(opReg, osize, GetReg(regEAX, osize));
+        SetReg(regEAX, osize, value);
+        return true;
+    }
+    case 0x98:  // CBW, CWDE, CDQE
+        SetReg(regEAX, osize, (uint64_t)signExtend(GetReg(regEAX, osize / 2), osize / 2));
+        return true;
+    case 0x99:  // CWD, CDQ, CQO
+        SetReg(regEDX, osize, (GetReg(regEAX, osize) & signBit(osize)) ? ~0ull : 0);
+        return true;
+    case 0x9C:  // PUSHF
+        Push(m_eflags & 0x00FCFFFF, ssize);
+        return true;
+    case 0x9D:  // POPF
+        SetFlags(Pop(ssize), ssize);
+        return true;
+    case 0x9E:  // SAHF
+        m_eflags = (m_eflags & ~0xD5u) | ((m_gpr[regEAX] >> 8) & 0xD5);
+        return true;
+    case 0x9F:  // LAHF
+        m_gpr[regEAX] = (m_gpr[regEAX] & ~0xFF00ull) | ((m_eflags & 0xFF) << 8);
+        return true;
+
+    case 0xA0: case 0xA1: case 0xA2: case 0xA3: { // MOV with memory offset
+        const size_t size = (op & 1) ? osize : 1;
+        const unsigned seg = segmentFromPrefix(insn.segment, segDS);
+        const uint64_t offset = imm & sizeMask(insn.addressSize);
+        if (op < 0xA2) {
+            SetReg(regEAX, size, Read(seg, offset, size));
+        }
+        else {
+            Write(seg, offset, size, GetReg(regEAX, size));
+        }
+        return true;
+    }
+    case 0xA8: case 0xA9:  // TEST rAX, imm
+        Arith(4, GetReg(regEAX, (op & 1) ? osize : 1), imm, (op & 1) ? osize : 1);
+        return true;
+
+    case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB4: case 0xB5: case 0xB6: case 0xB7:  // MOV r8, imm
+        SetReg(opReg, 1, imm);
+        return true;
+    case 0xB8: case 0xB9: case 0xBA: case 0xBB: case 0xBC: case 0xBD: case 0xBE: case 0xBF:  // MOV r, imm
+        SetReg(opReg, osize, imm);
+        return true;
+
+    case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3: { // Group 2
+        const size_t size = (op & 1) ? osize : 1;
+        const uint8_t count = (op <= 0xC1) ? (uint8_t)imm : (op <= 0xD1) ? 1 : (uint8_t)m_gpr[regECX];
+        WriteRM(insn, size, Shift(ext, ReadRM(insn, size), count, size));
+        return true;
+    }
+    case 0xC2: { // RET imm16
+        m_nextRip = Pop(bsize) & ipMask;
+        const size_t stackSize = StackSize();
+        SetReg(regESP, stackSize, GetReg(regESP, stackSize) + (imm & 0xFFFF));
+        return true;
+    }
+    case 0xC3:  // RET
+        m_nextRip = Pop(bsize) & ipMask;
+        return true;
+    case 0xC6: case 0xC7:  // MOV r/m, imm
+        if (ext != 0) {
+            RaiseFault(vectorUD);
+            return true;
+        }
+        WriteRM(insn, (op & 1) ? osize : 1, imm);
+        return true;
+    case 0xC9: { // LEAVE
+        const size_t stackSize = StackSize();
+        SetReg(regESP, stackSize, GetReg(regEBP, stackSize));
+        SetReg(regEBP, ssize, Pop(ssize));
+        return true;
+    }
+    case 0xCC:  // INT3
+        if (m_softwareBreakpoints) {
+            m_nextRip = m_rip;
+            m_exitInfo.reason = VMExitReason::SoftwareBreakpoint;
+            return true;
+        }
+        DeliverInterrupt(3, m_nextRip);
+        return true;
+    case 0xCD:  // INT imm8
+        DeliverInterrupt((uint8_t)imm, m_nextRip);
+        return true;
+    case 0xCF:  // IRET
+        return ExecuteIRET(osize, ci.mode);
+
+    case 0xE0: case 0xE1: case 0xE2: { // LOOPNE, LOOPE, LOOP
+        const uint64_t count = GetReg(regECX, insn.addressSize) - 1;
+        SetReg(regECX, insn.addressSize, count);
+        const bool zf = (m_eflags & flagZF) != 0;
+        if ((count & sizeMask(insn.addressSize)) != 0 && (op == 0xE2 || (op == 0xE1) == zf)) {
+            m_nextRip = (m_nextRip + imm) & ipMask;
+        }
+        return true;
+    }
+    case 0xE3:  // JCXZ, JECXZ, JRCXZ
+        if (GetReg(regECX, insn.addressSize) == 0) {
+            m_nextRip = (m_nextRip + imm) & ipMask;
+        }
+        return true;
+    case 0xE4: case 0xE5:  // IN eAX, imm8
+        SetReg(regEAX, (op & 1) ? osize : 1, PortRead((uint8_t)imm, (op & 1) ? osize : 1));
+        return true;
+    case 0xE6: case 0xE7:  // OUT imm8, eAX
+        PortWrite((uint8_t)imm, (op & 1) ? osize : 1, (uint32_t)GetReg(regEAX, (op & 1) ? osize : 1));
+        return true;
+    case 0xE8:  // CALL rel
+        Push(m_nextRip, bsize);
+        m_nextRip = (m_nextRip + imm) & ipMask;
+        return true;
+    case 0xE9: case 0xEB:  // JMP rel
+        m_nextRip = (m_nextRip + imm) & ipMask;
+        return true;
+    case 0xEA: { // JMP ptr16:16/32
+        const uint64_t offset = readBytes(&bytes[insn.immOffset], osize);
+        const uint16_t selector = (uint16_t)readBytes(&bytes[insn.immOffset + osize], 2);
+        if (LoadSegment(segCS, selector)) {
+            m_nextRip = offset;
+        }
+        return true;
+    }
+    case 0xEC: case 0xED:  // IN eAX, DX
+        SetReg(regEAX, (op & 1) ? osize : 1, PortRead((uint16_t)m_gpr[regEDX], (op & 1) ? osize : 1));
+        return true;
+    case 0xEE: case 0xEF:  // OUT DX, eAX
+        PortWrite((uint16_t)m_gpr[regEDX], (op & 1) ? osize : 1, (uint32_t)GetReg(regEAX, (op & 1) ? osize : 1));
+        return true;
+
+    case 0xF4:  // HLT
+        m_exitInfo.reason = VMExitReason::HLT;
+        return true;
+    case 0xF5:  // CMC
+        m_eflags ^= flagCF;
+        return true;
+    case 0xF6: case 0xF7:
+        return ExecuteGroup3(insn, imm);
+    case 0xF8: m_eflags &= ~flagCF; return true;  // CLC
+    case 0xF9: m_eflags |= flagCF; return true;   // STC
+    case 0xFA: m_eflags &= ~flagIF; return true;  // CLI
+    case 0xFB:  // STI
+        if (!(m_eflags & flagIF)) {
+            m_interruptShadow = true;
+        }
+        m_eflags |= flagIF;
+        return true;
+    case 0xFC: m_eflags &= ~flagDF; return true;  // CLD
+    case 0xFD: m_eflags |= flagDF; return true;   // STD
+
+    case 0xFE: case 0xFF: { // Groups 4 and 5
+        const size_t size = (op & 1) ? osize : 1;
+        switch (ext) {
+        case 0: case 1: { // INC, DEC
+            const uint32_t carry = m_eflags & flagCF;
+            WriteRM(insn, size, Arith(ext ? 5 : 0, ReadRM(insn, size), 1, size));
+            m_eflags = (m_eflags & ~flagCF) | carry;
+            return true;
+        }
+        case 2:  // CALL r/m
+            if (op == 0xFF) {
+                const uint64_t target = ReadRM(insn, bsize);
+                Push(m_nextRip, bsize);
+                m_nextRip = target & ipMask;
+                return true;
+            }
+            break;
+        case 4:  // JMP r/m
+            if (op == 0xFF) {
+                m_nextRip = ReadRM(insn, bsize) & ipMask;
+                return true;
+            }
+            break;
+        case 6:  // PUSH r/m
+            if (op == 0xFF) {
+                Push(ReadRM(insn, ssize), ssize);
+                return true;
+            }
+            break;
+        }
+        return false;
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool ReferenceCPU::ExecuteGroup3(const X86Instruction& insn, uint64_t imm) noexcept {
+    const size_t size = (insn.opcode & 1) ? insn.operandSize : 1;
+    const unsigned ext = (insn.modrm >> 3) & 7;
+    const uint64_t value = ReadRM(insn, size);
+    const uint64_t mask = sizeMask(size);
+    switch (ext) {
+    case 0: case 1:  // TEST r/m, imm
+        Arith(4, value, imm, size);
+        return true;
+    case 2:  // NOT
+        WriteRM(insn, size, ~value & mask);
+        return true;
+    case 3:  // NEG
+        WriteRM(insn, size, Arith(5, 0, value, size));
+        SetFlag(flagCF, (value & mask) != 0);
+        return true;
+    case 4: case 5: { // MUL, IMUL
+        uint64_t low, high;
+        bool overflow;
+        if (size == 8) {
+            if (ext == 4) {
+                high = multiply128(m_gpr[regEAX], value, low);
+                overflow = high != 0;
+            }
+            else {
+                high = signedMultiply128(m_gpr[regEAX], value, low);
+                overflow = high != (((int64_t)low < 0) ? ~0ull : 0);
+            }
+        }
+        else {
+            uint64_t product;
+            if (ext == 4) {
+                product = GetReg(regEAX, size) * (value & mask);
+                overflow = (product >> (size * 8)) != 0;
+            }
+            else {
+                const int64_t sproduct = signExtend(GetReg(regEAX, size), size) * signExtend(value, size);
+                product = (uint64_t)sproduct;
+                overflow = sproduct != signExtend(product & mask, size);
+            }
+            low = product & mask;
+            high = (product >> (size * 8)) & mask;
+        }
+        if (size == 1) {
+            SetReg(regEAX, 2, (high << 8) | low);
+        }
+        else {
+            SetReg(regEAX, size, low);
+            SetReg(regEDX, size, high);
+        }
+        SetFlag(flagCF, overflow);
+        SetFlag(flagOF, overflow);
+        return true;
+    }
+    case 6: case 7: { // DIV, IDIV
+        if ((value & mask) == 0) {
+            RaiseFault(vectorDE);
+            return true;
+        }
+        uint64_t quotient, remainder;
+        if (size == 8) {
+            uint64_t high = m_gpr[regEDX];
+            uint64_t low = m_gpr[regEAX];
+            if (ext == 6) {
+                if (high >= value) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                quotient = divide128(high, low, value, remainder);
+            }
+            else {
+                // Divide the magnitudes and fix up the signs
+                const bool negativeDividend = (int64_t)high < 0;
+                const bool negativeDivisor = (int64_t)value < 0;
+                if (negativeDividend) {
+                    low = ~low + 1;
+                    high = ~high + (low == 0 ? 1 : 0);
+                }
+                const uint64_t divisor = negativeDivisor ? ~value + 1 : value;
+                if (high >= divisor) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                quotient = divide128(high, low, divisor, remainder);
+                const bool negativeQuotient = negativeDividend != negativeDivisor;
+                if (quotient > (negativeQuotient ? 1ull << 63 : (1ull << 63) - 1)) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                if (negativeQuotient) {
+                    quotient = ~quotient + 1;
+                }
+                if (negativeDividend) {
+                    remainder = ~remainder + 1;
+                }
+            }
+        }
+        else {
+            const unsigned bits = (unsigned)size * 8;
+            uint64_t dividend;
+            if (size == 1) {
+                dividend = GetReg(regEAX, 2);
+            }
+            else {
+                dividend = (GetReg(regEDX, size) << bits) | GetReg(regEAX, size);
+            }
+            if (ext == 6) {
+                const uint64_t q = dividend / (value & mask);
+                if (q > mask) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                quotient = q;
+                remainder = dividend % (value & mask);
+            }
+            else {
+                // Sign-extend the double-width dividend
+                const int64_t sdividend = (bits * 2 == 64) ? (int64_t)dividend : ((int64_t)(dividend << (64 - bits * 2)) >> (64 - bits * 2));
+                const int64_t divisor = signExtend(value, size);
+                if (sdividend == INT64_MIN && divisor == -1) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                const int64_t q = sdividend / divisor;
+                if (q > (int64_t)(mask >> 1) || q < -(int64_t)(mask >> 1) - 1) {
+                    RaiseFault(vectorDE);
+                    return true;
+                }
+                quotient = (uint64_t)q;
+                remainder = (uint64_t)(sdividend % divisor);
+            }
+        }
+        if (size == 1) {
+            SetReg(regEAX, 2, (quotient & 0xFF) | ((remainder & 0xFF) << 8));
+        }
+        else {
+            SetReg(regEAX, size, quotient);
+            SetReg(regEDX, size, remainder);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+bool ReferenceCPU::ExecuteString(const X86Instruction& insn) noexcept {
+    const uint8_t op = insn.opcode;
+    const size_t size = (op & 1) ? insn.operandSize : 1;
+    const size_t asize = insn.addressSize;
+    const unsigned source = segmentFromPrefix(insn.segment, segDS);
+    const uint64_t delta = (m_eflags & flagDF) ? (uint64_t)-(int64_t)size : (uint64_t)size;
+    const bool repeat = insn.rep || insn.repne;
+    const bool compare = op == 0xA6 || op == 0xA7 || op == 0xAE || op == 0xAF;
+
+    while (!repeat || GetReg(regECX, asize) != 0) {
+        const uint64_t si = GetReg(regESI, asize);
+        const uint64_t di = GetReg(regEDI, asize);
+        switch (op) {
+        case 0x6C: case 0x6D:  // INS
+            Write(segES, di, size, PortRead((uint16_t)m_gpr[regEDX], size));
+            SetReg(regEDI, asize, di + delta);
+            break;
+        case 0x6E: case 0x6F:  // OUTS
+            PortWrite((uint16_t)m_gpr[regEDX], size, (uint32_t)Read(source, si, size));
+            SetReg(regESI, asize, si + delta);
+            break;
+        case 0xA4: case 0xA5:  // MOVS
+            Write(segES, di, size, Read(source, si, size));
+            SetReg(regESI, asize, si + delta);
+            SetReg(regEDI, asize, di + delta);
+            break;
+        case 0xA6: case 0xA7:  // CMPS
+            Arith(7, Read(source, si, size), Read(segES, di, size), size);
+            SetReg(regESI, asize, si + delta);
+            SetReg(regEDI, asize, di + delta);
+            break;
+        case 0xAA: case 0xAB:  // STOS
+            Write(segES, di, size, GetReg(regEAX, size));
+            SetReg(regEDI, asize, di + delta);
+            break;
+        case 0xAC: case 0xAD:  // LODS
+            SetReg(regEAX, size, Read(source, si, size));
+            SetReg(regESI, asize, si + delta);
+            break;
+        case 0xAE: case 0xAF:  // SCAS
+            Arith(7, GetReg(regEAX, size), Read(segES, di, size), size);
+            SetReg(regEDI, asize, di + delta);
+            break;
+        }
+        if (m_fault || !repeat) {
+            break;
+        }
+        SetReg(regECX, asize, GetReg(regECX, asize) - 1);
+        if (compare && ((insn.rep && !(m_eflags & flagZF)) || (insn.repne && (m_eflags & flagZF)))) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool ReferenceCPU::ExecuteTwoByte(const X86Instruction& insn, const uint8_t *bytes, uint64_t imm) noexcept {
+    const bool long64 = CodeMode() == X86Mode::Bits64;
+    const size_t osize = insn.operandSize;
+    const size_t ssize = (long64 && osize == 4) ? 8 : osize;
+    const uint8_t op = insn.opcode;
+    const unsigned ext = (insn.modrm >> 3) & 7;
+    const unsigned reg = ext | ((insn.rex & 4) << 1);
+    const unsigned rm = (insn.modrm & 7) | ((insn.rex & 1) << 3);
+    const bool registerOperand = (insn.modrm >> 6) == 3;
+    const uint64_t ipMask = long64 ? ~0ull : (osize == 2) ? 0xFFFF : 0xFFFFFFFF;
+    // Control and debug registers are moved with their full width
+    const size_t crSize = long64 ? 8 : 4;
+
+    switch (op) {
+    case 0x01: { // Group 7
+        const unsigned seg = m_eaSegment;
+        const size_t baseSize = long64 ? 8 : 4;
+        switch (ext) {
+        case 0: case 1: { // SGDT, SIDT
+            if (registerOperand) {
+                break;
+            }
+            const Table& table = (ext == 0) ? m_gdtr : m_idtr;
+            Write(seg, m_ea, 2, table.limit);
+            Write(seg, m_ea + 2, baseSize, table.base);
+            return true;
+        }
+        case 2: case 3: { // LGDT, LIDT
+            if (registerOperand) {
+                break;
+            }
+            Table& table = (ext == 2) ? m_gdtr : m_idtr;
+            const uint16_t limit = (uint16_t)Read(seg, m_ea, 2);
+            uint64_t base = Read(seg, m_ea + 2, baseSize);
+            if (osize == 2 && !long64) {
+                base &= 0x00FFFFFF;
+            }
+            if (!m_fault) {
+                table = Table{ base, limit };
+            }
+            return true;
+        }
+        case 4:  // SMSW
+            WriteRM(insn, registerOperand ? osize : 2, m_cr0);
+            return true;
+        case 7:  // INVLPG; there is no TLB
+            return !registerOperand;
+        }
+        return false;
+    }
+    case 0x06:  // CLTS
+        m_cr0 &= ~8ull;
+        return true;
+    case 0x08: case 0x09:  // INVD, WBINVD
+        return true;
+    case 0x0B:  // UD2
+        RaiseFault(vectorUD);
+        return true;
+    case 0x1F:  // NOP r/m
+        return true;
+
+    case 0x20:  // MOV r, CRn
+        switch (reg) {
+        case 0: SetReg(rm, crSize, m_cr0); return true;
+        case 2: SetReg(rm, crSize, m_cr2); return true;
+        case 3: SetReg(rm, crSize, m_cr3); return true;
+        case 4: SetReg(rm, crSize, m_cr4); return true;
+        case 8: SetReg(rm, crSize, m_cr8); return true;
+        }
+        RaiseFault(vectorUD);
+        return true;
+    case 0x22: { // MOV CRn, r
+        const uint64_t value = GetReg(rm, crSize);
+        switch (reg) {
+        case 0: m_cr0 = value | 0x10; UpdateLongMode(); return true;
+        case 2: m_cr2 = value; return true;
+        case 3: m_cr3 = value; return true;
+        case 4: m_cr4 = value; return true;
+        case 8: m_cr8 = value & 0xF; return true;
+        }
+        RaiseFault(vectorUD);
+        return true;
+    }
+    case 0x21:  // MOV r, DRn
+        SetReg(rm, crSize, m_dr[ext]);
+        return true;
+    case 0x23:  // MOV DRn, r
+        m_dr[ext] = GetReg(rm, crSize);
+        return true;
+
+    case 0x30: { // WRMSR
+        if (!WriteMSR((uint32_t)m_gpr[regECX], ((m_gpr[regEDX] & 0xFFFFFFFF) << 32) | (m_gpr[regEAX] & 0xFFFFFFFF))) {
+            RaiseFault(vectorGP);
+        }
+        return true;
+    }
+    case 0x31:  // RDTSC
+        m_gpr[regEAX] = (uint32_t)m_tsc;
+        m_gpr[regEDX] = (uint32_t)(m_tsc >> 32);
+        return true;
+    case 0x32: { // RDMSR
+        uint64_t value;
+        if (!ReadMSR((uint32_t)m_gpr[regECX], value)) {
+            RaiseFault(vectorGP);
+            return true;
+        }
+        m_gpr[regEAX] = (uint32_t)value;
+        m_gpr[regEDX] = (uint32_t)(value >> 32);
+        return true;
+    }
+
+    case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:  // CMOVcc
+    case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F: {
+        const uint64_t value = ReadRM(insn, osize);
+        // A 32-bit destination is zero-extended even if the move does not happen
+        SetReg(reg, osize, Condition(op & 0xF) ? value : GetReg(reg, osize));
+        return true;
+    }
+
+    case 0x80: case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86: case 0x87:  // Jcc rel16/32
+    case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C: case 0x8D: case 0x8E: case 0x8F:
+        if (Condition(op & 0xF)) {
+            m_nextRip = (m_nextRip + imm) & ipMask;
+        }
+        return true;
+
+    case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:  // SETcc
+    case 0x98: case 0x99: case 0x9A: case 0x9B: case 0x9C: case 0x9D: case 0x9E: case 0x9F:
+        WriteRM(insn, 1, Condition(op & 0xF) ? 1 : 0);
+        return true;
+
+    case 0xA0: case 0xA8:  // PUSH FS, PUSH GS
+        Push(m_seg[(op == 0xA0) ? segFS : segGS].selector, ssize);
+        return true;
+    case 0xA1: case 0xA9:  // POP FS, POP GS
+        LoadSegment((op == 0xA1) ? segFS : segGS, (uint16_t)Pop(ssize));
+        return true;
+    case 0xA2:
+        CPUID();
+        return true;
+
+    case 0xA3: case 0xAB: case 0xB3: case 0xBB: case 0xBA: { // BT, BTS, BTR, BTC
+        const unsigned bits = (unsigned)osize * 8;
+        unsigned action;
+        unsigned bit;
+        if (op == 0xBA) {
+            if (ext < 4) {
+                return false;
+            }
+            action = ext - 4;
+            bit = (unsigned)readBytes(&bytes[insn.immOffset], 1) & (bits - 1);
+        }
+        else {
+            action = (op >> 3) & 3;
+            const uint64_t offset = GetReg(reg, osize);
+            bit = (unsigned)offset & (bits - 1);
+            // Bit offsets in registers can address memory beyond the operand
+            if (!registerOperand) {
+                const unsigned shift = (osize == 2) ? 4 : (osize == 4) ? 5 : 6;
+                m_ea += (uint64_t)((signExtend(offset, osize) >> shift) * (int64_t)osize);
+            }
+        }
+        const uint64_t value = ReadRM(insn, osize);
+        SetFlag(flagCF, (value >> bit) & 1);
+        switch (action) {
+        case 1: WriteRM(insn, osize, value | (1ull << bit)); break;   // BTS
+        case 2: WriteRM(insn, osize, value & ~(1ull << bit)); break;  // BTR
+        case 3: WriteRM(insn, osize, value ^ (1ull << bit)); break;   // BTC
+        }
+        return true;
+    }
+
+    case 0xAF:  // IMUL r, r/m
+        SetReg(reg, osize, IMul(GetReg(reg, osize), ReadRM(insn, osize), osize));
+        return true;
+
+    case 0xB0: case 0xB1: { // CMPXCHG
+        const size_t size = (op & 1) ? osize : 1;
+        const uint64_t value = ReadRM(insn, size);
+        Arith(7, GetReg(regEAX, size), value, size);
+        if (m_eflags & flagZF) {
+            WriteRM(insn, size, GetReg(reg, size));
+        }
+        else {
+            SetReg(regEAX, size, value);
+        }
+        return true;
+    }
+
+    case 0xB6: case 0xB7:  // MOVZX
+        SetReg(reg, osize, ReadRM(insn, (op & 1) ? 2 : 1));
+        return true;
+    case 0xBE: case 0xBF: { // MOVSX
+        const size_t size = (op & 1) ? 2 : 1;
+        SetReg(reg, osize, (uint64_t)signExtend(ReadRM(insn, size), size));
+        return true;
+    }
+
+    case 0xBC: case 0xBD: { // BSF, BSR
+        const uint64_t value = ReadRM(insn, osize) & sizeMask(osize);
+        SetFlag(flagZF, value == 0);
+        if (value != 0) {
+            unsigned index = 0;
+            if (op == 0xBC) {
+                while (!((value >> index) & 1)) index++;
+            }
+            else {
+                index = (unsigned)osize * 8 - 1;
+                while (!((value >> index) & 1)) index--;
+            }
+            SetReg(reg, osize, index);
+        }
+        return true;
+    }
+
+    case 0xC0: case 0xC1: { // XADD
+        const size_t size = (op & 1) ? osize : 1;
+        const uint64_t value = ReadRM(insn, size);
+        const uint64_t sum = Arith(0, value, GetReg(reg, size), size);
+        SetReg(reg, size, value);
+        WriteRM(insn, size, sum);
+        return true;
+    }
+
+    case 0xC8: case 0xC9: case 0xCA: case 0xCB: case 0xCC: case 0xCD: case 0xCE: case 0xCF: { // BSWAP
+        const unsigned index = (op & 7) | ((insn.rex & 1) << 3);
+        const size_t size = (osize == 8) ? 8 : 4;
+        const uint64_t value = GetReg(index, size);
+        uint64_t swapped = 0;
+        for (size_t i = 0; i < size; i++) {
+            swapped |= ((value >> (i * 8)) & 0xFF) << ((size - 1 - i) * 8);
+        }
+        SetReg(index, size, swapped);
+        return true;
+    }
+    }
+    return false;
+}
+
+// ----- Registers and flags ----------------------------------------------------------------------------------------------
+
+// Byte registers 4-7 are AH, CH, DH and BH unless the instruction has a REX
+// prefix, which selects SPL, BPL, SIL and DIL instead.
+uint64_t ReferenceCPU::GetReg(unsigned index, size_t size) const noexcept {
+    switch (size) {
+    case 1:
+        if (m_rex == 0 && index >= 4 && index < 8) {
+            return (m_gpr[index - 4] >> 8) & 0xFF;
+        }
+        return m_gpr[index] & 0xFF;
+    case 2: return m_gpr[index] & 0xFFFF;
+    case 4: return m_gpr[index] & 0xFFFFFFFF;
+    default: return m_gpr[index];
+    }
+}
+
+// 32-bit writes zero-extend into the full register; 8 and 16-bit writes
+// preserve the remaining bits.
+void ReferenceCPU::SetReg(unsigned index, size_t size, uint64_t value) noexcept {
+    switch (size) {
+    case 1:
+        if (m_rex == 0 && index >= 4 && index < 8) {
+            m_gpr[index - 4] = (m_gpr[index - 4] & ~0xFF00ull) | ((value & 0xFF) << 8);
+        }
+        else {
+            m_gpr[index] = (m_gpr[index] & ~0xFFull) | (value & 0xFF);
+        }
+        break;
+    case 2:
+        m_gpr[index] = (m_gpr[index] & ~0xFFFFull) | (value & 0xFFFF);
+        break;
+    case 4:
+        m_gpr[index] = value & 0xFFFFFFFF;
+        break;
+    default:
+        m_gpr[index] = value;
+        break;
+    }
+}
+
+void ReferenceCPU::SetFlag(uint32_t flag, bool set) noexcept {
+    if (set) {
+        m_eflags |= flag;
+    }
+    else {
+        m_eflags &= ~flag;
+    }
+}
+
+void ReferenceCPU::SetFlags(uint64_t value, size_t size) noexcept {
+    if (size == 2) {
+        value = (m_eflags & 0xFFFF0000) | (value & 0xFFFF);
+    }
+    m_eflags = (m_eflags & ~flagsWritable) | ((uint32_t)value & flagsWritable) | 0x2;
+}
+
+void ReferenceCPU::SetResultFlags(uint64_t result, size_t size) noexcept {
+    result &= sizeMask(size);
+    SetFlag(flagZF, result == 0);
+    SetFlag(flagSF, (result & signBit(size)) != 0);
+    SetFlag(flagPF, evenParity((uint8_t)result));
+}
+
+bool ReferenceCPU::Condition(uint8_t cc) const noexcept {
+    const bool cf = (m_eflags & flagCF) != 0;
+    const bool zf = (m_eflags & flagZF) != 0;
+    const bool sf = (m_eflags & flagSF) != 0;
+    const bool of = (m_eflags & flagOF) != 0;
+    bool result;
+    switch (cc >> 1) {
+    case 0: result = of; break;
+    case 1: result = cf; break;
+    case 2: result = zf; break;
+    case 3: result = cf || zf; break;
+    case 4: result = sf; break;
+    case 5: result = (m_eflags & flagPF) != 0; break;
+    case 6: result = sf != of; break;
+    default: result = zf || sf != of; break;
+    }
+    return (cc & 1) ? !result : result;
+}
+
+// Performs ADD, OR, ADC, SBB, AND, SUB, XOR or CMP and updates the flags.
+uint64_t ReferenceCPU::Arith(unsigned op, uint64_t a, uint64_t b, size_t size) noexcept {
+    const uint64_t mask = sizeMask(size);
+    const uint64_t sign = signBit(size);
+    a &= mask;
+    b &= mask;
+    uint64_t result;
+    switch (op) {
+    case 0: case 2: { // ADD, ADC
+        const uint64_t carry = (op == 2 && (m_eflags & flagCF)) ? 1 : 0;
+        result = (a + b + carry) & mask;
+        SetFlag(flagCF, result < a || (carry && result == a));
+        SetFlag(flagOF, ((a ^ result) & (b ^ result) & sign) != 0);
+        SetFlag(flagAF, ((a ^ b ^ result) & 0x10) != 0);
+        break;
+    }
+    case 3: case 5: case 7: { // SBB, SUB, CMP
+        const uint64_t borrow = (op == 3 && (m_eflags & flagCF)) ? 1 : 0;
+        result = (a - b - borrow) & mask;
+        SetFlag(flagCF, b > a || (borrow && b == a));
+        SetFlag(flagOF, ((a ^ b) & (a ^ result) & sign) != 0);
+        SetFlag(flagAF, ((a ^ b ^ result) & 0x10) != 0);
+        break;
+    }
+    default: { // OR, AND, XOR
+        result = (op == 1) ? (a | b) : (op == 4) ? (a & b) : (a ^ b);
+        m_eflags &= ~(flagCF | flagOF | flagAF);
+        break;
+    }
+    }
+    SetResultFlags(result, size);
+    return result;
+}
+
+// Performs ROL, ROR, RCL, RCR, SHL, SHR, SAL or SAR and updates the flags.
+uint64_t ReferenceCPU::Shift(unsigned op, uint64_t value, uint8_t count, size_t size) noexcept {
+    const unsigned bits = (unsigned)size * 8;
+    const uint64_t mask = sizeMask(size);
+    const uint64_t sign = signBit(size);
+    value &= mask;
+    count &= (size == 8) ? 0x3F : 0x1F;
+    if (count == 0) {
+        return value;
+    }
+    uint64_t result;
+    switch (op) {
+    case 0: { // ROL
+        const unsigned c = count % bits;
+        result = c ? ((value << c) | (value >> (bits - c))) & mask : value;
+        SetFlag(flagCF, result & 1);
+        SetFlag(flagOF, ((result & sign) != 0) != ((result & 1) != 0));
+        return result;
+    }
+    case 1: { // ROR
+        const unsigned c = count % bits;
+        result = c ? ((value >> c) | (value << (bits - c))) & mask : value;
+        SetFlag(flagCF, (result & sign) != 0);
+        SetFlag(flagOF, ((result ^ (result << 1)) & sign) != 0);
+        return result;
+    }
+    case 2: case 3: { // RCL, RCR
+        const unsigned c = count % (bits + 1);
+        bool carry = (m_eflags & flagCF) != 0;
+        result = value;
+        if (op == 3) {
+            SetFlag(flagOF, ((result & sign) != 0) != carry);
+        }
+        for (unsigned i = 0; i < c; i++) {
+            if (op == 2) {
+                const bool out = (result & sign) != 0;
+                result = ((result << 1) | (carry ? 1 : 0)) & mask;
+                carry = out;
+            }
+            else {
+                const bool out = (result & 1) != 0;
+                result = (result >> 1) | (carry ? sign : 0);
+                carry = out;
+            }
+        }
+        SetFlag(flagCF, carry);
+        if (op == 2) {
+            SetFlag(flagOF, ((result & sign) != 0) != carry);
+        }
+        return result;
+    }
+    case 4: case 6: { // SHL, SAL
+        result = (count < bits) ? (value << count) & mask : 0;
+        const bool carry = count <= bits && ((value >> (bits - count)) & 1);
+        SetFlag(flagCF, carry);
+        SetFlag(flagOF, ((result & sign) != 0) != carry);
+        break;
+    }
+    case 5:  // SHR
+        SetFlag(flagCF, count <= bits && ((value >> (count - 1)) & 1));
+        SetFlag(flagOF, (value & sign) != 0);
+        result = (count < bits) ? (value >> count) : 0;
+        break;
+    default: { // SAR
+        const int64_t svalue = signExtend(value, size);
+        SetFlag(flagCF, (svalue >> std::min<unsigned>(count - 1, 63)) & 1);
+        SetFlag(flagOF, false);
+        result = (uint64_t)(svalue >> std::min<unsigned>(count, 63)) & mask;
+        break;
+    }
+    }
+    m_eflags &= ~flagAF;
+    SetResultFlags(result, size);
+    return result;
+}
+
+uint64_t ReferenceCPU::IMul(uint64_t a, uint64_t b, size_t size) noexcept {
+    uint64_t result;
+    bool overflow;
+    if (size == 8) {
+        const uint64_t high = signedMultiply128(a, b, result);
+        overflow = high != (((int64_t)result < 0) ? ~0ull : 0);
+    }
+    else {
+        const int64_t product = signExtend(a, size) * signExtend(b, size);
+        result = (uint64_t)product & sizeMask(size);
+        overflow = product != signExtend(result, size);
+    }
+    SetFlag(flagCF, overflow);
+    SetFlag(flagOF, overflow);
+    return result;
+}
+
+// Loads a segment register. In protected mode the descriptor is read from
+// the GDT; LDT selectors are not supported. A null SS is allowed in IA-32e
+// mode.
+bool ReferenceCPU::LoadSegment(unsigned index, uint16_t selector) noexcept {
+    Segment& seg = m_seg[index];
+    if (!Protected()) {
+        seg.selector = selector;
+        seg.base = (uint32_t)selector << 4;
+        return true;
+    }
+    if ((selector & ~3) == 0) {
+        if (index == segCS || (index == segSS && !LongModeActive())) {
+            RaiseFault(vectorGP);
+            return false;
+        }
+        seg = Segment{ selector, 0, 0, 0 };
+        return true;
+    }
+    if ((selector & 4) || (uint32_t)(selector | 7) > m_gdtr.limit) {
+        RaiseFault(vectorGP);
+        return false;
+    }
+    const uint32_t low = (uint32_t)ReadLinear(m_gdtr.base + (selector & ~7), 4);
+    const uint32_t high = (uint32_t)ReadLinear(m_gdtr.base + (selector & ~7) + 4, 4);
+    if (m_fault) {
+        return false;
+    }
+    if (!(high & 0x8000)) {
+        RaiseFault(vectorNP);
+        return false;
+    }
+    uint32_t limit = (low & 0xFFFF) | (high & 0xF0000);
+    if (high & 0x800000) {
+        limit = (limit << 12) | 0xFFF;
+    }
+    seg.selector = selector;
+    seg.base = (low >> 16) | ((high & 0xFF) << 16) | (high & 0xFF000000);
+    seg.limit = limit;
+    seg.attributes = (uint16_t)(((high >> 8) & 0xFF) | ((high >> 8) & 0xF000));
+    return true;
+}
+
+VPOperationStatus ReferenceCPU::RegRead(const Reg reg, RegValue& value) noexcept {
+    value.u64 = 0;
+    switch (reg) {
+    case Reg::EAX: case Reg::ECX: case Reg::EDX: case Reg::EBX: case Reg::ESP: case Reg::EBP: case Reg::ESI: case Reg::EDI:
+        value.u64 = m_gpr[(int)reg - (int)Reg::EAX] & 0xFFFFFFFF;
+        break;
+    case Reg::RAX: case Reg::RCX: case Reg::RDX: case Reg::RBX: case Reg::RSP: case Reg::RBP: case Reg::RSI: case Reg::RDI:
+    case Reg::R8: case Reg::R9: case Reg::R10: case Reg::R11: case Reg::R12: case Reg::R13: case Reg::R14: case Reg::R15:
+        value.u64 = m_gpr[(int)reg - (int)Reg::RAX];
+        break;
+    case Reg::EIP: value.u64 = m_rip & 0xFFFFFFFF; break;
+    case Reg::RIP: value.u64 = m_rip; break;
+    case Reg::EFLAGS: case Reg::RFLAGS: value.u64 = m_eflags; break;
+    case Reg::ES: case Reg::CS: case Reg::SS: case Reg::DS: case Reg::FS: case Reg::GS: case Reg::LDTR: case Reg::TR: {
+        const Segment& seg = (reg == Reg::ES) ? m_seg[segES] : (reg == Reg::CS) ? m_seg[segCS] : (reg == Reg::SS) ? m_seg[segSS]
+            : (reg == Reg::DS) ? m_seg[segDS] : (reg == Reg::FS) ? m_seg[segFS] : (reg == Reg::GS) ? m_seg[segGS]
+            : (reg == Reg::LDTR) ? m_ldtr : m_tr;
+        value.segment.selector = seg.selector;
+        value.segment.base = seg.base;
+        value.segment.limit = seg.limit;
+        value.segment.attributes = seg.attributes;
+        break;
+    }
+    case Reg::GDTR: value.table.base = m_gdtr.base; value.table.limit = m_gdtr.limit; break;
+    case Reg::IDTR: value.table.base = m_idtr.base; value.table.limit = m_idtr.limit; break;
+    case Reg::CR0: value.u64 = m_cr0; break;
+    case Reg::CR2: value.u64 = m_cr2; break;
+    case Reg::CR3: value.u64 = m_cr3; break;
+    case Reg::CR4: value.u64 = m_cr4; break;
+    case Reg::CR8: value.u64 = m_cr8; break;
+    case Reg::EFER: value.u64 = m_efer; break;
+    case Reg::DR0: value.u64 = m_dr[0]; break;
+    case Reg::DR1: value.u64 = m_dr[1]; break;
+    case Reg::DR2: value.u64 = m_dr[2]; break;
+    case Reg::DR3: value.u64 = m_dr[3]; break;
+    case Reg::DR6: value.u64 = m_dr[6]; break;
+    case Reg::DR7: value.u64 = m_dr[7]; break;
+    default: return VPOperationStatus::InvalidRegister;
+    }
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus ReferenceCPU::RegWrite(const Reg reg, const RegValue& value) noexcept {
+    const uint64_t v = value.u64;
+    switch (reg) {
+    case Reg::EAX: case Reg::ECX: case Reg::EDX: case Reg::EBX: case Reg::ESP: case Reg::EBP: case Reg::ESI: case Reg::EDI:
+        m_gpr[(int)reg - (int)Reg::EAX] = value.u32;
+        break;
+    case Reg::RAX: case Reg::RCX: case Reg::RDX: case Reg::RBX: case Reg::RSP: case Reg::RBP: case Reg::RSI: case Reg::RDI:
+    case Reg::R8: case Reg::R9: case Reg::R10: case Reg::R11: case Reg::R12: case Reg::R13: case Reg::R14: case Reg::R15:
+        m_gpr[(int)reg - (int)Reg::RAX] = v;
+        break;
+    case Reg::EIP: m_rip = value.u32; break;
+    case Reg::RIP: m_rip = v; break;
+    case Reg::EFLAGS: case Reg::RFLAGS: m_eflags = value.u32 | 0x2; break;
+    case Reg::ES: case Reg::CS: case Reg::SS: case Reg::DS: case Reg::FS: case Reg::GS: case Reg::LDTR: case Reg::TR: {
+        Segment& seg = (reg == Reg::ES) ? m_seg[segES] : (reg == Reg::CS) ? m_seg[segCS] : (reg == Reg::SS) ? m_seg[segSS]
+            : (reg == Reg::DS) ? m_seg[segDS] : (reg == Reg::FS) ? m_seg[segFS] : (reg == Reg::GS) ? m_seg[segGS]
+            : (reg == Reg::LDTR) ? m_ldtr : m_tr;
+        seg.selector = value.segment.selector;
+        seg.base = value.segment.base;
+        seg.limit = value.segment.limit;
+        seg.attributes = value.segment.attributes;
+        break;
+    }
+    case Reg::GDTR: m_gdtr = Table{ value.table.base, value.table.limit }; break;
+    case Reg::IDTR: m_idtr = Table{ value.table.base, value.table.limit }; break;
+    case Reg::CR0: m_cr0 = v; UpdateLongMode(); break;
+    case Reg::CR2: m_cr2 = v; break;
+    case Reg::CR3: m_cr3 = v; break;
+    case Reg::CR4: m_cr4 = v; break;
+    case Reg::CR8: m_cr8 = v & 0xF; break;
+    case Reg::EFER: m_efer = v; break;
+    case Reg::DR0: m_dr[0] = v; break;
+    case Reg::DR1: m_dr[1] = v; break;
+    case Reg::DR2: m_dr[2] = v; break;
+    case Reg::DR3: m_dr[3] = v; break;
+    case Reg::DR6: m_dr[6] = v; break;
+    case Reg::DR7: m_dr[7] = v; break;
+    default: return VPOperationStatus::InvalidRegister;
+    }
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus ReferenceCPU::RegRead(const Reg regs[], RegValue values[], const size_t numRegs) noexcept {
+    for (size_t i = 0; i < numRegs; i++) {
+        const auto status = RegRead(regs[i], values[i]);
+        if (status != VPOperationStatus::OK) {
+            return status;
+        }
+    }
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus ReferenceCPU::RegWrite(const Reg regs[], const RegValue values[], const size_t numRegs) noexcept {
+    for (size_t i = 0; i < numRegs; i++) {
+        const auto status = RegWrite(regs[i], values[i]);
+        if (status != VPOperationStatus::OK) {
+            return status;
+        }
+    }
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus ReferenceCPU::GetMSR(const uint64_t msr, uint64_t& value) noexcept {
+    return (msr <= 0xFFFFFFFF && ReadMSR((uint32_t)msr, value)) ? VPOperationStatus::OK : VPOperationStatus::Failed;
+}
+
+VPOperationStatus ReferenceCPU::SetMSR(const uint64_t msr, const uint64_t value) noexcept {
+    return (msr <= 0xFFFFFFFF && WriteMSR((uint32_t)msr, value)) ? VPOperationStatus::OK : VPOperationStatus::Failed;
+}
+
+// ----- Memory and I/O ---------------------------------------------------------------------------------------------------
+
+// Returns a host pointer to [address, address + size) if the whole range lies
+// in one mapped region (and the region is writable, for writes).
+uint8_t *ReferenceCPU::RamPointer(uint64_t address, size_t size, bool write) noexcept {
+    if (m_lastRegion < m_regions.size()) {
+        const Region& region = m_regions[m_lastRegion];
+        if (address >= region.base && address - region.base + size <= region.size) {
+            return (write && !region.writable) ? nullptr : region.memory + (address - region.base);
+        }
+    }
+    for (size_t i = 0; i < m_regions.size(); i++) {
+        const Region& region = m_regions[i];
+        if (address >= region.base && address - region.base + size <= region.size) {
+            m_lastRegion = i;
+            return (write && !region.writable) ? nullptr : region.memory + (address - region.base);
+        }
+    }
+    return nullptr;
+}
+
+// Reads a paging structure entry. Entries outside mapped memory read as not
+// present.
+uint64_t ReferenceCPU::ReadTableEntry(uint64_t address, size_t size) noexcept {
+    const uint8_t *ptr = RamPointer(address, size, false);
+    return (ptr != nullptr) ? readBytes(ptr, size) : 0;
+}
+
+void ReferenceCPU::PageFault(uint64_t linear) noexcept {
+    RaiseFault(vectorPF);
+    m_cr2 = linear;
+}
+
+// Translates a linear address through the 32-bit, PAE or 4-level paging
+// structures, raising a page fault if the page is not present.
+bool ReferenceCPU::Translate(uint64_t linear, uint64_t& physical) noexcept {
+    if (!(m_cr0 & cr0PG)) {
+        physical = linear;
+        return true;
+    }
+    if (!(m_cr4 & cr4PAE)) {
+        const uint32_t pde = (uint32_t)ReadTableEntry((m_cr3 & 0xFFFFF000) + ((linear >> 22) & 0x3FF) * 4, 4);
+        if (!(pde & 1)) {
+            PageFault(linear);
+            return false;
+        }
+        if ((pde & 0x80) && (m_cr4 & cr4PSE)) {
+            physical = (pde & 0xFFC00000) | (linear & 0x3FFFFF);
+            return true;
+        }
+        const uint32_t pte = (uint32_t)ReadTableEntry((pde & ~0xFFFu) + ((linear >> 12) & 0x3FF) * 4, 4);
+        if (!(pte & 1)) {
+            PageFault(linear);
+            return false;
+        }
+        physical = (pte & ~0xFFFu) | (linear & 0xFFF);
+        return true;
+    }
+
+    uint64_t pdpte;
+    if (LongModeActive()) {
+        const uint64_t pml4e = ReadTableEntry((m_cr3 & pageAddressMask) + ((linear >> 39) & 0x1FF) * 8, 8);
+        if (!(pml4e & 1)) {
+            PageFault(linear);
+            return false;
+        }
+        pdpte = ReadTableEntry((pml4e & pageAddressMask) + ((linear >> 30) & 0x1FF) * 8, 8);
+        if ((pdpte & 1) && (pdpte & 0x80)) {
+            physical = (pdpte & pageAddressMask & ~0x3FFFFFFFull) | (linear & 0x3FFFFFFF);
+            return true;
+        }
+    }
+    else {
+        // The four PAE PDPTEs are 32-byte aligned
+        pdpte = ReadTableEntry((m_cr3 & 0xFFFFFFE0) + ((linear >> 30) & 3) * 8, 8);
+    }
+    if (!(pdpte & 1)) {
+        PageFault(linear);
+        return false;
+    }
+    const uint64_t pde = ReadTableEntry((pdpte & pageAddressMask) + ((linear >> 21) & 0x1FF) * 8, 8);
+    if (!(pde & 1)) {
+        PageFault(linear);
+        return false;
+    }
+    if (pde & 0x80) {
+        physical = (pde & pageAddressMask & ~0x1FFFFFull) | (linear & 0x1FFFFF);
+        return true;
+    }
+    const uint64_t pte = ReadTableEntry((pde & pageAddressMask) + ((linear >> 12) & 0x1FF) * 8, 8);
+    if (!(pte & 1)) {
+        PageFault(linear);
+        return false;
+    }
+    physical = (pte & pageAddressMask) | (linear & 0xFFF);
+    return true;
+}
+
+uint64_t ReferenceCPU::ReadPhysical(uint64_t address, size_t size) noexcept {
+    const uint8_t *ptr = RamPointer(address, size, false);
+    if (ptr != nullptr) {
+        return readBytes(ptr, size);
+    }
+    m_mmioAccess = true;
+    return (m_mmioRead != nullptr) ? m_mmioRead(m_ioContext, address, size) & sizeMask(size) : sizeMask(size);
+}
+
+void ReferenceCPU::WritePhysical(uint64_t address, size_t size, uint64_t value) noexcept {
+    uint8_t *ptr = RamPointer(address, size, true);
+    if (ptr != nullptr) {
+        memcpy(ptr, &value, size);
+        if (!m_codePages.empty()) {
+            const uint64_t page = address & ~(uint64_t)(PAGE_SIZE - 1);
+            InvalidatePage(page);
+            if (((address + size - 1) & ~(uint64_t)(PAGE_SIZE - 1)) != page) {
+                InvalidatePage(page + PAGE_SIZE);
+            }
+        }
+        return;
+    }
+    m_mmioAccess = true;
+    if (m_mmioWrite != nullptr) {
+        m_mmioWrite(m_ioContext, address, size, value & sizeMask(size));
+    }
+}
+
+uint64_t ReferenceCPU::ReadLinear(uint64_t address, size_t size) noexcept {
+    if (m_fault) {
+        return 0;
+    }
+    if ((address & (PAGE_SIZE - 1)) + size > PAGE_SIZE) {
+        // Accesses that cross a page boundary are split into bytes
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            value |= ReadLinear(address + i, 1) << (i * 8);
+        }
+        return value;
+    }
+    uint64_t physical;
+    if (!Translate(address, physical)) {
+        return 0;
+    }
+    CheckDataBreakpoints(address, size, false);
+    return ReadPhysical(physical, size);
+}
+
+void ReferenceCPU::WriteLinear(uint64_t address, size_t size, uint64_t value) noexcept {
+    if (m_fault) {
+        return;
+    }
+    if ((address & (PAGE_SIZE - 1)) + size > PAGE_SIZE) {
+        // Translate both pages first so that a fault leaves memory untouched
+        uint64_t physical;
+        if (!Translate(address, physical) || !Translate(address + size - 1, physical)) {
+            return;
+        }
+        for (size_t i = 0; i < size; i++) {
+            WriteLinear(address + i, 1, value >> (i * 8));
+        }
+        return;
+    }
+    uint64_t physical;
+    if (Translate(address, physical)) {
+        CheckDataBreakpoints(address, size, true);
+        WritePhysical(physical, size, value);
+    }
+}
+
+// Returns the DR6 B0-B3 bits of the enabled instruction breakpoints at the
+// linear address
+uint8_t ReferenceCPU::ExecutionBreakpointHits(uint64_t linear) const noexcept {
+    uint8_t hits = 0;
+    for (int i = 0; i < 4; i++) {
+        const bool enabled = ((m_dr[7] >> (i * 2)) & 3) != 0;
+        const uint64_t trigger = (m_dr[7] >> (16 + i * 4)) & 3;
+        if (enabled && trigger == 0b00 && m_dr[i] == linear) {
+            hits |= 1 << i;
+        }
+    }
+    return hits;
+}
+
+// Records the data breakpoints the access hits. The breakpoint's range is
+// aligned to its length, like on hardware.
+void ReferenceCPU::CheckDataBreakpoints(uint64_t linear, size_t size, bool write) noexcept {
+    if ((m_dr[7] & dr7EnableMask) == 0) {
+        return;
+    }
+    static const uint64_t lengths[] = { 1, 2, 8, 4 };
+    for (int i = 0; i < 4; i++) {
+        const bool enabled = ((m_dr[7] >> (i * 2)) & 3) != 0;
+        const uint64_t trigger = (m_dr[7] >> (16 + i * 4)) & 3;
+        if (!enabled || (trigger != 0b11 && !(trigger == 0b01 && write))) {
+            continue;
+        }
+        const uint64_t length = lengths[(m_dr[7] >> (18 + i * 4)) & 3];
+        const uint64_t start = m_dr[i] & ~(length - 1);
+        if (linear < start + length && start < linear + size) {
+            m_dataBreakpointHits |= 1 << i;
+        }
+    }
+}
+
+// Converts a segment offset into a linear address. In 64-bit mode only FS and
+// GS have a base; elsewhere addresses wrap at 4 GiB.
+uint64_t ReferenceCPU::Linear(unsigned segment, uint64_t offset) const noexcept {
+    if (CodeMode() == X86Mode::Bits64) {
+        return (segment == segFS || segment == segGS) ? m_seg[segment].base + offset : offset;
+    }
+    return (uint32_t)(m_seg[segment].base + offset);
+}
+
+uint64_t ReferenceCPU::Read(unsigned segment, uint64_t offset, size_t size) noexcept {
+    return ReadLinear(Linear(segment, offset), size);
+}
+
+void ReferenceCPU::Write(unsigned segment, uint64_t offset, size_t size, uint64_t value) noexcept {
+    WriteLinear(Linear(segment, offset), size, value);
+}
+
+void ReferenceCPU::ComputeEffectiveAddress(const X86Instruction& insn, const uint8_t *bytes) noexcept {
+    m_ea = 0;
+    m_eaSegment = segDS;
+    const uint8_t mod = insn.modrm >> 6;
+    if (!insn.hasModRM || mod == 3 || (insn.opcodeMap == 1 && insn.opcode >= 0x20 && insn.opcode <= 0x27)) {
+        return;
+    }
+    const uint8_t rm = insn.modrm & 7;
+    const uint64_t disp = (uint64_t)signExtend(readBytes(&bytes[insn.dispOffset], insn.dispSize), insn.dispSize);
+    unsigned defaultSegment = segDS;
+    if (insn.addressSize == 2) {
+        uint64_t ea;
+        switch (rm) {
+        case 0: ea = m_gpr[regEBX] + m_gpr[regESI]; break;
+        case 1: ea = m_gpr[regEBX] + m_gpr[regEDI]; break;
+        case 2: ea = m_gpr[regEBP] + m_gpr[regESI]; defaultSegment = segSS; break;
+        case 3: ea = m_gpr[regEBP] + m_gpr[regEDI]; defaultSegment = segSS; break;
+        case 4: ea = m_gpr[regESI]; break;
+        case 5: ea = m_gpr[regEDI]; break;
+        case 6:
+            if (mod == 0) {
+                ea = 0;
+            }
+            else {
+                ea = m_gpr[regEBP];
+                defaultSegment = segSS;
+            }
+            break;
+        default: ea = m_gpr[regEBX]; break;
+        }
+        m_ea = (ea + disp) & 0xFFFF;
+    }
+    else {
+        // REX.X extends the SIB index, REX.B the SIB base or ModR/M register
+        const unsigned rexX = (insn.rex & 2) << 2;
+        const unsigned rexB = (insn.rex & 1) << 3;
+        uint64_t ea = disp;
+        if (insn.hasSIB) {
+            const uint8_t scale = insn.sib >> 6;
+            const unsigned index = ((insn.sib >> 3) & 7) | rexX;
+            const unsigned base = (insn.sib & 7) | rexB;
+            if (index != regESP) {
+                ea += m_gpr[index] << scale;
+            }
+            if ((base & 7) == regEBP && mod == 0) {
+                // Displacement only
+            }
+            else {
+                ea += m_gpr[base];
+                if (base == regESP || base == regEBP) {
+                    defaultSegment = segSS;
+                }
+            }
+        }
+        else if (rm == regEBP && mod == 0) {
+            // Displacement only, or relative to the next instruction in 64-bit mode
+            if (CodeMode() == X86Mode::Bits64) {
+                ea += m_nextRip;
+            }
+        }
+        else {
+            ea += m_gpr[rm | rexB];
+            if ((rm | rexB) == regEBP) {
+                defaultSegment = segSS;
+            }
+        }
+        m_ea = (insn.addressSize == 4) ? (ea & 0xFFFFFFFF) : ea;
+    }
+    m_eaSegment = segmentFromPrefix(insn.segment, defaultSegment);
+}
+
+uint64_t ReferenceCPU::ReadRM(const X86Instruction& insn, size_t size) noexcept {
+    if ((insn.modrm >> 6) == 3) {
+        return GetReg((insn.modrm & 7) | ((insn.rex & 1) << 3), size);
+    }
+    return Read(m_eaSegment, m_ea, size);
+}
+
+void ReferenceCPU::WriteRM(const X86Instruction& insn, size_t size, uint64_t value) noexcept {
+    if ((insn.modrm >> 6) == 3) {
+        SetReg((insn.modrm & 7) | ((insn.rex & 1) << 3), size, value);
+        return;
+    }
+    Write(m_eaSegment, m_ea, size, value);
+}
+
+void ReferenceCPU::Push(uint64_t value, size_t size) noexcept {
+    const size_t stackSize = StackSize();
+    const uint64_t sp = (GetReg(regESP, stackSize) - size) & sizeMask(stackSize);
+    Write(segSS, sp, size, value);
+    if (!m_fault) {
+        SetReg(regESP, stackSize, sp);
+    }
+}
+
+uint64_t ReferenceCPU::Pop(size_t size) noexcept {
+    const size_t stackSize = StackSize();
+    const uint64_t sp = GetReg(regESP, stackSize);
+    const uint64_t value = Read(segSS, sp, size);
+    if (!m_fault) {
+        SetReg(regESP, stackSize, sp + size);
+    }
+    return value;
+}
+
+uint32_t ReferenceCPU::PortRead(uint16_t port, size_t size) noexcept {
+    m_pioAccess = true;
+    const uint32_t mask = (uint32_t)sizeMask(size);
+    return (m_ioRead != nullptr) ? m_ioRead(m_ioContext, port, size) & mask : mask;
+}
+
+void ReferenceCPU::PortWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    m_pioAccess = true;
+    if (m_ioWrite != nullptr) {
+        m_ioWrite(m_ioContext, port, size, value & (uint32_t)sizeMask(size));
+    }
+}
+
+bool ReferenceCPU::LinearToPhysical(const uint64_t address, uint64_t *physical) noexcept {
+    const bool fault = m_fault;
+    const uint64_t cr2 = m_cr2;
+    const bool ok = Translate(address, *physical);
+    m_fault = fault;
+    m_cr2 = cr2;
+    return ok;
+}
+
+bool ReferenceCPU::LMemRead(const uint64_t address, const size_t size, void *buffer) noexcept {
+    uint8_t *out = (uint8_t *)buffer;
+    for (size_t i = 0; i < size; i++) {
+        uint64_t physical;
+        if (!LinearToPhysical(address + i, &physical)) {
+            return false;
+        }
+        const uint8_t *ptr = RamPointer(physical, 1, false);
+        if (ptr == nullptr) {
+            return false;
+        }
+        out[i] = *ptr;
+    }
+    return true;
+}
+
+bool ReferenceCPU::LMemWrite(const uint64_t address, const size_t size, const void *buffer) noexcept {
+    const uint8_t *in = (const uint8_t *)buffer;
+    for (size_t i = 0; i < size; i++) {
+        uint64_t physical;
+        if (!LinearToPhysical(address + i, &physical)) {
+            return false;
+        }
+        uint8_t *ptr = RamPointer(physical, 1, false);
+        if (ptr == nullptr) {
+            return false;
+        }
+        *ptr = in[i];
+        InvalidatePage(physical & ~(uint64_t)(PAGE_SIZE - 1));
+    }
+    return true;
+}
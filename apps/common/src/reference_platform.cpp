@@ -0,0 +1,238 @@
+/*
+Defines a virt86 platform backed by the software x86 interpreter, so the
+demos can run without a hypervisor.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "reference_platform.hpp"
+
+using namespace virt86;
+
+Platform& ReferencePlatform::Instance() noexcept {
+    static ReferencePlatform instance;
+    return instance;
+}
+
+ReferencePlatform::ReferencePlatform() noexcept
+    : Platform("Reference interpreter")
+{
+    m_version = "1.0.0";
+
+    m_features.maxProcessorsPerVM = 64;
+    m_features.maxProcessorsGlobal = 64;
+    m_features.guestPhysicalAddress.maxBits = 36;
+    m_features.guestPhysicalAddress.maxAddress = (1ull << 36) - 1;
+    m_features.guestPhysicalAddress.mask = (1ull << 36) - 1;
+    m_features.unrestrictedGuest = true;
+    m_features.extendedPageTables = false;
+    m_features.guestDebugging = true;
+    m_features.guestMemoryProtection = false;
+    m_features.dirtyPageTracking = false;
+    m_features.partialDirtyBitmap = false;
+    m_features.largeMemoryAllocation = true;
+    m_features.memoryAliasing = false;
+    m_features.memoryUnmapping = true;
+    m_features.partialUnmapping = false;
+    m_features.partialMMIOInstructions = false;
+    m_features.guestTSCScaling = false;
+    m_features.customCPUIDs = false;
+    m_features.floatingPointExtensions = FloatingPointExtension::None;
+    m_features.extendedControlRegisters = ExtendedControlRegister::CR8;
+    m_features.extendedVMExits = ExtendedVMExit::CPUID;
+
+    m_initStatus = PlatformInitStatus::OK;
+}
+
+std::unique_ptr<VirtualMachine> ReferencePlatform::CreateVMImpl(const VMSpecifications& specifications) {
+    return std::make_unique<ReferenceVirtualMachine>(*this, specifications);
+}
+
+// ----- Virtual machine --------------------------------------------------------------------------------------------------
+
+ReferenceVirtualMachine::ReferenceVirtualMachine(ReferencePlatform& platform, const VMSpecifications& specifications) noexcept
+    : VirtualMachine(platform, specifications)
+{
+    for (size_t i = 0; i < specifications.numProcessors; i++) {
+        m_vps.push_back(std::make_unique<ReferenceVirtualProcessor>(*this));
+    }
+}
+
+MemoryMappingStatus ReferenceVirtualMachine::MapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags, void *memory) noexcept {
+    for (size_t i = 0; i < m_vps.size(); i++) {
+        if (!static_cast<ReferenceVirtualProcessor&>(*m_vps[i]).CPU().MapGuestMemory(baseAddress, size, flags, memory)) {
+            // Undo the mappings made so far
+            for (size_t j = 0; j < i; j++) {
+                static_cast<ReferenceVirtualProcessor&>(*m_vps[j]).CPU().UnmapGuestMemory(baseAddress, size);
+            }
+            return MemoryMappingStatus::AlreadyAllocated;
+        }
+    }
+    return MemoryMappingStatus::OK;
+}
+
+MemoryMappingStatus ReferenceVirtualMachine::UnmapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size) noexcept {
+    bool unmapped = true;
+    for (auto& vp : m_vps) {
+        unmapped &= static_cast<ReferenceVirtualProcessor&>(*vp).CPU().UnmapGuestMemory(baseAddress, size);
+    }
+    return unmapped ? MemoryMappingStatus::OK : MemoryMappingStatus::Failed;
+}
+
+uint32_t ReferenceVirtualMachine::ioReadCallback(void *context, uint16_t port, size_t size) noexcept {
+    return ((ReferenceVirtualMachine *)context)->IORead(port, size);
+}
+
+void ReferenceVirtualMachine::ioWriteCallback(void *context, uint16_t port, size_t size, uint32_t value) noexcept {
+    ((ReferenceVirtualMachine *)context)->IOWrite(port, size, value);
+}
+
+uint64_t ReferenceVirtualMachine::mmioReadCallback(void *context, uint64_t address, size_t size) noexcept {
+    return ((ReferenceVirtualMachine *)context)->MMIORead(address, size);
+}
+
+void ReferenceVirtualMachine::mmioWriteCallback(void *context, uint64_t address, size_t size, uint64_t value) noexcept {
+    ((ReferenceVirtualMachine *)context)->MMIOWrite(address, size, value);
+}
+
+// ----- Virtual processor ------------------------------------------------------------------------------------------------
+
+ReferenceVirtualProcessor::ReferenceVirtualProcessor(ReferenceVirtualMachine& vm) noexcept
+    : VirtualProcessor(vm)
+{
+    m_cpu.RegisterIOContext(&vm);
+    m_cpu.RegisterIOReadCallback(ReferenceVirtualMachine::ioReadCallback);
+    m_cpu.RegisterIOWriteCallback(ReferenceVirtualMachine::ioWriteCallback);
+    m_cpu.RegisterMMIOReadCallback(ReferenceVirtualMachine::mmioReadCallback);
+    m_cpu.RegisterMMIOWriteCallback(ReferenceVirtualMachine::mmioWriteCallback);
+
+    const auto& specifications = vm.GetSpecifications();
+    if (BitmaskEnum(specifications.extendedVMExits).AnyOf(ExtendedVMExit::CPUID)) {
+        m_cpu.SetCPUIDExits(specifications.vmExitCPUIDFunctions);
+    }
+}
+
+VPExecutionStatus ReferenceVirtualProcessor::RunImpl() noexcept {
+    const auto status = m_cpu.Run();
+    UpdateExitInfo();
+    return status;
+}
+
+VPExecutionStatus ReferenceVirtualProcessor::StepImpl() noexcept {
+    const auto status = m_cpu.Step();
+    UpdateExitInfo();
+    return status;
+}
+
+void ReferenceVirtualProcessor::UpdateExitInfo() noexcept {
+    m_exitInfo = m_cpu.GetVMExitInfo();
+    if (m_exitInfo.reason == VMExitReason::SoftwareBreakpoint) {
+        RegValue rip;
+        m_cpu.RegRead(Reg::RIP, rip);
+        m_breakpointAddress = rip.u64;
+    }
+}
+
+// The interpreter queues interrupts and delivers them once IF allows, so they
+// can always be injected.
+bool ReferenceVirtualProcessor::PrepareInterrupt(uint8_t vector) noexcept {
+    return true;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::InjectInterrupt(uint8_t vector) noexcept {
+    return m_cpu.EnqueueInterrupt(vector) ? VPOperationStatus::OK : VPOperationStatus::Failed;
+}
+
+bool ReferenceVirtualProcessor::CanInjectInterrupt() const noexcept {
+    return true;
+}
+
+void ReferenceVirtualProcessor::RequestInterruptWindow() noexcept {
+}
+
+VPOperationStatus ReferenceVirtualProcessor::RegRead(const Reg reg, RegValue& value) noexcept {
+    return m_cpu.RegRead(reg, value);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::RegWrite(const Reg reg, const RegValue& value) noexcept {
+    return m_cpu.RegWrite(reg, value);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::RegRead(const Reg regs[], RegValue values[], const size_t numRegs) noexcept {
+    return m_cpu.RegRead(regs, values, numRegs);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::RegWrite(const Reg regs[], const RegValue values[], const size_t numRegs) noexcept {
+    return m_cpu.RegWrite(regs, values, numRegs);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::GetFPUControl(FPUControl& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::SetFPUControl(const FPUControl& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::GetMXCSR(MXCSR& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::SetMXCSR(const MXCSR& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::GetMXCSRMask(MXCSR& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::SetMXCSRMask(const MXCSR& value) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus ReferenceVirtualProcessor::GetMSR(const uint64_t msr, uint64_t& value) noexcept {
+    return m_cpu.GetMSR(msr, value);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::SetMSR(const uint64_t msr, const uint64_t value) noexcept {
+    return m_cpu.SetMSR(msr, value);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::EnableSoftwareBreakpoints(bool enable) noexcept {
+    return m_cpu.EnableSoftwareBreakpoints(enable);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::SetHardwareBreakpoints(HardwareBreakpoints breakpoints) noexcept {
+    return m_cpu.SetHardwareBreakpoints(breakpoints);
+}
+
+VPOperationStatus ReferenceVirtualProcessor::ClearHardwareBreakpoints() noexcept {
+    return m_cpu.ClearHardwareBreakpoints();
+}
+
+VPOperationStatus ReferenceVirtualProcessor::GetBreakpointAddress(uint64_t *address) const noexcept {
+    if (m_exitInfo.reason != VMExitReason::SoftwareBreakpoint) {
+        return VPOperationStatus::BreakpointNeverHit;
+    }
+    *address = m_breakpointAddress;
+    return VPOperationStatus::OK;
+}
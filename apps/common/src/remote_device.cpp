@@ -0,0 +1,379 @@
+/*
+Implements a protocol that forwards I/O and MMIO accesses to a device model
+running in another process through shared-memory rings.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "remote_device.hpp"
+
+#if defined(__linux__)
+
+#include "event_loop.hpp"
+#include "unix_socket.hpp"
+
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+// ----- Shared memory layout -------------------------------------------------------------------------------------------------
+
+static const uint32_t remoteRingsMagic = 0x56454452;  // 'RDEV'
+static const uint32_t remoteRingEntries = 256;
+
+enum class RemoteRequestType : uint8_t {
+    PIORead,
+    PIOWrite,
+    MMIORead,
+    MMIOWrite,
+};
+
+struct RemoteRequest {
+    uint32_t seq;
+    RemoteRequestType type;
+    uint8_t size;
+    uint16_t reserved;
+    uint64_t address;  // Port or guest physical address
+    uint64_t value;    // Value to write
+};
+
+// Only reads have a response
+struct RemoteResponse {
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t value;
+};
+
+// A single-producer, single-consumer ring. The indices are free-running and
+// each lives on its own cache line so that the two processes do not bounce a
+// line back and forth on every access.
+template<typename T>
+struct RemoteRing {
+    alignas(64) std::atomic<uint32_t> head;             // Next entry to consume; written by the consumer
+    alignas(64) std::atomic<uint32_t> tail;             // Next entry to produce; written by the producer
+    alignas(64) std::atomic<uint32_t> consumerWaiting;  // Set while the consumer is blocked on the doorbell
+    alignas(64) T entries[remoteRingEntries];
+};
+
+struct RemoteRings {
+    uint32_t magic;
+    RemoteRing<RemoteRequest> requests;
+    RemoteRing<RemoteResponse> responses;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Ring indices must be lock-free to be shared between processes");
+
+// ----- Ring operations ------------------------------------------------------------------------------------------------------
+
+template<typename T>
+static bool ringEmpty(RemoteRing<T>& ring) noexcept {
+    return ring.tail.load(std::memory_order_seq_cst) == ring.head.load(std::memory_order_relaxed);
+}
+
+template<typename T>
+static bool ringPush(RemoteRing<T>& ring, const T& entry, int doorbell) noexcept {
+    const uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == remoteRingEntries) {
+        return false;
+    }
+    ring.entries[tail % remoteRingEntries] = entry;
+
+    // The consumer sets its waiting flag before checking the ring one last
+    // time, so either it sees this entry or we see the flag
+    ring.tail.store(tail + 1, std::memory_order_seq_cst);
+    if (ring.consumerWaiting.load(std::memory_order_seq_cst)) {
+        signalEventFD(doorbell);
+    }
+    return true;
+}
+
+template<typename T>
+static bool ringPop(RemoteRing<T>& ring, T& entry) noexcept {
+    const uint32_t head = ring.head.load(std::memory_order_relaxed);
+    if (ring.tail.load(std::memory_order_acquire) == head) {
+        return false;
+    }
+    entry = ring.entries[head % remoteRingEntries];
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+static bool peerHungUp(int sock) noexcept {
+    pollfd pfd = { sock, POLLRDHUP, 0 };
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// Waits for an entry to be consumed from the ring. Returns false if the peer
+// hung up first.
+template<typename T>
+static bool ringWait(RemoteRing<T>& ring, int doorbell, int sock, AdaptiveSpinner& spinner, RemoteDeviceStats& stats) noexcept {
+    if (spinner.Spin([&] { return !ringEmpty(ring); })) {
+        stats.spinWaits++;
+        return true;
+    }
+
+    stats.blockWaits++;
+    spinner.Blocked();
+    for (;;) {
+        ring.consumerWaiting.store(1, std::memory_order_seq_cst);
+        if (!ringEmpty(ring)) {
+            ring.consumerWaiting.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        // No data is ever sent over the socket after the handshake, so any
+        // event on it means the peer closed it or exited
+        pollfd pfds[2] = {
+            { doorbell, POLLIN, 0 },
+            { sock, POLLRDHUP, 0 },
+        };
+        const int result = poll(pfds, 2, -1);
+        ring.consumerWaiting.store(0, std::memory_order_relaxed);
+        if (result < 0) {
+            continue;
+        }
+        if (pfds[0].revents & POLLIN) {
+            drainEventFD(doorbell);
+        }
+        if (!ringEmpty(ring)) {
+            return true;
+        }
+        if (pfds[1].revents != 0) {
+            return false;
+        }
+    }
+}
+
+// Pushes an entry, waiting for the consumer to make room if the ring is full.
+// Returns false if the peer hung up first.
+template<typename T>
+static bool ringPushWait(RemoteRing<T>& ring, const T& entry, int doorbell, int sock) noexcept {
+    for (uint32_t attempt = 1; !ringPush(ring, entry, doorbell); attempt++) {
+        // The consumer is awake if the ring is full, so it is making progress
+        if (attempt % 1024 == 0 && peerHungUp(sock)) {
+            return false;
+        }
+        sched_yield();
+    }
+    return true;
+}
+
+// Spinning only helps if the peer can run at the same time
+static AdaptiveSpinner makeSpinner() noexcept {
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return AdaptiveSpinner(0, 0);
+    }
+    return AdaptiveSpinner();
+}
+
+// ----- Virtual machine side -------------------------------------------------------------------------------------------------
+
+RemoteIODevice::~RemoteIODevice() noexcept {
+    if (m_rings != nullptr) {
+        m_memory.Unmap(m_rings);
+    }
+    if (m_requestFD >= 0) {
+        close(m_requestFD);
+    }
+    if (m_responseFD >= 0) {
+        close(m_responseFD);
+    }
+}
+
+bool RemoteIODevice::Connect(int sock) noexcept {
+    if (m_rings != nullptr) {
+        return false;
+    }
+    if (!m_memory.Create(sizeof(RemoteRings), "virt86-remote-device")) {
+        return false;
+    }
+    uint8_t *memory = m_memory.MapShared();
+    if (memory == nullptr) {
+        return false;
+    }
+    m_rings = new (memory) RemoteRings();
+    m_rings->magic = remoteRingsMagic;
+    m_memory.Seal();
+
+    m_requestFD = createEventFD();
+    m_responseFD = createEventFD();
+    if (m_requestFD < 0 || m_responseFD < 0) {
+        return false;
+    }
+
+    // The rings go first, followed by the doorbells
+    const int fds[2] = { m_requestFD, m_responseFD };
+    if (!m_memory.SendTo(sock) || !sendWithFDs(sock, &remoteRingsMagic, sizeof(remoteRingsMagic), fds, 2)) {
+        return false;
+    }
+    m_sock = sock;
+    m_spinner = makeSpinner();
+    m_alive = true;
+    return true;
+}
+
+bool RemoteIODevice::Post(uint8_t type, uint8_t size, uint64_t address, uint64_t value, uint32_t& seq) noexcept {
+    if (!m_alive) {
+        return false;
+    }
+    RemoteRequest request = { 0 };
+    request.seq = seq = m_nextSeq++;
+    request.type = (RemoteRequestType)type;
+    request.size = size;
+    request.address = address;
+    request.value = value;
+    if (!ringPushWait(m_rings->requests, request, m_requestFD, m_sock)) {
+        m_alive = false;
+        return false;
+    }
+    m_stats.requests++;
+    return true;
+}
+
+bool RemoteIODevice::Complete(uint32_t seq, uint64_t& value) noexcept {
+    RemoteResponse response;
+    while (!ringPop(m_rings->responses, response)) {
+        if (!ringWait(m_rings->responses, m_responseFD, m_sock, m_spinner, m_stats)) {
+            m_alive = false;
+            return false;
+        }
+    }
+    // Requests are served in order and only reads are answered, so the
+    // response must be for the one read in flight
+    if (response.seq != seq) {
+        m_alive = false;
+        return false;
+    }
+    value = response.value;
+    return true;
+}
+
+uint32_t RemoteIODevice::IORead(uint16_t port, size_t size) noexcept {
+    uint32_t seq;
+    uint64_t value;
+    if (!Post((uint8_t)RemoteRequestType::PIORead, (uint8_t)size, port, 0, seq) || !Complete(seq, value)) {
+        return 0xFFFFFFFF;
+    }
+    return (uint32_t)value;
+}
+
+void RemoteIODevice::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    uint32_t seq;
+    Post((uint8_t)RemoteRequestType::PIOWrite, (uint8_t)size, port, value, seq);
+}
+
+uint64_t RemoteIODevice::MMIORead(uint64_t address, size_t size) noexcept {
+    uint32_t seq;
+    uint64_t value;
+    if (!Post((uint8_t)RemoteRequestType::MMIORead, (uint8_t)size, address, 0, seq) || !Complete(seq, value)) {
+        return ~0ull;
+    }
+    return value;
+}
+
+void RemoteIODevice::MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept {
+    uint32_t seq;
+    Post((uint8_t)RemoteRequestType::MMIOWrite, (uint8_t)size, address, value, seq);
+}
+
+// ----- Device side ----------------------------------------------------------------------------------------------------------
+
+RemoteDeviceServer::~RemoteDeviceServer() noexcept {
+    if (m_rings != nullptr) {
+        m_memory.Unmap(m_rings);
+    }
+    if (m_requestFD >= 0) {
+        close(m_requestFD);
+    }
+    if (m_responseFD >= 0) {
+        close(m_responseFD);
+    }
+}
+
+bool RemoteDeviceServer::Connect(int sock) noexcept {
+    if (m_rings != nullptr) {
+        return false;
+    }
+    if (!m_memory.ReceiveFrom(sock) || m_memory.Size() < sizeof(RemoteRings)) {
+        return false;
+    }
+    uint32_t magic;
+    int fds[2];
+    if (!receiveWithFDs(sock, &magic, sizeof(magic), fds, 2)) {
+        return false;
+    }
+    m_requestFD = fds[0];
+    m_responseFD = fds[1];
+    if (magic != remoteRingsMagic) {
+        return false;
+    }
+    m_rings = (RemoteRings *)m_memory.MapShared();
+    if (m_rings == nullptr || m_rings->magic != remoteRingsMagic) {
+        return false;
+    }
+    m_sock = sock;
+    m_spinner = makeSpinner();
+    return true;
+}
+
+void RemoteDeviceServer::Serve(IODevice& device) noexcept {
+    if (m_rings == nullptr) {
+        return;
+    }
+    for (;;) {
+        RemoteRequest request;
+        if (!ringPop(m_rings->requests, request)) {
+            if (!ringWait(m_rings->requests, m_requestFD, m_sock, m_spinner, m_stats)) {
+                return;
+            }
+            continue;
+        }
+        m_stats.requests++;
+
+        RemoteResponse response = { 0 };
+        response.seq = request.seq;
+        switch (request.type) {
+        case RemoteRequestType::PIORead:
+            response.value = device.IORead((uint16_t)request.address, request.size);
+            break;
+        case RemoteRequestType::PIOWrite:
+            device.IOWrite((uint16_t)request.address, request.size, (uint32_t)request.value);
+            continue;
+        case RemoteRequestType::MMIORead:
+            response.value = device.MMIORead(request.address, request.size);
+            break;
+        case RemoteRequestType::MMIOWrite:
+            device.MMIOWrite(request.address, request.size, request.value);
+            continue;
+        default:
+            return;
+        }
+        if (!ringPushWait(m_rings->responses, response, m_responseFD, m_sock)) {
+            return;
+        }
+    }
+}
+
+#endif
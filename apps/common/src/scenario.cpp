@@ -0,0 +1,451 @@
+/*
+Defines a declarative test scenario engine that runs independent scenarios
+in parallel, each on its own virtual machine.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "scenario.hpp"
+#include "align_alloc.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+// Platforms are not required to support creating and destroying virtual
+// machines concurrently
+static std::mutex vmLifecycleMutex;
+
+static const char *regName(Reg reg) noexcept {
+    switch (reg) {
+    case Reg::EAX: return "EAX";
+    case Reg::ECX: return "ECX";
+    case Reg::EDX: return "EDX";
+    case Reg::EBX: return "EBX";
+    case Reg::ESP: return "ESP";
+    case Reg::EBP: return "EBP";
+    case Reg::ESI: return "ESI";
+    case Reg::EDI: return "EDI";
+    case Reg::EIP: return "EIP";
+    case Reg::EFLAGS: return "EFLAGS";
+    case Reg::RAX: return "RAX";
+    case Reg::RCX: return "RCX";
+    case Reg::RDX: return "RDX";
+    case Reg::RBX: return "RBX";
+    case Reg::RSP: return "RSP";
+    case Reg::RBP: return "RBP";
+    case Reg::RSI: return "RSI";
+    case Reg::RDI: return "RDI";
+    case Reg::RIP: return "RIP";
+    case Reg::RFLAGS: return "RFLAGS";
+    case Reg::CS: return "CS";
+    case Reg::SS: return "SS";
+    case Reg::DS: return "DS";
+    case Reg::ES: return "ES";
+    case Reg::FS: return "FS";
+    case Reg::GS: return "GS";
+    case Reg::CR0: return "CR0";
+    case Reg::CR2: return "CR2";
+    case Reg::CR3: return "CR3";
+    case Reg::CR4: return "CR4";
+    default: return "register";
+    }
+}
+
+static std::string format(const char *fmt, ...) noexcept {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+// Adapts read and write functions to the I/O bus.
+class FunctionDevice : public IODevice {
+public:
+    FunctionDevice(ScenarioReadHandler read, ScenarioWriteHandler write) noexcept
+        : m_read(std::move(read))
+        , m_write(std::move(write))
+    {
+    }
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        return m_read ? (uint32_t)m_read(port, size) : 0xFFFFFFFF;
+    }
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        if (m_write) {
+            m_write(port, size, value);
+        }
+    }
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override {
+        return m_read ? m_read(address, size) : ~0ull;
+    }
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept override {
+        if (m_write) {
+            m_write(address, size, value);
+        }
+    }
+
+private:
+    ScenarioReadHandler m_read;
+    ScenarioWriteHandler m_write;
+};
+
+uint8_t *ScenarioContext::HostPointer(uint64_t address, size_t size) noexcept {
+    for (auto& region : regions) {
+        if (address >= region.base && address - region.base + size <= region.size) {
+            return region.memory + (address - region.base);
+        }
+    }
+    return nullptr;
+}
+
+// ----- Scenario builder -------------------------------------------------------------------------------------------------
+
+Scenario& Scenario::Require(std::string what, std::function<bool(const PlatformFeatures&)> predicate) {
+    m_requirements.emplace_back(std::move(what), std::move(predicate));
+    return *this;
+}
+
+Scenario& Scenario::Specs(std::function<void(VMSpecifications&)> setup) {
+    m_specs.push_back(std::move(setup));
+    return *this;
+}
+
+Scenario& Scenario::Memory(uint64_t base, uint64_t size, MemoryFlags flags, std::function<void(uint8_t *)> init) {
+    m_memory.push_back(MemorySetup{ base, size, flags, std::move(init) });
+    return *this;
+}
+
+Scenario& Scenario::Run(VMExitReason expected) {
+    return Do(format("run, expecting %s", reason_str(expected)), [expected](ScenarioContext& ctx, std::string& error) {
+        if (ctx.vp.Run() != VPExecutionStatus::OK) {
+            error = "virtual processor failed to run";
+            return false;
+        }
+        const VMExitReason reason = ctx.vp.GetVMExitInfo().reason;
+        if (reason != expected) {
+            error = format("exited due to %s", reason_str(reason));
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::RunUntil(VMExitReason expected, size_t maxExits) {
+    return Do(format("run until %s", reason_str(expected)), [expected, maxExits](ScenarioContext& ctx, std::string& error) {
+        for (size_t i = 0; i < maxExits; i++) {
+            if (ctx.vp.Run() != VPExecutionStatus::OK) {
+                error = "virtual processor failed to run";
+                return false;
+            }
+            const VMExitReason reason = ctx.vp.GetVMExitInfo().reason;
+            if (reason == expected) {
+                return true;
+            }
+            if (reason != VMExitReason::PIO && reason != VMExitReason::MMIO) {
+                error = format("exited due to %s", reason_str(reason));
+                return false;
+            }
+        }
+        error = format("no %s within %zu exits", reason_str(expected), maxExits);
+        return false;
+    });
+}
+
+Scenario& Scenario::Step(size_t count) {
+    return Do(format("step %zu instruction%s", count, count == 1 ? "" : "s"), [count](ScenarioContext& ctx, std::string& error) {
+        for (size_t i = 0; i < count; i++) {
+            if (ctx.vp.Step() != VPExecutionStatus::OK) {
+                error = "virtual processor failed to step";
+                return false;
+            }
+            const VMExitReason reason = ctx.vp.GetVMExitInfo().reason;
+            if (reason != VMExitReason::Step) {
+                error = format("step %zu exited due to %s", i + 1, reason_str(reason));
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::SetReg(Reg reg, uint64_t value) {
+    return Do(format("set %s = 0x%" PRIx64, regName(reg), value), [reg, value](ScenarioContext& ctx, std::string& error) {
+        RegValue regValue;
+        regValue.u64 = value;
+        if (ctx.vp.RegWrite(reg, regValue) != VPOperationStatus::OK) {
+            error = "failed to write register";
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::ExpectReg(Reg reg, uint64_t value, size_t size) {
+    const uint64_t mask = (size >= 8) ? ~0ull : (1ull << (size * 8)) - 1;
+    return Do(format("expect %s = 0x%" PRIx64, regName(reg), value & mask), [reg, value, mask](ScenarioContext& ctx, std::string& error) {
+        RegValue regValue;
+        if (ctx.vp.RegRead(reg, regValue) != VPOperationStatus::OK) {
+            error = "failed to read register";
+            return false;
+        }
+        if ((regValue.u64 & mask) != (value & mask)) {
+            error = format("%s = 0x%" PRIx64, regName(reg), regValue.u64 & mask);
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::ExpectMemory(uint64_t address, std::vector<uint8_t> bytes) {
+    return Do(format("expect %zu bytes at 0x%" PRIx64, bytes.size(), address), [address, bytes](ScenarioContext& ctx, std::string& error) {
+        const uint8_t *memory = ctx.HostPointer(address, bytes.size());
+        if (memory == nullptr) {
+            error = "address is not backed by scenario memory";
+            return false;
+        }
+        for (size_t i = 0; i < bytes.size(); i++) {
+            if (memory[i] != bytes[i]) {
+                error = format("byte at 0x%" PRIx64 " = 0x%02x, expected 0x%02x", address + i, memory[i], bytes[i]);
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::ExpectMemory32(uint64_t address, uint32_t value) {
+    return Do(format("expect dword at 0x%" PRIx64 " = 0x%" PRIx32, address, value), [address, value](ScenarioContext& ctx, std::string& error) {
+        const uint8_t *memory = ctx.HostPointer(address, sizeof(uint32_t));
+        if (memory == nullptr) {
+            error = "address is not backed by scenario memory";
+            return false;
+        }
+        uint32_t actual;
+        memcpy(&actual, memory, sizeof(actual));
+        if (actual != value) {
+            error = format("dword at 0x%" PRIx64 " = 0x%" PRIx32, address, actual);
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::IOHandler(uint16_t basePort, uint32_t numPorts, ScenarioReadHandler read, ScenarioWriteHandler write) {
+    auto readFn = std::make_shared<ScenarioReadHandler>(std::move(read));
+    auto writeFn = std::make_shared<ScenarioWriteHandler>(std::move(write));
+    return Do(format("install I/O handler at ports 0x%x-0x%x", basePort, basePort + numPorts - 1), [=](ScenarioContext& ctx, std::string& error) {
+        ctx.devices.emplace_back(new FunctionDevice(*readFn, *writeFn));
+        if (!ctx.bus.AddPIODevice(basePort, numPorts, *ctx.devices.back())) {
+            error = "ports overlap another handler";
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::MMIOHandler(uint64_t baseAddress, uint64_t size, ScenarioReadHandler read, ScenarioWriteHandler write) {
+    auto readFn = std::make_shared<ScenarioReadHandler>(std::move(read));
+    auto writeFn = std::make_shared<ScenarioWriteHandler>(std::move(write));
+    return Do(format("install MMIO handler at 0x%" PRIx64 "-0x%" PRIx64, baseAddress, baseAddress + size - 1), [=](ScenarioContext& ctx, std::string& error) {
+        ctx.devices.emplace_back(new FunctionDevice(*readFn, *writeFn));
+        if (!ctx.bus.AddMMIODevice(baseAddress, size, *ctx.devices.back())) {
+            error = "address range overlaps another handler";
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::EnableSoftwareBreakpoints(bool enable) {
+    return Do(enable ? "enable software breakpoints" : "disable software breakpoints", [enable](ScenarioContext& ctx, std::string& error) {
+        if (ctx.vp.EnableSoftwareBreakpoints(enable) != VPOperationStatus::OK) {
+            error = "operation not supported";
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::Interrupt(uint8_t vector) {
+    return Do(format("inject interrupt 0x%02x", vector), [vector](ScenarioContext& ctx, std::string& error) {
+        if (!ctx.vp.EnqueueInterrupt(vector)) {
+            error = "failed to enqueue interrupt";
+            return false;
+        }
+        return true;
+    });
+}
+
+Scenario& Scenario::Do(std::string description, ScenarioAction action) {
+    m_steps.push_back(StepDef{ std::move(description), std::move(action) });
+    return *this;
+}
+
+// ----- Runner -----------------------------------------------------------------------------------------------------------
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start) noexcept {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+ScenarioResult ScenarioRunner::RunScenario(const Scenario& scenario) {
+    ScenarioResult result;
+    result.name = scenario.m_name;
+    result.status = ScenarioStatus::Passed;
+    result.milliseconds = 0.0;
+    const auto start = std::chrono::steady_clock::now();
+
+    const PlatformFeatures& features = m_platform.GetFeatures();
+    for (auto& requirement : scenario.m_requirements) {
+        if (!requirement.second(features)) {
+            result.status = ScenarioStatus::Skipped;
+            result.error = "requires " + requirement.first;
+            return result;
+        }
+    }
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    for (auto& setup : scenario.m_specs) {
+        setup(vmSpecs);
+    }
+
+    VirtualMachine *vm;
+    {
+        std::lock_guard<std::mutex> lock(vmLifecycleMutex);
+        auto opt_vm = m_platform.CreateVM(vmSpecs);
+        vm = opt_vm ? &opt_vm->get() : nullptr;
+    }
+    if (vm == nullptr) {
+        result.status = ScenarioStatus::Failed;
+        result.error = "failed to create virtual machine";
+        return result;
+    }
+
+    ScenarioContext ctx{ m_platform, *vm, vm->GetVirtualProcessor(0)->get() };
+    for (auto& setup : scenario.m_memory) {
+        uint8_t *memory = alignedAlloc(setup.size);
+        if (memory == nullptr) {
+            result.status = ScenarioStatus::Failed;
+            result.error = "failed to allocate guest memory";
+            break;
+        }
+        memset(memory, 0, setup.size);
+        ctx.regions.push_back(ScenarioContext::Region{ setup.base, setup.size, memory });
+        if (setup.init) {
+            setup.init(memory);
+        }
+        if (vm->MapGuestMemory(setup.base, setup.size, setup.flags, memory) != MemoryMappingStatus::OK) {
+            result.status = ScenarioStatus::Failed;
+            result.error = format("failed to map guest memory at 0x%" PRIx64, setup.base);
+            break;
+        }
+    }
+
+    if (result.status == ScenarioStatus::Passed) {
+        ctx.bus.Attach(*vm);
+        for (auto& step : scenario.m_steps) {
+            StepResult stepResult;
+            stepResult.description = step.description;
+            const auto stepStart = std::chrono::steady_clock::now();
+            stepResult.passed = step.action(ctx, stepResult.error);
+            stepResult.milliseconds = millisecondsSince(stepStart);
+            result.steps.push_back(std::move(stepResult));
+            if (!result.steps.back().passed) {
+                result.status = ScenarioStatus::Failed;
+                break;
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(vmLifecycleMutex);
+        m_platform.FreeVM(*vm);
+    }
+    for (auto& region : ctx.regions) {
+        alignedFree(region.memory);
+    }
+    result.milliseconds = millisecondsSince(start);
+    return result;
+}
+
+std::vector<ScenarioResult> ScenarioRunner::RunAll(size_t maxParallel) {
+    if (maxParallel == 0) {
+        maxParallel = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<ScenarioResult> results(m_scenarios.size());
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < m_scenarios.size(); i = next++) {
+            results[i] = RunScenario(m_scenarios[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(maxParallel, m_scenarios.size()); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
+bool ScenarioRunner::PrintReport(const std::vector<ScenarioResult>& results, double wallMilliseconds) noexcept {
+    size_t passed = 0, failed = 0, skipped = 0;
+    double scenarioMilliseconds = 0.0;
+    for (auto& result : results) {
+        const char *status;
+        switch (result.status) {
+        case ScenarioStatus::Passed: status = "PASS"; passed++; break;
+        case ScenarioStatus::Failed: status = "FAIL"; failed++; break;
+        default: status = "SKIP"; skipped++; break;
+        }
+        scenarioMilliseconds += result.milliseconds;
+        printf("[%s] %s (%.3f ms)\n", status, result.name.c_str(), result.milliseconds);
+        if (!result.error.empty()) {
+            printf("       %s\n", result.error.c_str());
+        }
+        for (auto& step : result.steps) {
+            printf("  %-4s %9.3f ms  %s\n", step.passed ? "ok" : "FAIL", step.milliseconds, step.description.c_str());
+            if (!step.passed) {
+                printf("                      %s\n", step.error.c_str());
+            }
+        }
+    }
+    printf("\n%zu passed, %zu failed, %zu skipped\n", passed, failed, skipped);
+    printf("%.3f ms of scenario time in %.3f ms of wall time (%.1fx)\n", scenarioMilliseconds, wallMilliseconds,
+        (wallMilliseconds > 0.0) ? scenarioMilliseconds / wallMilliseconds : 0.0);
+    return failed == 0;
+}
@@ -0,0 +1,182 @@
+/*
+Implements a block of memory backed by an anonymous file that can be mapped
+several times, either shared or copy-on-write.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "shared_memory.hpp"
+#include "unix_socket.hpp"
+
+#if defined(_WIN32)
+#  include <Windows.h>
+#elif defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#elif defined(__APPLE__)
+#  include <fcntl.h>
+#  include <stdio.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#else
+#  error Unsupported platform
+#endif
+
+#if defined(__linux__)
+#  if !defined(MFD_CLOEXEC)
+#    define MFD_CLOEXEC 0x0001U
+#    define MFD_ALLOW_SEALING 0x0002U
+#  endif
+#  if !defined(F_ADD_SEALS)
+#    define F_ADD_SEALS 1033
+#    define F_SEAL_SEAL 0x0001
+#    define F_SEAL_SHRINK 0x0002
+#    define F_SEAL_GROW 0x0004
+#  endif
+#endif
+
+bool SharedMemory::Create(size_t size, const char *name) noexcept {
+    Close();
+#if defined(_WIN32)
+    (void)name;
+    HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (section == NULL) {
+        return false;
+    }
+    m_handle = (intptr_t)section;
+#else
+#  if defined(__linux__)
+    // Called through syscall() for C libraries that predate the wrapper
+    const int fd = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#  elif defined(__APPLE__)
+    // Create a uniquely named object and unlink it right away
+    char shmName[32];
+    snprintf(shmName, sizeof(shmName), "/virt86-%d-%p", (int)getpid(), (void *)this);
+    const int fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(shmName);
+    }
+    (void)name;
+#  endif
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return false;
+    }
+    m_handle = fd;
+#endif
+    m_size = size;
+    return true;
+}
+
+void SharedMemory::Close() noexcept {
+    if (m_handle != -1) {
+#if defined(_WIN32)
+        CloseHandle((HANDLE)m_handle);
+#else
+        close((int)m_handle);
+#endif
+        m_handle = -1;
+    }
+}
+
+bool SharedMemory::Seal() noexcept {
+#if defined(__linux__)
+    return m_handle != -1 && fcntl((int)m_handle, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0;
+#else
+    return false;
+#endif
+}
+
+bool SharedMemory::SendTo(int sock) noexcept {
+#if defined(_WIN32)
+    (void)sock;
+    return false;
+#else
+    if (m_handle == -1) {
+        return false;
+    }
+    const uint64_t size = m_size;
+    const int fd = (int)m_handle;
+    return sendWithFDs(sock, &size, sizeof(size), &fd, 1);
+#endif
+}
+
+bool SharedMemory::ReceiveFrom(int sock) noexcept {
+#if defined(_WIN32)
+    (void)sock;
+    return false;
+#else
+    uint64_t size;
+    int fd;
+    if (!receiveWithFDs(sock, &size, sizeof(size), &fd, 1)) {
+        return false;
+    }
+    // Don't trust the sender about the size
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < size) {
+        close(fd);
+        return false;
+    }
+    Close();
+    m_handle = fd;
+    m_size = (size_t)size;
+    return true;
+#endif
+}
+
+uint8_t *SharedMemory::MapShared() noexcept {
+    return Map(false);
+}
+
+uint8_t *SharedMemory::MapPrivate() noexcept {
+    return Map(true);
+}
+
+uint8_t *SharedMemory::Map(bool copyOnWrite) noexcept {
+    if (m_handle == -1) {
+        return NULL;
+    }
+#if defined(_WIN32)
+    return (uint8_t *)MapViewOfFile((HANDLE)m_handle, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_ALL_ACCESS, 0, 0, m_size);
+#else
+    void *mem = mmap(NULL, m_size, PROT_READ | PROT_WRITE, copyOnWrite ? MAP_PRIVATE : MAP_SHARED, (int)m_handle, 0);
+    return (mem != MAP_FAILED) ? (uint8_t *)mem : NULL;
+#endif
+}
+
+bool SharedMemory::Unmap(void *memory) noexcept {
+    if (memory == NULL) {
+        return true;
+    }
+#if defined(_WIN32)
+    return UnmapViewOfFile(memory) == TRUE;
+#else
+    return munmap(memory, m_size) == 0;
+#endif
+}
@@ -0,0 +1,406 @@
+/*
+Implements functions that save and load compressed snapshots of a virtual
+machine's memory and processor state.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "snapshot.hpp"
+#include "lz4_block.hpp"
+#include "vp_state.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+
+using namespace virt86;
+
+// ----- File format ------------------------------------------------------------------------------------------------------
+//
+// A snapshot file contains, in order:
+// - a FileHeader
+// - a RegionHeader for each memory region
+// - the processor state: numRegs RegValues making up a VPState
+// - a ChunkHeader for each chunk of each region, in address order
+// - the payloads of the chunks, in the same order
+//
+// Regions are split into chunks of up to chunkPages pages. A chunk's payload
+// contains the chunk's non-zero pages, in address order, either as one LZ4
+// block or uncompressed. Bit N of a chunk's page mask is set if the chunk's
+// page N is stored; the other pages are all zeros.
+
+static const char fileMagic[8] = { 'V', '8', '6', 'S', 'N', 'A', 'P', 0 };
+const uint32_t fileVersion = 1;
+const uint32_t chunkPages = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint32_t chunkPages;
+    uint32_t numRegions;
+    uint32_t regValueSize;
+    uint32_t longMode;
+    uint32_t numRegs;
+    uint32_t reserved;
+};
+
+struct RegionHeader {
+    uint64_t guestBase;
+    uint64_t size;
+};
+
+enum ChunkFlags : uint32_t {
+    ChunkCompressed = (1 << 0),
+};
+
+struct ChunkHeader {
+    uint64_t pageMask;
+    uint32_t payloadSize;
+    uint32_t flags;
+};
+
+// A range of pages of a region
+struct Chunk {
+    uint8_t *memory;
+    uint32_t numPages;
+    uint64_t offset;    // Offset of the payload from the start of the payloads
+    ChunkHeader header;
+    std::vector<uint8_t> payload;
+};
+
+static bool isZeroPage(const uint8_t *page) noexcept {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, page + i, sizeof(value));
+        bits |= value;
+    }
+    return bits == 0;
+}
+
+static bool splitChunks(const std::vector<SnapshotRegion>& regions, std::vector<Chunk>& chunks) noexcept {
+    for (auto& region : regions) {
+        if (region.size % PAGE_SIZE != 0) {
+            return false;
+        }
+        const uint64_t numPages = region.size / PAGE_SIZE;
+        for (uint64_t page = 0; page < numPages; page += chunkPages) {
+            Chunk chunk;
+            chunk.memory = region.memory + page * PAGE_SIZE;
+            chunk.numPages = (uint32_t)std::min<uint64_t>(chunkPages, numPages - page);
+            chunk.offset = 0;
+            chunk.header = ChunkHeader{ 0 };
+            chunks.push_back(std::move(chunk));
+        }
+    }
+    return true;
+}
+
+// Runs func(index, scratch) for every index in [0, count) on numThreads
+// threads, including the calling thread. Each thread has its own scratch
+// buffer.
+template<typename Func>
+static void parallelFor(size_t count, size_t numThreads, Func func) {
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&] {
+        std::vector<uint8_t> scratch;
+        for (size_t index = next++; index < count; index = next++) {
+            func(index, scratch);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+static size_t threadCount(size_t numThreads, size_t numChunks) noexcept {
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return std::max<size_t>(1, std::min(numThreads, numChunks));
+}
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) noexcept {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void fillStats(SnapshotStats& stats, const std::vector<Chunk>& chunks, size_t numRegions, size_t numRegs, uint64_t payloadSize,
+    size_t numThreads, std::chrono::steady_clock::time_point start) noexcept {
+    stats = SnapshotStats{ 0 };
+    stats.chunks = chunks.size();
+    stats.threads = numThreads;
+    for (auto& chunk : chunks) {
+        stats.pages += chunk.numPages;
+        for (uint32_t page = 0; page < chunk.numPages; page++) {
+            if ((chunk.header.pageMask & (1ull << page)) == 0) {
+                stats.zeroPages++;
+            }
+        }
+    }
+    stats.memoryBytes = stats.pages * PAGE_SIZE;
+    stats.fileBytes = sizeof(FileHeader) + numRegions * sizeof(RegionHeader) + numRegs * sizeof(RegValue)
+        + chunks.size() * sizeof(ChunkHeader) + payloadSize;
+    stats.elapsedNs = elapsedNs(start);
+}
+
+// ----- Save -------------------------------------------------------------------------------------------------------------
+
+static void compressChunk(Chunk& chunk, std::vector<uint8_t>& scratch) noexcept {
+    // Gather the non-zero pages
+    scratch.resize((size_t)chunk.numPages * PAGE_SIZE);
+    size_t size = 0;
+    for (uint32_t page = 0; page < chunk.numPages; page++) {
+        const uint8_t *data = chunk.memory + (size_t)page * PAGE_SIZE;
+        if (!isZeroPage(data)) {
+            chunk.header.pageMask |= 1ull << page;
+            memcpy(&scratch[size], data, PAGE_SIZE);
+            size += PAGE_SIZE;
+        }
+    }
+    if (size == 0) {
+        return;
+    }
+
+    // Store the pages uncompressed if LZ4 doesn't make them smaller
+    chunk.payload.resize(lz4CompressBound(size));
+    const size_t compressedSize = lz4Compress(scratch.data(), size, chunk.payload.data(), chunk.payload.size());
+    if (compressedSize != 0 && compressedSize < size) {
+        chunk.payload.resize(compressedSize);
+        chunk.header.flags = ChunkCompressed;
+    }
+    else {
+        chunk.payload.assign(scratch.begin(), scratch.begin() + size);
+    }
+    chunk.header.payloadSize = (uint32_t)chunk.payload.size();
+}
+
+bool saveSnapshot(const char *path, VirtualProcessor& vp, const std::vector<SnapshotRegion>& regions, size_t numThreads, SnapshotStats *stats) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+
+    VPState state;
+    if (!readVPState(vp, state)) {
+        return false;
+    }
+    std::vector<Chunk> chunks;
+    if (!splitChunks(regions, chunks)) {
+        return false;
+    }
+
+    numThreads = threadCount(numThreads, chunks.size());
+    parallelFor(chunks.size(), numThreads, [&](size_t index, std::vector<uint8_t>& scratch) {
+        compressChunk(chunks[index], scratch);
+    });
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, fileMagic, sizeof(header.magic));
+    header.version = fileVersion;
+    header.pageSize = PAGE_SIZE;
+    header.chunkPages = chunkPages;
+    header.numRegions = (uint32_t)regions.size();
+    header.regValueSize = sizeof(RegValue);
+    header.longMode = state.longMode ? 1 : 0;
+    header.numRegs = (uint32_t)state.values.size();
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (auto& region : regions) {
+        const RegionHeader regionHeader = { region.guestBase, region.size };
+        ok = ok && fwrite(&regionHeader, sizeof(regionHeader), 1, fp) == 1;
+    }
+    ok = ok && fwrite(state.values.data(), sizeof(RegValue), state.values.size(), fp) == state.values.size();
+    for (auto& chunk : chunks) {
+        ok = ok && fwrite(&chunk.header, sizeof(chunk.header), 1, fp) == 1;
+    }
+    for (auto& chunk : chunks) {
+        ok = ok && fwrite(chunk.payload.data(), 1, chunk.payload.size(), fp) == chunk.payload.size();
+    }
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        remove(path);
+        return false;
+    }
+
+    if (stats != NULL) {
+        uint64_t payloadSize = 0;
+        for (auto& chunk : chunks) {
+            payloadSize += chunk.payload.size();
+        }
+        fillStats(*stats, chunks, regions.size(), state.values.size(), payloadSize, numThreads, start);
+    }
+    return true;
+}
+
+// ----- Load -------------------------------------------------------------------------------------------------------------
+
+// Returns the number of bytes between the current position and the end of
+// the file, or -1 if it cannot be determined.
+static int64_t remainingFileSize(FILE *fp) noexcept {
+#if defined(_WIN32)
+    const int64_t pos = _ftelli64(fp);
+    if (pos < 0 || _fseeki64(fp, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    const int64_t end = _ftelli64(fp);
+    if (_fseeki64(fp, pos, SEEK_SET) != 0) {
+        return -1;
+    }
+#else
+    const off_t pos = ftello(fp);
+    if (pos < 0 || fseeko(fp, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    const off_t end = ftello(fp);
+    if (fseeko(fp, pos, SEEK_SET) != 0) {
+        return -1;
+    }
+#endif
+    return (end >= pos) ? (int64_t)(end - pos) : -1;
+}
+
+static bool decompressChunk(const Chunk& chunk, const uint8_t *payload, std::vector<uint8_t>& scratch) noexcept {
+    size_t numStored = 0;
+    for (uint32_t page = 0; page < chunk.numPages; page++) {
+        if (chunk.header.pageMask & (1ull << page)) {
+            numStored++;
+        }
+    }
+    const size_t size = numStored * PAGE_SIZE;
+    const uint8_t *pages = payload;
+    if (chunk.header.flags & ChunkCompressed) {
+        scratch.resize(size);
+        if (!lz4Decompress(payload, chunk.header.payloadSize, scratch.data(), size)) {
+            return false;
+        }
+        pages = scratch.data();
+    }
+    else if (chunk.header.payloadSize != size) {
+        return false;
+    }
+
+    for (uint32_t page = 0; page < chunk.numPages; page++) {
+        uint8_t *data = chunk.memory + (size_t)page * PAGE_SIZE;
+        if (chunk.header.pageMask & (1ull << page)) {
+            memcpy(data, pages, PAGE_SIZE);
+            pages += PAGE_SIZE;
+        }
+        else {
+            memset(data, 0, PAGE_SIZE);
+        }
+    }
+    return true;
+}
+
+bool loadSnapshot(const char *path, VirtualProcessor& vp, const std::vector<SnapshotRegion>& regions, size_t numThreads, SnapshotStats *stats) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<Chunk> chunks;
+    if (!splitChunks(regions, chunks)) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    // Read and validate the headers
+    FileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && memcmp(header.magic, fileMagic, sizeof(header.magic)) == 0 && header.version == fileVersion;
+    ok = ok && header.pageSize == PAGE_SIZE && header.chunkPages == chunkPages && header.regValueSize == sizeof(RegValue);
+    ok = ok && header.numRegions == regions.size();
+    for (size_t i = 0; ok && i < regions.size(); i++) {
+        RegionHeader regionHeader;
+        ok = fread(&regionHeader, sizeof(regionHeader), 1, fp) == 1;
+        ok = ok && regionHeader.guestBase == regions[i].guestBase && regionHeader.size == regions[i].size;
+    }
+
+    VPState state;
+    if (ok) {
+        state.longMode = header.longMode != 0;
+        ok = header.numRegs == vpStateRegisterCount(state.longMode);
+    }
+    if (ok) {
+        state.values.resize(header.numRegs);
+        ok = fread(state.values.data(), sizeof(RegValue), state.values.size(), fp) == state.values.size();
+    }
+
+    uint64_t payloadSize = 0;
+    for (auto& chunk : chunks) {
+        if (!ok) {
+            break;
+        }
+        ok = fread(&chunk.header, sizeof(chunk.header), 1, fp) == 1;
+        ok = ok && (chunk.numPages == chunkPages || (chunk.header.pageMask >> chunk.numPages) == 0);
+        // Never trust sizes coming from the file
+        ok = ok && chunk.header.payloadSize <= lz4CompressBound((size_t)chunk.numPages * PAGE_SIZE);
+        chunk.offset = payloadSize;
+        payloadSize += chunk.header.payloadSize;
+    }
+
+    // Read all payloads at once; they are decompressed in parallel below
+    std::vector<uint8_t> payloads;
+    if (ok) {
+        const int64_t remaining = remainingFileSize(fp);
+        ok = remaining >= 0 && payloadSize <= (uint64_t)remaining;
+    }
+    if (ok) {
+        payloads.resize((size_t)payloadSize);
+        ok = fread(payloads.data(), 1, payloads.size(), fp) == payloads.size();
+    }
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+
+    numThreads = threadCount(numThreads, chunks.size());
+    std::atomic<bool> decompressed{ true };
+    parallelFor(chunks.size(), numThreads, [&](size_t index, std::vector<uint8_t>& scratch) {
+        const Chunk& chunk = chunks[index];
+        if (!decompressChunk(chunk, payloads.data() + chunk.offset, scratch)) {
+            decompressed = false;
+        }
+    });
+    if (!decompressed || !writeVPState(vp, state)) {
+        return false;
+    }
+
+    if (stats != NULL) {
+        fillStats(*stats, chunks, regions.size(), state.values.size(), payloadSize, numThreads, start);
+    }
+    return true;
+}
@@ -0,0 +1,129 @@
+/*
+Defines a programmable interval timer device backed by a timerfd.
+Linux only.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "timer_device.hpp"
+
+#if defined(__linux__)
+
+#include <unistd.h>
+
+TimerDevice::TimerDevice(EventLoop& loop, InterruptQueue& irqs, uint8_t vector, uint16_t basePort) noexcept
+    : m_loop(loop)
+    , m_irqs(irqs)
+    , m_vector(vector)
+    , m_basePort(basePort)
+    , m_timerFD(createTimerFD(0, 0))
+    , m_resetTime(std::chrono::steady_clock::now())
+    , m_sampleTime(m_resetTime)
+{
+    if (m_timerFD >= 0 && !m_loop.Add(m_timerFD, EPOLLIN, [this](uint32_t) { OnExpire(); })) {
+        close(m_timerFD);
+        m_timerFD = -1;
+    }
+}
+
+TimerDevice::~TimerDevice() {
+    if (m_timerFD >= 0) {
+        m_loop.Remove(m_timerFD);
+        close(m_timerFD);
+    }
+}
+
+uint32_t TimerDevice::IORead(uint16_t port, size_t size) noexcept {
+    switch (port - m_basePort) {
+    case RegControl:
+        return m_control;
+    case RegPeriod:
+        return m_period;
+    case RegPending:
+        // Acknowledge before collecting ticks so that a tick arriving in
+        // between raises a new interrupt instead of being left behind
+        m_irqOutstanding = false;
+        return (uint32_t)m_pendingTicks.exchange(0);
+    case RegCounter:
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - m_resetTime;
+        return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+    default:
+        return 0xFFFFFFFF;
+    }
+}
+
+void TimerDevice::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    switch (port - m_basePort) {
+    case RegControl:
+    {
+        m_control = value & (ControlEnable | ControlPeriodic);
+        const uint64_t periodNs = (uint64_t)m_period * 1000;
+        if ((value & ControlEnable) && periodNs != 0) {
+            setTimerFD(m_timerFD, periodNs, (value & ControlPeriodic) ? periodNs : 0);
+        }
+        else {
+            setTimerFD(m_timerFD, 0, 0);
+        }
+        break;
+    }
+    case RegPeriod:
+        m_period = value;
+        break;
+    }
+}
+
+TimerDevice::Stats TimerDevice::SampleStats() noexcept {
+    std::lock_guard<std::mutex> lock(m_sampleMutex);
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - m_sampleTime;
+
+    Stats stats;
+    stats.ticks = m_ticks;
+    stats.injections = m_injections;
+    stats.injectionsPerSecond = (elapsed.count() > 0.0) ? (stats.injections - m_sampleInjections) / elapsed.count() : 0.0;
+
+    m_sampleTime = now;
+    m_sampleInjections = stats.injections;
+    return stats;
+}
+
+void TimerDevice::OnExpire() noexcept {
+    const uint64_t expirations = readTimerFD(m_timerFD);
+    if (expirations == 0) {
+        return;
+    }
+    if ((m_control & ControlPeriodic) == 0) {
+        m_control &= ~ControlEnable;
+    }
+    m_ticks += expirations;
+    m_pendingTicks += expirations;
+
+    // Only raise an interrupt if the guest has acknowledged the previous one
+    if (!m_irqOutstanding.exchange(true)) {
+        m_injections++;
+        m_irqs.Raise(m_vector);
+    }
+}
+
+#endif
@@ -0,0 +1,346 @@
+/*
+Defines a 16550 UART model whose output is written to the host by a
+background thread.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "uart_device.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#  include <io.h>
+#elif defined(__linux__) || defined(__APPLE__)
+#  include <errno.h>
+#  include <unistd.h>
+#else
+#  error Unsupported platform
+#endif
+
+UartDevice::UartDevice(InterruptQueue& irqs, uint8_t vector, uint16_t basePort, int outputFD, size_t bufferSize, std::chrono::milliseconds flushInterval) noexcept
+    : m_irqs(irqs)
+    , m_vector(vector)
+    , m_basePort(basePort)
+    , m_outputFD(outputFD)
+    , m_flushInterval(flushInterval)
+{
+    size_t size = FifoSize * 4;
+    while (size < bufferSize) {
+        size <<= 1;
+    }
+    m_ring.resize(size);
+    m_writer = std::thread([this]() { WriterThread(); });
+}
+
+UartDevice::~UartDevice() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_writerCond.notify_one();
+    }
+    m_writer.join();
+}
+
+void UartDevice::EnableBulkTransmit(const uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ram = ram;
+    m_ramBase = ramBase;
+    m_ramSize = ramSize;
+}
+
+void UartDevice::Flush() noexcept {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const uint64_t target = m_tail;
+    m_flushWaiters++;
+    m_writerCond.notify_one();
+    m_flushedCond.wait(lock, [this, target] { return m_head >= target; });
+    m_flushWaiters--;
+}
+
+void UartDevice::Receive(const uint8_t *data, size_t length) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_input.erase(m_input.begin(), m_input.begin() + m_inputPos);
+    m_inputPos = 0;
+    m_input.insert(m_input.end(), data, data + length);
+}
+
+uint32_t UartDevice::IORead(uint16_t port, size_t size) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const bool dlab = (m_lcr & LcrDLAB) != 0;
+    switch (port - m_basePort) {
+    case RegData:
+        if (dlab) {
+            return m_divisor & 0xFF;
+        }
+        m_stats.dataReads++;
+        if (InputPending() == 0) {
+            return 0;
+        }
+        m_stats.received++;
+        return m_input[m_inputPos++];
+    case RegIntEnable:
+        return dlab ? (m_divisor >> 8) : m_ier;
+    case RegIntId: {
+        const uint8_t fifos = ((m_fcr & FcrEnable) != 0) ? IirFifos : 0;
+        if (m_threPending) {
+            // Reading IIR acknowledges the interrupt
+            m_threPending = false;
+            return fifos | IirTHRE;
+        }
+        return fifos | IirNone;
+    }
+    case RegLineControl:
+        return m_lcr;
+    case RegModemControl:
+        return m_mcr;
+    case RegLineStatus:
+        // From the guest's point of view the transmitter empties instantly,
+        // so drivers waiting for it to drain never wait on the host
+        return ((Room() >= FifoSize) ? (LsrTHRE | LsrTEMT) : 0) | ((InputPending() != 0) ? LsrDR : 0);
+    case RegModemStatus:
+        return MsrReady;
+    case RegScratch:
+        return m_scratch;
+    case RegBulkAddress:
+        if (m_ram != nullptr) {
+            return m_bulkAddress;
+        }
+        break;
+    case RegBulkLength:
+        if (m_ram != nullptr) {
+            return m_bulkAccepted;
+        }
+        break;
+    }
+    return 0xFFFFFFFF;
+}
+
+void UartDevice::IOWrite(uint16_t port, size_t size, uint32_t value) noexcept {
+    bool raise = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const bool dlab = (m_lcr & LcrDLAB) != 0;
+        const uint8_t byte = (uint8_t)value;
+        switch (port - m_basePort) {
+        case RegData:
+            if (dlab) {
+                m_divisor = (m_divisor & 0xFF00) | byte;
+                break;
+            }
+            m_stats.dataWrites++;
+            if (Append(&byte, 1) == 0) {
+                m_stats.dropped++;
+            }
+            // The interrupt stays pending through the rest of the burst, so
+            // the guest gets one per burst rather than one per byte
+            raise = SignalTHRE();
+            break;
+        case RegIntEnable: {
+            if (dlab) {
+                m_divisor = (m_divisor & 0x00FF) | (byte << 8);
+                break;
+            }
+            const bool enabling = (byte & IerTHRE) != 0 && (m_ier & IerTHRE) == 0;
+            m_ier = byte & 0x0F;
+            if ((m_ier & IerTHRE) == 0) {
+                m_threPending = false;
+            }
+            else if (enabling) {
+                raise = SignalTHRE();
+            }
+            break;
+        }
+        case RegIntId:
+            m_fcr = byte;
+            break;
+        case RegLineControl:
+            m_lcr = byte;
+            break;
+        case RegModemControl:
+            m_mcr = byte & 0x1F;
+            break;
+        case RegScratch:
+            m_scratch = byte;
+            break;
+        case RegBulkAddress:
+            if (m_ram != nullptr) {
+                m_bulkAddress = value;
+            }
+            break;
+        case RegBulkLength:
+            if (m_ram == nullptr) {
+                break;
+            }
+            m_stats.bulkTransmits++;
+            m_bulkAccepted = 0;
+            // Never trust addresses coming from the guest
+            if (m_bulkAddress >= m_ramBase && m_bulkAddress - m_ramBase <= m_ramSize && value <= m_ramSize - (m_bulkAddress - m_ramBase)) {
+                m_bulkAccepted = (uint32_t)Append(&m_ram[m_bulkAddress - m_ramBase], value);
+            }
+            break;
+        }
+    }
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+void UartDevice::IOWriteString(uint16_t port, size_t size, const uint8_t *data, size_t count) noexcept {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (port != m_basePort + RegData || size != 1 || (m_lcr & LcrDLAB) != 0) {
+        // Let IOWrite sort out everything else
+        lock.unlock();
+        IODevice::IOWriteString(port, size, data, count);
+        return;
+    }
+    m_stats.stringWrites++;
+    m_stats.dropped += count - Append(data, count);
+    const bool raise = SignalTHRE();
+    lock.unlock();
+    if (raise) {
+        m_irqs.Raise(m_vector);
+    }
+}
+
+size_t UartDevice::IOPeekString(uint16_t port, size_t size, uint8_t *data, size_t count) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (port != m_basePort + RegData || size != 1 || (m_lcr & LcrDLAB) != 0) {
+        // IORead sorts out everything else
+        return 0;
+    }
+    const size_t peeked = std::min(count, InputPending());
+    memcpy(data, &m_input[m_inputPos], peeked);
+    return peeked;
+}
+
+void UartDevice::IOConsumeString(uint16_t port, size_t size, size_t count) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t consumed = std::min(count, InputPending());
+    m_inputPos += consumed;
+    m_stats.stringReads++;
+    m_stats.received += consumed;
+}
+
+UartDevice::Stats UartDevice::GetStats() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+size_t UartDevice::Append(const uint8_t *data, size_t length) noexcept {
+    const size_t count = std::min(length, Room());
+    if (count == 0) {
+        return 0;
+    }
+    const size_t pending = (size_t)(m_tail - m_head);
+    const size_t start = (size_t)m_tail & (m_ring.size() - 1);
+    const size_t first = std::min(count, m_ring.size() - start);
+    memcpy(&m_ring[start], data, first);
+    memcpy(&m_ring[0], data + first, count - first);
+    m_tail += count;
+    m_stats.bytes += count;
+
+    // Only wake up the writer when output starts or the ring is filling up;
+    // it picks up everything else in batches
+    const size_t threshold = m_ring.size() / 4;
+    if (pending == 0 || (pending < threshold && pending + count >= threshold)) {
+        m_writerCond.notify_one();
+    }
+    return count;
+}
+
+bool UartDevice::SignalTHRE() noexcept {
+    if ((m_ier & IerTHRE) == 0 || m_threPending || Room() < FifoSize) {
+        return false;
+    }
+    m_threPending = true;
+    m_stats.interrupts++;
+    return true;
+}
+
+size_t UartDevice::WriteOut(const uint8_t *data, size_t length) noexcept {
+    size_t calls = 0;
+    while (length > 0) {
+#if defined(_WIN32)
+        const auto written = _write(m_outputFD, data, (unsigned int)std::min<size_t>(length, 0x40000000));
+#else
+        const auto written = write(m_outputFD, data, length);
+#endif
+        calls++;
+#if !defined(_WIN32)
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (written <= 0) {
+            // Nowhere to send the output; drop it rather than stall the guest
+            break;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return calls;
+}
+
+void UartDevice::WriterThread() noexcept {
+    const size_t threshold = m_ring.size() / 4;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_writerCond.wait(lock, [this] { return m_stop || m_tail != m_head; });
+        // Let more output accumulate, unless the ring is filling up or
+        // someone is waiting for it
+        m_writerCond.wait_for(lock, m_flushInterval, [this, threshold] {
+            return m_stop || m_flushWaiters > 0 || m_tail - m_head >= threshold;
+        });
+        if (m_tail == m_head) {
+            if (m_stop) {
+                break;
+            }
+            continue;
+        }
+
+        // Producers only append past the tail, so the batch can be written
+        // out without holding the lock
+        const uint64_t head = m_head;
+        const uint64_t tail = m_tail;
+        lock.unlock();
+        const size_t start = (size_t)head & (m_ring.size() - 1);
+        const size_t length = (size_t)(tail - head);
+        const size_t first = std::min(length, m_ring.size() - start);
+        size_t calls = WriteOut(&m_ring[start], first);
+        if (first < length) {
+            calls += WriteOut(&m_ring[0], length - first);
+        }
+        lock.lock();
+
+        const bool wasFull = Room() < FifoSize;
+        m_head = tail;
+        m_stats.hostWrites += calls;
+        m_flushedCond.notify_all();
+        if (wasFull && SignalTHRE()) {
+            lock.unlock();
+            m_irqs.Raise(m_vector);
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,130 @@
+/*
+Implements functions that pass file descriptors between processes over Unix
+domain sockets.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "unix_socket.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstring>
+
+#if !defined(MSG_NOSIGNAL)
+#  define MSG_NOSIGNAL 0
+#endif
+
+#if !defined(MSG_CMSG_CLOEXEC)
+#  define MSG_CMSG_CLOEXEC 0
+#endif
+
+bool sendWithFDs(int sock, const void *data, size_t size, const int *fds, size_t numFDs) noexcept {
+    if (numFDs > maxPassedFDs || size == 0) {
+        return false;
+    }
+    union {
+        cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int) * maxPassedFDs)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (numFDs > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFDs);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFDs);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFDs);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+bool receiveWithFDs(int sock, void *data, size_t size, int *fds, size_t numFDs) noexcept {
+    if (numFDs > maxPassedFDs || size == 0) {
+        return false;
+    }
+    union {
+        cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int) * maxPassedFDs)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    const ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        return false;
+    }
+
+    // Take every descriptor that arrived so that none leak on failure
+    size_t numReceived = 0;
+    int receivedFDs[maxPassedFDs];
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count && numReceived < maxPassedFDs; i++) {
+            memcpy(&receivedFDs[numReceived++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        }
+    }
+
+    const bool ok = (size_t)received == size && numReceived == numFDs && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) == 0;
+    for (size_t i = 0; i < numReceived; i++) {
+        if (ok) {
+#if defined(__APPLE__)
+            // No MSG_CMSG_CLOEXEC on macOS
+            fcntl(receivedFDs[i], F_SETFD, FD_CLOEXEC);
+#endif
+            fds[i] = receivedFDs[i];
+        }
+        else {
+            close(receivedFDs[i]);
+        }
+    }
+    return ok;
+}
+
+#endif
@@ -24,6 +24,14 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "utils.hpp"
+#if defined(VIRT86_DEMOS_REFERENCE_PLATFORM)
+#include "reference_platform.hpp"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+static bool useReferencePlatform = false;
 
 const char *reason_str(virt86::VMExitReason reason) noexcept {
     switch (reason) {
@@ -45,3 +53,79 @@ const char *reason_str(virt86::VMExitReason reason) noexcept {
     default: return "Unknown/unexpected reason";
     }
 }
+
+// Returns the reference platform, or NULL if it was left out of the build
+// because it does not compile against the installed virt86
+static virt86::Platform *referencePlatform() noexcept {
+#if defined(VIRT86_DEMOS_REFERENCE_PLATFORM)
+    return &ReferencePlatform::Instance();
+#else
+    return NULL;
+#endif
+}
+
+void parsePlatformOptions(int& argc, char *argv[]) noexcept {
+    int out = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reference") == 0) {
+            useReferencePlatform = true;
+        }
+        else {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = NULL;
+}
+
+bool referencePlatformSelected() noexcept {
+    return useReferencePlatform;
+}
+
+virt86::Platform *loadFirstPlatform() noexcept {
+    printf("Loading virtualization platform... ");
+    if (useReferencePlatform) {
+        virt86::Platform *platform = referencePlatform();
+        if (platform == NULL) {
+            printf("the reference platform is not included in this build\n");
+            return NULL;
+        }
+        printf("%s loaded successfully\n", platform->GetName().c_str());
+        return platform;
+    }
+    for (size_t i = 0; i < array_size(virt86::PlatformFactories); i++) {
+        virt86::Platform& platform = virt86::PlatformFactories[i]();
+        if (platform.GetInitStatus() == virt86::PlatformInitStatus::OK) {
+            printf("%s loaded successfully\n", platform.GetName().c_str());
+            return &platform;
+        }
+    }
+    printf("none found\n");
+    return NULL;
+}
+
+std::vector<virt86::Platform *> loadAllPlatforms() noexcept {
+    std::vector<virt86::Platform *> platforms;
+    printf("Loading virtualization platforms...\n");
+    if (useReferencePlatform) {
+        virt86::Platform *platform = referencePlatform();
+        if (platform == NULL) {
+            printf("  the reference platform is not included in this build\n");
+            return platforms;
+        }
+        printf("  %s loaded successfully\n", platform->GetName().c_str());
+        platforms.push_back(platform);
+        return platforms;
+    }
+    for (size_t i = 0; i < array_size(virt86::PlatformFactories); i++) {
+        virt86::Platform& platform = virt86::PlatformFactories[i]();
+        if (platform.GetInitStatus() == virt86::PlatformInitStatus::OK) {
+            printf("  %s loaded successfully\n", platform.GetName().c_str());
+            platforms.push_back(&platform);
+        }
+    }
+    if (platforms.empty()) {
+        printf("  none found\n");
+    }
+    return platforms;
+}
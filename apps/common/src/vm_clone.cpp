@@ -0,0 +1,108 @@
+/*
+Implements copy-on-write cloning of a stopped virtual machine into new
+virtual machines that share its unmodified memory.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vm_clone.hpp"
+
+using namespace virt86;
+
+// ----- Clone ------------------------------------------------------------------------------------------------------------
+
+VMClone::VMClone(VMTemplate& source, VirtualMachine& vm, VirtualProcessor& vp) noexcept
+    : m_template(source)
+    , m_vm(vm)
+    , m_vp(vp)
+{
+}
+
+VMClone::~VMClone() noexcept {
+    // The memory must outlive the virtual machine that maps it
+    m_vm.GetPlatform().FreeVM(m_vm);
+    for (size_t i = 0; i < m_mappings.size(); i++) {
+        m_template.m_privateRegions[i].memory->Unmap(m_mappings[i]);
+    }
+}
+
+// ----- Template ---------------------------------------------------------------------------------------------------------
+
+VMTemplate::VMTemplate(VirtualMachine& vm) noexcept
+    : m_vm(vm)
+{
+}
+
+void VMTemplate::AddSharedRegion(uint64_t guestBase, uint64_t size, uint8_t *memory, MemoryFlags flags) noexcept {
+    m_sharedRegions.push_back({ guestBase, size, memory, flags });
+}
+
+void VMTemplate::AddPrivateRegion(uint64_t guestBase, SharedMemory& memory, MemoryFlags flags) noexcept {
+    m_privateRegions.push_back({ guestBase, &memory, flags });
+}
+
+bool VMTemplate::Capture() noexcept {
+    auto opt_vp = m_vm.GetVirtualProcessor(0);
+    m_captured = opt_vp && readVPState(opt_vp->get(), m_state);
+    return m_captured;
+}
+
+std::unique_ptr<VMClone> VMTemplate::Clone() noexcept {
+    if (!m_captured) {
+        return nullptr;
+    }
+
+    Platform& platform = m_vm.GetPlatform();
+    auto opt_vm = platform.CreateVM(m_vm.GetSpecifications());
+    if (!opt_vm) {
+        return nullptr;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    auto opt_vp = vm.GetVirtualProcessor(0);
+    if (!opt_vp) {
+        platform.FreeVM(vm);
+        return nullptr;
+    }
+    // From here on, the clone frees the virtual machine and its mappings on failure
+    std::unique_ptr<VMClone> clone(new VMClone(*this, vm, opt_vp->get()));
+
+    for (auto& region : m_sharedRegions) {
+        if (vm.MapGuestMemory(region.guestBase, region.size, region.flags, region.memory) != MemoryMappingStatus::OK) {
+            return nullptr;
+        }
+    }
+    for (auto& region : m_privateRegions) {
+        uint8_t *memory = region.memory->MapPrivate();
+        if (memory == NULL) {
+            return nullptr;
+        }
+        clone->m_mappings.push_back(memory);
+        if (vm.MapGuestMemory(region.guestBase, region.memory->Size(), region.flags, memory) != MemoryMappingStatus::OK) {
+            return nullptr;
+        }
+    }
+
+    if (!writeVPState(clone->GetVP(), m_state)) {
+        return nullptr;
+    }
+    return clone;
+}
@@ -0,0 +1,169 @@
+/*
+Defines a scheduler that multiplexes virtual processors on a small pool of
+threads, and the asynchronous operations device models use to wait for host
+I/O without blocking those threads.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vp_scheduler.hpp"
+
+#include <deque>
+#include <memory>
+#include <thread>
+
+using namespace virt86;
+
+struct VPWorker {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Fiber *> ready;
+    std::vector<std::unique_ptr<Fiber>> fibers;
+
+    // Queues a fiber to be resumed by the worker thread
+    void MakeReady(Fiber *fiber) noexcept {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(fiber);
+        }
+        cond.notify_one();
+    }
+
+    void Run() {
+        size_t remaining = fibers.size();
+        while (remaining > 0) {
+            Fiber *fiber;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !ready.empty(); });
+                fiber = ready.front();
+                ready.pop_front();
+            }
+            t_currentWorker = this;
+            fiber->Resume();
+            t_currentWorker = nullptr;
+            if (fiber->IsFinished()) {
+                remaining--;
+            }
+        }
+    }
+
+    // Worker whose thread is currently running
+    static thread_local VPWorker *t_currentWorker;
+};
+
+thread_local VPWorker *VPWorker::t_currentWorker = nullptr;
+
+// ----- AsyncOperation -------------------------------------------------------------------------------------------------------
+
+void AsyncOperation::Complete(uint64_t result) noexcept {
+    // The waiter may destroy the operation as soon as it sees it complete, so
+    // everything here is done under the lock and nothing is touched after it
+    // is released. awaitOperation() always takes the lock before returning.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_result = result;
+    m_complete.store(true, std::memory_order_release);
+    if (m_waiter != nullptr) {
+        m_worker->MakeReady(m_waiter);
+        m_worker = nullptr;
+        m_waiter = nullptr;
+    }
+    else {
+        m_cond.notify_all();
+    }
+}
+
+uint64_t awaitOperation(AsyncOperation& op) noexcept {
+    Fiber *fiber = Fiber::Current();
+    VPWorker *worker = VPWorker::t_currentWorker;
+    std::unique_lock<std::mutex> lock(op.m_mutex);
+    if (op.IsComplete()) {
+        return op.Result();
+    }
+    if (fiber == nullptr || worker == nullptr) {
+        // Not running on a scheduler; block the thread
+        op.m_cond.wait(lock, [&op] { return op.IsComplete(); });
+        return op.Result();
+    }
+
+    // Park the virtual processor until the operation completes. Complete()
+    // may run on another thread as soon as the lock is released, but the
+    // fiber cannot be resumed until it suspends since it belongs to this
+    // thread. Once resumed, wait for Complete() to release the lock so that
+    // the caller may safely destroy the operation.
+    op.m_worker = worker;
+    op.m_waiter = fiber;
+    lock.unlock();
+    fiber->Suspend();
+    lock.lock();
+    return op.Result();
+}
+
+// ----- VPScheduler ----------------------------------------------------------------------------------------------------------
+
+VPScheduler::VPScheduler(size_t numThreads) noexcept
+    : m_numThreads((numThreads == 0) ? 1 : numThreads)
+{
+}
+
+void VPScheduler::AddVP(VirtualProcessor& vp, VMExitHandler handler, IOBus *bus) {
+    m_vps.push_back(VPEntry{ &vp, std::move(handler), bus });
+}
+
+void VPScheduler::Run() {
+    // Distribute virtual processors among the workers
+    const size_t numWorkers = (m_vps.size() < m_numThreads) ? m_vps.size() : m_numThreads;
+    std::vector<std::unique_ptr<VPWorker>> workers;
+    for (size_t i = 0; i < numWorkers; i++) {
+        workers.emplace_back(new VPWorker());
+    }
+
+    for (size_t i = 0; i < m_vps.size(); i++) {
+        VPWorker *worker = workers[i % numWorkers].get();
+        VPEntry *entry = &m_vps[i];
+        Fiber *fiber = new Fiber([entry, worker]() {
+            Fiber *self = Fiber::Current();
+            for (;;) {
+                const auto status = (entry->bus != nullptr) ? entry->bus->Run(*entry->vp) : entry->vp->Run();
+                if (status != VPExecutionStatus::OK) {
+                    break;
+                }
+                if (!entry->handler(*entry->vp, entry->vp->GetVMExitInfo())) {
+                    break;
+                }
+                // Give other virtual processors on this thread a chance to run
+                worker->MakeReady(self);
+                self->Suspend();
+            }
+        });
+        worker->fibers.emplace_back(fiber);
+        worker->ready.push_back(fiber);
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker]() { worker->Run(); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,66 @@
+/*
+Implements functions that save and restore the register state of a virtual
+processor.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vp_state.hpp"
+#include "utils.hpp"
+
+using namespace virt86;
+
+#define REG_COMMON \
+    Reg::CS, Reg::SS, Reg::DS, Reg::ES, Reg::FS, Reg::GS, Reg::LDTR, Reg::TR, Reg::GDTR, Reg::IDTR, \
+    Reg::CR0, Reg::CR2, Reg::CR3, Reg::CR4, Reg::EFER, \
+    Reg::DR0, Reg::DR1, Reg::DR2, Reg::DR3, Reg::DR6, Reg::DR7
+
+// Control registers and segments come first: writing CR0 or EFER changes how
+// the rest of the state is interpreted.
+static const Reg regs32[] = {
+    REG_COMMON,
+    Reg::EAX, Reg::ECX, Reg::EDX, Reg::EBX, Reg::ESP, Reg::EBP, Reg::ESI, Reg::EDI, Reg::EIP, Reg::EFLAGS,
+};
+static const Reg regs64[] = {
+    REG_COMMON, Reg::CR8,
+    Reg::RAX, Reg::RCX, Reg::RDX, Reg::RBX, Reg::RSP, Reg::RBP, Reg::RSI, Reg::RDI,
+    Reg::R8, Reg::R9, Reg::R10, Reg::R11, Reg::R12, Reg::R13, Reg::R14, Reg::R15, Reg::RIP, Reg::RFLAGS,
+};
+
+#undef REG_COMMON
+
+size_t vpStateRegisterCount(bool longMode) noexcept {
+    return longMode ? array_size(regs64) : array_size(regs32);
+}
+
+bool readVPState(VirtualProcessor& vp, VPState& state) noexcept {
+    state.longMode = vp.GetExecutionMode() == CPUExecutionMode::IA32e;
+    state.values.resize(vpStateRegisterCount(state.longMode));
+    return vp.RegRead(state.longMode ? regs64 : regs32, state.values.data(), state.values.size()) == VPOperationStatus::OK;
+}
+
+bool writeVPState(VirtualProcessor& vp, const VPState& state) noexcept {
+    if (state.values.size() != vpStateRegisterCount(state.longMode)) {
+        return false;
+    }
+    return vp.RegWrite(state.longMode ? regs64 : regs32, state.values.data(), state.values.size()) == VPOperationStatus::OK;
+}
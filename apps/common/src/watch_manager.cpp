@@ -0,0 +1,491 @@
+/*
+Defines a watchpoint manager that multiplexes any number of watches over the
+four hardware breakpoint slots, page protection and software breakpoints.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "watch_manager.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace virt86;
+
+const uint64_t pageMask = ~(uint64_t)(PAGE_SIZE - 1);
+const uint64_t rflagsRF = 1ull << 16;
+const uint64_t dr6Clear = 0xFFFF0FF0;
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) noexcept {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+WatchManager::WatchManager(VirtualMachine& vm, VirtualProcessor& vp, uint8_t *ram, uint64_t ramBase, uint64_t ramSize) noexcept
+    : m_vm(vm)
+    , m_vp(vp)
+    , m_ram(ram)
+    , m_ramBase(ramBase)
+    , m_ramSize(ramSize)
+{
+}
+
+int WatchManager::Add(WatchType type, uint64_t address, uint32_t length) noexcept {
+    if (type == WatchType::Execute) {
+        length = 1;
+    }
+    if (length == 0) {
+        return -1;
+    }
+    uint64_t physical;
+    if (!m_vp.LinearToPhysical(address, &physical)) {
+        return -1;
+    }
+    if (physical < m_ramBase || physical - m_ramBase + length > m_ramSize) {
+        return -1;
+    }
+    if (type == WatchType::Execute) {
+        for (auto& watch : m_watches) {
+            if (watch.active && watch.type == WatchType::Execute && watch.physical == physical) {
+                return -1;
+            }
+        }
+    }
+
+    Watch watch = { 0 };
+    watch.active = true;
+    watch.type = type;
+    watch.address = address;
+    watch.physical = physical;
+    watch.length = length;
+    m_watches.push_back(watch);
+
+    const int id = (int)m_watches.size() - 1;
+    if (!Rebalance()) {
+        Remove(id);
+        return -1;
+    }
+    return id;
+}
+
+bool WatchManager::Remove(int id) noexcept {
+    if (id < 0 || (size_t)id >= m_watches.size() || !m_watches[id].active) {
+        return false;
+    }
+    m_watches[id].active = false;
+    return Rebalance();
+}
+
+void WatchManager::RemoveAll() noexcept {
+    for (auto& watch : m_watches) {
+        watch.active = false;
+    }
+    Rebalance();
+    m_watches.clear();
+    if (m_softwareBreakpoints) {
+        m_vp.EnableSoftwareBreakpoints(false);
+        m_softwareBreakpoints = false;
+    }
+}
+
+bool WatchManager::GetStats(int id, Stats& stats) const noexcept {
+    if (id < 0 || (size_t)id >= m_watches.size() || !m_watches[id].active) {
+        return false;
+    }
+    stats = m_watches[id].stats;
+    return true;
+}
+
+// ----- Placement --------------------------------------------------------------------------------------------------------
+
+static bool fitsDebugRegister(uint64_t address, uint32_t length) noexcept {
+    switch (length) {
+    case 1: case 2: case 4: case 8:
+        return (address & (length - 1)) == 0;
+    default:
+        return false;
+    }
+}
+
+bool WatchManager::Rebalance() noexcept {
+    m_rebalancePending = false;
+    m_hitsSinceRebalance = 0;
+
+    std::vector<size_t> order;
+    for (size_t id = 0; id < m_watches.size(); id++) {
+        auto& watch = m_watches[id];
+        if (watch.active) {
+            watch.score = watch.score / 2 + watch.recentHits;
+            watch.recentHits = 0;
+            order.push_back(id);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_watches[a].score > m_watches[b].score; });
+
+    // Give the debug registers to the hottest watches, skipping those whose
+    // pages end up protected on behalf of colder watches. Each round can only
+    // protect more pages, so this settles in a few rounds.
+    std::vector<size_t> inRegisters;
+    std::map<uint64_t, Protection> pages;
+    for (;;) {
+        inRegisters.clear();
+        for (size_t id : order) {
+            auto& watch = m_watches[id];
+            const bool pageProtected = watch.type != WatchType::Execute && pages.count(watch.physical & pageMask);
+            if (inRegisters.size() < 4 && fitsDebugRegister(watch.address, watch.length) && !pageProtected) {
+                inRegisters.push_back(id);
+            }
+        }
+        std::map<uint64_t, Protection> newPages;
+        for (size_t id : order) {
+            auto& watch = m_watches[id];
+            if (watch.type == WatchType::Execute || std::find(inRegisters.begin(), inRegisters.end(), id) != inRegisters.end()) {
+                continue;
+            }
+            const Protection protection = (watch.type == WatchType::Access) ? Protection::NoAccess : Protection::ReadOnly;
+            for (uint64_t page = watch.physical & pageMask; page < watch.physical + watch.length; page += PAGE_SIZE) {
+                auto& current = newPages[page];
+                current = std::max(current, protection);
+            }
+        }
+        if (newPages.size() == pages.size()) {
+            pages.swap(newPages);
+            break;
+        }
+        pages.swap(newPages);
+    }
+
+    bool ok = true;
+
+    // Debug registers
+    for (int i = 0; i < 4; i++) {
+        m_slots[i] = (i < (int)inRegisters.size()) ? (int)inRegisters[i] : -1;
+    }
+    ok &= ApplyDebugRegisters();
+
+    // Software breakpoints
+    for (auto it = m_breakpoints.begin(); it != m_breakpoints.end(); ) {
+        const size_t id = (it++)->second;
+        if (!m_watches[id].active || std::find(inRegisters.begin(), inRegisters.end(), id) != inRegisters.end()) {
+            LiftBreakpoint(id);
+        }
+    }
+    for (size_t id : order) {
+        auto& watch = m_watches[id];
+        if (watch.type == WatchType::Execute && std::find(inRegisters.begin(), inRegisters.end(), id) == inRegisters.end()
+            && !m_breakpoints.count(watch.physical)) {
+            ok &= PlantBreakpoint(id);
+        }
+    }
+    if (m_softwareBreakpoints != !m_breakpoints.empty()) {
+        m_softwareBreakpoints = !m_breakpoints.empty();
+        ok &= m_vp.EnableSoftwareBreakpoints(m_softwareBreakpoints) == VPOperationStatus::OK;
+    }
+
+    // Page protection
+    for (auto& page : m_pages) {
+        if (!pages.count(page.first)) {
+            ok &= SetPageProtection(page.first, page.second, Protection::None);
+        }
+    }
+    for (auto& page : pages) {
+        auto it = m_pages.find(page.first);
+        const Protection from = (it != m_pages.end()) ? it->second : Protection::None;
+        if (from != page.second) {
+            ok &= SetPageProtection(page.first, from, page.second);
+        }
+    }
+    m_pages.swap(pages);
+
+    m_pageWatches.clear();
+    for (size_t id : order) {
+        auto& watch = m_watches[id];
+        if (std::find(inRegisters.begin(), inRegisters.end(), id) != inRegisters.end()) {
+            watch.stats.mechanism = WatchMechanism::DebugRegister;
+        }
+        else if (watch.type == WatchType::Execute) {
+            watch.stats.mechanism = WatchMechanism::SoftwareBreakpoint;
+        }
+        else {
+            watch.stats.mechanism = WatchMechanism::PageProtection;
+            for (uint64_t page = watch.physical & pageMask; page < watch.physical + watch.length; page += PAGE_SIZE) {
+                m_pageWatches.emplace(page, id);
+            }
+        }
+    }
+    return ok;
+}
+
+bool WatchManager::SetPageProtection(uint64_t page, Protection from, Protection to) noexcept {
+    uint8_t *host = m_ram + (page - m_ramBase);
+    const MemoryFlags flags = (to == Protection::ReadOnly)
+        ? MemoryFlags::Read | MemoryFlags::Execute
+        : MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute;
+
+    if (to == Protection::NoAccess) {
+        return m_vm.UnmapGuestMemory(page, PAGE_SIZE) == MemoryMappingStatus::OK;
+    }
+    if (from != Protection::NoAccess) {
+        // Change the permissions in place if the platform supports it,
+        // otherwise remap the page with the new permissions
+        if (m_vm.SetGuestMemoryFlags(page, PAGE_SIZE, flags) == MemoryMappingStatus::OK) {
+            return true;
+        }
+        if (m_vm.UnmapGuestMemory(page, PAGE_SIZE) != MemoryMappingStatus::OK) {
+            return false;
+        }
+    }
+    return m_vm.MapGuestMemory(page, PAGE_SIZE, flags, host) == MemoryMappingStatus::OK;
+}
+
+bool WatchManager::PlantBreakpoint(size_t id) noexcept {
+    auto& watch = m_watches[id];
+    uint8_t *host = m_ram + (watch.physical - m_ramBase);
+    watch.original = *host;
+    *host = 0xCC;
+    m_breakpoints[watch.physical] = id;
+    return true;
+}
+
+void WatchManager::LiftBreakpoint(size_t id) noexcept {
+    auto& watch = m_watches[id];
+    m_ram[watch.physical - m_ramBase] = watch.original;
+    m_breakpoints.erase(watch.physical);
+}
+
+bool WatchManager::ApplyDebugRegisters() noexcept {
+    // The trigger and length enumerations follow the encoding of the R/W and
+    // LEN fields of DR7
+    HardwareBreakpoints bps = { 0 };
+    bool any = false;
+    for (int i = 0; i < 4; i++) {
+        if (m_slots[i] < 0) {
+            continue;
+        }
+        auto& watch = m_watches[m_slots[i]];
+        uint8_t triggerBits, lengthBits;
+        switch (watch.type) {
+        case WatchType::Execute: triggerBits = 0b00; break;
+        case WatchType::Write: triggerBits = 0b01; break;
+        default: triggerBits = 0b11; break;
+        }
+        switch (watch.length) {
+        case 2: lengthBits = 0b01; break;
+        case 8: lengthBits = 0b10; break;
+        case 4: lengthBits = 0b11; break;
+        default: lengthBits = 0b00; break;
+        }
+        bps.bp[i].address = watch.address;
+        bps.bp[i].localEnable = true;
+        bps.bp[i].globalEnable = false;
+        bps.bp[i].trigger = static_cast<HardwareBreakpointTrigger>(triggerBits);
+        bps.bp[i].length = static_cast<HardwareBreakpointLength>(lengthBits);
+        any = true;
+    }
+    if (!any) {
+        return m_vp.ClearHardwareBreakpoints() == VPOperationStatus::OK;
+    }
+    return m_vp.SetHardwareBreakpoints(bps) == VPOperationStatus::OK;
+}
+
+// ----- Hits -------------------------------------------------------------------------------------------------------------
+
+void WatchManager::Hit(size_t id, uint64_t address) noexcept {
+    auto& watch = m_watches[id];
+    watch.stats.hits++;
+    watch.recentHits++;
+    if (m_rebalanceInterval != 0 && ++m_hitsSinceRebalance >= m_rebalanceInterval) {
+        // Memory mappings cannot be changed from within an MMIO callback;
+        // rebalance on the next call to HandleExit
+        m_rebalancePending = true;
+    }
+    if (m_hitHandler) {
+        m_hitHandler(id, address);
+    }
+}
+
+bool WatchManager::HandleExit(const VMExitInfo& exitInfo) noexcept {
+    bool handled;
+    switch (exitInfo.reason) {
+    case VMExitReason::HardwareBreakpoint:
+        handled = HandleHardwareBreakpoint();
+        break;
+    case VMExitReason::SoftwareBreakpoint:
+        handled = HandleSoftwareBreakpoint();
+        break;
+    default:
+        handled = false;
+        break;
+    }
+    if (m_rebalancePending) {
+        Rebalance();
+    }
+    return handled;
+}
+
+bool WatchManager::HandleHardwareBreakpoint() noexcept {
+    const auto start = std::chrono::steady_clock::now();
+    RegValue dr6;
+    if (m_vp.RegRead(Reg::DR6, dr6) != VPOperationStatus::OK) {
+        return false;
+    }
+    int hitSlots[4];
+    size_t numHits = 0;
+    for (int i = 0; i < 4; i++) {
+        if (m_slots[i] >= 0 && (dr6.u64 & (1ull << i))) {
+            hitSlots[numHits++] = m_slots[i];
+        }
+    }
+    if (numHits == 0) {
+        return false;
+    }
+    dr6.u64 = dr6Clear;
+    m_vp.RegWrite(Reg::DR6, dr6);
+
+    bool execute = false;
+    for (size_t i = 0; i < numHits; i++) {
+        auto& watch = m_watches[hitSlots[i]];
+        execute |= watch.type == WatchType::Execute;
+        Hit(hitSlots[i], watch.physical);
+    }
+    if (execute) {
+        // Instruction breakpoints are faults; set RF so that the instruction
+        // executes on resume instead of trapping again
+        RegValue rflags;
+        if (m_vp.RegRead(Reg::RFLAGS, rflags) == VPOperationStatus::OK) {
+            rflags.u64 |= rflagsRF;
+            m_vp.RegWrite(Reg::RFLAGS, rflags);
+        }
+    }
+
+    m_totalExits++;
+    const uint64_t overhead = elapsedNs(start) / numHits;
+    for (size_t i = 0; i < numHits; i++) {
+        auto& stats = m_watches[hitSlots[i]].stats;
+        stats.exits++;
+        stats.overheadNs += overhead;
+    }
+    return true;
+}
+
+bool WatchManager::HandleSoftwareBreakpoint() noexcept {
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t address, physical;
+    if (m_vp.GetBreakpointAddress(&address) != VPOperationStatus::OK || !m_vp.LinearToPhysical(address, &physical)) {
+        return false;
+    }
+    auto it = m_breakpoints.find(physical);
+    if (it == m_breakpoints.end()) {
+        return false;
+    }
+    const size_t id = it->second;
+    Hit(id, physical);
+
+    // Step over the original instruction, then plant the breakpoint again
+    auto& watch = m_watches[id];
+    uint8_t *host = m_ram + (physical - m_ramBase);
+    *host = watch.original;
+    const auto status = m_vp.Step();
+    *host = 0xCC;
+
+    m_totalExits += 2;
+    watch.stats.exits += 2;
+    watch.stats.overheadNs += elapsedNs(start);
+
+    if (status != VPExecutionStatus::OK) {
+        return false;
+    }
+    // The stepped instruction may have hit a watch in a debug register
+    if (m_vp.GetVMExitInfo().reason == VMExitReason::HardwareBreakpoint) {
+        HandleHardwareBreakpoint();
+    }
+    return true;
+}
+
+// ----- Emulated accesses ------------------------------------------------------------------------------------------------
+
+void WatchManager::TrapAccess(uint64_t address, size_t size, bool write, uint64_t elapsed) noexcept {
+    m_totalExits++;
+
+    // Every protected watch on the touched pages pays for the exit; only the
+    // ones overlapping the access with a matching type count it as a hit
+    size_t watches[16];
+    size_t numWatches = 0;
+    for (uint64_t page = address & pageMask; page < address + size; page += PAGE_SIZE) {
+        auto range = m_pageWatches.equal_range(page);
+        for (auto it = range.first; it != range.second && numWatches < 16; ++it) {
+            const size_t id = it->second;
+            if (std::find(watches, watches + numWatches, id) == watches + numWatches) {
+                watches[numWatches++] = id;
+            }
+        }
+    }
+    if (numWatches == 0) {
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numWatches; i++) {
+        auto& watch = m_watches[watches[i]];
+        const bool overlaps = address < watch.physical + watch.length && watch.physical < address + size;
+        if (overlaps && (write || watch.type == WatchType::Access)) {
+            Hit(watches[i], address);
+        }
+    }
+    const uint64_t overhead = (elapsed + elapsedNs(start)) / numWatches;
+    for (size_t i = 0; i < numWatches; i++) {
+        auto& stats = m_watches[watches[i]].stats;
+        stats.exits++;
+        stats.overheadNs += overhead;
+    }
+}
+
+uint64_t WatchManager::MMIORead(uint64_t address, size_t size) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+    if (address < m_ramBase || address - m_ramBase + size > m_ramSize || size > sizeof(uint64_t)) {
+        return ~0ull;
+    }
+    uint8_t bytes[sizeof(uint64_t)] = { 0 };
+    memcpy(bytes, &m_ram[address - m_ramBase], size);
+
+    // Hide planted breakpoints from the guest
+    if (!m_breakpoints.empty()) {
+        for (size_t i = 0; i < size; i++) {
+            auto it = m_breakpoints.find(address + i);
+            if (it != m_breakpoints.end()) {
+                bytes[i] = m_watches[it->second].original;
+            }
+        }
+    }
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    TrapAccess(address, size, false, elapsedNs(start));
+    return value;
+}
+
+void WatchManager::MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+    if (address < m_ramBase || address - m_ramBase + size > m_ramSize || size > sizeof(uint64_t)) {
+        return;
+    }
+    memcpy(&m_ram[address - m_ramBase], &value, size);
+    TrapAccess(address, size, true, elapsedNs(start));
+}
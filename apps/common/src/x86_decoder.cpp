@@ -0,0 +1,338 @@
+/*
+Defines a lightweight x86 instruction decoder that determines instruction
+boundaries, operand layout and control flow without fully disassembling.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "x86_decoder.hpp"
+
+#include <cstring>
+
+// Opcodes that take a ModR/M byte, one bit per opcode in rows of 16.
+static const uint16_t modrmMap0[16] = {
+    0x0F0F, 0x0F0F, 0x0F0F, 0x0F0F, 0x0000, 0x0000, 0x0A0C, 0x0000,  // 00-7F
+    0xFFFF, 0x0000, 0x0000, 0x0000, 0x00F3, 0xFF0F, 0x0000, 0xC0C0,  // 80-FF
+};
+
+static const uint16_t modrmMap1[16] = {
+    0xA00F, 0xFFFF, 0xFFFF, 0x0000, 0xFFFF, 0xFFFF, 0xFFFF, 0xFF7F,  // 0F 00-7F
+    0x0000, 0xFFFF, 0xF838, 0xFFFF, 0x00FF, 0xFFFF, 0xFFFF, 0xFFFF,  // 0F 80-FF
+};
+
+static inline bool testBit(const uint16_t *map, uint8_t opcode) noexcept {
+    return (map[opcode >> 4] >> (opcode & 0xF)) & 1;
+}
+
+// One-byte opcodes that do not exist in 64-bit mode
+static bool invalidIn64(uint8_t opcode) noexcept {
+    switch (opcode) {
+    case 0x06: case 0x07: case 0x0E: case 0x16: case 0x17: case 0x1E: case 0x1F:
+    case 0x27: case 0x2F: case 0x37: case 0x3F: case 0x60: case 0x61: case 0x82:
+    case 0x9A: case 0xD4: case 0xD5: case 0xD6: case 0xEA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int64_t signExtend(const uint8_t *bytes, size_t size) noexcept {
+    switch (size) {
+    case 1: return (int8_t)bytes[0];
+    case 2: { int16_t v; memcpy(&v, bytes, 2); return v; }
+    case 4: { int32_t v; memcpy(&v, bytes, 4); return v; }
+    default: return 0;
+    }
+}
+
+bool decodeX86(const uint8_t *code, size_t size, uint64_t address, X86Mode mode, X86Instruction& insn) noexcept {
+    memset(&insn, 0, sizeof(insn));
+    const size_t maxLength = (size < 15) ? size : 15;
+    const bool long64 = mode == X86Mode::Bits64;
+    size_t pos = 0;
+
+    // ----- Prefixes ---------------------------------------------------------------------------------------------------------
+
+    bool operandOverride = false;
+    bool addressOverride = false;
+    for (;;) {
+        if (pos >= maxLength) {
+            return false;
+        }
+        const uint8_t b = code[pos];
+        if (b == 0x66) operandOverride = true;
+        else if (b == 0x67) addressOverride = true;
+        else if (b == 0xF0) insn.lock = true;
+        else if (b == 0xF2) { insn.repne = true; insn.rep = false; }
+        else if (b == 0xF3) { insn.rep = true; insn.repne = false; }
+        else if (b == 0x26 || b == 0x2E || b == 0x36 || b == 0x3E || b == 0x64 || b == 0x65) insn.segment = b;
+        else break;
+        pos++;
+    }
+    if (long64 && (code[pos] & 0xF0) == 0x40) {
+        insn.rex = code[pos++];
+        if (pos >= maxLength) {
+            return false;
+        }
+    }
+
+    switch (mode) {
+    case X86Mode::Bits16:
+        insn.operandSize = operandOverride ? 4 : 2;
+        insn.addressSize = addressOverride ? 4 : 2;
+        break;
+    case X86Mode::Bits32:
+        insn.operandSize = operandOverride ? 2 : 4;
+        insn.addressSize = addressOverride ? 2 : 4;
+        break;
+    case X86Mode::Bits64:
+        insn.operandSize = (insn.rex & 0x08) ? 8 : (operandOverride ? 2 : 4);
+        insn.addressSize = addressOverride ? 4 : 8;
+        break;
+    }
+
+    // ----- Opcode -----------------------------------------------------------------------------------------------------------
+
+    uint8_t b = code[pos];
+    const bool vexCandidate = (b == 0xC4 || b == 0xC5 || b == 0x62) && pos + 1 < maxLength && (long64 || (code[pos + 1] & 0xC0) == 0xC0);
+    if (vexCandidate) {
+        // EVEX is not supported; VEX may not be combined with legacy SIMD prefixes or REX
+        if (b == 0x62 || operandOverride || insn.rep || insn.repne || insn.rex) {
+            return false;
+        }
+        insn.vex = true;
+        uint8_t pp;
+        if (b == 0xC5) {
+            pp = code[pos + 1] & 3;
+            insn.opcodeMap = 1;
+            pos += 2;
+        }
+        else {
+            if (pos + 2 >= maxLength) {
+                return false;
+            }
+            insn.opcodeMap = code[pos + 1] & 0x1F;
+            if (insn.opcodeMap < 1 || insn.opcodeMap > 3) {
+                return false;
+            }
+            pp = code[pos + 2] & 3;
+            if (long64 && (code[pos + 2] & 0x80)) {
+                insn.operandSize = 8;
+            }
+            pos += 3;
+        }
+        insn.rep = pp == 2;
+        insn.repne = pp == 3;
+        if (pos >= maxLength) {
+            return false;
+        }
+        insn.opcodeOffset = (uint8_t)pos;
+        insn.opcode = code[pos++];
+        // VZEROUPPER and VZEROALL are the only VEX instructions without ModR/M
+        insn.hasModRM = !(insn.opcodeMap == 1 && insn.opcode == 0x77);
+    }
+    else if (b == 0x0F) {
+        if (++pos >= maxLength) {
+            return false;
+        }
+        b = code[pos];
+        if (b == 0x38 || b == 0x3A) {
+            insn.opcodeMap = (b == 0x38) ? 2 : 3;
+            if (++pos >= maxLength) {
+                return false;
+            }
+            insn.hasModRM = true;
+        }
+        else {
+            insn.opcodeMap = 1;
+            insn.hasModRM = testBit(modrmMap1, b);
+        }
+        insn.opcodeOffset = (uint8_t)pos;
+        insn.opcode = code[pos++];
+    }
+    else {
+        if (long64 && invalidIn64(b)) {
+            return false;
+        }
+        insn.opcodeMap = 0;
+        insn.opcodeOffset = (uint8_t)pos;
+        insn.opcode = code[pos++];
+        insn.hasModRM = testBit(modrmMap0, b);
+    }
+
+    // ----- ModR/M, SIB and displacement -------------------------------------------------------------------------------------
+
+    if (insn.hasModRM) {
+        if (pos >= maxLength) {
+            return false;
+        }
+        insn.modrm = code[pos++];
+        // Moves to and from control, debug and test registers ignore the mod
+        // field and always use the register form
+        const bool registerForm = insn.opcodeMap == 1 && insn.opcode >= 0x20 && insn.opcode <= 0x27;
+        const uint8_t mod = registerForm ? 3 : (insn.modrm >> 6);
+        const uint8_t rm = insn.modrm & 7;
+        if (insn.addressSize == 2) {
+            if ((mod == 0 && rm == 6) || mod == 2) insn.dispSize = 2;
+            else if (mod == 1) insn.dispSize = 1;
+        }
+        else if (mod != 3) {
+            if (rm == 4) {
+                if (pos >= maxLength) {
+                    return false;
+                }
+                insn.hasSIB = true;
+                insn.sib = code[pos++];
+                if (mod == 0 && (insn.sib & 7) == 5) {
+                    insn.dispSize = 4;
+                }
+            }
+            if (mod == 0 && rm == 5) insn.dispSize = 4;
+            else if (mod == 1) insn.dispSize = 1;
+            else if (mod == 2) insn.dispSize = 4;
+        }
+        insn.dispOffset = (uint8_t)pos;
+        pos += insn.dispSize;
+    }
+
+    // ----- Immediate --------------------------------------------------------------------------------------------------------
+
+    const uint8_t op = insn.opcode;
+    const uint8_t reg = (insn.modrm >> 3) & 7;
+    const uint8_t iz = (insn.operandSize == 2) ? 2 : 4;
+    uint8_t immSize = 0;
+    if (insn.vex) {
+        if (insn.opcodeMap == 3 || (insn.opcodeMap == 1 && ((op >= 0x70 && op <= 0x73) || op == 0xC2 || (op >= 0xC4 && op <= 0xC6)))) {
+            immSize = 1;
+        }
+    }
+    else if (insn.opcodeMap == 0) {
+        if (op < 0x40 && (op & 7) == 4) immSize = 1;
+        else if (op < 0x40 && (op & 7) == 5) immSize = iz;
+        else if (op >= 0x70 && op <= 0x7F) immSize = 1;
+        else if (op >= 0xB0 && op <= 0xB7) immSize = 1;
+        else if (op >= 0xB8 && op <= 0xBF) immSize = insn.operandSize;
+        else if (op >= 0xE0 && op <= 0xE7) immSize = 1;
+        else if (op >= 0xA0 && op <= 0xA3) immSize = insn.addressSize;
+        else {
+            switch (op) {
+            case 0x6A: case 0x6B: case 0x80: case 0x82: case 0x83: case 0xA8:
+            case 0xC0: case 0xC1: case 0xC6: case 0xCD: case 0xD4: case 0xD5: case 0xEB:
+                immSize = 1;
+                break;
+            case 0x68: case 0x69: case 0x81: case 0xA9: case 0xC7:
+                immSize = iz;
+                break;
+            case 0xE8: case 0xE9:
+                immSize = long64 ? 4 : iz;
+                break;
+            case 0xC2: case 0xCA:
+                immSize = 2;
+                break;
+            case 0xC8:
+                immSize = 3;
+                break;
+            case 0x9A: case 0xEA:
+                immSize = 2 + iz;
+                break;
+            case 0xF6:
+                immSize = (reg < 2) ? 1 : 0;
+                break;
+            case 0xF7:
+                immSize = (reg < 2) ? iz : 0;
+                break;
+            }
+        }
+    }
+    else if (insn.opcodeMap == 1) {
+        if (op >= 0x80 && op <= 0x8F) immSize = long64 ? 4 : iz;
+        else {
+            switch (op) {
+            case 0x0F: case 0x70: case 0x71: case 0x72: case 0x73: case 0xA4: case 0xAC:
+            case 0xBA: case 0xC2: case 0xC4: case 0xC5: case 0xC6:
+                immSize = 1;
+                break;
+            }
+        }
+    }
+    else if (insn.opcodeMap == 3) {
+        immSize = 1;
+    }
+    insn.immOffset = (uint8_t)pos;
+    insn.immSize = immSize;
+    pos += immSize;
+
+    if (pos > maxLength) {
+        return false;
+    }
+    insn.length = (uint8_t)pos;
+
+    // ----- Control flow -----------------------------------------------------------------------------------------------------
+
+    const uint64_t next = address + insn.length;
+    auto relTarget = [&]() {
+        uint64_t target = next + (uint64_t)signExtend(&code[insn.immOffset], insn.immSize);
+        if (mode == X86Mode::Bits32) {
+            target &= 0xFFFFFFFF;
+        }
+        return target;
+    };
+
+    insn.flow = X86Flow::Sequential;
+    if (insn.vex) {
+        return true;
+    }
+    if (insn.opcodeMap == 0) {
+        if ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3)) {
+            insn.flow = X86Flow::ConditionalJump;
+            insn.target = relTarget();
+        }
+        else {
+            switch (op) {
+            case 0xE8: insn.flow = X86Flow::Call; insn.target = relTarget(); break;
+            case 0xE9: case 0xEB: insn.flow = X86Flow::Jump; insn.target = relTarget(); break;
+            case 0x9A: insn.flow = X86Flow::IndirectCall; break;
+            case 0xEA: insn.flow = X86Flow::IndirectJump; break;
+            case 0xC2: case 0xC3: case 0xCA: case 0xCB: case 0xCF: insn.flow = X86Flow::Return; break;
+            case 0xCC: case 0xCD: case 0xCE: case 0xF1: insn.flow = X86Flow::Interrupt; break;
+            case 0xF4: insn.flow = X86Flow::Halt; break;
+            case 0xFF:
+                if (reg == 2 || reg == 3) insn.flow = X86Flow::IndirectCall;
+                else if (reg == 4 || reg == 5) insn.flow = X86Flow::IndirectJump;
+                break;
+            }
+        }
+    }
+    else if (insn.opcodeMap == 1) {
+        if (op >= 0x80 && op <= 0x8F) {
+            insn.flow = X86Flow::ConditionalJump;
+            insn.target = relTarget();
+        }
+        else {
+            switch (op) {
+            case 0x05: case 0x34: insn.flow = X86Flow::Interrupt; break;
+            case 0x07: case 0x0B: case 0x35: case 0xAA: case 0xB9: case 0xFF: insn.flow = X86Flow::Terminate; break;
+            }
+        }
+    }
+    return true;
+}
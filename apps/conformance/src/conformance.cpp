@@ -0,0 +1,447 @@
+/*
+Runs the same guest on every available platform concurrently, compares their
+behavior and reports their performance.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "reference_cpu.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+
+const uint16_t inputPort = 0x80;
+const uint64_t mmioBase = 0xE0000000;
+const size_t maxExits = 1000000;
+
+static void writeDefaultGuest(uint8_t *ram) noexcept {
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Mixes port and MMIO reads into a hash, exercising the MMIO TEST
+    // instruction along the way, then runs a compute-bound loop. Intermediate
+    // hashes are stored at 0x4000, the final hash at 0x3000.
+    addr = kernelBase;
+    emit(ram, "\xbf\x00\x00\x00\xe0");             // [0x1000] mov    edi, 0xe0000000
+    emit(ram, "\x31\xdb");                         // [0x1005] xor    ebx, ebx
+    emit(ram, "\xb9\x40\x00\x00\x00");             // [0x1007] mov    ecx, 64
+    emit(ram, "\xe5\x80");                         // [0x100c] in     eax, 0x80
+    emit(ram, "\x01\xc3");                         // [0x100e] add    ebx, eax
+    emit(ram, "\x8b\x07");                         // [0x1010] mov    eax, [edi]
+    emit(ram, "\x31\xc3");                         // [0x1012] xor    ebx, eax
+    emit(ram, "\x85\x0f");                         // [0x1014] test   [edi], ecx
+    emit(ram, "\x0f\x95\xc2");                     // [0x1016] setnz  dl
+    emit(ram, "\x0f\xb6\xd2");                     // [0x1019] movzx  edx, dl
+    emit(ram, "\x01\xd3");                         // [0x101c] add    ebx, edx
+    emit(ram, "\x89\x5f\x04");                     // [0x101e] mov    [edi+4], ebx
+    emit(ram, "\xe7\x81");                         // [0x1021] out    0x81, eax
+    emit(ram, "\x69\xdb\x93\x01\x00\x01");         // [0x1023] imul   ebx, ebx, 0x01000193
+    emit(ram, "\x89\x1c\x8d\x00\x40\x00\x00");     // [0x1029] mov    [ecx*4+0x4000], ebx
+    emit(ram, "\x49");                             // [0x1030] dec    ecx
+    emit(ram, "\x75\xd9");                         // [0x1031] jnz    0x100c
+    emit(ram, "\xb9\x00\x00\x10\x00");             // [0x1033] mov    ecx, 0x100000
+    emit(ram, "\x6b\xdb\x21");                     // [0x1038] imul   ebx, ebx, 33
+    emit(ram, "\x01\xcb");                         // [0x103b] add    ebx, ecx
+    emit(ram, "\x49");                             // [0x103d] dec    ecx
+    emit(ram, "\x75\xf8");                         // [0x103e] jnz    0x1038
+    emit(ram, "\x89\x1d\x00\x30\x00\x00");         // [0x1040] mov    [0x3000], ebx
+    emit(ram, "\xf4");                             // [0x1046] hlt
+#undef emit
+}
+
+// A deterministic device that answers reads with sequences and hashes every
+// access, so that platforms performing extra or missing accesses stand out.
+class WorkloadDevice : public IODevice {
+public:
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        Mix(port, size, 0);
+        return (port == inputPort) ? ++m_ioReads * 0x9E3779B9 : 0xFFFFFFFF;
+    }
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        Mix(port, size, value);
+    }
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override {
+        Mix(address, size, 0);
+        return (uint32_t)((address - mmioBase) * 0x01000193) ^ ++m_mmioReads;
+    }
+    void MMIOWrite(uint64_t address, size_t size, uint64_t value) noexcept override {
+        Mix(address, size, value);
+    }
+
+    uint64_t Hash() const noexcept { return m_hash; }
+    uint64_t Accesses() const noexcept { return m_accesses; }
+
+private:
+    uint32_t m_ioReads = 0;
+    uint32_t m_mmioReads = 0;
+    uint64_t m_hash = 0xcbf29ce484222325;
+    uint64_t m_accesses = 0;
+
+    void Mix(uint64_t address, size_t size, uint64_t value) noexcept {
+        const uint64_t words[] = { address, size, value };
+        for (uint64_t word : words) {
+            m_hash = (m_hash ^ word) * 0x100000001b3;
+        }
+        m_accesses++;
+    }
+};
+
+static const Reg compareRegs[] = {
+    Reg::EAX, Reg::ECX, Reg::EDX, Reg::EBX, Reg::ESP, Reg::EBP, Reg::ESI, Reg::EDI, Reg::EIP, Reg::EFLAGS,
+};
+static const char *compareRegNames[] = {
+    "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI", "EIP", "EFLAGS",
+};
+const size_t numCompareRegs = array_size(compareRegs);
+
+struct ExitRecord {
+    VMExitReason reason;
+    uint64_t rip;
+};
+
+// Everything observed while running the guest on one platform.
+struct PlatformRun {
+    std::string name;
+    Platform *platform;  // NULL for the reference interpreter
+    bool ok = false;
+    std::string error;
+
+    // Observations from the first run
+    std::vector<ExitRecord> exits;
+    uint64_t regs[numCompareRegs];
+    std::vector<uint8_t> ram;
+    uint64_t deviceHash = 0;
+    uint64_t deviceAccesses = 0;
+
+    std::vector<double> milliseconds;
+};
+
+// Runs the guest until HLT, recording exits and the final state if observing.
+// Works with both virt86 virtual processors and the reference interpreter.
+template<typename VP>
+static bool runToHalt(PlatformRun& run, VP& vp, const uint8_t *ram, const WorkloadDevice& device, bool observe) {
+    bool ok = false;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < maxExits; i++) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            run.error = "virtual processor failed to run";
+            break;
+        }
+        const VMExitReason reason = vp.GetVMExitInfo().reason;
+        if (observe) {
+            RegValue rip;
+            vp.RegRead(Reg::EIP, rip);
+            run.exits.push_back(ExitRecord{ reason, rip.u32 });
+        }
+        if (reason == VMExitReason::HLT) {
+            ok = true;
+            break;
+        }
+        if (reason != VMExitReason::PIO && reason != VMExitReason::MMIO) {
+            run.error = std::string("unexpected exit: ") + reason_str(reason);
+            break;
+        }
+    }
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (ok) {
+        run.milliseconds.push_back(elapsed.count());
+    }
+    else if (run.error.empty()) {
+        run.error = "guest did not halt";
+    }
+
+    if (observe) {
+        RegValue values[numCompareRegs];
+        vp.RegRead(compareRegs, values, numCompareRegs);
+        for (size_t i = 0; i < numCompareRegs; i++) {
+            run.regs[i] = values[i].u32;
+        }
+        run.ram.assign(ram, ram + ramSize);
+        run.deviceHash = device.Hash();
+        run.deviceAccesses = device.Accesses();
+    }
+    return ok;
+}
+
+// Allocates the boot ROM and RAM and loads the guest image.
+static bool allocateGuest(PlatformRun& run, const std::vector<uint8_t>& image, uint8_t *& rom, uint8_t *& ram) {
+    rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        run.error = "failed to allocate guest memory";
+        alignedFree(rom);
+        alignedFree(ram);
+        return false;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    memset(ram, 0, ramSize);
+    memcpy(&ram[kernelBase], image.data(), image.size());
+    return true;
+}
+
+// Boots the guest image on a new virtual machine and runs it until HLT.
+static bool runGuest(PlatformRun& run, const std::vector<uint8_t>& image, bool observe) {
+    Platform& platform = *run.platform;
+    uint8_t *rom;
+    uint8_t *ram;
+    if (!allocateGuest(run, image, rom, ram)) {
+        return false;
+    }
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        run.error = "failed to create virtual machine";
+        alignedFree(ram);
+        alignedFree(rom);
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+
+    bool ok = false;
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        run.error = "failed to map ROM";
+    }
+    else if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        run.error = "failed to map RAM";
+    }
+    else {
+        auto& vp = vm.GetVirtualProcessor(0)->get();
+        WorkloadDevice device;
+        IOBus bus;
+        bus.AddPIODevice(0, 0x10000, device);
+        bus.AddMMIODevice(mmioBase, PAGE_SIZE, device);
+        bus.Attach(vm);
+        ok = runToHalt(run, vp, ram, device, observe);
+    }
+
+    platform.FreeVM(vm);
+    alignedFree(ram);
+    alignedFree(rom);
+    return ok;
+}
+
+// Runs the guest image on the software reference interpreter, which needs no
+// hypervisor and is therefore always available.
+static bool runReference(PlatformRun& run, const std::vector<uint8_t>& image, bool observe) {
+    uint8_t *rom;
+    uint8_t *ram;
+    if (!allocateGuest(run, image, rom, ram)) {
+        return false;
+    }
+
+    ReferenceCPU cpu;
+    cpu.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom);
+    cpu.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram);
+    WorkloadDevice device;
+    IOBus bus;
+    bus.AddPIODevice(0, 0x10000, device);
+    bus.AddMMIODevice(mmioBase, PAGE_SIZE, device);
+    bus.Attach(cpu);
+    const bool ok = runToHalt(run, cpu, ram, device, observe);
+
+    alignedFree(ram);
+    alignedFree(rom);
+    return ok;
+}
+
+// Prints the differences between a platform's observations and the
+// reference. Returns true if they behaved the same.
+static bool compareRuns(const PlatformRun& ref, const PlatformRun& run) {
+    bool same = true;
+    const char *refName = ref.name.c_str();
+    const char *name = run.name.c_str();
+
+    const size_t numExits = std::min(ref.exits.size(), run.exits.size());
+    for (size_t i = 0; i < numExits; i++) {
+        auto& a = ref.exits[i];
+        auto& b = run.exits[i];
+        if (a.reason != b.reason || a.rip != b.rip) {
+            printf("  Exit #%zu: %s at 0x%" PRIx64 " on %s, %s at 0x%" PRIx64 " on %s\n", i, reason_str(a.reason), a.rip, refName, reason_str(b.reason), b.rip, name);
+            same = false;
+            break;
+        }
+    }
+    if (ref.exits.size() != run.exits.size()) {
+        printf("  %zu exits on %s, %zu on %s\n", ref.exits.size(), refName, run.exits.size(), name);
+        same = false;
+    }
+
+    for (size_t i = 0; i < numCompareRegs; i++) {
+        if (ref.regs[i] != run.regs[i]) {
+            printf("  %-6s = 0x%08" PRIx64 " on %s, 0x%08" PRIx64 " on %s\n", compareRegNames[i], ref.regs[i], refName, run.regs[i], name);
+            same = false;
+        }
+    }
+
+    size_t diffBytes = 0;
+    size_t firstDiff = 0;
+    for (size_t i = 0; i < ramSize; i++) {
+        if (ref.ram[i] != run.ram[i]) {
+            if (diffBytes++ == 0) {
+                firstDiff = i;
+            }
+        }
+    }
+    if (diffBytes > 0) {
+        printf("  RAM differs in %zu bytes, starting at 0x%zx\n", diffBytes, firstDiff);
+        same = false;
+    }
+
+    if (ref.deviceHash != run.deviceHash) {
+        printf("  Device accesses differ: %" PRIu64 " on %s, %" PRIu64 " on %s\n", ref.deviceAccesses, refName, run.deviceAccesses, name);
+        same = false;
+    }
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    // Usage: virt86-conformance [guest image [runs]]
+    // The image is a flat 32-bit binary loaded and started at 0x1000.
+    std::vector<uint8_t> image;
+    if (argc > 1) {
+        FILE *fp = fopen(argv[1], "rb");
+        if (fp == NULL) {
+            printf("fatal: could not open %s\n", argv[1]);
+            return -1;
+        }
+        image.resize(ramSize - kernelBase);
+        image.resize(fread(image.data(), 1, image.size(), fp));
+        fclose(fp);
+    }
+    else {
+        std::vector<uint8_t> ram(ramSize);
+        writeDefaultGuest(ram.data());
+        image.assign(ram.begin() + kernelBase, ram.end());
+    }
+    const size_t numRuns = (argc > 2) ? std::max(1ul, strtoul(argv[2], NULL, 10)) : 5;
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    // The reference interpreter always runs, so the guest can be checked
+    // even on hosts without any hypervisor. With --reference the only
+    // platform loaded is that same interpreter behind the virt86 interface,
+    // so the built-in run is left out rather than compared with itself.
+    std::vector<PlatformRun> runs;
+    for (Platform *platform : loadAllPlatforms()) {
+        runs.emplace_back();
+        runs.back().name = platform->GetName();
+        runs.back().platform = platform;
+    }
+    if (!referencePlatformSelected()) {
+        runs.emplace_back();
+        runs.back().name = "Interpreter";
+        runs.back().platform = NULL;
+    }
+    if (runs.empty()) {
+        // loadAllPlatforms already said why
+        return -1;
+    }
+
+    // Each platform runs on its own thread; the first run of each records
+    // exits and final state, the others are only timed
+    printf("\nRunning the guest %zu times on %zu platform%s\n", numRuns, runs.size(), runs.size() == 1 ? "" : "s");
+    std::vector<std::thread> threads;
+    for (auto& run : runs) {
+        threads.emplace_back([&run, &image, numRuns]() {
+            auto runOnce = (run.platform != NULL) ? runGuest : runReference;
+            run.ok = runOnce(run, image, true);
+            for (size_t i = 1; run.ok && i < numRuns; i++) {
+                run.ok = runOnce(run, image, false);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Compare every platform against the first one that completed
+    const PlatformRun *ref = NULL;
+    bool conformant = true;
+    printf("\n");
+    for (auto& run : runs) {
+        if (!run.ok) {
+            printf("%s: %s\n", run.name.c_str(), run.error.c_str());
+            conformant = false;
+            continue;
+        }
+        if (ref == NULL) {
+            ref = &run;
+            printf("%s: reference\n", run.name.c_str());
+            continue;
+        }
+        printf("%s:\n", run.name.c_str());
+        if (compareRuns(*ref, run)) {
+            printf("  Matches %s\n", ref->name.c_str());
+        }
+        else {
+            conformant = false;
+        }
+    }
+
+    printf("\n%-20s %8s %12s %12s %14s %9s\n", "Platform", "Exits", "Best (ms)", "Mean (ms)", "Exits/s", "Relative");
+    double fastest = 0.0;
+    for (auto& run : runs) {
+        if (run.ok) {
+            const double best = *std::min_element(run.milliseconds.begin(), run.milliseconds.end());
+            if (fastest == 0.0 || best < fastest) {
+                fastest = best;
+            }
+        }
+    }
+    for (auto& run : runs) {
+        if (!run.ok) {
+            printf("%-20s %8s\n", run.name.c_str(), "failed");
+            continue;
+        }
+        double best = run.milliseconds[0];
+        double total = 0.0;
+        for (double ms : run.milliseconds) {
+            best = std::min(best, ms);
+            total += ms;
+        }
+        const double mean = total / run.milliseconds.size();
+        printf("%-20s %8zu %12.3f %12.3f %14.0f %8.2fx\n", run.name.c_str(), run.exits.size(), best, mean,
+            run.exits.size() / (mean / 1000.0), best / fastest);
+    }
+
+    printf("\n%s\n", conformant ? "All platforms behaved identically" : "Platforms diverged");
+    return conformant ? 0 : -1;
+}
@@ -0,0 +1,254 @@
+/*
+Entry point of the code coverage demo.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "block_coverage.hpp"
+#include "flat_guest.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t resultAddr = 0x3000;
+const uint32_t stackTop = 0x8000;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Count the primes below 1000 by trial division and store the result at
+    // 0x3000. The error path at 0x103e is never taken.
+    addr = kernelBase;
+    emit(ram, "\x31\xf6");                                 // [0x1000] xor    esi, esi
+    emit(ram, "\xbb\x02\x00\x00\x00");                     // [0x1002] mov    ebx, 2
+    emit(ram, "\x81\xfb\xe8\x03\x00\x00");                 // [0x1007] cmp    ebx, 1000
+    emit(ram, "\x73\x1e");                                 // [0x100d] jae    0x102d
+    emit(ram, "\xb9\x02\x00\x00\x00");                     // [0x100f] mov    ecx, 2
+    emit(ram, "\x89\xc8");                                 // [0x1014] mov    eax, ecx
+    emit(ram, "\xf7\xe1");                                 // [0x1016] mul    ecx
+    emit(ram, "\x39\xd8");                                 // [0x1018] cmp    eax, ebx
+    emit(ram, "\x77\x0d");                                 // [0x101a] ja     0x1029
+    emit(ram, "\x89\xd8");                                 // [0x101c] mov    eax, ebx
+    emit(ram, "\x31\xd2");                                 // [0x101e] xor    edx, edx
+    emit(ram, "\xf7\xf1");                                 // [0x1020] div    ecx
+    emit(ram, "\x85\xd2");                                 // [0x1022] test   edx, edx
+    emit(ram, "\x74\x04");                                 // [0x1024] jz     0x102a
+    emit(ram, "\x41");                                     // [0x1026] inc    ecx
+    emit(ram, "\xeb\xeb");                                 // [0x1027] jmp    0x1014
+    emit(ram, "\x46");                                     // [0x1029] inc    esi
+    emit(ram, "\x43");                                     // [0x102a] inc    ebx
+    emit(ram, "\xeb\xda");                                 // [0x102b] jmp    0x1007
+    emit(ram, "\x89\x35\x00\x30\x00\x00");                 // [0x102d] mov    [0x3000], esi
+    emit(ram, "\x81\xfe\xa8\x00\x00\x00");                 // [0x1033] cmp    esi, 168
+    emit(ram, "\x75\x03");                                 // [0x1039] jne    0x103e
+    emit(ram, "\xf4");                                     // [0x103b] hlt
+    emit(ram, "\xeb\xfd");                                 // [0x103c] jmp    0x103b
+    emit(ram, "\xc7\x05\x04\x30\x00\x00\xef\xbe\xad\xde"); // [0x103e] mov    dword ptr [0x3004], 0xdeadbeef
+    emit(ram, "\xeb\xf1");                                 // [0x1048] jmp    0x103b
+#undef emit
+}
+
+// Creates a VM running the guest from scratch.
+static VirtualMachine *createVM(Platform& platform, uint8_t *rom, uint8_t *ram) {
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return NULL;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+    return &vm;
+}
+
+static void printCoverage(const BlockCoverage& coverage) {
+    printf("  Blocks covered: %zu of %zu\n", coverage.HitCount(), coverage.Blocks().size());
+    for (auto& block : coverage.Blocks()) {
+        printf("    0x%04" PRIx64 " (%2u bytes) %s\n", block.address, block.size, block.hit ? "hit" : "-");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Usage: virt86-coverage-demo [output prefix]
+    const char *prefix = (argc > 1) ? argv[1] : "coverage";
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().guestDebugging) {
+        printf("fatal: platform does not support guest debugging\n");
+        return -1;
+    }
+
+    // ----- One-shot breakpoints ---------------------------------------------------------------------------------------------
+
+    printf("\nCollecting coverage with one-shot breakpoints\n");
+    VirtualMachine *vm = createVM(platform, rom, ram);
+    if (vm == NULL) {
+        return -1;
+    }
+    auto& vp = vm->GetVirtualProcessor(0)->get();
+
+    BlockCoverage coverage(vp);
+    printf("  Found %zu basic blocks\n", coverage.Discover(ram, ramBase, ramSize, X86Mode::Bits32, { kernelBase }));
+    if (!coverage.Arm()) {
+        printf("fatal: failed to enable software breakpoints\n");
+        return -1;
+    }
+
+    uint64_t exits = 0;
+    bool running = true;
+    auto start = std::chrono::steady_clock::now();
+    while (running) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            return -1;
+        }
+        exits++;
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::SoftwareBreakpoint:
+            if (!coverage.HandleBreakpoint()) {
+                printf("Unexpected breakpoint\n");
+                running = false;
+            }
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> bpTime = std::chrono::steady_clock::now() - start;
+    coverage.Disarm();
+
+    uint32_t primes;
+    memcpy(&primes, &ram[resultAddr], sizeof(primes));
+    printf("  Guest found %u primes\n", primes);
+    printf("  VM exits: %" PRIu64 ", time: %.3f ms\n", exits, bpTime.count() * 1000.0);
+    printCoverage(coverage);
+
+    std::string drcovPath = std::string(prefix) + ".drcov";
+    std::string lcovPath = std::string(prefix) + ".info";
+    if (coverage.WriteDrcov(drcovPath.c_str(), "guest") && coverage.WriteLcov(lcovPath.c_str(), "guest")) {
+        printf("  Coverage written to %s and %s\n", drcovPath.c_str(), lcovPath.c_str());
+    }
+    else {
+        printf("  Failed to write coverage files\n");
+    }
+    platform.FreeVM(*vm);
+
+    // ----- Single stepping --------------------------------------------------------------------------------------------------
+
+    printf("\nCollecting coverage by single stepping, for comparison\n");
+    vm = createVM(platform, rom, ram);
+    if (vm == NULL) {
+        return -1;
+    }
+    auto& stepVP = vm->GetVirtualProcessor(0)->get();
+
+    BlockCoverage stepCoverage(stepVP);
+    stepCoverage.Discover(ram, ramBase, ramSize, X86Mode::Bits32, { kernelBase });
+
+    uint64_t steps = 0;
+    running = true;
+    start = std::chrono::steady_clock::now();
+    while (running) {
+        if (stepVP.Step() != VPExecutionStatus::OK) {
+            printf("VCPU failed to step\n");
+            return -1;
+        }
+        steps++;
+        auto& exitInfo = stepVP.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::Step:
+        {
+            RegValue eip;
+            stepVP.RegRead(Reg::EIP, eip);
+            stepCoverage.MarkHit(eip.u32);
+            break;
+        }
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> stepTime = std::chrono::steady_clock::now() - start;
+    printf("  VM exits: %" PRIu64 ", time: %.3f ms\n", steps, stepTime.count() * 1000.0);
+    printf("  Blocks covered: %zu of %zu\n", stepCoverage.HitCount(), stepCoverage.Blocks().size());
+    platform.FreeVM(*vm);
+
+    printf("\nOne-shot breakpoints took %.1fx fewer VM exits and ran %.1fx faster\n",
+        (double)steps / exits, stepTime.count() / bpTime.count());
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+Entry point of the decoded instruction cache demo. Runs a guest that polls
+a device register in a tight loop and attributes every MMIO exit to the
+instruction that caused it, with and without the decode cache.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "decode_cache.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+const uint32_t resultAddr = 0x3000;
+
+const uint64_t deviceBase = 0xE0000000;
+const uint32_t readsPerPhase = 5000;
+const uint32_t numPhases = 2;
+
+// Dirty pages are checked after this many MMIO exits and on every other exit
+const uint64_t refreshInterval = 256;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Polls the device's status register until it is ready, then adds the
+    // data register to a sum, 5000 times. Between the two phases, the guest
+    // patches the data read to use the register at offset 8 instead of 4 and
+    // signals the host through port 0x80. The sum is stored at 0x3000.
+    addr = kernelBase;
+    emit(ram, "\xbf\x00\x00\x00\xe0");             // [0x1000] mov    edi, 0xe0000000
+    emit(ram, "\x31\xdb");                         // [0x1005] xor    ebx, ebx
+    emit(ram, "\xbd\x02\x00\x00\x00");             // [0x1007] mov    ebp, 2
+    emit(ram, "\xbe\x88\x13\x00\x00");             // [0x100c] mov    esi, 5000
+    emit(ram, "\xf6\x07\x01");                     // [0x1011] test   byte ptr [edi], 1
+    emit(ram, "\x74\xfb");                         // [0x1014] jz     0x1011
+    emit(ram, "\x8b\x47\x04");                     // [0x1016] mov    eax, [edi+4]
+    emit(ram, "\x01\xc3");                         // [0x1019] add    ebx, eax
+    emit(ram, "\x4e");                             // [0x101b] dec    esi
+    emit(ram, "\x75\xf3");                         // [0x101c] jnz    0x1011
+    emit(ram, "\xc6\x05\x18\x10\x00\x00\x08");     // [0x101e] mov    byte ptr [0x1018], 8
+    emit(ram, "\xe6\x80");                         // [0x1025] out    0x80, al
+    emit(ram, "\x4d");                             // [0x1027] dec    ebp
+    emit(ram, "\x75\xe2");                         // [0x1028] jnz    0x100c
+    emit(ram, "\x89\x1d\x00\x30\x00\x00");         // [0x102a] mov    [0x3000], ebx
+    emit(ram, "\xf4");                             // [0x1030] hlt
+#undef emit
+}
+
+// A device whose status register reports ready on every fourth read. The data
+// registers at offsets 4 and 8 return sequences; the device keeps the sum of
+// the values it handed out so the guest's result can be checked.
+class PollDevice : public IODevice {
+public:
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override {
+        uint32_t value;
+        switch (address - deviceBase) {
+        case 0: value = (++m_statusReads % 4 == 0) ? 1 : 0; break;
+        case 4: value = ++m_counter; m_sum += value; break;
+        case 8: value = ++m_counter * 3; m_sum += value; break;
+        default: value = 0xFFFFFFFF; break;
+        }
+        return value & (size >= 4 ? 0xFFFFFFFF : (1u << (size * 8)) - 1);
+    }
+
+    uint32_t Sum() const noexcept { return m_sum; }
+
+private:
+    uint32_t m_statusReads = 0;
+    uint32_t m_counter = 0;
+    uint32_t m_sum = 0;
+};
+
+// Instruction that caused MMIO exits
+struct Site {
+    uint8_t length;
+    uint8_t opcodeMap;
+    uint8_t opcode;
+    uint8_t operandSize;
+    uint64_t exits;
+};
+
+// Runs the guest, looking up the instruction behind every MMIO exit. Returns
+// false if the guest could not run.
+static bool runGuest(Platform& platform, uint8_t *rom, uint8_t *ram, bool useCache) {
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute | MemoryFlags::DirtyPageTracking, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    PollDevice device;
+    IOBus bus;
+    bus.AddMMIODevice(deviceBase, PAGE_SIZE, device);
+    bus.Attach(vm);
+
+    DecodeCache cache(vm, ram, ramBase, ramSize);
+    cache.SetEnabled(useCache);
+    std::map<uint64_t, Site> sites;
+
+    bool running = true;
+    bool ok = true;
+    uint64_t exits = 0;
+    uint64_t mmioExits = 0;
+    uint64_t lookupNs = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (running) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+        auto& exitInfo = vp.GetVMExitInfo();
+        if (exitInfo.reason != VMExitReason::MMIO) {
+            // Catch up with any code the guest modified before leaving
+            cache.Refresh();
+        }
+        switch (exitInfo.reason) {
+        case VMExitReason::MMIO: {
+            const auto lookupStart = std::chrono::steady_clock::now();
+            uint64_t address;
+            const X86Instruction *insn = cache.Lookup(vp, &address);
+            lookupNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - lookupStart).count();
+            if (insn == NULL) {
+                printf("Could not decode the instruction at the MMIO exit\n");
+                running = false;
+                ok = false;
+                break;
+            }
+            auto it = sites.find(address);
+            if (it == sites.end()) {
+                it = sites.emplace(address, Site{ insn->length, insn->opcodeMap, insn->opcode, insn->operandSize, 0 }).first;
+            }
+            it->second.exits++;
+            if (++mmioExits % refreshInterval == 0) {
+                cache.Refresh();
+            }
+            break;
+        }
+        case VMExitReason::PIO:
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("  %-10s %-10s %6s %6s %8s\n", "Address", "Opcode", "Length", "Size", "Exits");
+    for (auto& kv : sites) {
+        auto& site = kv.second;
+        char opcode[16];
+        snprintf(opcode, sizeof(opcode), site.opcodeMap == 1 ? "0F %02X" : "%02X", site.opcode);
+        printf("  0x%08" PRIx64 " %-10s %6u %6u %8" PRIu64 "\n", kv.first, opcode, site.length, site.operandSize, site.exits);
+    }
+
+    uint32_t result;
+    memcpy(&result, &ram[resultAddr], sizeof(result));
+    if (ok && result != device.Sum()) {
+        printf("  Guest computed 0x%08x, expected 0x%08x\n", result, device.Sum());
+        ok = false;
+    }
+
+    auto& stats = cache.GetStats();
+    printf("  VM exits: %" PRIu64 " (%" PRIu64 " MMIO), time: %.3f ms\n", exits, mmioExits, elapsed.count() * 1000.0);
+    printf("  Lookups: %" PRIu64 ", cache hits: %" PRIu64 ", decodes: %" PRIu64 ", %.0f ns per lookup\n",
+        stats.lookups, stats.hits, stats.decodes, stats.lookups ? (double)lookupNs / stats.lookups : 0.0);
+    printf("  Dirty page refreshes: %" PRIu64 ", code pages invalidated: %" PRIu64 "\n", stats.refreshes, stats.invalidatedPages);
+
+    platform.FreeVM(vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().dirtyPageTracking) {
+        printf("warning: dirty page tracking not supported; the cache will be flushed on every refresh\n\n");
+    }
+
+    printf("Decoding every MMIO instruction:\n");
+    bool ok = runGuest(platform, rom, ram, false);
+    printf("\nWith the decode cache:\n");
+    ok = runGuest(platform, rom, ram, true) && ok;
+
+    alignedFree(ram);
+    alignedFree(rom);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,360 @@
+/*
+Demonstrates a device model running in a separate process that accesses
+guest memory directly through a sealed memfd.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "shared_memory.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace virt86;
+
+const uint32_t ramSize = 16 * 1024 * 1024;  // 16 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+const uint32_t resultAddr = 0x3000;
+
+const uint32_t bufferBase = 0x20000;
+const uint32_t bufferSize = 0x10000;
+
+// I/O ports of the device
+const uint16_t portBase = 0x100;
+const uint16_t portAddress = 0x100;  // W: guest physical address of the buffer
+const uint16_t portLength = 0x104;   // W: length of the buffer
+const uint16_t portCommand = 0x108;  // W: runs a command on the buffer
+const uint16_t portResult = 0x10C;   // R: result of the last command, all ones if it failed
+
+// Commands understood by the device process
+enum DeviceCommand : uint32_t {
+    CommandProcess = 1,  // Returns the CRC-32 of the buffer and swaps the case of its letters
+    CommandCrash = 2,    // Makes the device process crash
+};
+
+struct DeviceRequest {
+    uint32_t command;
+    uint32_t length;
+    uint64_t address;
+};
+
+struct DeviceResponse {
+    uint32_t status;  // 0 on success
+    uint32_t value;
+};
+
+static uint32_t crc32(const uint8_t *data, size_t size) noexcept {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// ----- Device process ---------------------------------------------------------------------------------------------------
+
+// Receives guest RAM, then serves requests until the socket is closed.
+static int runDeviceProcess(int sock) {
+    SharedMemory ram;
+    if (!ram.ReceiveFrom(sock)) {
+        return 1;
+    }
+    uint8_t *memory = ram.MapShared();
+    if (memory == NULL) {
+        return 1;
+    }
+
+    // Tell the virtual machine process whether the file is protected against
+    // being shrunk from here
+    DeviceResponse hello = { 0, 0 };
+    if (ftruncate((int)ram.Handle(), 0) != 0 && errno == EPERM) {
+        hello.value = 1;
+    }
+    if (send(sock, &hello, sizeof(hello), 0) != sizeof(hello)) {
+        return 1;
+    }
+
+    DeviceRequest request;
+    while (recv(sock, &request, sizeof(request), 0) == sizeof(request)) {
+        DeviceResponse response = { 1, 0 };
+        switch (request.command) {
+        case CommandProcess:
+            // Never trust addresses coming from the guest
+            if (request.address >= ramBase && request.address - ramBase <= ram.Size() && request.length <= ram.Size() - (request.address - ramBase)) {
+                uint8_t *data = &memory[request.address - ramBase];
+                response.status = 0;
+                response.value = crc32(data, request.length);
+                for (uint32_t i = 0; i < request.length; i++) {
+                    if ((data[i] >= 'a' && data[i] <= 'z') || (data[i] >= 'A' && data[i] <= 'Z')) {
+                        data[i] ^= 0x20;
+                    }
+                }
+            }
+            break;
+        case CommandCrash:
+            abort();
+        }
+        if (send(sock, &response, sizeof(response), 0) != sizeof(response)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// ----- Virtual machine process ------------------------------------------------------------------------------------------
+
+// Forwards commands from the guest to the device process. Once the device
+// process is gone, every command fails and the guest keeps running.
+class RemoteDevice : public IODevice {
+public:
+    RemoteDevice(int sock) noexcept : m_sock(sock) {}
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        return (port == portResult && size == 4) ? m_result : 0xFFFFFFFF;
+    }
+
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        if (size != 4) {
+            return;
+        }
+        switch (port) {
+        case portAddress: m_address = value; break;
+        case portLength: m_length = value; break;
+        case portCommand: m_result = Execute(value); break;
+        }
+    }
+
+    bool Alive() const noexcept { return m_alive; }
+
+private:
+    int m_sock;
+    bool m_alive = true;
+    uint32_t m_address = 0;
+    uint32_t m_length = 0;
+    uint32_t m_result = 0xFFFFFFFF;
+
+    uint32_t Execute(uint32_t command) noexcept {
+        if (!m_alive) {
+            return 0xFFFFFFFF;
+        }
+        const DeviceRequest request = { command, m_length, m_address };
+        DeviceResponse response;
+        if (send(m_sock, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request) || recv(m_sock, &response, sizeof(response), 0) != sizeof(response)) {
+            printf("The device process stopped responding\n");
+            m_alive = false;
+            return 0xFFFFFFFF;
+        }
+        return (response.status == 0) ? response.value : 0xFFFFFFFF;
+    }
+};
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, bufferBase);
+    static const char text[] = "The Quick Brown Fox Jumps Over The Lazy Dog. ";
+    for (uint32_t i = 0; i < bufferSize; i++) {
+        ram[bufferBase + i] = (uint8_t)text[i % (sizeof(text) - 1)];
+    }
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Asks the device to process a 64 KiB buffer and stores the result at
+    // 0x3000. Then crashes the device, tries the same command again and
+    // stores the result at 0x3004.
+    addr = kernelBase;
+    emit(ram, "\x66\xba\x00\x01");                 // [0x1000] mov    dx, 0x100
+    emit(ram, "\xb8\x00\x00\x02\x00");             // [0x1004] mov    eax, 0x20000
+    emit(ram, "\xef");                             // [0x1009] out    dx, eax
+    emit(ram, "\x66\xba\x04\x01");                 // [0x100a] mov    dx, 0x104
+    emit(ram, "\xb8\x00\x00\x01\x00");             // [0x100e] mov    eax, 0x10000
+    emit(ram, "\xef");                             // [0x1013] out    dx, eax
+    emit(ram, "\x66\xba\x08\x01");                 // [0x1014] mov    dx, 0x108
+    emit(ram, "\xb8\x01\x00\x00\x00");             // [0x1018] mov    eax, 1
+    emit(ram, "\xef");                             // [0x101d] out    dx, eax
+    emit(ram, "\x66\xba\x0c\x01");                 // [0x101e] mov    dx, 0x10c
+    emit(ram, "\xed");                             // [0x1022] in     eax, dx
+    emit(ram, "\xa3\x00\x30\x00\x00");             // [0x1023] mov    [0x3000], eax
+    emit(ram, "\x66\xba\x08\x01");                 // [0x1028] mov    dx, 0x108
+    emit(ram, "\xb8\x02\x00\x00\x00");             // [0x102c] mov    eax, 2
+    emit(ram, "\xef");                             // [0x1031] out    dx, eax
+    emit(ram, "\xb8\x01\x00\x00\x00");             // [0x1032] mov    eax, 1
+    emit(ram, "\xef");                             // [0x1037] out    dx, eax
+    emit(ram, "\x66\xba\x0c\x01");                 // [0x1038] mov    dx, 0x10c
+    emit(ram, "\xed");                             // [0x103c] in     eax, dx
+    emit(ram, "\xa3\x04\x30\x00\x00");             // [0x103d] mov    [0x3004], eax
+    emit(ram, "\xf4");                             // [0x1042] hlt
+#undef emit
+}
+
+static bool runGuest(uint8_t *rom, uint8_t *ram, RemoteDevice& device) {
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return false;
+    }
+    Platform& platform = *pPlatform;
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    IOBus bus;
+    bus.AddPIODevice(portBase, 16, device);
+    bus.Attach(vm);
+
+    bool ok = true;
+    for (bool running = true; running; ) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::PIO:
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    platform.FreeVM(vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Guest RAM is a sealed memfd shared with the device process
+    SharedMemory ramFile;
+    if (!ramFile.Create(ramSize) || !ramFile.Seal()) {
+        printf("fatal: failed to create sealed guest memory\n");
+        return -1;
+    }
+    uint8_t *ram = ramFile.MapShared();
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    writeGuest(ram);
+    const uint32_t expected = crc32(&ram[bufferBase], bufferSize);
+
+    // Start the device process before loading the hypervisor platform so that
+    // it inherits nothing but the socket
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks) != 0) {
+        printf("fatal: failed to create socket pair\n");
+        return -1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        printf("fatal: failed to start the device process\n");
+        return -1;
+    }
+    if (pid == 0) {
+        close(socks[0]);
+        _exit(runDeviceProcess(socks[1]));
+    }
+    close(socks[1]);
+    const int sock = socks[0];
+
+    DeviceResponse hello;
+    if (!ramFile.SendTo(sock) || recv(sock, &hello, sizeof(hello), 0) != sizeof(hello)) {
+        printf("fatal: failed to share guest memory with the device process\n");
+        return -1;
+    }
+    printf("Device process %d mapped guest RAM; %s\n\n", (int)pid, hello.value ? "it cannot resize it" : "warning: it can resize it");
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    RemoteDevice device(sock);
+    bool ok = runGuest(rom, ram, device);
+    close(sock);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        printf("Device process terminated by signal %d\n", WTERMSIG(status));
+    }
+
+    if (ok) {
+        uint32_t results[2];
+        memcpy(results, &ram[resultAddr], sizeof(results));
+        if (results[0] != expected) {
+            printf("Device returned 0x%08x, expected 0x%08x\n", results[0], expected);
+            ok = false;
+        }
+        else if (ram[bufferBase] != 't' || ram[bufferBase + 4] != 'q') {
+            printf("The device's changes to guest memory are missing\n");
+            ok = false;
+        }
+        else if (results[1] != 0xFFFFFFFF || device.Alive()) {
+            printf("The guest did not notice the device crash\n");
+            ok = false;
+        }
+        else {
+            printf("Guest survived the device crash; the device processed its buffer in place\n");
+        }
+    }
+
+    ramFile.Unmap(ram);
+    alignedFree(rom);
+    return ok ? 0 : -1;
+}
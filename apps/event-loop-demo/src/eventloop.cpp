@@ -0,0 +1,318 @@
+/*
+Entry point of the event loop demo.
+
+Drives an interrupt-driven guest from an epoll event loop that watches a
+timerfd, an eventfd and a Unix socket. The virtual processor sleeps while
+the guest is halted, so an idle guest consumes close to no host CPU time.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "event_loop.hpp"
+#include "flat_guest.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t handlerBase = 0x1100;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t stackTop = 0x8000;
+
+const uint16_t eventPort = 0x100;
+const uint8_t eventVector = 0x20;
+
+// Identifiers of the event sources, as read by the guest from the event port
+enum EventSource : uint8_t {
+    SourceNone = 0,
+    SourceTimer = 1,
+    SourceEventFD = 2,
+    SourceSocket = 3,
+};
+
+// Reports the source of each interrupt to the guest, oldest first.
+class EventDevice : public IODevice {
+public:
+    explicit EventDevice(InterruptQueue& irqs) noexcept : m_irqs(irqs) {}
+
+    // Called by the event loop thread
+    void Post(EventSource source) noexcept {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_events.push_back(source);
+        }
+        m_irqs.Raise(eventVector);
+    }
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_events.empty()) {
+            return SourceNone;
+        }
+        const EventSource source = m_events.front();
+        m_events.pop_front();
+        m_acknowledged[source]++;
+        return source;
+    }
+
+    uint64_t Acknowledged(EventSource source) noexcept {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_acknowledged[source];
+    }
+
+private:
+    InterruptQueue& m_irqs;
+    std::mutex m_mutex;
+    std::deque<EventSource> m_events;
+    uint64_t m_acknowledged[4] = { 0 };
+};
+
+static double cpuSeconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // ----- Guest memory -----------------------------------------------------------------------------------------------------
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    memset(ram, 0, ramSize);
+    {
+        uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+        // Load the IDT, enable interrupts and halt forever
+        addr = kernelBase;
+        emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");     // [0x1000] lidt   [0x1800]
+        emit(ram, "\xfb");                             // [0x1007] sti
+        emit(ram, "\xf4");                             // [0x1008] hlt
+        emit(ram, "\xeb\xfd");                         // [0x1009] jmp    0x1008
+
+        // Interrupt handler: acknowledge the event by reading its source
+        addr = handlerBase;
+        emit(ram, "\x50");                             // [0x1100] push   eax
+        emit(ram, "\x52");                             // [0x1101] push   edx
+        emit(ram, "\x66\xba\x00\x01");                 // [0x1102] mov     dx, 0x100
+        emit(ram, "\xec");                             // [0x1106] in      al, dx
+        emit(ram, "\x5a");                             // [0x1107] pop    edx
+        emit(ram, "\x58");                             // [0x1108] pop    eax
+        emit(ram, "\xcf");                             // [0x1109] iretd
+
+        // IDT pointer
+        addr = idtrBase;
+        emit(ram, "\x07\x01\x00\x20\x00\x00");         // [0x1800] IDT pointer: 0x00002000:0x0107
+#undef emit
+        writeFlatGuestIDTEntry(ram, idtBase, eventVector, handlerBase);
+    }
+
+    // ----- Virtual machine --------------------------------------------------------------------------------------------------
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return -1;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        return -1;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        return -1;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    InterruptQueue irqs;
+    EventDevice eventDevice(irqs);
+    IOBus bus;
+    bus.AddPIODevice(eventPort, 1, eventDevice);
+    bus.Attach(vm);
+
+    // ----- Event sources ----------------------------------------------------------------------------------------------------
+
+    EventLoop loop;
+    if (!loop.IsValid()) {
+        printf("fatal: failed to create event loop\n");
+        return -1;
+    }
+
+    std::atomic<bool> done{ false };
+
+    // A periodic timer ticking every 100 ms
+    int timerFD = createTimerFD(100000000, 100000000);
+    loop.Add(timerFD, EPOLLIN, [&](uint32_t) {
+        for (uint64_t i = readTimerFD(timerFD); i > 0; i--) {
+            eventDevice.Post(SourceTimer);
+        }
+    });
+
+    // An eventfd signaled by a host thread every 250 ms
+    int eventFD = createEventFD();
+    loop.Add(eventFD, EPOLLIN, [&](uint32_t) {
+        for (uint64_t i = drainEventFD(eventFD); i > 0; i--) {
+            eventDevice.Post(SourceEventFD);
+        }
+    });
+
+    // A Unix socket receiving a message from a host thread every 500 ms
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sockets) != 0) {
+        printf("fatal: failed to create socket pair\n");
+        return -1;
+    }
+    loop.Add(sockets[0], EPOLLIN, [&](uint32_t) {
+        char buf[64];
+        while (read(sockets[0], buf, sizeof(buf)) > 0) {
+            eventDevice.Post(SourceSocket);
+        }
+    });
+
+    // Stop after three seconds
+    int stopFD = createTimerFD(3000000000ull, 0);
+    loop.Add(stopFD, EPOLLIN, [&](uint32_t) {
+        readTimerFD(stopFD);
+        done = true;
+        loop.Stop();
+        // Wake up the virtual processor so that it notices
+        irqs.Raise(eventVector);
+    });
+
+    std::thread producer([&]() {
+        int tick = 0;
+        while (!done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            signalEventFD(eventFD);
+            if (++tick % 2 == 0) {
+                const char msg[] = "ping";
+                if (write(sockets[1], msg, sizeof(msg)) < 0) {
+                    break;
+                }
+            }
+        }
+    });
+    std::thread loopThread([&]() { loop.Run(); });
+
+    // ----- Run --------------------------------------------------------------------------------------------------------------
+
+    printf("\nRunning guest for 3 seconds...\n");
+    uint64_t exits = 0, halts = 0, injected = 0;
+    const double cpuStart = cpuSeconds();
+    const auto wallStart = std::chrono::steady_clock::now();
+    bool running = true;
+    while (running) {
+        injected += irqs.Deliver(vp);
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            break;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            if (done) {
+                running = false;
+                break;
+            }
+            // Sleep until an event source raises an interrupt
+            halts++;
+            irqs.WaitForInterrupt();
+            break;
+        case VMExitReason::PIO:
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+    const double cpuTime = cpuSeconds() - cpuStart;
+
+    loop.Stop();
+    loopThread.join();
+    producer.join();
+
+    // ----- Report -----------------------------------------------------------------------------------------------------------
+
+    printf("\nEvents acknowledged by the guest:\n");
+    printf("  timerfd:     %" PRIu64 "\n", eventDevice.Acknowledged(SourceTimer));
+    printf("  eventfd:     %" PRIu64 "\n", eventDevice.Acknowledged(SourceEventFD));
+    printf("  Unix socket: %" PRIu64 "\n", eventDevice.Acknowledged(SourceSocket));
+    printf("\n");
+    printf("VM exits: %" PRIu64 ", HLT waits: %" PRIu64 ", interrupts injected: %" PRIu64 "\n", exits, halts, injected);
+    printf("Wall time: %.3f s, host CPU time: %.3f s (%.2f%% of one CPU)\n", wallTime.count(), cpuTime, cpuTime / wallTime.count() * 100.0);
+
+    close(stopFD);
+    close(sockets[0]);
+    close(sockets[1]);
+    close(eventFD);
+    close(timerFD);
+
+    platform.FreeVM(vm);
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+Entry point of the framebuffer demo. Shows how cheaply a remote console can
+follow a guest's screen when the changed regions are found through dirty page
+tracking.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "framebuffer.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = 64 * 1024;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x8000;
+
+// Parameters and results shared with the guest
+const uint32_t paramFrames = 0x3000;
+const uint32_t paramWidth = 0x3004;
+const uint32_t paramHeight = 0x3008;
+const uint32_t paramFramebuffer = 0x300C;
+const uint32_t resultDone = 0x3010;
+const uint32_t varSpeedX = 0x3020;
+const uint32_t varSpeedY = 0x3024;
+
+const uint64_t fbBase = 0xE0000000;
+const uint32_t fbWidth = 640;
+const uint32_t fbHeight = 480;
+const uint16_t vsyncPort = 0xF00;
+
+const uint32_t defaultFrames = 120;
+const auto refreshInterval = std::chrono::milliseconds(16);
+
+// Reading the port waits for the next screen refresh, which paces the guest
+// at one frame per refresh. The frame's dirty pages are collected here, while
+// the processor is stopped in the exit.
+class VsyncDevice : public IODevice {
+public:
+    VsyncDevice(Framebuffer& fb) noexcept : m_fb(fb) {}
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        m_fb.CollectDirtyPages();
+        m_fb.WaitForRefresh();
+        return 0;
+    }
+
+private:
+    Framebuffer& m_fb;
+};
+
+static void writeGuest(uint8_t *ram, uint32_t frames) noexcept {
+    memset(ram, 0, ramSize);
+
+    const uint32_t width = fbWidth;
+    const uint32_t height = fbHeight;
+    const uint32_t framebuffer = (uint32_t)fbBase;
+    const int32_t speedX = 5;
+    const int32_t speedY = 3;
+    memcpy(&ram[paramFrames], &frames, sizeof(frames));
+    memcpy(&ram[paramWidth], &width, sizeof(width));
+    memcpy(&ram[paramHeight], &height, sizeof(height));
+    memcpy(&ram[paramFramebuffer], &framebuffer, sizeof(framebuffer));
+    memcpy(&ram[varSpeedX], &speedX, sizeof(speedX));
+    memcpy(&ram[varSpeedY], &speedY, sizeof(speedY));
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Fills the screen, then bounces a 32x32 square around it: each frame
+    // erases the square, moves it, draws it again and waits for the next
+    // refresh. Sets 0x3010 and halts once every frame is drawn.
+    addr = kernelBase;
+    emit(ram, "\x8b\x3d\x0c\x30\x00\x00");         // [0x1000] mov    edi, [0x300c]
+    emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x1006] mov    ecx, [0x3004]
+    emit(ram, "\x0f\xaf\x0d\x08\x30\x00\x00");     // [0x100c] imul   ecx, [0x3008]
+    emit(ram, "\xb8\x40\x30\x20\x00");             // [0x1013] mov    eax, 0x203040
+    emit(ram, "\xf3\xab");                         // [0x1018] rep stosd
+    emit(ram, "\xbe\x00\x00\x00\x00");             // [0x101a] mov    esi, 0
+    emit(ram, "\xbd\x00\x00\x00\x00");             // [0x101f] mov    ebp, 0
+    emit(ram, "\x31\xdb");                         // [0x1024] xor    ebx, ebx
+    emit(ram, "\xb8\x40\x30\x20\x00");             // [0x1026] mov    eax, 0x203040
+    emit(ram, "\xe8\x63\x00\x00\x00");             // [0x102b] call   0x1093
+    emit(ram, "\xa1\x20\x30\x00\x00");             // [0x1030] mov    eax, [0x3020]
+    emit(ram, "\x01\xc6");                         // [0x1035] add    esi, eax
+    emit(ram, "\x78\x0d");                         // [0x1037] js     0x1046
+    emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x1039] mov    ecx, [0x3004]
+    emit(ram, "\x83\xe9\x20");                     // [0x103f] sub    ecx, 32
+    emit(ram, "\x39\xce");                         // [0x1042] cmp    esi, ecx
+    emit(ram, "\x7e\x0a");                         // [0x1044] jle    0x1050
+    emit(ram, "\xf7\x1d\x20\x30\x00\x00");         // [0x1046] neg    dword ptr [0x3020]
+    emit(ram, "\x29\xc6");                         // [0x104c] sub    esi, eax
+    emit(ram, "\x29\xc6");                         // [0x104e] sub    esi, eax
+    emit(ram, "\xa1\x24\x30\x00\x00");             // [0x1050] mov    eax, [0x3024]
+    emit(ram, "\x01\xc5");                         // [0x1055] add    ebp, eax
+    emit(ram, "\x78\x0d");                         // [0x1057] js     0x1066
+    emit(ram, "\x8b\x0d\x08\x30\x00\x00");         // [0x1059] mov    ecx, [0x3008]
+    emit(ram, "\x83\xe9\x20");                     // [0x105f] sub    ecx, 32
+    emit(ram, "\x39\xcd");                         // [0x1062] cmp    ebp, ecx
+    emit(ram, "\x7e\x0a");                         // [0x1064] jle    0x1070
+    emit(ram, "\xf7\x1d\x24\x30\x00\x00");         // [0x1066] neg    dword ptr [0x3024]
+    emit(ram, "\x29\xc5");                         // [0x106c] sub    ebp, eax
+    emit(ram, "\x29\xc5");                         // [0x106e] sub    ebp, eax
+    emit(ram, "\xb8\x00\xc0\xff\x00");             // [0x1070] mov    eax, 0xffc000
+    emit(ram, "\xe8\x19\x00\x00\x00");             // [0x1075] call   0x1093
+    emit(ram, "\x66\xba\x00\x0f");                 // [0x107a] mov     dx, 0xf00    ; FB_VSYNC
+    emit(ram, "\xed");                             // [0x107e] in     eax, dx
+    emit(ram, "\x43");                             // [0x107f] inc    ebx
+    emit(ram, "\x3b\x1d\x00\x30\x00\x00");         // [0x1080] cmp    ebx, [0x3000]
+    emit(ram, "\x72\x9e");                         // [0x1086] jb     0x1026
+    emit(ram, "\xc7\x05\x10\x30\x00\x00\x01\x00\x00\x00"); // [0x1088] mov    dword ptr [0x3010], 1
+    emit(ram, "\xf4");                             // [0x1092] hlt
+    emit(ram, "\x89\xef");                         // [0x1093] mov    edi, ebp
+    emit(ram, "\x0f\xaf\x3d\x04\x30\x00\x00");     // [0x1095] imul   edi, [0x3004]
+    emit(ram, "\x01\xf7");                         // [0x109c] add    edi, esi
+    emit(ram, "\xc1\xe7\x02");                     // [0x109e] shl    edi, 2
+    emit(ram, "\x03\x3d\x0c\x30\x00\x00");         // [0x10a1] add    edi, [0x300c]
+    emit(ram, "\xba\x20\x00\x00\x00");             // [0x10a7] mov    edx, 32
+    emit(ram, "\xb9\x20\x00\x00\x00");             // [0x10ac] mov    ecx, 32
+    emit(ram, "\x57");                             // [0x10b1] push   edi
+    emit(ram, "\xf3\xab");                         // [0x10b2] rep stosd
+    emit(ram, "\x5f");                             // [0x10b4] pop    edi
+    emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x10b5] mov    ecx, [0x3004]
+    emit(ram, "\x8d\x3c\x8f");                     // [0x10bb] lea    edi, [edi + ecx*4]
+    emit(ram, "\x4a");                             // [0x10be] dec    edx
+    emit(ram, "\x75\xeb");                         // [0x10bf] jne    0x10ac
+    emit(ram, "\xc3");                             // [0x10c1] ret
+#undef emit
+}
+
+static bool runPhase(Platform& platform, uint8_t *rom, uint8_t *ram, bool trackDirtyPages, uint32_t frames, const char *outputDir) {
+    writeGuest(ram, frames);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    Framebuffer fb(fbWidth, fbHeight);
+    if (!fb.IsValid() || fb.Map(vm, fbBase, trackDirtyPages) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map framebuffer\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    VsyncDevice vsync(fb);
+    IOBus bus;
+    bus.AddPIODevice(vsyncPort, 4, vsync);
+    bus.Attach(vm);
+
+    printf("\n%s:\n", fb.IsTrackingDirtyPages() ? "Dirty page tracking" : "Comparing the whole framebuffer");
+
+    // Encodes every changed rectangle, as a remote console would send them
+    uint64_t encodedBytes = 0;
+    uint32_t refreshNum = 0;
+    bool encodeOK = true;
+    fb.Start(refreshInterval, [&](const Framebuffer& screen, const std::vector<DirtyRect>& rects) {
+        for (size_t i = 0; i < rects.size(); i++) {
+            encodedBytes += (uint64_t)rects[i].width * rects[i].height * 3;
+            if (outputDir != NULL) {
+                char name[64];
+                snprintf(name, sizeof(name), "/frame-%04" PRIu32 "-%02zu.ppm", refreshNum, i);
+                encodeOK &= writePPM((std::string(outputDir) + name).c_str(), screen.Pixels(), screen.Width(), rects[i]);
+            }
+        }
+        refreshNum++;
+    });
+
+    uint64_t exits = 0;
+    const auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (;;) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        if (exitInfo.reason == VMExitReason::HLT && ram[resultDone] != 0) {
+            break;
+        }
+        if (exitInfo.reason != VMExitReason::PIO && exitInfo.reason != VMExitReason::Cancelled && exitInfo.reason != VMExitReason::Interrupt) {
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fb.Stop();
+
+    if (ok && outputDir != NULL) {
+        const std::string path = std::string(outputDir) + "/screen.ppm";
+        encodeOK &= writePPM(path.c_str(), fb.Pixels(), fb.Width(), { 0, 0, fb.Width(), fb.Height() });
+    }
+
+    // The host copy must match what the guest drew
+    const bool match = memcmp(fb.Pixels(), fb.Memory(), (size_t)fbWidth * fbHeight * sizeof(uint32_t)) == 0;
+    platform.FreeVM(vm);
+
+    const auto stats = fb.GetStats();
+    const uint64_t screenPixels = (uint64_t)fbWidth * fbHeight;
+    const uint64_t screenPages = fb.Size() / PAGE_SIZE;
+    printf("  %" PRIu32 " frames in %.3f s, %" PRIu64 " VM exits (%.2f per frame)\n", frames, elapsed.count(), exits, (double)exits / frames);
+    printf("  Refreshes: %" PRIu64 ", %.1f us each on average\n",
+        stats.refreshes, stats.refreshes ? stats.refreshTime.count() / 1000.0 / stats.refreshes : 0.0);
+    printf("  Pages compared: %.1f of %" PRIu64 " per refresh (%" PRIu64 " reported dirty in total)\n",
+        stats.refreshes ? (double)stats.pagesCompared / stats.refreshes : 0.0, screenPages, stats.dirtyPages);
+    printf("  Rectangles: %" PRIu64 ", %.1f%% of the screen per refresh, %" PRIu64 " KiB encoded\n",
+        stats.rects, stats.refreshes ? 100.0 * stats.pixels / stats.refreshes / screenPixels : 0.0, encodedBytes / 1024);
+    if (!encodeOK) {
+        printf("  Failed to write some images to %s\n", outputDir);
+    }
+    if (!match) {
+        printf("  The host copy does not match the framebuffer\n");
+        return false;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    const char *outputDir = (argc >= 2) ? argv[1] : NULL;
+    uint32_t frames = defaultFrames;
+    if (argc >= 3) {
+        frames = (uint32_t)strtoul(argv[2], NULL, 0);
+        if (frames == 0) {
+            printf("usage: %s [output directory] [frames]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    printf("\nThe guest draws %" PRIu32 " frames on a %" PRIu32 "x%" PRIu32 " screen, refreshed every %d ms\n",
+        frames, fbWidth, fbHeight, (int)refreshInterval.count());
+    bool ok = true;
+    if (platform.GetFeatures().dirtyPageTracking) {
+        ok = runPhase(platform, rom, ram, true, frames, outputDir);
+    }
+    else {
+        printf("\nDirty page tracking is not supported by the hypervisor\n");
+    }
+    ok = ok && runPhase(platform, rom, ram, false, frames, NULL);
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,160 @@
+/*
+Entry point of the GDB stub demo.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "gdb_server.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x8000;
+
+const uint16_t defaultPort = 1234;
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Usage: virt86-gdb-stub [port | unix:<path>]
+    const char *endpoint = (argc > 1) ? argv[1] : NULL;
+
+    // ----- Guest memory -----------------------------------------------------------------------------------------------------
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    memset(ram, 0, ramSize);
+    {
+        uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+        // Compute the 17th Fibonacci number, store it at 0x3000 and halt
+        addr = kernelBase;
+        emit(ram, "\x31\xc0");                         // [0x1000] xor    eax, eax
+        emit(ram, "\xbb\x01\x00\x00\x00");             // [0x1002] mov    ebx, 1
+        emit(ram, "\xb9\x10\x00\x00\x00");             // [0x1007] mov    ecx, 16
+        emit(ram, "\x8d\x14\x18");                     // [0x100c] lea    edx, [eax + ebx]
+        emit(ram, "\x89\xd8");                         // [0x100f] mov    eax, ebx
+        emit(ram, "\x89\xd3");                         // [0x1011] mov    ebx, edx
+        emit(ram, "\xe2\xf7");                         // [0x1013] loop   0x100c
+        emit(ram, "\xa3\x00\x30\x00\x00");             // [0x1015] mov    [0x3000], eax
+        emit(ram, "\xf4");                             // [0x101a] hlt
+        emit(ram, "\xeb\xfd");                         // [0x101b] jmp    0x101a
+#undef emit
+    }
+
+    // ----- Virtual machine --------------------------------------------------------------------------------------------------
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().guestDebugging) {
+        printf("fatal: platform does not support guest debugging\n");
+        return -1;
+    }
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return -1;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        return -1;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        return -1;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    // ----- Debugger ---------------------------------------------------------------------------------------------------------
+
+    GDBServer gdb(vp, GDBArch::X86);
+    gdb.AddMemoryRegion(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, rom);
+    gdb.AddMemoryRegion(ramBase, ramSize, ram);
+
+    if (endpoint != NULL && strncmp(endpoint, "unix:", 5) == 0) {
+        if (!gdb.ListenUnix(endpoint + 5)) {
+            printf("fatal: failed to listen on Unix socket %s\n", endpoint + 5);
+            return -1;
+        }
+        printf("Waiting for gdb on %s\n", endpoint + 5);
+        printf("  (gdb) set architecture i386\n");
+        printf("  (gdb) target remote %s\n", endpoint + 5);
+    }
+    else {
+        const uint16_t port = (endpoint != NULL) ? (uint16_t)atoi(endpoint) : defaultPort;
+        if (!gdb.ListenTCP(port)) {
+            printf("fatal: failed to listen on port %u\n", port);
+            return -1;
+        }
+        printf("Waiting for gdb on localhost:%u\n", port);
+        printf("  (gdb) set architecture i386\n");
+        printf("  (gdb) target remote localhost:%u\n", port);
+    }
+
+    if (!gdb.Accept()) {
+        printf("fatal: failed to accept debugger connection\n");
+        return -1;
+    }
+    printf("Debugger connected\n");
+
+    switch (gdb.Serve()) {
+    case GDBSessionEnd::Detached: printf("Debugger detached\n"); break;
+    case GDBSessionEnd::Killed: printf("Debugger killed the guest\n"); break;
+    case GDBSessionEnd::Disconnected: printf("Debugger disconnected\n"); break;
+    case GDBSessionEnd::Failed: printf("VCPU failed to run\n"); break;
+    }
+
+    uint32_t result;
+    memcpy(&result, &ram[0x3000], sizeof(result));
+    printf("Value at 0x3000: %u\n", result);
+
+    platform.FreeVM(vm);
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return 0;
+}
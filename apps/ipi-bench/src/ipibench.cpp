@@ -0,0 +1,245 @@
+/*
+Entry point of the IPI round-trip benchmark.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "local_apic.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t pingHandlerBase = 0x1100;
+const uint32_t pongHandlerBase = 0x1180;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t roundTripsAddr = 0x3000;
+const uint32_t stackTops[] = { 0x8000, 0x7000 };
+
+const uint8_t pingVector = 0x40;
+const uint8_t pongVector = 0x41;
+
+const uint32_t benchSeconds = 2;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Both processors start here with their index in ESI and their stack
+    // pointer in EDI. Processor 0 sends a ping IPI to processor 1 and waits
+    // for the pong before sending the next one; processor 1 halts forever and
+    // answers pings from its interrupt handler.
+    addr = kernelBase;
+    emit(ram, "\x89\xfc");                                 // [0x1000] mov    esp, edi
+    emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");             // [0x1002] lidt   [0x1800]
+    emit(ram, "\x85\xf6");                                 // [0x1009] test   esi, esi
+    emit(ram, "\x75\x35");                                 // [0x100b] jnz    0x1042
+    emit(ram, "\xfa");                                     // [0x100d] cli
+    emit(ram, "\xc7\x05\x10\x03\xe0\xfe\x00\x00\x00\x01"); // [0x100e] mov    dword ptr [0xfee00310], 0x01000000  ; ICR high: APIC 1
+    emit(ram, "\xc7\x05\x00\x03\xe0\xfe\x40\x00\x00\x00"); // [0x1018] mov    dword ptr [0xfee00300], 0x40        ; ICR low: ping
+    emit(ram, "\x83\x3d\x04\x30\x00\x00\x00");             // [0x1022] cmp    dword ptr [0x3004], 0
+    emit(ram, "\x75\x05");                                 // [0x1029] jnz    0x1030
+    emit(ram, "\xfb");                                     // [0x102b] sti
+    emit(ram, "\xf4");                                     // [0x102c] hlt
+    emit(ram, "\xfa");                                     // [0x102d] cli
+    emit(ram, "\xeb\xf2");                                 // [0x102e] jmp    0x1022
+    emit(ram, "\xc7\x05\x04\x30\x00\x00\x00\x00\x00\x00"); // [0x1030] mov    dword ptr [0x3004], 0
+    emit(ram, "\xff\x05\x00\x30\x00\x00");                 // [0x103a] inc    dword ptr [0x3000]
+    emit(ram, "\xeb\xcb");                                 // [0x1040] jmp    0x100d
+    emit(ram, "\xfb");                                     // [0x1042] sti
+    emit(ram, "\xf4");                                     // [0x1043] hlt
+    emit(ram, "\xeb\xfd");                                 // [0x1044] jmp    0x1043
+
+    // Ping handler, runs on processor 1: send the pong to processor 0
+    addr = pingHandlerBase;
+    emit(ram, "\xc7\x05\x10\x03\xe0\xfe\x00\x00\x00\x00"); // [0x1100] mov    dword ptr [0xfee00310], 0           ; ICR high: APIC 0
+    emit(ram, "\xc7\x05\x00\x03\xe0\xfe\x41\x00\x00\x00"); // [0x110a] mov    dword ptr [0xfee00300], 0x41        ; ICR low: pong
+    emit(ram, "\xc7\x05\xb0\x00\xe0\xfe\x00\x00\x00\x00"); // [0x1114] mov    dword ptr [0xfee000b0], 0           ; EOI
+    emit(ram, "\xcf");                                     // [0x111e] iretd
+
+    // Pong handler, runs on processor 0: flag the reply
+    addr = pongHandlerBase;
+    emit(ram, "\xc7\x05\x04\x30\x00\x00\x01\x00\x00\x00"); // [0x1180] mov    dword ptr [0x3004], 1
+    emit(ram, "\xc7\x05\xb0\x00\xe0\xfe\x00\x00\x00\x00"); // [0x118a] mov    dword ptr [0xfee000b0], 0           ; EOI
+    emit(ram, "\xcf");                                     // [0x1194] iretd
+
+    // IDT pointer
+    addr = idtrBase;
+    emit(ram, "\xff\x07\x00\x20\x00\x00");                 // [0x1800] IDT pointer: 0x00002000:0x07ff
+#undef emit
+    writeFlatGuestIDTEntry(ram, idtBase, pingVector, pingHandlerBase);
+    writeFlatGuestIDTEntry(ram, idtBase, pongVector, pongHandlerBase);
+}
+
+struct VPStats {
+    uint64_t exits = 0;
+    uint64_t halts = 0;
+    bool ok = true;
+};
+
+// Runs a virtual processor on the calling thread until the benchmark is done.
+static void runVP(VirtualProcessor& vp, APICBus& apics, size_t index, uint32_t spinIterations, std::atomic<bool>& done, VPStats& stats) {
+    apics.BindCurrentThread(index);
+    LocalAPIC& apic = apics.Get(index);
+
+    vp.RegWrite(Reg::ESI, (uint32_t)index);
+    vp.RegWrite(Reg::EDI, stackTops[index]);
+
+    while (!done) {
+        apic.Deliver(vp);
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU %zu failed to run\n", index);
+            stats.ok = false;
+            break;
+        }
+        stats.exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            stats.halts++;
+            apic.WaitForInterrupt(spinIterations);
+            break;
+        case VMExitReason::MMIO:
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            break;
+        default:
+            printf("VCPU %zu exited for another reason: %s\n", index, reason_str(exitInfo.reason));
+            stats.ok = false;
+            done = true;
+            break;
+        }
+    }
+}
+
+static bool runBenchmark(Platform& platform, uint8_t *rom, uint8_t *ram, uint32_t spinIterations) {
+    printf("\nSpinning for up to %" PRIu32 " iterations before sleeping, running for %" PRIu32 " seconds\n", spinIterations, benchSeconds);
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 2;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+
+    APICBus apics(2);
+    IOBus bus;
+    bus.AddMMIODevice(LAPIC_BASE, LAPIC_SIZE, apics);
+    bus.Attach(vm);
+
+    std::atomic<bool> done{ false };
+    VPStats stats[2];
+    std::thread threads[2];
+    const auto wallStart = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < 2; i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        threads[i] = std::thread(runVP, std::ref(vp), std::ref(apics), i, spinIterations, std::ref(done), std::ref(stats[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(benchSeconds));
+    done = true;
+    // Wake up halted processors so that they notice
+    apics.Get(0).Kick();
+    apics.Get(1).Kick();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+
+    uint32_t roundTrips;
+    memcpy(&roundTrips, &ram[roundTripsAddr], sizeof(roundTrips));
+
+    printf("  Round trips: %" PRIu32 " (%.0f/s)\n", roundTrips, roundTrips / wallTime.count());
+    if (roundTrips > 0) {
+        printf("  Average round-trip latency: %.2f us\n", wallTime.count() * 1e6 / roundTrips);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        printf("  VCPU %zu: %" PRIu64 " IPIs sent, %" PRIu64 " IPIs received, %" PRIu64 " VM exits, %" PRIu64 " HLT waits\n",
+            i, apics.Get(i).IPIsSent(), apics.Get(i).IPIsReceived(), stats[i].exits, stats[i].halts);
+    }
+
+    platform.FreeVM(vm);
+    return stats[0].ok && stats[1].ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTops[0]);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (platform.GetFeatures().maxProcessorsPerVM < 2) {
+        printf("fatal: platform does not support multiple processors per VM\n");
+        return -1;
+    }
+
+    // Compare sleeping immediately on HLT against polling the mailbox briefly
+    bool ok = runBenchmark(platform, rom, ram, 0)
+        && runBenchmark(platform, rom, ram, 20000);
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
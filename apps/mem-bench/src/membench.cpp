@@ -0,0 +1,442 @@
+/*
+Entry point of the guest memory benchmark. Measures guest memory bandwidth
+and first-touch page fault cost with guest RAM backed by each allocation
+mode.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#if defined(_WIN32)
+#  include <Windows.h>
+#  include <psapi.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+using namespace virt86;
+
+// Guest memory layout
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;     // Guest kernel code
+const uint32_t stackTop = 0x1000;       // Stack grows down from the kernel
+const uint32_t bufferBase = 0x200000;   // Memory swept by the guest kernel
+
+// Kernels selected through ECX
+enum Kernel : uint32_t {
+    KernelRead = 0,    // Reads one dword from every cache line
+    KernelWrite = 1,   // Writes one dword to every cache line
+    KernelRandom = 2,  // Reads EDI random cache lines
+    KernelTouch = 3,   // Writes one dword to every page
+};
+
+// Number of timed passes of each bandwidth kernel
+const int numPasses = 5;
+
+// Writes the benchmark kernels to RAM.
+// The kernels expect EBX to contain the start of the buffer and EDX its end.
+// The random kernel also expects EBP to hold the number of cache lines in the
+// buffer minus one (a power of two minus one) and EDI the number of reads.
+// Every kernel stops at a HLT before each pass, so that every VP.Run() call
+// times exactly one pass of the kernel chosen by ECX.
+static void writeKernel(uint8_t *ram) {
+    uint32_t addr = kernelBase;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    emit(ram, "\xf4");                             // [0x1000] hlt
+    emit(ram, "\x89\xde");                         // [0x1001] mov    esi, ebx
+    emit(ram, "\x83\xf9\x01");                     // [0x1003] cmp    ecx, 1
+    emit(ram, "\x74\x27");                         // [0x1006] je     write
+    emit(ram, "\x83\xf9\x02");                     // [0x1008] cmp    ecx, 2
+    emit(ram, "\x74\x3f");                         // [0x100b] je     random
+    emit(ram, "\x83\xf9\x03");                     // [0x100d] cmp    ecx, 3
+    emit(ram, "\x74\x57");                         // [0x1010] je     touch
+    //                                             // read:
+    emit(ram, "\x8b\x06");                         // [0x1012] mov    eax, [esi]
+    emit(ram, "\x8b\x46\x40");                     // [0x1014] mov    eax, [esi+0x40]
+    emit(ram, "\x8b\x86\x80\x00\x00\x00");         // [0x1017] mov    eax, [esi+0x80]
+    emit(ram, "\x8b\x86\xc0\x00\x00\x00");         // [0x101d] mov    eax, [esi+0xc0]
+    emit(ram, "\x81\xc6\x00\x01\x00\x00");         // [0x1023] add    esi, 0x100
+    emit(ram, "\x39\xd6");                         // [0x1029] cmp    esi, edx
+    emit(ram, "\x72\xe5");                         // [0x102b] jb     read
+    emit(ram, "\xeb\xd1");                         // [0x102d] jmp    0x1000
+    //                                             // write:
+    emit(ram, "\x89\x06");                         // [0x102f] mov    [esi], eax
+    emit(ram, "\x89\x46\x40");                     // [0x1031] mov    [esi+0x40], eax
+    emit(ram, "\x89\x86\x80\x00\x00\x00");         // [0x1034] mov    [esi+0x80], eax
+    emit(ram, "\x89\x86\xc0\x00\x00\x00");         // [0x103a] mov    [esi+0xc0], eax
+    emit(ram, "\x81\xc6\x00\x01\x00\x00");         // [0x1040] add    esi, 0x100
+    emit(ram, "\x39\xd6");                         // [0x1046] cmp    esi, edx
+    emit(ram, "\x72\xe5");                         // [0x1048] jb     write
+    emit(ram, "\xeb\xb4");                         // [0x104a] jmp    0x1000
+    //                                             // random:
+    emit(ram, "\x69\xc0\x0d\x66\x19\x00");         // [0x104c] imul   eax, eax, 1664525
+    emit(ram, "\x05\x5f\xf3\x6e\x3c");             // [0x1052] add    eax, 1013904223
+    emit(ram, "\x89\xc6");                         // [0x1057] mov    esi, eax
+    emit(ram, "\xc1\xee\x06");                     // [0x1059] shr    esi, 6
+    emit(ram, "\x21\xee");                         // [0x105c] and    esi, ebp
+    emit(ram, "\xc1\xe6\x06");                     // [0x105e] shl    esi, 6
+    emit(ram, "\x8b\x34\x1e");                     // [0x1061] mov    esi, [esi+ebx]
+    emit(ram, "\x4f");                             // [0x1064] dec    edi
+    emit(ram, "\x75\xe5");                         // [0x1065] jnz    random
+    emit(ram, "\xeb\x97");                         // [0x1067] jmp    0x1000
+    //                                             // touch:
+    emit(ram, "\x89\x06");                         // [0x1069] mov    [esi], eax
+    emit(ram, "\x81\xc6\x00\x10\x00\x00");         // [0x106b] add    esi, 0x1000
+    emit(ram, "\x39\xd6");                         // [0x1071] cmp    esi, edx
+    emit(ram, "\x72\xf4");                         // [0x1073] jb     touch
+    emit(ram, "\xeb\x89");                         // [0x1075] jmp    0x1000
+#undef emit
+}
+
+// Runs the guest until the next HLT. Returns false if the VP failed or exited
+// for any other reason.
+static bool runToHLT(VirtualProcessor& vp) {
+    for (;;) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            return false;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            return true;
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            continue;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            return false;
+        }
+    }
+}
+
+// Runs one pass of a kernel and returns its duration in seconds, or a
+// negative value if the guest failed.
+static double timeKernel(VirtualProcessor& vp, Kernel kernel) {
+    vp.RegWrite(Reg::ECX, kernel);
+    const auto start = std::chrono::steady_clock::now();
+    if (!runToHLT(vp)) {
+        return -1.0;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Returns the best of several passes of a kernel after an untimed warm-up
+// pass, or a negative value if the guest failed.
+static double bestOf(VirtualProcessor& vp, Kernel kernel) {
+    if (timeKernel(vp, kernel) < 0.0) {
+        return -1.0;
+    }
+    double best = 0.0;
+    for (int pass = 0; pass < numPasses; pass++) {
+        const double seconds = timeKernel(vp, kernel);
+        if (seconds < 0.0) {
+            return -1.0;
+        }
+        if (pass == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+// Returns the number of page faults taken by the calling thread, or by the
+// whole process where per-thread counts are not available.
+static uint64_t hostPageFaults() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PageFaultCount;
+#else
+    struct rusage usage;
+#if defined(__linux__)
+    if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+#else
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+#endif
+        return 0;
+    }
+    return (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+#endif
+}
+
+// Reads KVM's count of guest page faults fixed by the MMU, which includes
+// EPT violations. The counter is global to the host and needs debugfs access,
+// usually root. Returns false if it is not available.
+static bool eptFaults(uint64_t& count) {
+#if defined(__linux__)
+    FILE *fp = fopen("/sys/kernel/debug/kvm/pf_fixed", "r");
+    if (fp == NULL) {
+        return false;
+    }
+    unsigned long long value;
+    const bool ok = fscanf(fp, "%llu", &value) == 1;
+    fclose(fp);
+    count = value;
+    return ok;
+#else
+    (void)count;
+    return false;
+#endif
+}
+
+// Counts how many bytes of a range the host backs with huge pages. Only
+// resident pages count, so call it after the guest touched the range.
+// Returns false if the host does not tell.
+static bool hugePageBytes(const void *memory, size_t size, uint64_t& bytes) {
+    bytes = 0;
+#if defined(_WIN32)
+    const SIZE_T largePage = GetLargePageMinimum();
+    if (largePage == 0) {
+        return true;
+    }
+    // Large pages are always resident, so checking one entry per large page
+    // is enough
+    for (size_t offset = 0; offset < size; offset += largePage) {
+        PSAPI_WORKING_SET_EX_INFORMATION info = {};
+        info.VirtualAddress = (uint8_t *)memory + offset;
+        if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info))) {
+            return false;
+        }
+        if (info.VirtualAttributes.Valid && info.VirtualAttributes.LargePage) {
+            bytes += std::min<uint64_t>(largePage, size - offset);
+        }
+    }
+    return true;
+#elif defined(__linux__)
+    // Sums the huge page fields of the mappings that overlap the range.
+    // Transparent huge pages show up as AnonHugePages, preallocated ones as
+    // Private_Hugetlb or Shared_Hugetlb.
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL) {
+        return false;
+    }
+    const uintptr_t start = (uintptr_t)memory;
+    const uintptr_t end = start + size;
+    bool inRange = false;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long mapStart, mapEnd;
+        unsigned long long kb;
+        if (sscanf(line, "%lx-%lx ", &mapStart, &mapEnd) == 2) {
+            inRange = mapStart < end && mapEnd > start;
+        }
+        else if (inRange && (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1
+            || sscanf(line, "Private_Hugetlb: %llu kB", &kb) == 1
+            || sscanf(line, "Shared_Hugetlb: %llu kB", &kb) == 1)) {
+            bytes += kb * 1024;
+        }
+    }
+    fclose(fp);
+    return true;
+#else
+    (void)memory;
+    (void)size;
+    return false;
+#endif
+}
+
+struct ModeResult {
+    const char *name;
+    bool ok;
+    double touchUs;        // First-touch cost per page, minus the cost of touching it again
+    uint64_t hostFaults;   // Host page faults during the first-touch pass
+    bool hasEPTFaults;
+    uint64_t eptFaults;    // KVM MMU faults during the first-touch pass
+    bool hasHugeBytes;
+    uint64_t hugeBytes;    // Bytes of guest RAM backed by huge pages after the first-touch pass
+    double readGBs;
+    double writeGBs;
+    double randomGBs;
+};
+
+// Boots a virtual machine with RAM allocated in the given mode and runs every
+// kernel. Returns false if the mode is unavailable or the guest failed.
+static bool runMode(Platform& platform, uint8_t *rom, uint32_t ramSize, AllocMode mode, ModeResult& result) {
+    const uint32_t bufferSize = ramSize - bufferBase;
+    uint8_t *ram = alignedAlloc(ramSize, mode);
+    if (ram == NULL) {
+        printf("  Allocation failed; mode not available on this host\n");
+        return false;
+    }
+    // Only the kernel's page is touched by the host; the buffer is left
+    // untouched so that the guest takes the first-touch faults
+    writeKernel(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("  Failed to create virtual machine\n");
+        alignedFree(ram);
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+
+    bool ok = false;
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("  Failed to map ROM\n");
+    }
+    else if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("  Failed to map RAM\n");
+    }
+    else {
+        auto& vp = vm.GetVirtualProcessor(0)->get();
+        vp.RegWrite(Reg::EBX, bufferBase);
+        vp.RegWrite(Reg::EDX, ramSize);
+
+        // The random kernel addresses the largest power of two number of
+        // cache lines that fits in the buffer
+        uint32_t lines = 1;
+        while (lines * 2 <= bufferSize / 64) {
+            lines *= 2;
+        }
+        vp.RegWrite(Reg::EBP, lines - 1);
+
+        const uint32_t pages = bufferSize / PAGE_SIZE;
+        uint64_t eptBefore = 0, eptAfter = 0;
+
+        // Boot into the kernel; the first HLT is right at its entry point
+        if (runToHLT(vp)) {
+            result.hasEPTFaults = eptFaults(eptBefore);
+            const uint64_t faultsBefore = hostPageFaults();
+            const double firstTouch = timeKernel(vp, KernelTouch);
+            result.hostFaults = hostPageFaults() - faultsBefore;
+            result.hasEPTFaults = result.hasEPTFaults && eptFaults(eptAfter);
+            result.eptFaults = eptAfter - eptBefore;
+            const double secondTouch = timeKernel(vp, KernelTouch);
+            result.hasHugeBytes = hugePageBytes(ram, ramSize, result.hugeBytes);
+            if (result.hasHugeBytes) {
+                printf("  Backed by huge pages: %" PRIu64 " of %" PRIu32 " MiB\n", result.hugeBytes / (1024 * 1024), ramSize / (1024 * 1024));
+            }
+
+            const double read = bestOf(vp, KernelRead);
+            const double write = bestOf(vp, KernelWrite);
+            vp.RegWrite(Reg::EDI, lines);
+            vp.RegWrite(Reg::EAX, 1);
+            const double random = bestOf(vp, KernelRandom);
+
+            ok = firstTouch >= 0.0 && secondTouch >= 0.0 && read > 0.0 && write > 0.0 && random > 0.0;
+            if (ok) {
+                result.touchUs = (firstTouch - secondTouch) * 1e6 / pages;
+                result.readGBs = bufferSize / read / 1e9;
+                result.writeGBs = bufferSize / write / 1e9;
+                result.randomGBs = (double)lines * 64 / random / 1e9;
+            }
+        }
+    }
+
+    platform.FreeVM(vm);
+    alignedFree(ram);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Optional argument: guest RAM size in MiB
+    uint32_t ramSizeMiB = 512;
+    if (argc >= 2) {
+        ramSizeMiB = (uint32_t)strtoul(argv[1], NULL, 10);
+        if (ramSizeMiB < 4 || ramSizeMiB > 3072) {
+            printf("fatal: RAM size must be between 4 and 3072 MiB\n");
+            printf("usage: %s [ram size in MiB]\n", argv[0]);
+            return -1;
+        }
+    }
+    const uint32_t ramSize = ramSizeMiB * 1024 * 1024;
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    if (rom == NULL) {
+        printf("fatal: failed to allocate memory for ROM\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    // ----- Benchmark --------------------------------------------------------------------------------------------------------
+
+    ModeResult results[] = {
+        { "plain" },
+        { "huge pages" },
+        { "lazy mmap" },
+        { "file-backed" },
+    };
+    const AllocMode modes[] = { AllocMode::Default, AllocMode::HugePages, AllocMode::Lazy, AllocMode::FileBacked };
+    for (size_t i = 0; i < array_size(modes); i++) {
+        printf("Guest RAM: %u MiB, %s\n", ramSizeMiB, results[i].name);
+        results[i].ok = runMode(platform, rom, ramSize, modes[i], results[i]);
+    }
+    printf("\n");
+
+    // ----- Report -----------------------------------------------------------------------------------------------------------
+
+    printf("%-12s %14s %12s %12s %11s %10s %10s %10s\n", "Mode", "Touch (us/pg)", "Host faults", "EPT faults", "Huge (MiB)", "Read", "Write", "Random");
+    for (auto& result : results) {
+        if (!result.ok) {
+            printf("%-12s %14s\n", result.name, "n/a");
+            continue;
+        }
+        char ept[24];
+        if (result.hasEPTFaults) {
+            snprintf(ept, sizeof(ept), "%" PRIu64, result.eptFaults);
+        }
+        else {
+            snprintf(ept, sizeof(ept), "n/a");
+        }
+        char huge[24];
+        if (result.hasHugeBytes) {
+            snprintf(huge, sizeof(huge), "%" PRIu64, result.hugeBytes / (1024 * 1024));
+        }
+        else {
+            snprintf(huge, sizeof(huge), "n/a");
+        }
+        printf("%-12s %14.3f %12" PRIu64 " %12s %11s %5.2f GB/s %5.2f GB/s %5.2f GB/s\n", result.name, result.touchUs, result.hostFaults, ept,
+            huge, result.readGBs, result.writeGBs, result.randomGBs);
+    }
+
+    alignedFree(rom);
+
+    return 0;
+}
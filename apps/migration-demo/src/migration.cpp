@@ -0,0 +1,339 @@
+/*
+Demonstrates pre-copy live migration of a running guest through a file or a
+Unix domain socket.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "migration.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = 64 * 1024 * 1024;  // 64 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+const uint32_t resultAddr = 0x3000;
+
+// Region the guest keeps writing to, and the number of dword slots per page
+// it cycles through. Everything above it is filled by the host before the
+// guest starts and never changes.
+const uint32_t hotBase = 0x200000;
+const uint32_t hotPages = 512;
+const uint32_t hotSlots = 1024;
+const uint32_t coldBase = 0x400000;
+
+// Must match the constants in the guest code
+const uint32_t numIterations = 3000;
+const uint32_t pagesPerIteration = 4;
+
+// How long the source runs before the migration starts
+const auto migrationDelay = std::chrono::milliseconds(100);
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, coldBase);
+    for (uint32_t offset = coldBase; offset < ramSize; offset += sizeof(uint32_t)) {
+        const uint32_t value = offset * 2654435761u;
+        memcpy(&ram[offset], &value, sizeof(value));
+    }
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // For 3000 iterations, writes the iteration number to four pages of the
+    // hot region, spins for a while and then exits through port 0x80, which
+    // gives the host a chance to pause the guest. The iteration count is
+    // stored at 0x3000 at the end.
+    addr = kernelBase;
+    emit(ram, "\x31\xdb");                         // [0x1000] xor    ebx, ebx
+    emit(ram, "\xb9\x04\x00\x00\x00");             // [0x1002] mov    ecx, 4
+    emit(ram, "\x8d\x04\x9d\x00\x00\x00\x00");     // [0x1007] lea    eax, [ebx*4]
+    emit(ram, "\x89\xc2");                         // [0x100e] mov    edx, eax
+    emit(ram, "\x81\xe2\xff\x01\x00\x00");         // [0x1010] and    edx, 0x1ff
+    emit(ram, "\xc1\xe2\x0c");                     // [0x1016] shl    edx, 12
+    emit(ram, "\x89\xde");                         // [0x1019] mov    esi, ebx
+    emit(ram, "\x81\xe6\xff\x03\x00\x00");         // [0x101b] and    esi, 0x3ff
+    emit(ram, "\x8d\x94\xb2\x00\x00\x20\x00");     // [0x1021] lea    edx, [edx+esi*4+0x200000]
+    emit(ram, "\x89\x1a");                         // [0x1028] mov    [edx], ebx
+    emit(ram, "\x40");                             // [0x102a] inc    eax
+    emit(ram, "\x49");                             // [0x102b] dec    ecx
+    emit(ram, "\x75\xe0");                         // [0x102c] jnz    0x100e
+    emit(ram, "\xb9\xe0\x93\x04\x00");             // [0x102e] mov    ecx, 300000
+    emit(ram, "\x49");                             // [0x1033] dec    ecx
+    emit(ram, "\x75\xfd");                         // [0x1034] jnz    0x1033
+    emit(ram, "\xe6\x80");                         // [0x1036] out    0x80, al
+    emit(ram, "\x43");                             // [0x1038] inc    ebx
+    emit(ram, "\x81\xfb\xb8\x0b\x00\x00");         // [0x1039] cmp    ebx, 3000
+    emit(ram, "\x72\xc1");                         // [0x103f] jb     0x1002
+    emit(ram, "\x89\x1d\x00\x30\x00\x00");         // [0x1041] mov    [0x3000], ebx
+    emit(ram, "\xf4");                             // [0x1047] hlt
+#undef emit
+}
+
+// Checks the memory of a guest that ran to completion against the result of
+// running the same algorithm on the host.
+static bool verifyGuest(const uint8_t *ram) noexcept {
+    std::vector<uint32_t> hot(hotPages * PAGE_SIZE / sizeof(uint32_t), 0);
+    for (uint32_t i = 0; i < numIterations; i++) {
+        for (uint32_t k = 0; k < pagesPerIteration; k++) {
+            const uint32_t page = (i * pagesPerIteration + k) % hotPages;
+            hot[page * (PAGE_SIZE / sizeof(uint32_t)) + i % hotSlots] = i;
+        }
+    }
+    if (memcmp(&ram[hotBase], hot.data(), hotPages * PAGE_SIZE) != 0) {
+        printf("  Hot region does not match\n");
+        return false;
+    }
+    for (uint32_t offset = coldBase; offset < ramSize; offset += sizeof(uint32_t)) {
+        uint32_t value;
+        memcpy(&value, &ram[offset], sizeof(value));
+        if (value != offset * 2654435761u) {
+            printf("  Cold region differs at 0x%08x\n", offset);
+            return false;
+        }
+    }
+    uint32_t result;
+    memcpy(&result, &ram[resultAddr], sizeof(result));
+    if (result != numIterations) {
+        printf("  Guest completed %u iterations, expected %u\n", result, numIterations);
+        return false;
+    }
+    return true;
+}
+
+static VirtualMachine *createVM(Platform& platform, uint8_t *rom, uint8_t *ram) {
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return NULL;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute | MemoryFlags::DirtyPageTracking, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+    return &vm;
+}
+
+// Runs the processor until the guest halts. Stops early if the source
+// reports that the guest was migrated away.
+static bool runGuest(VirtualProcessor& vp, MigrationSource *source, bool& migrated) {
+    migrated = false;
+    for (;;) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            return false;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        if (exitInfo.reason == VMExitReason::HLT) {
+            return true;
+        }
+        if (exitInfo.reason != VMExitReason::PIO) {
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            return false;
+        }
+        if (source != NULL && source->SafePoint()) {
+            migrated = true;
+            return true;
+        }
+    }
+}
+
+// Starts the guest and migrates it through the channel while it runs.
+static bool sendGuest(Platform& platform, uint8_t *rom, uint8_t *ram, MigrationChannel& channel) {
+    writeGuest(ram);
+    VirtualMachine *vm = createVM(platform, rom, ram);
+    if (vm == NULL) {
+        return false;
+    }
+    auto& vp = vm->GetVirtualProcessor(0)->get();
+    IOBus bus;
+    bus.Attach(*vm);
+
+    MigrationSource source(*vm, vp, ram, ramBase, ramSize);
+    MigrationSource::Options options;
+    bool sent = false;
+    std::thread migrationThread([&] {
+        std::this_thread::sleep_for(migrationDelay);
+        sent = source.Migrate(channel, options);
+    });
+
+    bool migrated;
+    const bool ran = runGuest(vp, &source, migrated);
+    source.Detach();
+    migrationThread.join();
+    platform.FreeVM(*vm);
+
+    if (!ran) {
+        return false;
+    }
+    if (!migrated || !sent) {
+        printf("Migration failed%s\n", migrated ? "" : "; the guest finished before it could be paused");
+        return false;
+    }
+
+    auto& stats = source.GetStats();
+    printf("Migrated in %zu rounds:", stats.rounds);
+    for (uint64_t pages : stats.pagesPerRound) {
+        printf(" %" PRIu64, pages);
+    }
+    printf(" pages\n");
+    if (!stats.dirtyPageTracking) {
+        printf("  Dirty page tracking is not supported; RAM was sent twice\n");
+    }
+    printf("  Pages sent: %" PRIu64 ", bytes sent: %" PRIu64 "\n", stats.pagesSent, stats.bytesSent);
+    printf("  Downtime: %.3f ms, total time: %.3f ms\n", stats.downtimeNs / 1000000.0, stats.totalNs / 1000000.0);
+    return true;
+}
+
+// Loads a migrated guest from the channel and runs it to completion.
+static bool receiveGuest(Platform& platform, uint8_t *rom, uint8_t *ram, MigrationChannel& channel) {
+    memset(ram, 0, ramSize);
+    VirtualMachine *vm = createVM(platform, rom, ram);
+    if (vm == NULL) {
+        return false;
+    }
+    auto& vp = vm->GetVirtualProcessor(0)->get();
+    IOBus bus;
+    bus.Attach(*vm);
+
+    MigrationTarget target(vp, ram, ramBase, ramSize);
+    const auto start = std::chrono::steady_clock::now();
+    if (!target.Receive(channel)) {
+        printf("Failed to receive the migration stream\n");
+        platform.FreeVM(*vm);
+        return false;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    auto& stats = target.GetStats();
+    printf("Received %" PRIu64 " pages in %zu records, %" PRIu64 " bytes in %.3f ms\n",
+        stats.pagesReceived, stats.pageRecords, stats.bytesReceived, elapsed.count() * 1000.0);
+
+    bool migrated;
+    bool ok = runGuest(vp, NULL, migrated);
+    platform.FreeVM(*vm);
+    if (ok) {
+        ok = verifyGuest(ram);
+        printf("Guest %s after migration\n", ok ? "completed successfully" : "produced wrong results");
+    }
+    return ok;
+}
+
+static void printUsage(const char *name) {
+    printf("usage: %s                 migrate within this process through a file\n", name);
+    printf("       %s listen <path>   receive a guest on a Unix socket\n", name);
+    printf("       %s send <path>     send a guest to a Unix socket\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    const char *mode = (argc >= 2) ? argv[1] : NULL;
+    if ((mode != NULL && argc != 3) || (mode != NULL && strcmp(mode, "listen") != 0 && strcmp(mode, "send") != 0)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().dirtyPageTracking) {
+        printf("warning: dirty page tracking not supported; RAM will be sent again while the guest is paused\n\n");
+    }
+
+    bool ok;
+    MigrationChannel channel;
+    if (mode == NULL) {
+        const char *path = "virt86-migration.bin";
+        ok = channel.OpenFile(path, true);
+        if (!ok) {
+            printf("fatal: failed to create %s\n", path);
+        }
+        else {
+            ok = sendGuest(platform, rom, ram, channel);
+            channel.Close();
+            if (ok && !channel.OpenFile(path, false)) {
+                printf("fatal: failed to open %s\n", path);
+                ok = false;
+            }
+            else if (ok) {
+                printf("\n");
+                ok = receiveGuest(platform, rom, ram, channel);
+            }
+            channel.Close();
+            remove(path);
+        }
+    }
+    else if (strcmp(mode, "listen") == 0) {
+        printf("Waiting for a guest on %s\n", argv[2]);
+        ok = channel.ListenUnix(argv[2]);
+        if (!ok) {
+            printf("fatal: failed to listen on %s\n", argv[2]);
+        }
+        else {
+            ok = receiveGuest(platform, rom, ram, channel);
+        }
+    }
+    else {
+        ok = channel.ConnectUnix(argv[2]);
+        if (!ok) {
+            printf("fatal: failed to connect to %s\n", argv[2]);
+        }
+        else {
+            ok = sendGuest(platform, rom, ram, channel);
+        }
+    }
+
+    alignedFree(ram);
+    alignedFree(rom);
+    return ok ? 0 : -1;
+}
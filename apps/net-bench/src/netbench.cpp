@@ -0,0 +1,331 @@
+/*
+Entry point of the network benchmark. Two virtual machines exchange packets
+through NetDevices connected by a PacketLink.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "event_loop.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "net_device.hpp"
+#include "packet_link.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t romSize = PAGE_SIZE * 16;  // 64 KiB
+const uint32_t ramSize = PAGE_SIZE * 512; // 2 MiB
+const uint64_t romBase = 0xFFFF0000;
+const uint64_t ramBase = 0x0;
+const uint64_t ramProgramBase = 0x10000;
+
+// Parameters and results shared with the guest, matching net.asm
+const uint32_t paramRole = 0x6000;
+const uint32_t paramSize = 0x6004;
+const uint32_t paramStream = 0x6008;
+const uint32_t paramPings = 0x600C;
+const uint32_t resultErrors = 0x6010;
+const uint32_t resultDone = 0x6014;
+
+const uint16_t netPort = 0xE00;
+const uint8_t netVector = 0x40;
+const uint16_t markerPort = 0xE80;
+
+const uint32_t roleClient = 0;
+const uint32_t roleServer = 1;
+
+const uint32_t defaultStreamPackets = 1000000;
+const uint32_t defaultPings = 20000;
+
+// Timestamps the phases of the benchmark when the guest writes their markers
+class MarkerDevice : public IODevice {
+public:
+    static const uint32_t StreamStart = 1;
+    static const uint32_t StreamEnd = 2;
+    static const uint32_t PingStart = 3;
+    static const uint32_t PingEnd = 4;
+
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        if (value < array_size(m_times)) {
+            m_times[value] = std::chrono::steady_clock::now();
+        }
+    }
+
+    double Seconds(uint32_t start, uint32_t end) const noexcept {
+        return std::chrono::duration<double>(m_times[end] - m_times[start]).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_times[5];
+};
+
+static bool loadFile(const char *path, uint8_t *buffer, size_t maxSize, size_t& size) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    const long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len < 0 || (size_t)len > maxSize) {
+        fclose(fp);
+        return false;
+    }
+    size = fread(buffer, 1, (size_t)len, fp);
+    fclose(fp);
+    return size == (size_t)len;
+}
+
+static VirtualMachine *createGuest(Platform& platform, uint8_t *rom, uint8_t *ram) {
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return NULL;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(romBase, romSize, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return NULL;
+    }
+
+    // The ROM builds its page tables at 0x0 and needs a small stack, like in
+    // the 64-bit guest demo
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+    RegValue edi, esp;
+    edi.u32 = 0x0;
+    esp.u32 = 0x10000;
+    vp.RegWrite(Reg::EDI, edi);
+    vp.RegWrite(Reg::ESP, esp);
+    return &vm;
+}
+
+// Runs the guest until it finishes the benchmark or the other guest fails
+static bool runGuest(VirtualProcessor& vp, InterruptQueue& irqs, const uint8_t *ram, const std::atomic<bool>& abort, uint64_t& exits) {
+    while (!abort) {
+        irqs.Deliver(vp);
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            return false;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            if (ram[resultDone] != 0) {
+                return true;
+            }
+            irqs.WaitForInterrupt();
+            break;
+        case VMExitReason::PIO:
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool runPhase(Platform& platform, uint8_t *rom, uint8_t *rams[2], const uint8_t *program, size_t programSize, uint32_t packetSize, uint32_t streamPackets, uint32_t pings) {
+    for (uint32_t i = 0; i < 2; i++) {
+        uint8_t *ram = rams[i];
+        memset(ram, 0, ramSize);
+        memcpy(&ram[ramProgramBase], program, programSize);
+        const uint32_t role = (i == 0) ? roleClient : roleServer;
+        memcpy(&ram[paramRole], &role, sizeof(role));
+        memcpy(&ram[paramSize], &packetSize, sizeof(packetSize));
+        memcpy(&ram[paramStream], &streamPackets, sizeof(streamPackets));
+        memcpy(&ram[paramPings], &pings, sizeof(pings));
+    }
+
+    VirtualMachine *vms[2] = { NULL, NULL };
+    vms[0] = createGuest(platform, rom, rams[0]);
+    vms[1] = (vms[0] != NULL) ? createGuest(platform, rom, rams[1]) : NULL;
+    if (vms[1] == NULL) {
+        if (vms[0] != NULL) {
+            platform.FreeVM(*vms[0]);
+        }
+        return false;
+    }
+
+    EventLoop loop;
+    PacketLink links[2];
+    if (!loop.IsValid() || !links[0].Create() || !links[1].OpenPeer(links[0])) {
+        printf("fatal: failed to create packet link\n");
+        platform.FreeVM(*vms[0]);
+        platform.FreeVM(*vms[1]);
+        return false;
+    }
+
+    // Each device reads the packets it receives straight from the other
+    // guest's memory
+    InterruptQueue irqs[2];
+    NetDevice client(loop, irqs[0], netVector, netPort, rams[0], ramBase, ramSize);
+    NetDevice server(loop, irqs[1], netVector, netPort, rams[1], ramBase, ramSize);
+    client.Attach(links[0], rams[1], ramBase, ramSize);
+    server.Attach(links[1], rams[0], ramBase, ramSize);
+
+    MarkerDevice markers;
+    IOBus buses[2];
+    buses[0].AddPIODevice(netPort, NetDevice::NumPorts, client);
+    buses[0].AddPIODevice(markerPort, 1, markers);
+    buses[1].AddPIODevice(netPort, NetDevice::NumPorts, server);
+    buses[0].Attach(*vms[0]);
+    buses[1].Attach(*vms[1]);
+
+    std::thread loopThread([&]() { loop.Run(); });
+
+    // Each guest runs on its own thread. A guest that fails wakes up the other
+    // one so that it can give up too.
+    std::atomic<bool> abort{ false };
+    bool ok[2] = { false, false };
+    uint64_t exits[2] = { 0, 0 };
+    std::thread guestThreads[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        guestThreads[i] = std::thread([&, i]() {
+            auto& vp = vms[i]->GetVirtualProcessor(0)->get();
+            ok[i] = runGuest(vp, irqs[i], rams[i], abort, exits[i]);
+            if (!ok[i]) {
+                abort = true;
+                irqs[1 - i].Raise(netVector);
+            }
+        });
+    }
+    for (auto& thread : guestThreads) {
+        thread.join();
+    }
+
+    loop.Stop();
+    loopThread.join();
+    platform.FreeVM(*vms[0]);
+    platform.FreeVM(*vms[1]);
+
+    uint32_t errors[2];
+    memcpy(&errors[0], &rams[0][resultErrors], sizeof(errors[0]));
+    memcpy(&errors[1], &rams[1][resultErrors], sizeof(errors[1]));
+    const auto clientStats = client.GetStats();
+    const auto serverStats = server.GetStats();
+
+    printf("\n%" PRIu32 "-byte packets:\n", packetSize);
+    if (!ok[0] || !ok[1]) {
+        printf("  The benchmark did not finish\n");
+        return false;
+    }
+    const double streamTime = markers.Seconds(MarkerDevice::StreamStart, MarkerDevice::StreamEnd);
+    const double pingTime = markers.Seconds(MarkerDevice::PingStart, MarkerDevice::PingEnd);
+    printf("  Stream: %" PRIu32 " packets in %.3f s: %.0f packets/s, %.1f Mbit/s\n",
+        streamPackets, streamTime, streamPackets / streamTime, streamPackets * packetSize * 8.0 / streamTime / 1000000.0);
+    printf("  Ping-pong: %" PRIu32 " round trips in %.3f s: %.2f us per round trip\n",
+        pings, pingTime, pingTime * 1000000.0 / pings);
+    printf("  Client sent %" PRIu64 " packets with %" PRIu64 " doorbells; the server was woken up %" PRIu64 " times\n",
+        clientStats.txPackets, clientStats.txDoorbells, clientStats.txKicks);
+    printf("  Server received %" PRIu64 " packets in %" PRIu64 " batches (%.1f per batch) with %" PRIu64 " interrupts\n",
+        serverStats.rxPackets, serverStats.rxBatches, serverStats.rxBatches ? (double)serverStats.rxPackets / serverStats.rxBatches : 0.0, serverStats.interrupts);
+    printf("  VM exits: client %" PRIu64 ", server %" PRIu64 " (%.2f per packet)\n",
+        exits[0], exits[1], (double)(exits[0] + exits[1]) / (streamPackets + 2 * pings + 1));
+    if (errors[0] != 0 || errors[1] != 0 || clientStats.rxDropped != 0 || serverStats.rxDropped != 0) {
+        printf("  Bad packets: %" PRIu32 " on the client, %" PRIu32 " on the server\n", errors[0], errors[1]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Require two arguments: the ROM code from the 64-bit guest demo and the
+    // network driver
+    if (argc < 3) {
+        printf("fatal: no input files specified\n");
+        printf("usage: %s <rom> <net.bin> [packets to stream] [round trips]\n", argv[0]);
+        return -1;
+    }
+    uint32_t streamPackets = defaultStreamPackets;
+    uint32_t pings = defaultPings;
+    if (argc >= 4) {
+        streamPackets = (uint32_t)strtoul(argv[3], NULL, 0);
+    }
+    if (argc >= 5) {
+        pings = (uint32_t)strtoul(argv[4], NULL, 0);
+    }
+    if (streamPackets == 0 || pings == 0) {
+        printf("usage: %s <rom> <net.bin> [packets to stream] [round trips]\n", argv[0]);
+        return -1;
+    }
+
+    uint8_t *rom = alignedAlloc(romSize);
+    uint8_t *program = alignedAlloc(ramSize);
+    uint8_t *rams[2] = { alignedAlloc(ramSize), alignedAlloc(ramSize) };
+    if (rom == NULL || program == NULL || rams[0] == NULL || rams[1] == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    size_t len;
+    if (!loadFile(argv[1], rom, romSize, len) || len != romSize) {
+        printf("fatal: could not load ROM file: %s\n", argv[1]);
+        return -1;
+    }
+    size_t programSize;
+    if (!loadFile(argv[2], program, ramSize - ramProgramBase, programSize)) {
+        printf("fatal: could not load RAM file: %s\n", argv[2]);
+        return -1;
+    }
+
+    printf("virt86 version: " VIRT86_VERSION "\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    bool ok = runPhase(platform, rom, rams, program, programSize, 64, streamPackets, pings)
+        && runPhase(platform, rom, rams, program, programSize, 1500, streamPackets, pings);
+
+    alignedFree(rams[1]);
+    alignedFree(rams[0]);
+    alignedFree(program);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,282 @@
+/*
+Entry point of the NUMA benchmark.
+
+Places guest RAM on each NUMA node of the host in turn and runs a guest
+kernel that sweeps through memory from virtual processor threads pinned to
+every node, reporting the bandwidth of local and remote memory accesses.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "print_helpers.hpp"
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "numa.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+// Guest memory layout
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;     // Guest kernel code
+const uint32_t stackTop = 0x1000;       // Stack grows down from the kernel
+const uint32_t bufferBase = 0x100000;   // Memory swept by the guest kernel
+
+// Number of timed passes over the buffer for each node combination
+const int numPasses = 5;
+
+// Writes the memory sweep kernel to RAM.
+// The kernel expects EBX to contain the start of the buffer and EDX its end.
+// It reads one dword from every 64-byte cache line and stops at a HLT before
+// each pass, so that every VP.Run() call times exactly one pass.
+static void writeKernel(uint8_t *ram) {
+    uint32_t addr = kernelBase;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    emit(ram, "\xf4");                             // [0x1000] hlt
+    emit(ram, "\x89\xde");                         // [0x1001] mov    esi, ebx
+    //                                             // sweep:
+    emit(ram, "\x8b\x06");                         // [0x1003] mov    eax, [esi]
+    emit(ram, "\x8b\x46\x40");                     // [0x1005] mov    eax, [esi+0x40]
+    emit(ram, "\x8b\x86\x80\x00\x00\x00");         // [0x1008] mov    eax, [esi+0x80]
+    emit(ram, "\x8b\x86\xc0\x00\x00\x00");         // [0x100e] mov    eax, [esi+0xc0]
+    emit(ram, "\x81\xc6\x00\x01\x00\x00");         // [0x1014] add    esi, 0x100
+    emit(ram, "\x39\xd6");                         // [0x101a] cmp    esi, edx
+    emit(ram, "\x72\xe5");                         // [0x101c] jb     sweep
+    emit(ram, "\xeb\xe0");                         // [0x101e] jmp    0x1000
+#undef emit
+}
+
+// Runs the guest until the next HLT. Returns false if the VP failed or exited
+// for any other reason.
+static bool runToHLT(VirtualProcessor& vp) {
+    for (;;) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            return false;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            return true;
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            continue;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            return false;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Optional argument: guest RAM size in MiB
+    uint32_t ramSizeMiB = 256;
+    if (argc >= 2) {
+        ramSizeMiB = (uint32_t)strtoul(argv[1], NULL, 10);
+        if (ramSizeMiB < 2 || ramSizeMiB > 3072) {
+            printf("fatal: RAM size must be between 2 and 3072 MiB\n");
+            printf("usage: %s [ram size in MiB]\n", argv[0]);
+            return -1;
+        }
+    }
+    const uint32_t ramSize = ramSizeMiB * 1024 * 1024;
+    const uint32_t bufferSize = ramSize - bufferBase;
+
+    // ----- NUMA topology ----------------------------------------------------------------------------------------------------
+
+    const size_t numNodes = numaNodeCount();
+    printf("NUMA nodes: %zu\n", numNodes);
+    for (size_t node = 0; node < numNodes; node++) {
+        std::vector<uint32_t> cpus;
+        numaNodeCPUs(node, cpus);
+        printf("  Node %zu: %zu CPUs\n", node, cpus.size());
+    }
+    if (numNodes == 1) {
+        printf("Single node host; only local accesses will be measured\n");
+    }
+    printf("\n");
+
+    // ----- Hypervisor platform initialization -------------------------------------------------------------------------------
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    printPlatformFeatures(platform);
+
+    // Initialize ROM
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    if (rom == NULL) {
+        printf("fatal: failed to allocate memory for ROM\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    // bandwidth[cpuNode][memNode] in GB/s; zero means not measured
+    std::vector<std::vector<double>> bandwidth(numNodes, std::vector<double>(numNodes, 0.0));
+
+    // ----- Benchmark --------------------------------------------------------------------------------------------------------
+
+    for (size_t memNode = 0; memNode < numNodes; memNode++) {
+        uint8_t *ram = alignedAllocOnNode(ramSize, memNode);
+        if (ram == NULL) {
+            printf("Failed to allocate RAM on node %zu, skipping\n", memNode);
+            continue;
+        }
+        // Touch every page so that they are faulted in on the bound node
+        memset(ram, 0, ramSize);
+        writeKernel(ram);
+
+        VMSpecifications vmSpecs = { 0 };
+        vmSpecs.numProcessors = 1;
+        auto opt_vm = platform.CreateVM(vmSpecs);
+        if (!opt_vm) {
+            printf("fatal: failed to create virtual machine\n");
+            return -1;
+        }
+        VirtualMachine& vm = opt_vm->get();
+
+        if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+            printf("fatal: failed to map ROM\n");
+            return -1;
+        }
+        if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+            printf("fatal: failed to map RAM\n");
+            return -1;
+        }
+
+        auto& vp = vm.GetVirtualProcessor(0)->get();
+        vp.RegWrite(Reg::EBX, bufferBase);
+        vp.RegWrite(Reg::EDX, ramSize);
+
+        // Boot into the kernel; the first HLT is right at its entry point
+        if (!runToHLT(vp)) {
+            return -1;
+        }
+
+        for (size_t cpuNode = 0; cpuNode < numNodes; cpuNode++) {
+            // Run the virtual processor from a thread pinned to the node
+            bool ok = true;
+            std::thread vcpuThread([&]() {
+                if (!numaPinCurrentThread(cpuNode)) {
+                    printf("Failed to pin VCPU thread to node %zu\n", cpuNode);
+                    ok = false;
+                    return;
+                }
+
+                // Warm up caches and TLBs with an untimed pass
+                if (!runToHLT(vp)) {
+                    ok = false;
+                    return;
+                }
+
+                double bestSeconds = 0.0;
+                for (int pass = 0; pass < numPasses; pass++) {
+                    const auto start = std::chrono::steady_clock::now();
+                    if (!runToHLT(vp)) {
+                        ok = false;
+                        return;
+                    }
+                    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    if (pass == 0 || elapsed.count() < bestSeconds) {
+                        bestSeconds = elapsed.count();
+                    }
+                }
+                bandwidth[cpuNode][memNode] = (double)bufferSize / bestSeconds / 1e9;
+            });
+            vcpuThread.join();
+            if (!ok) {
+                return -1;
+            }
+            printf("VCPU on node %zu, RAM on node %zu: %.2f GB/s\n", cpuNode, memNode, bandwidth[cpuNode][memNode]);
+        }
+
+        platform.FreeVM(vm);
+        alignedFree(ram);
+    }
+    printf("\n");
+
+    // ----- Report -----------------------------------------------------------------------------------------------------------
+
+    printf("Read bandwidth in GB/s (rows: VCPU node, columns: RAM node)\n");
+    printf("      ");
+    for (size_t memNode = 0; memNode < numNodes; memNode++) {
+        printf("  node %-3zu", memNode);
+    }
+    printf("\n");
+    double localSum = 0.0, remoteSum = 0.0;
+    size_t localCount = 0, remoteCount = 0;
+    for (size_t cpuNode = 0; cpuNode < numNodes; cpuNode++) {
+        printf("  %-4zu", cpuNode);
+        for (size_t memNode = 0; memNode < numNodes; memNode++) {
+            const double value = bandwidth[cpuNode][memNode];
+            printf("  %8.2f", value);
+            if (value <= 0.0) {
+                continue;
+            }
+            if (cpuNode == memNode) {
+                localSum += value;
+                localCount++;
+            }
+            else {
+                remoteSum += value;
+                remoteCount++;
+            }
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    if (localCount > 0) {
+        printf("Average local bandwidth:  %.2f GB/s\n", localSum / localCount);
+    }
+    if (remoteCount > 0) {
+        printf("Average remote bandwidth: %.2f GB/s\n", remoteSum / remoteCount);
+    }
+    if (localCount > 0 && remoteCount > 0) {
+        const double local = localSum / localCount;
+        const double remote = remoteSum / remoteCount;
+        printf("Local/remote gap: %.1f%% (local is %.2fx remote)\n", (local - remote) / local * 100.0, local / remote);
+    }
+    else {
+        printf("Local/remote gap: n/a\n");
+    }
+
+    alignedFree(rom);
+
+    return 0;
+}
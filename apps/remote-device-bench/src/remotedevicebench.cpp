@@ -0,0 +1,332 @@
+/*
+Compares the latency of device accesses handled in the virtual machine process
+with accesses forwarded to a device process through shared-memory rings.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "remote_device.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace virt86;
+
+const uint32_t ramSize = 1 * 1024 * 1024;  // 1 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x10000;
+const uint32_t paramsAddr = 0x3000;
+
+const uint32_t hostIterations = 1000000;
+const uint32_t defaultGuestIterations = 200000;
+
+// Registers of the benchmarked device
+const uint16_t portBase = 0x200;
+const uint16_t portCounter = 0x200;  // R: increments and returns the read counter; W: increments the write counter
+const uint16_t portWrites = 0x204;   // R: number of writes; W: resets both counters
+const uint64_t mmioBase = 0xF0000000;
+
+// Marks the end of each phase of the guest program
+const uint16_t portMarker = 0x80;
+
+// A trivial device, so that the benchmark measures the cost of reaching it
+class CounterDevice : public IODevice {
+public:
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        switch (port) {
+        case portCounter: return ++m_reads;
+        case portWrites: return m_writes;
+        default: return 0xFFFFFFFF;
+        }
+    }
+
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        switch (port) {
+        case portCounter: m_writes++; break;
+        case portWrites: m_reads = m_writes = 0; break;
+        }
+    }
+
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override {
+        return ++m_reads;
+    }
+
+private:
+    uint32_t m_reads = 0;
+    uint32_t m_writes = 0;
+};
+
+// Records the time at which each phase of the guest program ends
+class MarkerDevice : public IODevice {
+public:
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        if (m_count < maxMarkers) {
+            m_times[m_count++] = std::chrono::steady_clock::now();
+        }
+    }
+
+    size_t Count() const noexcept { return m_count; }
+    double Seconds(size_t phase) const noexcept {
+        return std::chrono::duration<double>(m_times[phase + 1] - m_times[phase]).count();
+    }
+
+private:
+    static const size_t maxMarkers = 4;
+    std::chrono::steady_clock::time_point m_times[maxMarkers];
+    size_t m_count = 0;
+};
+
+static void writeGuest(uint8_t *ram, uint32_t iterations) noexcept {
+    memset(ram, 0, ramSize);
+    memcpy(&ram[paramsAddr], &iterations, sizeof(iterations));
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Reads the counter port, writes to it and reads the counter register
+    // through MMIO, [0x3000] times each. The number of writes seen by the
+    // device is stored at 0x3004.
+    addr = kernelBase;
+    emit(ram, "\x8b\x0d\x00\x30\x00\x00");         // [0x1000] mov    ecx, [0x3000]
+    emit(ram, "\x66\xba\x00\x02");                 // [0x1006] mov    dx, 0x200
+    emit(ram, "\xe6\x80");                         // [0x100a] out    0x80, al
+    emit(ram, "\xed");                             // [0x100c] in     eax, dx
+    emit(ram, "\x49");                             // [0x100d] dec    ecx
+    emit(ram, "\x75\xfc");                         // [0x100e] jnz    0x100c
+    emit(ram, "\xe6\x80");                         // [0x1010] out    0x80, al
+    emit(ram, "\x8b\x0d\x00\x30\x00\x00");         // [0x1012] mov    ecx, [0x3000]
+    emit(ram, "\xef");                             // [0x1018] out    dx, eax
+    emit(ram, "\x49");                             // [0x1019] dec    ecx
+    emit(ram, "\x75\xfc");                         // [0x101a] jnz    0x1018
+    emit(ram, "\x66\xba\x04\x02");                 // [0x101c] mov    dx, 0x204
+    emit(ram, "\xed");                             // [0x1020] in     eax, dx
+    emit(ram, "\xa3\x04\x30\x00\x00");             // [0x1021] mov    [0x3004], eax
+    emit(ram, "\xe6\x80");                         // [0x1026] out    0x80, al
+    emit(ram, "\x8b\x0d\x00\x30\x00\x00");         // [0x1028] mov    ecx, [0x3000]
+    emit(ram, "\xa1\x00\x00\x00\xf0");             // [0x102e] mov    eax, [0xf0000000]
+    emit(ram, "\x49");                             // [0x1033] dec    ecx
+    emit(ram, "\x75\xf8");                         // [0x1034] jnz    0x102e
+    emit(ram, "\xe6\x80");                         // [0x1036] out    0x80, al
+    emit(ram, "\xf4");                             // [0x1038] hlt
+#undef emit
+}
+
+// ----- Host benchmark -------------------------------------------------------------------------------------------------------
+
+// Calls the device handlers directly, which measures the cost of the
+// transport alone
+static bool benchHost(const char *name, IODevice& device) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < hostIterations; i++) {
+        device.IORead(portCounter, 4);
+    }
+    const std::chrono::duration<double> readTime = std::chrono::steady_clock::now() - start;
+
+    // Posted writes complete when the next read is answered
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < hostIterations; i++) {
+        device.IOWrite(portCounter, 4, i);
+    }
+    const uint32_t writes = device.IORead(portWrites, 4);
+    const std::chrono::duration<double> writeTime = std::chrono::steady_clock::now() - start;
+    device.IOWrite(portWrites, 4, 0);
+
+    printf("  %-8s  read %8.1f ns   write %8.1f ns\n", name, readTime.count() * 1e9 / hostIterations, writeTime.count() * 1e9 / hostIterations);
+    if (writes != hostIterations) {
+        printf("  The device saw %" PRIu32 " writes, expected %" PRIu32 "\n", writes, hostIterations);
+        return false;
+    }
+    return true;
+}
+
+// ----- Guest benchmark ------------------------------------------------------------------------------------------------------
+
+static bool benchGuest(Platform& platform, const char *name, uint8_t *rom, uint8_t *ram, uint32_t iterations, IODevice& device) {
+    writeGuest(ram, iterations);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    MarkerDevice marker;
+    IOBus bus;
+    bus.AddPIODevice(portBase, 16, device);
+    bus.AddMMIODevice(mmioBase, 0x1000, device);
+    bus.AddPIODevice(portMarker, 1, marker);
+    bus.Attach(vm);
+
+    bool ok = true;
+    for (bool running = true; running; ) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::PIO:
+        case VMExitReason::MMIO:
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    platform.FreeVM(vm);
+    device.IOWrite(portWrites, 4, 0);
+
+    if (!ok || marker.Count() != 4) {
+        printf("  %-8s  the guest did not complete\n", name);
+        return false;
+    }
+    printf("  %-8s  PIO read %8.1f ns   PIO write %8.1f ns   MMIO read %8.1f ns\n", name,
+        marker.Seconds(0) * 1e9 / iterations, marker.Seconds(1) * 1e9 / iterations, marker.Seconds(2) * 1e9 / iterations);
+
+    uint32_t writes;
+    memcpy(&writes, &ram[paramsAddr + 4], sizeof(writes));
+    if (writes != iterations) {
+        printf("  The device saw %" PRIu32 " writes, expected %" PRIu32 "\n", writes, iterations);
+        return false;
+    }
+    return true;
+}
+
+// ----- Main -----------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    uint32_t guestIterations = defaultGuestIterations;
+    if (argc >= 2) {
+        guestIterations = (uint32_t)strtoul(argv[1], NULL, 0);
+        if (guestIterations == 0) {
+            printf("usage: %s [guest iterations]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // Start the device process before loading the hypervisor platform so that
+    // it inherits nothing but the socket
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks) != 0) {
+        printf("fatal: failed to create socket pair\n");
+        return -1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        printf("fatal: failed to start the device process\n");
+        return -1;
+    }
+    if (pid == 0) {
+        close(socks[0]);
+        RemoteDeviceServer server;
+        if (!server.Connect(socks[1])) {
+            _exit(1);
+        }
+        CounterDevice device;
+        server.Serve(device);
+        _exit(0);
+    }
+    close(socks[1]);
+    const int sock = socks[0];
+
+    RemoteIODevice remoteDevice;
+    if (!remoteDevice.Connect(sock)) {
+        printf("fatal: failed to connect to the device process\n");
+        return -1;
+    }
+    CounterDevice localDevice;
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    printf("Host calls, average per access:\n");
+    bool ok = benchHost("local", localDevice);
+    ok = benchHost("remote", remoteDevice) && ok;
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    printf("\nGuest accesses, %" PRIu32 " iterations, average per access including the VM exit:\n", guestIterations);
+    ok = benchGuest(platform, "local", rom, ram, guestIterations, localDevice) && ok;
+    ok = benchGuest(platform, "remote", rom, ram, guestIterations, remoteDevice) && ok;
+
+    auto& stats = remoteDevice.GetStats();
+    printf("\nRemote requests: %" PRIu64 ", responses received while spinning: %" PRIu64 ", after blocking: %" PRIu64 "\n",
+        stats.requests, stats.spinWaits, stats.blockWaits);
+
+    // Closing the socket stops the device process
+    close(sock);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("The device process failed\n");
+        ok = false;
+    }
+
+    alignedFree(rom);
+    alignedFree(ram);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,281 @@
+/*
+Records the non-deterministic inputs of a guest and replays them to reproduce
+the run exactly.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "input_log.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t handlerBase = 0x1100;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t resultAddr = 0x3000;
+const uint32_t stackTop = 0x8000;
+
+const uint16_t entropyPort = 0x60;
+const uint64_t clockBase = 0xE0000000;
+const uint8_t tickVector = 0x20;
+const uint32_t cpuidLeaf = 0x40000000;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Mix the results of CPUID leaf 0x40000000, 1000 reads from the entropy
+    // port and the MMIO clock, and the return address of every interrupt into
+    // a hash stored at 0x3000. Interrupts are counted at 0x3004.
+    addr = kernelBase;
+    emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");     // [0x1000] lidt   [0x1800]
+    emit(ram, "\xb8\x00\x00\x00\x40");             // [0x1007] mov    eax, 0x40000000
+    emit(ram, "\x0f\xa2");                         // [0x100c] cpuid
+    emit(ram, "\x89\xc6");                         // [0x100e] mov    esi, eax
+    emit(ram, "\x31\xde");                         // [0x1010] xor    esi, ebx
+    emit(ram, "\xfb");                             // [0x1012] sti
+    emit(ram, "\xb9\xe8\x03\x00\x00");             // [0x1013] mov    ecx, 1000
+    emit(ram, "\x66\xba\x60\x00");                 // [0x1018] mov     dx, 0x60     ; entropy
+    emit(ram, "\xed");                             // [0x101c] in     eax, dx
+    emit(ram, "\x6b\xf6\x1f");                     // [0x101d] imul   esi, esi, 31
+    emit(ram, "\x01\xc6");                         // [0x1020] add    esi, eax
+    emit(ram, "\xa1\x00\x00\x00\xe0");             // [0x1022] mov    eax, [0xe0000000] ; clock
+    emit(ram, "\x31\xc6");                         // [0x1027] xor    esi, eax
+    emit(ram, "\x89\xc2");                         // [0x1029] mov    edx, eax
+    emit(ram, "\x81\xe2\xff\x00\x00\x00");         // [0x102b] and    edx, 0xff
+    emit(ram, "\x42");                             // [0x1031] inc    edx
+    emit(ram, "\x6b\xf6\x21");                     // [0x1032] imul   esi, esi, 33
+    emit(ram, "\x01\xd6");                         // [0x1035] add    esi, edx
+    emit(ram, "\x4a");                             // [0x1037] dec    edx
+    emit(ram, "\x75\xf8");                         // [0x1038] jnz    0x1032
+    emit(ram, "\x49");                             // [0x103a] dec    ecx
+    emit(ram, "\x75\xdb");                         // [0x103b] jnz    0x1018
+    emit(ram, "\x89\x35\x00\x30\x00\x00");         // [0x103d] mov    [0x3000], esi
+    emit(ram, "\xfa");                             // [0x1043] cli
+    emit(ram, "\xf4");                             // [0x1044] hlt
+    emit(ram, "\xeb\xfd");                         // [0x1045] jmp    0x1044
+
+    // Interrupt handler
+    addr = handlerBase;
+    emit(ram, "\xff\x05\x04\x30\x00\x00");         // [0x1100] inc    dword ptr [0x3004]
+    emit(ram, "\x03\x34\x24");                     // [0x1106] add    esi, [esp]
+    emit(ram, "\xcf");                             // [0x1109] iretd
+
+    // IDT pointer
+    addr = idtrBase;
+    emit(ram, "\x07\x01\x00\x20\x00\x00");         // [0x1800] IDT pointer: 0x00002000:0x0107
+#undef emit
+    writeFlatGuestIDTEntry(ram, idtBase, tickVector, handlerBase);
+}
+
+// Returns random numbers from the host.
+class EntropyDevice : public IODevice {
+public:
+    uint32_t IORead(uint16_t port, size_t size) noexcept override { return m_rng(); }
+
+private:
+    std::mt19937 m_rng{ std::random_device{}() };
+};
+
+// Returns the host's monotonic clock in nanoseconds.
+class ClockDevice : public IODevice {
+public:
+    uint64_t MMIORead(uint64_t address, size_t size) noexcept override {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+struct RunResult {
+    uint32_t hash;
+    uint32_t interrupts;
+    uint64_t inputs;
+};
+
+// Runs the guest from scratch, recording or replaying its inputs.
+static bool runGuest(Platform& platform, uint8_t *rom, uint8_t *ram, InputLogMode mode, const char *path, RunResult& result) {
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    const auto extVMExits = BitmaskEnum(platform.GetFeatures().extendedVMExits);
+    if (extVMExits.AnyOf(ExtendedVMExit::CPUID)) {
+        vmSpecs.extendedVMExits = ExtendedVMExit::CPUID;
+        vmSpecs.vmExitCPUIDFunctions.push_back(cpuidLeaf);
+    }
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    EntropyDevice entropy;
+    ClockDevice clock;
+    IOBus bus;
+    bus.AddPIODevice(entropyPort, 1, entropy);
+    bus.AddMMIODevice(clockBase, PAGE_SIZE, clock);
+
+    InputLog log(vp, X86Mode::Bits32);
+    log.Attach(vm, bus);
+    std::mt19937 rng{ std::random_device{}() };
+    log.SetCPUIDHandler([&](VirtualProcessor& vp) {
+        vp.RegWrite(Reg::EAX, rng());
+        vp.RegWrite(Reg::EBX, rng());
+    });
+    bool started = true;
+    if (mode == InputLogMode::Record) {
+        started = log.StartRecording(path);
+    }
+    else if (mode == InputLogMode::Replay) {
+        started = log.StartReplay(path);
+    }
+    if (!started) {
+        printf("fatal: failed to open input log %s\n", path);
+        platform.FreeVM(vm);
+        return false;
+    }
+
+    bool ok = true;
+    bool running = true;
+    const auto start = std::chrono::steady_clock::now();
+    while (running) {
+        if (log.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::PIO:
+        case VMExitReason::MMIO:
+            // Tick at random points in time; ignored while replaying
+            if ((rng() & 7) == 0) {
+                log.EnqueueInterrupt(tickVector);
+            }
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    memcpy(&result.hash, &ram[resultAddr], sizeof(result.hash));
+    memcpy(&result.interrupts, &ram[resultAddr + 4], sizeof(result.interrupts));
+    result.inputs = log.InputCount();
+    if (log.DivergenceReason() != NULL) {
+        printf("  Replay diverged after %" PRIu64 " inputs: %s\n", log.DivergenceInput(), log.DivergenceReason());
+    }
+    if (mode == InputLogMode::Replay && !log.ReplayComplete()) {
+        printf("  Replay ended before consuming the whole log\n");
+        ok = false;
+    }
+    log.Close();
+    if (mode == InputLogMode::Record) {
+        printf("  Log size: %" PRIu64 " bytes (%.2f bytes/input)\n", log.BytesWritten(), (double)log.BytesWritten() / result.inputs);
+    }
+    printf("  Inputs: %" PRIu64 ", interrupts: %" PRIu32 ", hash: 0x%08" PRIx32 ", time: %.3f ms\n", result.inputs, result.interrupts, result.hash, elapsed.count() * 1000.0);
+
+    platform.FreeVM(vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Usage: virt86-replay-demo [log path]
+    const char *path = (argc > 1) ? argv[1] : "inputs.log";
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().guestDebugging) {
+        printf("fatal: platform does not support guest debugging\n");
+        return -1;
+    }
+
+    RunResult recorded, replayed, again;
+    printf("\nRecording inputs to %s\n", path);
+    if (!runGuest(platform, rom, ram, InputLogMode::Record, path, recorded)) {
+        return -1;
+    }
+
+    printf("\nReplaying inputs\n");
+    if (!runGuest(platform, rom, ram, InputLogMode::Replay, path, replayed)) {
+        return -1;
+    }
+
+    printf("\nRunning again without the log, for comparison\n");
+    if (!runGuest(platform, rom, ram, InputLogMode::Off, path, again)) {
+        return -1;
+    }
+
+    const bool match = recorded.hash == replayed.hash && recorded.interrupts == replayed.interrupts;
+    printf("\nReplay %s the recorded run\n", match ? "reproduced" : "did NOT reproduce");
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return match ? 0 : -1;
+}
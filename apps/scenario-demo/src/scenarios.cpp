@@ -0,0 +1,254 @@
+/*
+Runs a suite of small guest programs as declarative scenarios, in parallel.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "flat_guest.hpp"
+#include "scenario.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t handlerBase = 0x1100;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t dataBase = 0x3000;
+const uint32_t stackTop = 0x8000;
+
+const uint64_t mmioBase = 0xE0000000;
+const uint8_t tickVector = 0x20;
+const uint32_t cpuidLeaf = 0x40000000;
+
+// ----- Guest programs ---------------------------------------------------------------------------------------------------
+
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+
+static void writeHLTGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\xb8\x78\x56\x34\x12");             // [0x1000] mov    eax, 0x12345678
+    emit(ram, "\xf4");                             // [0x1005] hlt
+}
+
+static void writePIOGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\x66\xba\x34\x12");                 // [0x1000] mov     dx, 0x1234
+    emit(ram, "\xb8\xbe\xba\xfe\xca");             // [0x1004] mov    eax, 0xcafebabe
+    emit(ram, "\xef");                             // [0x1009] out     dx, eax
+    emit(ram, "\xed");                             // [0x100a] in     eax, dx
+    emit(ram, "\xf4");                             // [0x100b] hlt
+}
+
+static void writeMMIOGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\xa1\x00\x00\x00\xe0");             // [0x1000] mov    eax, [0xe0000000]
+    emit(ram, "\x83\xc0\x01");                     // [0x1005] add    eax, 1
+    emit(ram, "\xa3\x04\x00\x00\xe0");             // [0x1008] mov    [0xe0000004], eax
+    emit(ram, "\xf4");                             // [0x100d] hlt
+}
+
+// Sums 16 dwords at 0x3000 into 0x3100.
+static void writeSumGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\xbe\x00\x30\x00\x00");             // [0x1000] mov    esi, 0x3000
+    emit(ram, "\xb9\x10\x00\x00\x00");             // [0x1005] mov    ecx, 16
+    emit(ram, "\x31\xc0");                         // [0x100a] xor    eax, eax
+    emit(ram, "\x03\x06");                         // [0x100c] add    eax, [esi]
+    emit(ram, "\x83\xc6\x04");                     // [0x100e] add    esi, 4
+    emit(ram, "\xe2\xf9");                         // [0x1011] loop   0x100c
+    emit(ram, "\xa3\x00\x31\x00\x00");             // [0x1013] mov    [0x3100], eax
+    emit(ram, "\xf4");                             // [0x1018] hlt
+
+    for (uint32_t i = 0; i < 16; i++) {
+        const uint32_t value = i * i + 1;
+        memcpy(&ram[dataBase + i * sizeof(uint32_t)], &value, sizeof(value));
+    }
+}
+
+// Exits to the host with an OUT before the instructions to be stepped, so
+// that the boot ROM does not have to be stepped through.
+static void writeStepGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\x66\xba\xe9\x00");                 // [0x1000] mov     dx, 0xe9
+    emit(ram, "\xee");                             // [0x1004] out     dx, al
+    emit(ram, "\xb8\x01\x00\x00\x00");             // [0x1005] mov    eax, 1
+    emit(ram, "\x40");                             // [0x100a] inc    eax
+    emit(ram, "\x40");                             // [0x100b] inc    eax
+    emit(ram, "\xf4");                             // [0x100c] hlt
+}
+
+static void writeBreakpointGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\xb8\x11\x00\x00\x00");             // [0x1000] mov    eax, 0x11
+    emit(ram, "\xcc");                             // [0x1005] int3
+    emit(ram, "\xb8\x22\x00\x00\x00");             // [0x1006] mov    eax, 0x22
+    emit(ram, "\xf4");                             // [0x100b] hlt
+}
+
+static void writeInterruptGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");     // [0x1000] lidt   [0x1800]
+    emit(ram, "\xfb");                             // [0x1007] sti
+    emit(ram, "\xf4");                             // [0x1008] hlt
+    emit(ram, "\xeb\xfd");                         // [0x1009] jmp    0x1008
+
+    addr = handlerBase;
+    emit(ram, "\xc7\x05\x00\x30\x00\x00\xee\xff\xc0\x00"); // [0x1100] mov    dword ptr [0x3000], 0xc0ffee
+    emit(ram, "\xfa");                             // [0x110a] cli
+    emit(ram, "\xf4");                             // [0x110b] hlt
+
+    addr = idtrBase;
+    emit(ram, "\x07\x01\x00\x20\x00\x00");         // [0x1800] IDT pointer: 0x00002000:0x0107
+    writeFlatGuestIDTEntry(ram, idtBase, tickVector, handlerBase);
+}
+
+static void writeCPUIDGuest(uint8_t *ram) noexcept {
+    uint32_t addr = kernelBase;
+    emit(ram, "\xb8\x00\x00\x00\x40");             // [0x1000] mov    eax, 0x40000000
+    emit(ram, "\x0f\xa2");                         // [0x1005] cpuid
+    emit(ram, "\xf4");                             // [0x1007] hlt
+}
+
+#undef emit
+
+// ----- Scenarios --------------------------------------------------------------------------------------------------------
+
+// Starts a scenario that boots the given program in 32-bit flat protected mode.
+static Scenario flatGuest(const char *name, void (*writeProgram)(uint8_t *ram)) {
+    Scenario scenario(name);
+    scenario
+        .Memory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute,
+            [](uint8_t *rom) { writeFlatGuestROM(rom, kernelBase, stackTop); })
+        .Memory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, writeProgram);
+    return scenario;
+}
+
+static void addScenarios(ScenarioRunner& runner) {
+    runner.Add(flatGuest("HLT", writeHLTGuest)
+        .RunUntil(VMExitReason::HLT)
+        .ExpectReg(Reg::EAX, 0x12345678));
+
+    // The device answers reads with the complement of the last value written
+    auto lastWrite = std::make_shared<uint64_t>(0);
+    runner.Add(flatGuest("Port I/O", writePIOGuest)
+        .IOHandler(0x1234, 1,
+            [lastWrite](uint64_t port, size_t size) { return ~*lastWrite & 0xFFFFFFFF; },
+            [lastWrite](uint64_t port, size_t size, uint64_t value) { *lastWrite = value; })
+        .RunUntil(VMExitReason::HLT)
+        .ExpectReg(Reg::EAX, 0x35014541));
+
+    auto mmioWrite = std::make_shared<uint64_t>(0);
+    runner.Add(flatGuest("MMIO", writeMMIOGuest)
+        .MMIOHandler(mmioBase, PAGE_SIZE,
+            [](uint64_t address, size_t size) { return (uint64_t)0x41; },
+            [mmioWrite](uint64_t address, size_t size, uint64_t value) { *mmioWrite = (address << 32) | (value & 0xFFFFFFFF); })
+        .RunUntil(VMExitReason::HLT)
+        .ExpectReg(Reg::EAX, 0x42)
+        .Do("expect 0x42 written to 0xe0000004", [mmioWrite](ScenarioContext& ctx, std::string& error) {
+            if (*mmioWrite != ((mmioBase + 4) << 32 | 0x42)) {
+                error = "wrong MMIO write";
+                return false;
+            }
+            return true;
+        }));
+
+    // 0^2 + 1^2 + ... + 15^2 + 16 = 1256
+    runner.Add(flatGuest("Memory sum", writeSumGuest)
+        .RunUntil(VMExitReason::HLT)
+        .ExpectMemory32(dataBase + 0x100, 1256));
+
+    runner.Add(flatGuest("Single step", writeStepGuest)
+        .Require("guest debugging", [](const PlatformFeatures& features) { return features.guestDebugging; })
+        .IOHandler(0xE9, 1, nullptr, nullptr)
+        .Run(VMExitReason::PIO)
+        .Step()
+        .ExpectReg(Reg::EAX, 1)
+        .ExpectReg(Reg::EIP, 0x100A)
+        .Step(2)
+        .ExpectReg(Reg::EAX, 3)
+        .ExpectReg(Reg::EIP, 0x100C));
+
+    runner.Add(flatGuest("Software breakpoint", writeBreakpointGuest)
+        .Require("guest debugging", [](const PlatformFeatures& features) { return features.guestDebugging; })
+        .EnableSoftwareBreakpoints()
+        .Run(VMExitReason::SoftwareBreakpoint)
+        .ExpectReg(Reg::EAX, 0x11));
+
+    runner.Add(flatGuest("Interrupt", writeInterruptGuest)
+        .RunUntil(VMExitReason::HLT)
+        .Interrupt(tickVector)
+        .RunUntil(VMExitReason::HLT)
+        .ExpectMemory32(dataBase, 0xC0FFEE));
+
+    runner.Add(flatGuest("CPUID exit", writeCPUIDGuest)
+        .Require("CPUID exits", [](const PlatformFeatures& features) {
+            return BitmaskEnum(features.extendedVMExits).AnyOf(ExtendedVMExit::CPUID);
+        })
+        .Specs([](VMSpecifications& specs) {
+            specs.extendedVMExits = ExtendedVMExit::CPUID;
+            specs.vmExitCPUIDFunctions.push_back(cpuidLeaf);
+        })
+        .Run(VMExitReason::CPUID)
+        .ExpectReg(Reg::EAX, cpuidLeaf)
+        .Do("answer CPUID", [](ScenarioContext& ctx, std::string& error) {
+            ctx.vp.RegWrite(Reg::EAX, 0x40000001);
+            ctx.vp.RegWrite(Reg::EBX, 0x36387476);  // "vt86"
+            ctx.vp.RegWrite(Reg::ECX, 0);
+            ctx.vp.RegWrite(Reg::EDX, 0);
+            return true;
+        })
+        .RunUntil(VMExitReason::HLT)
+        .ExpectReg(Reg::EBX, 0x36387476));
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    // Usage: virt86-scenario-demo [max parallel scenarios]
+    const size_t maxParallel = (argc > 1) ? strtoul(argv[1], NULL, 10) : 0;
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+
+    ScenarioRunner runner(*pPlatform);
+    addScenarios(runner);
+
+    printf("\n");
+    const auto start = std::chrono::steady_clock::now();
+    const auto results = runner.RunAll(maxParallel);
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    return ScenarioRunner::PrintReport(results, elapsed.count()) ? 0 : -1;
+}
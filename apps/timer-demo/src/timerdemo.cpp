@@ -0,0 +1,264 @@
+/*
+Entry point of the timer device demo.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include "align_alloc.hpp"
+#include "event_loop.hpp"
+#include "flat_guest.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "timer_device.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t handlerBase = 0x1100;
+const uint32_t idtrBase = 0x1800;
+const uint32_t idtBase = 0x2000;
+const uint32_t tickCountAddr = 0x3000;
+const uint32_t stackTop = 0x8000;
+
+const uint16_t timerPort = 0xC00;
+const uint8_t timerVector = 0x20;
+
+const uint32_t phaseSeconds = 2;
+
+static double cpuSeconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Program the timer with the control value in EBX and the period in ECX,
+    // then halt forever
+    addr = kernelBase;
+    emit(ram, "\x0f\x01\x1d\x00\x18\x00\x00");     // [0x1000] lidt   [0x1800]
+    emit(ram, "\x66\xba\x04\x0c");                 // [0x1007] mov     dx, 0xc04    ; PERIOD
+    emit(ram, "\x89\xc8");                         // [0x100b] mov    eax, ecx
+    emit(ram, "\xef");                             // [0x100d] out     dx, eax
+    emit(ram, "\x66\xba\x00\x0c");                 // [0x100e] mov     dx, 0xc00    ; CONTROL
+    emit(ram, "\x89\xd8");                         // [0x1012] mov    eax, ebx
+    emit(ram, "\xef");                             // [0x1014] out     dx, eax
+    emit(ram, "\xfb");                             // [0x1015] sti
+    emit(ram, "\xf4");                             // [0x1016] hlt
+    emit(ram, "\xeb\xfd");                         // [0x1017] jmp    0x1016
+
+    // Timer interrupt handler: account for every elapsed tick and rearm the
+    // timer if it is in one-shot mode
+    addr = handlerBase;
+    emit(ram, "\x50");                             // [0x1100] push   eax
+    emit(ram, "\x52");                             // [0x1101] push   edx
+    emit(ram, "\x66\xba\x08\x0c");                 // [0x1102] mov     dx, 0xc08    ; PENDING
+    emit(ram, "\xed");                             // [0x1106] in     eax, dx
+    emit(ram, "\x01\x05\x00\x30\x00\x00");         // [0x1107] add    dword ptr [0x3000], eax
+    emit(ram, "\xf6\xc3\x02");                     // [0x110d] test    bl, 0x2      ; periodic?
+    emit(ram, "\x75\x07");                         // [0x1110] jnz    0x1119
+    emit(ram, "\x66\xba\x00\x0c");                 // [0x1112] mov     dx, 0xc00    ; CONTROL
+    emit(ram, "\x89\xd8");                         // [0x1116] mov    eax, ebx
+    emit(ram, "\xef");                             // [0x1118] out     dx, eax
+    emit(ram, "\x5a");                             // [0x1119] pop    edx
+    emit(ram, "\x58");                             // [0x111a] pop    eax
+    emit(ram, "\xcf");                             // [0x111b] iretd
+
+    // IDT pointer
+    addr = idtrBase;
+    emit(ram, "\x07\x01\x00\x20\x00\x00");         // [0x1800] IDT pointer: 0x00002000:0x0107
+#undef emit
+    writeFlatGuestIDTEntry(ram, idtBase, timerVector, handlerBase);
+}
+
+// Runs the guest with the timer programmed with the given mode and period.
+static bool runPhase(Platform& platform, uint8_t *rom, uint8_t *ram, const char *name, uint32_t control, uint32_t periodUs) {
+    printf("\n%s: period %" PRIu32 " us, running for %" PRIu32 " seconds\n", name, periodUs, phaseSeconds);
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+    vp.RegWrite(Reg::EBX, control);
+    vp.RegWrite(Reg::ECX, periodUs);
+
+    EventLoop loop;
+    if (!loop.IsValid()) {
+        printf("fatal: failed to create event loop\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+
+    InterruptQueue irqs;
+    TimerDevice timer(loop, irqs, timerVector, timerPort);
+    if (!timer.IsValid()) {
+        printf("fatal: failed to create timer device\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    IOBus bus;
+    bus.AddPIODevice(timerPort, TimerDevice::NumPorts, timer);
+    bus.Attach(vm);
+
+    std::atomic<bool> done{ false };
+
+    // Print the injection rate every second
+    int statsFD = createTimerFD(1000000000ull, 1000000000ull);
+    loop.Add(statsFD, EPOLLIN, [&](uint32_t) {
+        readTimerFD(statsFD);
+        auto stats = timer.SampleStats();
+        printf("  %" PRIu64 " ticks, %" PRIu64 " injections, %.0f injections/s\n", stats.ticks, stats.injections, stats.injectionsPerSecond);
+    });
+
+    int stopFD = createTimerFD((uint64_t)phaseSeconds * 1000000000ull, 0);
+    loop.Add(stopFD, EPOLLIN, [&](uint32_t) {
+        readTimerFD(stopFD);
+        done = true;
+        loop.Stop();
+        // Wake up the virtual processor so that it notices
+        irqs.Raise(timerVector);
+    });
+
+    std::thread loopThread([&]() { loop.Run(); });
+
+    uint64_t exits = 0, halts = 0;
+    const double cpuStart = cpuSeconds();
+    const auto wallStart = std::chrono::steady_clock::now();
+    bool running = true;
+    bool ok = true;
+    while (running) {
+        irqs.Deliver(vp);
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::HLT:
+            if (done) {
+                running = false;
+                break;
+            }
+            halts++;
+            irqs.WaitForInterrupt();
+            break;
+        case VMExitReason::PIO:
+        case VMExitReason::Cancelled:
+        case VMExitReason::Interrupt:
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+    const double cpuTime = cpuSeconds() - cpuStart;
+
+    loop.Stop();
+    loopThread.join();
+
+    uint32_t guestTicks;
+    memcpy(&guestTicks, &ram[tickCountAddr], sizeof(guestTicks));
+    auto stats = timer.SampleStats();
+
+    printf("  Ticks counted by the guest: %" PRIu32 " (device: %" PRIu64 ", expected for the wall time: %.0f)\n",
+        guestTicks, stats.ticks, wallTime.count() * 1e6 / periodUs);
+    printf("  Interrupts injected: %" PRIu64 " (%.1f ticks per interrupt)\n",
+        stats.injections, stats.injections ? (double)stats.ticks / stats.injections : 0.0);
+    printf("  VM exits: %" PRIu64 " (%.0f/s), HLT waits: %" PRIu64 "\n", exits, exits / wallTime.count(), halts);
+    printf("  Host CPU time: %.3f s (%.2f%% of one CPU)\n", cpuTime, cpuTime / wallTime.count() * 100.0);
+
+    close(stopFD);
+    close(statsFD);
+    platform.FreeVM(vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    const uint32_t periodic = TimerDevice::ControlEnable | TimerDevice::ControlPeriodic;
+    const uint32_t oneShot = TimerDevice::ControlEnable;
+    bool ok = runPhase(platform, rom, ram, "Periodic 1 kHz", periodic, 1000)
+        && runPhase(platform, rom, ram, "Periodic 20 kHz", periodic, 50)
+        && runPhase(platform, rom, ram, "Tickless, 10 ms deadlines", oneShot, 10000);
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,314 @@
+/*
+Records delta-compressed single-step instruction traces of a guest and queries
+them.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "instruction_trace.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 16;  // 64 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t resultAddr = 0x3000;
+const uint32_t stackTop = 0x8000;
+
+static void writeGuest(uint8_t *ram, uint32_t limit) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // Count the primes below the limit by trial division and store the result
+    // at 0x3000
+    addr = kernelBase;
+    emit(ram, "\x31\xf6");                                 // [0x1000] xor    esi, esi
+    emit(ram, "\xbb\x02\x00\x00\x00");                     // [0x1002] mov    ebx, 2
+    emit(ram, "\x81\xfb\x00\x00\x00\x00");                 // [0x1007] cmp    ebx, <limit>
+    emit(ram, "\x73\x1e");                                 // [0x100d] jae    0x102d
+    emit(ram, "\xb9\x02\x00\x00\x00");                     // [0x100f] mov    ecx, 2
+    emit(ram, "\x89\xc8");                                 // [0x1014] mov    eax, ecx
+    emit(ram, "\xf7\xe1");                                 // [0x1016] mul    ecx
+    emit(ram, "\x39\xd8");                                 // [0x1018] cmp    eax, ebx
+    emit(ram, "\x77\x0d");                                 // [0x101a] ja     0x1029
+    emit(ram, "\x89\xd8");                                 // [0x101c] mov    eax, ebx
+    emit(ram, "\x31\xd2");                                 // [0x101e] xor    edx, edx
+    emit(ram, "\xf7\xf1");                                 // [0x1020] div    ecx
+    emit(ram, "\x85\xd2");                                 // [0x1022] test   edx, edx
+    emit(ram, "\x74\x04");                                 // [0x1024] jz     0x102a
+    emit(ram, "\x41");                                     // [0x1026] inc    ecx
+    emit(ram, "\xeb\xeb");                                 // [0x1027] jmp    0x1014
+    emit(ram, "\x46");                                     // [0x1029] inc    esi
+    emit(ram, "\x43");                                     // [0x102a] inc    ebx
+    emit(ram, "\xeb\xda");                                 // [0x102b] jmp    0x1007
+    emit(ram, "\x89\x35\x00\x30\x00\x00");                 // [0x102d] mov    [0x3000], esi
+    emit(ram, "\xf4");                                     // [0x1033] hlt
+    emit(ram, "\xeb\xfd");                                 // [0x1034] jmp    0x1033
+#undef emit
+    memcpy(&ram[kernelBase + 0x9], &limit, sizeof(limit));
+}
+
+// ----- record -----------------------------------------------------------------------------------------------------------
+
+static int record(const char *path, uint32_t limit, uint32_t keyframeInterval) {
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+    writeGuest(ram, limit);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    if (!platform.GetFeatures().guestDebugging) {
+        printf("fatal: platform does not support guest debugging\n");
+        return -1;
+    }
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return -1;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        return -1;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        return -1;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    // The guest starts in real mode in the ROM; the recorder keeps the 32-bit
+    // register layout throughout, which also covers the 16-bit registers
+    TraceRecorder recorder(vp, X86Mode::Bits32, keyframeInterval);
+    if (!recorder.Open(path)) {
+        printf("fatal: failed to create trace file %s\n", path);
+        return -1;
+    }
+    recorder.Capture();
+
+    printf("Recording trace of the guest counting primes below %u\n", limit);
+    bool running = true;
+    auto start = std::chrono::steady_clock::now();
+    while (running) {
+        if (recorder.Step() != VPExecutionStatus::OK) {
+            printf("VCPU failed to step\n");
+            running = false;
+            break;
+        }
+        auto& exitInfo = vp.GetVMExitInfo();
+        switch (exitInfo.reason) {
+        case VMExitReason::Step:
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const bool ok = recorder.Close();
+
+    uint32_t primes;
+    memcpy(&primes, &ram[resultAddr], sizeof(primes));
+    const uint64_t fullSize = recorder.Steps() * traceRegisterCount(X86Mode::Bits32) * sizeof(uint32_t);
+    printf("  Guest found %u primes\n", primes);
+    printf("  Steps recorded: %" PRIu64 " in %.3f s (%.0f steps/s)\n", recorder.Steps(), elapsed.count(), recorder.Steps() / elapsed.count());
+    printf("  Trace size: %" PRIu64 " bytes (%.2f bytes/step), full register dumps would take %" PRIu64 " bytes\n",
+        recorder.BytesWritten(), (double)recorder.BytesWritten() / recorder.Steps(), fullSize);
+    if (!ok) {
+        printf("  Failed to write trace file\n");
+    }
+
+    platform.FreeVM(vm);
+    alignedFree(ram);
+    alignedFree(rom);
+    return ok ? 0 : -1;
+}
+
+// ----- Queries ----------------------------------------------------------------------------------------------------------
+
+static void printStep(const TraceReader& reader, bool all) {
+    const X86Mode mode = reader.Mode();
+    printf("%10" PRIu64 "  %08" PRIx64, reader.Step(), reader.IP());
+    for (size_t i = 0; i < reader.RegisterCount(); i++) {
+        if (i == traceIPIndex(mode)) {
+            continue;
+        }
+        if (all || (reader.ChangedMask() & (1ull << i))) {
+            printf("  %s=%" PRIx64, traceRegisterName(mode, i), reader.Register(i));
+        }
+    }
+    printf("\n");
+}
+
+static int dump(TraceReader& reader, uint64_t from, uint64_t count) {
+    if (!reader.Seek(from)) {
+        printf("Step %" PRIu64 " is out of range; the trace has %" PRIu64 " steps\n", from, reader.TotalSteps());
+        return -1;
+    }
+    // The first line shows the full state, the rest only what changed
+    printStep(reader, true);
+    for (uint64_t i = 1; i < count && reader.Next(); i++) {
+        printStep(reader, false);
+    }
+    return 0;
+}
+
+static int find(TraceReader& reader, const char *query, uint64_t maxResults) {
+    // Query format: <register>=<value>, e.g. eip=0x1029 or ebx=997
+    const char *eq = strchr(query, '=');
+    if (eq == NULL) {
+        printf("Invalid query: %s\n", query);
+        return -1;
+    }
+    const std::string name(query, eq - query);
+    const uint64_t value = strtoull(eq + 1, NULL, 0);
+    const X86Mode mode = reader.Mode();
+    size_t index = reader.RegisterCount();
+    for (size_t i = 0; i < reader.RegisterCount(); i++) {
+        if (name == traceRegisterName(mode, i)) {
+            index = i;
+            break;
+        }
+    }
+    if (index == reader.RegisterCount()) {
+        printf("Unknown register: %s\n", name.c_str());
+        return -1;
+    }
+
+    uint64_t matches = 0;
+    while (reader.Next()) {
+        // Only report the steps where the register becomes the value
+        if ((reader.ChangedMask() & (1ull << index)) && reader.Register(index) == value) {
+            if (matches < maxResults) {
+                printStep(reader, false);
+            }
+            matches++;
+        }
+    }
+    printf("%" PRIu64 " matches\n", matches);
+    return 0;
+}
+
+static int stats(TraceReader& reader) {
+    const X86Mode mode = reader.Mode();
+    std::vector<uint64_t> changes(reader.RegisterCount());
+    std::map<uint64_t, uint64_t> ipCounts;
+    while (reader.Next()) {
+        for (size_t i = 0; i < changes.size(); i++) {
+            if (reader.ChangedMask() & (1ull << i)) {
+                changes[i]++;
+            }
+        }
+        ipCounts[reader.IP()]++;
+    }
+
+    printf("Steps: %" PRIu64 "\n", reader.TotalSteps());
+    printf("Register changes:\n");
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (changes[i] > 0) {
+            printf("  %-6s %" PRIu64 "\n", traceRegisterName(mode, i), changes[i]);
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> hottest(ipCounts.begin(), ipCounts.end());
+    std::sort(hottest.begin(), hottest.end(), [](auto& a, auto& b) { return a.second > b.second; });
+    printf("Most executed instructions:\n");
+    for (size_t i = 0; i < hottest.size() && i < 10; i++) {
+        printf("  %08" PRIx64 "  %" PRIu64 "\n", hottest[i].first, hottest[i].second);
+    }
+    return 0;
+}
+
+static void usage() {
+    printf("Usage:\n");
+    printf("  virt86-trace-tool record <trace> [prime limit] [keyframe interval]\n");
+    printf("  virt86-trace-tool dump <trace> [first step] [count]\n");
+    printf("  virt86-trace-tool find <trace> <register>=<value> [max results]\n");
+    printf("  virt86-trace-tool stats <trace>\n");
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    if (argc < 3) {
+        usage();
+        return -1;
+    }
+    const std::string command = argv[1];
+    const char *path = argv[2];
+
+    if (command == "record") {
+        const uint32_t limit = (argc > 3) ? (uint32_t)strtoul(argv[3], NULL, 0) : 10000;
+        const uint32_t keyframeInterval = (argc > 4) ? (uint32_t)strtoul(argv[4], NULL, 0) : 65536;
+        return record(path, limit, keyframeInterval);
+    }
+
+    TraceReader reader;
+    if (!reader.Open(path)) {
+        printf("Failed to open trace file %s\n", path);
+        return -1;
+    }
+    if (command == "dump") {
+        const uint64_t from = (argc > 3) ? strtoull(argv[3], NULL, 0) : 0;
+        const uint64_t count = (argc > 4) ? strtoull(argv[4], NULL, 0) : 20;
+        return dump(reader, from, count);
+    }
+    if (command == "find" && argc > 3) {
+        const uint64_t maxResults = (argc > 4) ? strtoull(argv[4], NULL, 0) : 20;
+        return find(reader, argv[3], maxResults);
+    }
+    if (command == "stats") {
+        return stats(reader);
+    }
+    usage();
+    return -1;
+}
@@ -0,0 +1,385 @@
+/*
+Entry point of the UART demo. Compares a console that writes every byte to
+the host as it arrives with the batched UartDevice.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "interrupt_queue.hpp"
+#include "io_bus.hpp"
+#include "uart_device.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = 4 * 1024 * 1024;  // 4 MiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x8000;
+
+// Parameters and results shared with the guest
+const uint32_t paramMode = 0x3000;
+const uint32_t paramLength = 0x3004;
+const uint32_t paramChunkSize = 0x3008;
+const uint32_t resultDone = 0x3010;
+
+const uint32_t textBase = 0x100000;
+
+const uint16_t uartPort = 0x3F8;
+const uint8_t uartVector = 0x24;
+
+const uint32_t modeFIFO = 0;
+const uint32_t modeBulk = 1;
+const uint32_t modeString = 2;
+const uint32_t modeEcho = 3;
+const uint32_t bulkChunkSize = 4096;
+const uint32_t defaultLength = 1024 * 1024;
+
+// The console found in simple emulators: every byte written to the UART goes
+// straight to the host with its own system call
+class SynchronousConsole : public IODevice {
+public:
+    SynchronousConsole(FILE *fp) noexcept : m_fp(fp) {}
+
+    uint32_t IORead(uint16_t port, size_t size) noexcept override {
+        // The transmitter is always empty
+        return (port == uartPort + UartDevice::RegLineStatus) ? (UartDevice::LsrTHRE | UartDevice::LsrTEMT) : 0;
+    }
+
+    void IOWrite(uint16_t port, size_t size, uint32_t value) noexcept override {
+        if (port == uartPort + UartDevice::RegData) {
+            fputc((int)(value & 0xFF), m_fp);
+            fflush(m_fp);
+            m_writes++;
+        }
+    }
+
+    uint64_t Writes() const noexcept { return m_writes; }
+
+private:
+    FILE *m_fp;
+    uint64_t m_writes = 0;
+};
+
+// Fills the guest's log with numbered lines, which are also returned to
+// check the output against. In echo mode the log is not placed in guest
+// memory; the host sends it as input instead.
+static std::string writeGuest(uint8_t *ram, uint32_t mode, uint32_t length) noexcept {
+    memset(ram, 0, ramSize);
+
+    std::string text;
+    char line[80];
+    for (uint32_t i = 0; text.size() < length; i++) {
+        snprintf(line, sizeof(line), "[%8" PRIu32 "] guest: processed request, status ok, queue depth %" PRIu32 "\n", i, i % 64);
+        text += line;
+    }
+    text.resize(length);
+    if (mode != modeEcho) {
+        memcpy(&ram[textBase], text.data(), length);
+    }
+
+    const uint32_t chunkSize = bulkChunkSize;
+    memcpy(&ram[paramMode], &mode, sizeof(mode));
+    memcpy(&ram[paramLength], &length, sizeof(length));
+    memcpy(&ram[paramChunkSize], &chunkSize, sizeof(chunkSize));
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    if (mode == modeEcho) {
+        // Reads the log from the UART into 0x100000, then writes it back,
+        // both in 16-byte REP INSB and REP OUTSB chunks after checking LSR.
+        // Sets 0x3010 and halts when done.
+        addr = kernelBase;
+        emit(ram, "\xbf\x00\x00\x10\x00");             // [0x1000] mov    edi, 0x100000
+        emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x1005] mov    ecx, [0x3004]
+        emit(ram, "\x66\xba\xfd\x03");                 // [0x100b] mov     dx, 0x3fd    ; LSR
+        emit(ram, "\xec");                             // [0x100f] in      al, dx
+        emit(ram, "\xa8\x01");                         // [0x1010] test    al, 0x01     ; DR
+        emit(ram, "\x74\xfb");                         // [0x1012] je     0x100f
+        emit(ram, "\xbb\x10\x00\x00\x00");             // [0x1014] mov    ebx, 16
+        emit(ram, "\x39\xd9");                         // [0x1019] cmp    ecx, ebx
+        emit(ram, "\x73\x02");                         // [0x101b] jae    0x101f
+        emit(ram, "\x89\xcb");                         // [0x101d] mov    ebx, ecx
+        emit(ram, "\x29\xd9");                         // [0x101f] sub    ecx, ebx
+        emit(ram, "\x66\xba\xf8\x03");                 // [0x1021] mov     dx, 0x3f8    ; RBR
+        emit(ram, "\x87\xd9");                         // [0x1025] xchg   ecx, ebx
+        emit(ram, "\xf3\x6c");                         // [0x1027] rep insb
+        emit(ram, "\x89\xd9");                         // [0x1029] mov    ecx, ebx
+        emit(ram, "\x85\xc9");                         // [0x102b] test   ecx, ecx
+        emit(ram, "\x75\xdc");                         // [0x102d] jne    0x100b
+        emit(ram, "\xbe\x00\x00\x10\x00");             // [0x102f] mov    esi, 0x100000
+        emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x1034] mov    ecx, [0x3004]
+        emit(ram, "\x66\xba\xfd\x03");                 // [0x103a] mov     dx, 0x3fd    ; LSR
+        emit(ram, "\xec");                             // [0x103e] in      al, dx
+        emit(ram, "\xa8\x20");                         // [0x103f] test    al, 0x20     ; THRE
+        emit(ram, "\x74\xfb");                         // [0x1041] je     0x103e
+        emit(ram, "\xbb\x10\x00\x00\x00");             // [0x1043] mov    ebx, 16
+        emit(ram, "\x39\xd9");                         // [0x1048] cmp    ecx, ebx
+        emit(ram, "\x73\x02");                         // [0x104a] jae    0x104e
+        emit(ram, "\x89\xcb");                         // [0x104c] mov    ebx, ecx
+        emit(ram, "\x29\xd9");                         // [0x104e] sub    ecx, ebx
+        emit(ram, "\x66\xba\xf8\x03");                 // [0x1050] mov     dx, 0x3f8    ; THR
+        emit(ram, "\x87\xd9");                         // [0x1054] xchg   ecx, ebx
+        emit(ram, "\xf3\x6e");                         // [0x1056] rep outsb
+        emit(ram, "\x89\xd9");                         // [0x1058] mov    ecx, ebx
+        emit(ram, "\x85\xc9");                         // [0x105a] test   ecx, ecx
+        emit(ram, "\x75\xdc");                         // [0x105c] jne    0x103a
+        emit(ram, "\xc7\x05\x10\x30\x00\x00\x01\x00\x00\x00"); // [0x105e] mov    dword ptr [0x3010], 1
+        emit(ram, "\xf4");                             // [0x1068] hlt
+        return text;
+    }
+
+    // Writes the log to the UART, then sets 0x3010 and halts. In FIFO mode
+    // the guest waits for the transmitter to empty, then writes up to 16
+    // bytes, like a FIFO-aware driver; in string mode it writes them with a
+    // single REP OUTSB. In bulk mode it hands 4 KiB chunks to the
+    // paravirtual bulk transmit registers, advancing by the number of bytes
+    // the device accepted.
+    addr = kernelBase;
+    emit(ram, "\xbe\x00\x00\x10\x00");             // [0x1000] mov    esi, 0x100000
+    emit(ram, "\x8b\x0d\x04\x30\x00\x00");         // [0x1005] mov    ecx, [0x3004]
+    emit(ram, "\x8b\x3d\x00\x30\x00\x00");         // [0x100b] mov    edi, [0x3000]
+    emit(ram, "\x83\xff\x01");                     // [0x1011] cmp    edi, 1
+    emit(ram, "\x74\x32");                         // [0x1014] je     0x1048
+    emit(ram, "\x66\xba\xfd\x03");                 // [0x1016] mov     dx, 0x3fd    ; LSR
+    emit(ram, "\xec");                             // [0x101a] in      al, dx
+    emit(ram, "\xa8\x20");                         // [0x101b] test    al, 0x20     ; THRE
+    emit(ram, "\x74\xfb");                         // [0x101d] je     0x101a
+    emit(ram, "\xbb\x10\x00\x00\x00");             // [0x101f] mov    ebx, 16
+    emit(ram, "\x39\xd9");                         // [0x1024] cmp    ecx, ebx
+    emit(ram, "\x73\x02");                         // [0x1026] jae    0x102a
+    emit(ram, "\x89\xcb");                         // [0x1028] mov    ebx, ecx
+    emit(ram, "\x29\xd9");                         // [0x102a] sub    ecx, ebx
+    emit(ram, "\x66\xba\xf8\x03");                 // [0x102c] mov     dx, 0x3f8    ; THR
+    emit(ram, "\x83\xff\x02");                     // [0x1030] cmp    edi, 2
+    emit(ram, "\x74\x07");                         // [0x1033] je     0x103c
+    emit(ram, "\xac");                             // [0x1035] lodsb
+    emit(ram, "\xee");                             // [0x1036] out     dx, al
+    emit(ram, "\x4b");                             // [0x1037] dec    ebx
+    emit(ram, "\x75\xfb");                         // [0x1038] jne    0x1035
+    emit(ram, "\xeb\x06");                         // [0x103a] jmp    0x1042
+    emit(ram, "\x87\xd9");                         // [0x103c] xchg   ecx, ebx
+    emit(ram, "\xf3\x6e");                         // [0x103e] rep outsb
+    emit(ram, "\x89\xd9");                         // [0x1040] mov    ecx, ebx
+    emit(ram, "\x85\xc9");                         // [0x1042] test   ecx, ecx
+    emit(ram, "\x75\xd0");                         // [0x1044] jne    0x1016
+    emit(ram, "\xeb\x21");                         // [0x1046] jmp    0x1069
+    emit(ram, "\x66\xba\x00\x04");                 // [0x1048] mov     dx, 0x400    ; BULK_ADDRESS
+    emit(ram, "\x89\xf0");                         // [0x104c] mov    eax, esi
+    emit(ram, "\xef");                             // [0x104e] out     dx, eax
+    emit(ram, "\x8b\x1d\x08\x30\x00\x00");         // [0x104f] mov    ebx, [0x3008]
+    emit(ram, "\x39\xd9");                         // [0x1055] cmp    ecx, ebx
+    emit(ram, "\x73\x02");                         // [0x1057] jae    0x105b
+    emit(ram, "\x89\xcb");                         // [0x1059] mov    ebx, ecx
+    emit(ram, "\x66\xba\x04\x04");                 // [0x105b] mov     dx, 0x404    ; BULK_LENGTH
+    emit(ram, "\x89\xd8");                         // [0x105f] mov    eax, ebx
+    emit(ram, "\xef");                             // [0x1061] out     dx, eax
+    emit(ram, "\xed");                             // [0x1062] in     eax, dx
+    emit(ram, "\x01\xc6");                         // [0x1063] add    esi, eax
+    emit(ram, "\x29\xc1");                         // [0x1065] sub    ecx, eax
+    emit(ram, "\x75\xdf");                         // [0x1067] jne    0x1048
+    emit(ram, "\xc7\x05\x10\x30\x00\x00\x01\x00\x00\x00"); // [0x1069] mov    dword ptr [0x3010], 1
+    emit(ram, "\xf4");                             // [0x1073] hlt
+#undef emit
+    return text;
+}
+
+static bool checkOutput(const char *path, const std::string& expected) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    std::string actual(expected.size() + 1, '\0');
+    const size_t size = fread(&actual[0], 1, actual.size(), fp);
+    fclose(fp);
+    return size == expected.size() && memcmp(actual.data(), expected.data(), size) == 0;
+}
+
+static bool runPhase(Platform& platform, uint8_t *rom, uint8_t *ram, const char *outputPath, bool batched, uint32_t mode, bool coalesce, uint32_t length) {
+    const std::string text = writeGuest(ram, mode, length);
+
+    FILE *fp = fopen(outputPath, "wb");
+    if (fp == NULL) {
+        printf("fatal: could not create %s\n", outputPath);
+        return false;
+    }
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        fclose(fp);
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        fclose(fp);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        fclose(fp);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    InterruptQueue irqs;
+    SynchronousConsole console(fp);
+    UartDevice uart(irqs, uartVector, uartPort, fileno(fp));
+    IOBus bus;
+    if (!batched) {
+        bus.AddPIODevice(uartPort, UartDevice::NumPorts, console);
+    }
+    else if (mode == modeBulk) {
+        uart.EnableBulkTransmit(ram, ramBase, ramSize);
+        bus.AddPIODevice(uartPort, UartDevice::NumPortsWithBulk, uart);
+    }
+    else {
+        bus.AddPIODevice(uartPort, UartDevice::NumPorts, uart);
+    }
+    bus.Attach(vm);
+    if (mode == modeEcho) {
+        uart.Receive((const uint8_t *)text.data(), text.size());
+    }
+
+    const char *modeName = (mode == modeBulk) ? "bulk transmit" : (mode == modeString) ? "16-byte REP OUTSB"
+        : (mode == modeEcho) ? "16-byte REP INSB echoed with REP OUTSB" : "16-byte FIFO";
+    printf("\n%s, %s%s:\n", batched ? "Batched UART" : "Synchronous console", modeName, coalesce ? " with string I/O coalescing" : "");
+
+    uint64_t exits = 0;
+    const auto wallStart = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (;;) {
+        const auto status = coalesce ? bus.Run(vp) : vp.Run();
+        if (status != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+
+        auto& exitInfo = vp.GetVMExitInfo();
+        if (exitInfo.reason == VMExitReason::HLT && ram[resultDone] != 0) {
+            break;
+        }
+        if (exitInfo.reason != VMExitReason::PIO && exitInfo.reason != VMExitReason::Cancelled && exitInfo.reason != VMExitReason::Interrupt) {
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> guestTime = std::chrono::steady_clock::now() - wallStart;
+
+    // The guest is done as soon as its output is in the ring; this is how
+    // long the writer thread needs to catch up
+    uart.Flush();
+    const std::chrono::duration<double> totalTime = std::chrono::steady_clock::now() - wallStart;
+    platform.FreeVM(vm);
+
+    const auto stats = uart.GetStats();
+    const uint64_t hostWrites = batched ? stats.hostWrites : console.Writes();
+    const uint64_t deviceCalls = batched ? stats.dataWrites + stats.stringWrites + stats.bulkTransmits : console.Writes();
+    printf("  %" PRIu32 " bytes in %.3f s (%.3f s until written out): %.1f ns per byte, %.1f MiB/s\n",
+        length, guestTime.count(), totalTime.count(), guestTime.count() * 1000000000.0 / length, length / guestTime.count() / (1024.0 * 1024.0));
+    printf("  VM exits: %" PRIu64 " (%.1f ns each), transmit calls into the device: %" PRIu64 "\n",
+        exits, guestTime.count() * 1000000000.0 / exits, deviceCalls);
+    if (mode == modeEcho) {
+        printf("  Receive calls into the device: %" PRIu64 ", %" PRIu64 " bytes received\n", stats.dataReads + stats.stringReads, stats.received);
+    }
+    printf("  Host write calls: %" PRIu64 " (%.0f bytes each)\n", hostWrites, hostWrites ? (double)length / hostWrites : 0.0);
+    if (batched && stats.dropped != 0) {
+        printf("  %" PRIu64 " bytes were dropped\n", stats.dropped);
+        ok = false;
+    }
+
+    // Both consoles are done with the file: the UART was flushed above
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+    if (mode == modeEcho && memcmp(&ram[textBase], text.data(), length) != 0) {
+        printf("  The guest did not read the input that was sent\n");
+        return false;
+    }
+    if (!checkOutput(outputPath, text)) {
+        printf("  The output does not match what the guest wrote\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    const char *outputPath = (argc >= 2) ? argv[1] : "uart-demo.log";
+    uint32_t length = defaultLength;
+    if (argc >= 3) {
+        length = (uint32_t)strtoul(argv[2], NULL, 0);
+        if (length == 0 || length > ramSize - textBase) {
+            printf("usage: %s [output path] [bytes to log, up to %" PRIu32 "]\n", argv[0], ramSize - textBase);
+            return -1;
+        }
+    }
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+
+    printf("\nThe guest logs %" PRIu32 " bytes to %s\n", length, outputPath);
+    bool ok = runPhase(platform, rom, ram, outputPath, false, modeFIFO, false, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeFIFO, false, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeString, false, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeString, true, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeEcho, false, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeEcho, true, length)
+        && runPhase(platform, rom, ram, outputPath, true, modeBulk, false, length);
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,231 @@
+/*
+Demonstrates watching more memory locations and instructions than there are
+hardware breakpoint slots.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "align_alloc.hpp"
+#include "flat_guest.hpp"
+#include "io_bus.hpp"
+#include "utils.hpp"
+#include "watch_manager.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+using namespace virt86;
+
+const uint32_t ramSize = PAGE_SIZE * 32;  // 128 KiB
+const uint64_t ramBase = 0x0;
+const uint32_t kernelBase = 0x1000;
+const uint32_t stackTop = 0x8000;
+const uint32_t countersBase = 0x10000;
+const uint32_t counterStride = 0x800;
+const uint32_t numCounters = 16;
+const uint32_t canaryAddr = 0x18000;
+const uint32_t outerLoopAddr = 0x1022;
+
+static void writeGuest(uint8_t *ram) noexcept {
+    memset(ram, 0, ramSize);
+
+    uint32_t addr;
+#define emit(buf, code) {memcpy(&buf[addr], code, sizeof(code) - 1); addr += sizeof(code) - 1;}
+    // for (i = 0; i < 2000; i++)
+    //     for (j = 0; j < 16; j++)
+    //         if (i % (j + 1) == 0) counter[j]++;
+    // Counter j lives at 0x10000 + j * 0x800 and is incremented 2000 / (j + 1)
+    // times. Finally, the guest overwrites the canary at 0x18000.
+    addr = kernelBase;
+    emit(ram, "\x31\xdb");                                 // [0x1000] xor    ebx, ebx
+    emit(ram, "\x31\xc9");                                 // [0x1002] xor    ecx, ecx
+    emit(ram, "\x89\xd8");                                 // [0x1004] mov    eax, ebx
+    emit(ram, "\x31\xd2");                                 // [0x1006] xor    edx, edx
+    emit(ram, "\x8d\x79\x01");                             // [0x1008] lea    edi, [ecx+1]
+    emit(ram, "\xf7\xf7");                                 // [0x100b] div    edi
+    emit(ram, "\x85\xd2");                                 // [0x100d] test   edx, edx
+    emit(ram, "\x75\x0b");                                 // [0x100f] jnz    0x101c
+    emit(ram, "\x89\xcf");                                 // [0x1011] mov    edi, ecx
+    emit(ram, "\xc1\xe7\x0b");                             // [0x1013] shl    edi, 11
+    emit(ram, "\xff\x87\x00\x00\x01\x00");                 // [0x1016] inc    dword ptr [edi+0x10000]
+    emit(ram, "\x41");                                     // [0x101c] inc    ecx
+    emit(ram, "\x83\xf9\x10");                             // [0x101d] cmp    ecx, 16
+    emit(ram, "\x72\xe2");                                 // [0x1020] jb     0x1004
+    emit(ram, "\x43");                                     // [0x1022] inc    ebx
+    emit(ram, "\x81\xfb\xd0\x07\x00\x00");                 // [0x1023] cmp    ebx, 2000
+    emit(ram, "\x72\xd7");                                 // [0x1029] jb     0x1002
+    emit(ram, "\xc7\x05\x00\x80\x01\x00\xef\xbe\xad\xde"); // [0x102b] mov    dword ptr [0x18000], 0xdeadbeef
+    emit(ram, "\xf4");                                     // [0x1035] hlt
+    emit(ram, "\xeb\xfd");                                 // [0x1036] jmp    0x1035
+#undef emit
+}
+
+static const char *mechanismName(WatchMechanism mechanism) noexcept {
+    switch (mechanism) {
+    case WatchMechanism::DebugRegister: return "debug register";
+    case WatchMechanism::PageProtection: return "page protection";
+    case WatchMechanism::SoftwareBreakpoint: return "software breakpoint";
+    default: return "?";
+    }
+}
+
+// Runs the guest with 18 watches and reports the cost of each. Returns false
+// if the guest could not run.
+static bool runGuest(Platform& platform, uint8_t *rom, uint8_t *ram, uint32_t rebalanceInterval) {
+    writeGuest(ram);
+
+    VMSpecifications vmSpecs = { 0 };
+    vmSpecs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(vmSpecs);
+    if (!opt_vm) {
+        printf("fatal: failed to create virtual machine\n");
+        return false;
+    }
+    VirtualMachine& vm = opt_vm->get();
+    if (vm.MapGuestMemory(FLAT_GUEST_ROM_BASE, FLAT_GUEST_ROM_SIZE, MemoryFlags::Read | MemoryFlags::Execute, rom) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map ROM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    if (vm.MapGuestMemory(ramBase, ramSize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, ram) != MemoryMappingStatus::OK) {
+        printf("fatal: failed to map RAM\n");
+        platform.FreeVM(vm);
+        return false;
+    }
+    auto& vp = vm.GetVirtualProcessor(0)->get();
+
+    WatchManager watches(vm, vp, ram, ramBase, ramSize);
+    IOBus bus;
+    bus.AddMMIODevice(ramBase, ramSize, watches);
+    bus.Attach(vm);
+
+    // Add the coldest counters first so that they start out in the debug
+    // registers, leaving it to the rebalancer to find the hot ones
+    int counterWatches[numCounters];
+    for (int j = numCounters - 1; j >= 0; j--) {
+        counterWatches[j] = watches.Add(WatchType::Write, countersBase + j * counterStride, sizeof(uint32_t));
+    }
+    const int loopWatch = watches.Add(WatchType::Execute, outerLoopAddr, 1);
+    const int canaryWatch = watches.Add(WatchType::Access, canaryAddr, sizeof(uint32_t));
+    watches.SetHitHandler([&](size_t id, uint64_t address) {
+        if ((int)id == canaryWatch) {
+            printf("  Canary accessed at 0x%" PRIx64 "\n", address);
+        }
+    });
+    watches.SetRebalanceInterval(rebalanceInterval);
+
+    bool running = true;
+    bool ok = true;
+    uint64_t exits = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (running) {
+        if (vp.Run() != VPExecutionStatus::OK) {
+            printf("VCPU failed to run\n");
+            ok = false;
+            break;
+        }
+        exits++;
+        auto& exitInfo = vp.GetVMExitInfo();
+        if (watches.HandleExit(exitInfo)) {
+            continue;
+        }
+        switch (exitInfo.reason) {
+        case VMExitReason::MMIO:
+            break;
+        case VMExitReason::HLT:
+            running = false;
+            break;
+        default:
+            printf("Emulation exited for another reason: %s\n", reason_str(exitInfo.reason));
+            running = false;
+            ok = false;
+            break;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("  %-12s %-20s %8s %8s %12s\n", "Watch", "Mechanism", "Hits", "Exits", "Overhead");
+    auto printWatch = [&](const char *name, int id) {
+        WatchManager::Stats stats;
+        if (watches.GetStats(id, stats)) {
+            printf("  %-12s %-20s %8" PRIu64 " %8" PRIu64 " %9.3f ms\n", name, mechanismName(stats.mechanism), stats.hits, stats.exits, stats.overheadNs / 1000000.0);
+        }
+    };
+    for (uint32_t j = 0; j < numCounters; j++) {
+        char name[16];
+        snprintf(name, sizeof(name), "counter[%u]", j);
+        printWatch(name, counterWatches[j]);
+    }
+    printWatch("outer loop", loopWatch);
+    printWatch("canary", canaryWatch);
+    printf("  VM exits: %" PRIu64 " (%" PRIu64 " taken by watches), time: %.3f ms\n", exits, watches.TotalExits(), elapsed.count() * 1000.0);
+
+    watches.RemoveAll();
+    platform.FreeVM(vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    parsePlatformOptions(argc, argv);
+
+    uint8_t *rom = alignedAlloc(FLAT_GUEST_ROM_SIZE);
+    uint8_t *ram = alignedAlloc(ramSize);
+    if (rom == NULL || ram == NULL) {
+        printf("fatal: failed to allocate guest memory\n");
+        return -1;
+    }
+    writeFlatGuestROM(rom, kernelBase, stackTop);
+
+    printf("virt86 version: " VIRT86_VERSION "\n\n");
+
+    Platform *pPlatform = loadFirstPlatform();
+    if (pPlatform == NULL) {
+        return -1;
+    }
+    Platform& platform = *pPlatform;
+    auto& features = platform.GetFeatures();
+    if (!features.guestDebugging) {
+        printf("fatal: platform does not support guest debugging\n");
+        return -1;
+    }
+    if (!features.guestMemoryProtection && !features.partialUnmapping) {
+        printf("fatal: platform can neither protect nor partially unmap guest memory\n");
+        return -1;
+    }
+
+    printf("\nRunning with fixed watch placement\n");
+    if (!runGuest(platform, rom, ram, 0)) {
+        return -1;
+    }
+
+    printf("\nRunning with the hottest watches moved into debug registers every 256 hits\n");
+    if (!runGuest(platform, rom, ram, 256)) {
+        return -1;
+    }
+
+    alignedFree(ram);
+    alignedFree(rom);
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+; Compile with NASM:
+;   $ nasm net.asm -o net.bin
+
+; Network benchmark driver for NetDevice, run by virt86-net-bench on two
+; virtual machines linked to each other and booted by rom.asm like ram.asm.
+;
+; The client streams packets to the server, which checks every one of them and
+; answers with a single packet once it has them all. The client then sends
+; packets one at a time, waiting for the server to echo each of them back. The
+; host timestamps the markers written by the client.
+
+; This is where the RAM program is loaded
+[BITS 64]
+org 0x10000
+
+%define CODE_SEG        0x0008
+
+; Parameters written by the host
+%define PARAM_ROLE      0x6000      ; 0: client, 1: server
+%define PARAM_SIZE      0x6004      ; Packet size in bytes
+%define PARAM_STREAM    0x6008      ; Packets to stream
+%define PARAM_PINGS     0x600C      ; Packets to echo
+%define RESULT_ERRORS   0x6010      ; Packets received with the wrong size or contents
+%define RESULT_DONE     0x6014      ; Set when the benchmark is over
+
+%define IDT_BASE        0x7000
+%define NET_VECTOR      0x40
+
+; NetDevice registers
+%define NET_PORT        0xE00
+%define NET_CONTROL     (NET_PORT + 0x00)
+%define NET_QUEUE_SIZE  (NET_PORT + 0x04)
+%define NET_TXQ_BASE    (NET_PORT + 0x08)
+%define NET_RXQ_BASE    (NET_PORT + 0x0C)
+%define NET_TX          (NET_PORT + 0x10)   ; Write: TX_TAIL, read: TX_HEAD
+%define NET_RX          (NET_PORT + 0x14)   ; Write: RX_TAIL, read: RX_HEAD
+%define NET_INT_MASK    (NET_PORT + 0x18)
+%define NET_INT_RX      (1 << 0)
+%define NET_INT_TX      (1 << 1)
+
+; Writes to this port are timestamped by the host
+%define MARKER_PORT         0xE80
+%define MARK_STREAM_START   1
+%define MARK_STREAM_END     2
+%define MARK_PING_START     3
+%define MARK_PING_END       4
+
+; Queues and buffers
+%define QUEUE_SIZE      128
+%define TXQ             0x20000
+%define RXQ             0x21000
+%define RX_BUFFERS      0x100000
+%define TX_BUFFERS      0x140000
+%define BUFFER_SIZE     2048
+%define TX_BATCH        32          ; Packets queued per doorbell while streaming
+%define RX_BATCH        32          ; Receive buffers returned to the device at a time
+
+; Registers kept throughout the program:
+;   ebp     packet size
+;   r11d    RX_HEAD as last read from the device
+;   r12d    next receive descriptor to process
+;   r13d    next transmit descriptor, which is TX_TAIL once the doorbell rings
+;   r14d    RX_TAIL, one past the last receive buffer returned to the device
+;   r15d    TX_HEAD as last read from the device
+;
+; Interrupts stay disabled except while halted, so that checking a register
+; and halting cannot miss the interrupt in between.
+
+Entry:
+    ; Install the interrupt handler; the ROM left a zero-length IDT
+    mov rax, NetInterrupt
+    mov rdi, IDT_BASE + NET_VECTOR * 16
+    mov [rdi], ax                   ; Offset 15..0
+    mov word [rdi + 2], CODE_SEG    ; Selector
+    mov word [rdi + 4], 0x8E00      ; Present, 64-bit interrupt gate
+    shr rax, 16
+    mov [rdi + 6], ax               ; Offset 31..16
+    shr rax, 16
+    mov [rdi + 8], eax              ; Offset 63..32
+    mov dword [rdi + 12], 0
+    lidt [IDT]
+
+    mov ebp, [PARAM_SIZE]
+
+    ; Point every descriptor at its own buffer
+    xor ecx, ecx
+.FillQueues:
+    mov eax, ecx
+    shl eax, 11                     ; Buffer offset
+    mov edi, ecx
+    shl edi, 4                      ; Descriptor offset
+    lea rsi, [rax + TX_BUFFERS]
+    mov [rdi + TXQ], rsi
+    mov [rdi + TXQ + 8], ebp
+    mov dword [rdi + TXQ + 12], 0
+    lea rsi, [rax + RX_BUFFERS]
+    mov [rdi + RXQ], rsi
+    mov dword [rdi + RXQ + 8], BUFFER_SIZE
+    mov dword [rdi + RXQ + 12], 0
+    inc ecx
+    cmp ecx, QUEUE_SIZE
+    jb .FillQueues
+
+    ; Set up the device and hand it every receive buffer
+    mov dx, NET_QUEUE_SIZE
+    mov eax, QUEUE_SIZE
+    out dx, eax
+    mov dx, NET_TXQ_BASE
+    mov eax, TXQ
+    out dx, eax
+    mov dx, NET_RXQ_BASE
+    mov eax, RXQ
+    out dx, eax
+    mov dx, NET_INT_MASK
+    mov eax, NET_INT_RX
+    out dx, eax
+    mov dx, NET_CONTROL
+    mov eax, 1
+    out dx, eax
+
+    xor r11d, r11d
+    xor r12d, r12d
+    xor r13d, r13d
+    xor r15d, r15d
+    mov r14d, QUEUE_SIZE
+    mov dx, NET_RX
+    mov eax, r14d
+    out dx, eax
+
+    cmp dword [PARAM_ROLE], 0
+    jne Server
+
+Client:
+    ; Stream numbered packets, ringing the doorbell once per batch
+    mov eax, MARK_STREAM_START
+    call Mark
+    xor ebx, ebx
+.Stream:
+    call TxReserve
+    call TxBuffer
+    mov [rdi], ebx
+    inc r13d
+    test r13d, TX_BATCH - 1
+    jnz .NextStream
+    call TxKick
+.NextStream:
+    inc ebx
+    cmp ebx, [PARAM_STREAM]
+    jb .Stream
+    call TxKick
+
+    ; The server answers with the number of packets once it has them all
+    call RxNext
+    call RxCheck
+    call RxDone
+    mov eax, MARK_STREAM_END
+    call Mark
+
+    ; Send one packet at a time and wait for its echo
+    mov eax, MARK_PING_START
+    call Mark
+    xor ebx, ebx
+.Ping:
+    call TxReserve
+    call TxBuffer
+    mov [rdi], ebx
+    inc r13d
+    call TxKick
+    call RxNext
+    call RxCheck
+    call RxDone
+    inc ebx
+    cmp ebx, [PARAM_PINGS]
+    jb .Ping
+    mov eax, MARK_PING_END
+    call Mark
+    jmp Done
+
+Server:
+    ; Check every streamed packet, then answer with their count
+    xor ebx, ebx
+.Sink:
+    call RxNext
+    call RxCheck
+    call RxDone
+    inc ebx
+    cmp ebx, [PARAM_STREAM]
+    jb .Sink
+    call TxReserve
+    call TxBuffer
+    mov [rdi], ebx
+    inc r13d
+    call TxKick
+
+    ; Echo every packet back as soon as it arrives
+    xor ebx, ebx
+.Echo:
+    call RxNext
+    call RxCheck
+    mov r8, rsi                     ; Keep the receive descriptor
+    call TxReserve
+    call TxBuffer
+    mov rsi, [r8]
+    mov ecx, ebp
+    rep movsb
+    inc r13d
+    call TxKick
+    mov rsi, r8
+    call RxDone
+    inc ebx
+    cmp ebx, [PARAM_PINGS]
+    jb .Echo
+
+Done:
+    mov dword [RESULT_DONE], 1
+.Halt:
+    hlt                             ; Let the host collect the results
+    jmp .Halt
+
+; Waits for the next received packet. Returns its descriptor in RSI.
+RxNext:
+    cmp r12d, r11d
+    jne .Ready
+    mov dx, NET_RX
+    in eax, dx                      ; Also acknowledges the receive interrupt
+    mov r11d, eax
+    cmp r12d, r11d
+    jne .Ready
+    sti
+    hlt                             ; Woken up by the next interrupt
+    cli
+    jmp RxNext
+.Ready:
+    mov esi, r12d
+    and esi, QUEUE_SIZE - 1
+    shl esi, 4
+    add esi, RXQ
+    ret
+
+; Counts an error unless the packet in RSI has the expected size and carries
+; the sequence number in EBX.
+RxCheck:
+    cmp [rsi + 8], ebp
+    jne .Bad
+    cmp dword [rsi + 12], 0
+    jne .Bad
+    mov rdi, [rsi]
+    cmp [rdi], ebx
+    je .Good
+.Bad:
+    inc dword [RESULT_ERRORS]
+.Good:
+    ret
+
+; Releases the packet in RSI, returning buffers to the device in batches.
+RxDone:
+    mov dword [rsi + 8], BUFFER_SIZE
+    inc r12d
+    mov eax, r12d
+    add eax, QUEUE_SIZE
+    sub eax, r14d                   ; Buffers released but not yet returned
+    cmp eax, RX_BATCH
+    jb .Done
+    add r14d, eax
+    mov dx, NET_RX
+    mov eax, r14d
+    out dx, eax
+.Done:
+    ret
+
+; Waits until the next transmit descriptor is no longer in use.
+TxReserve:
+    mov eax, r13d
+    sub eax, r15d
+    cmp eax, QUEUE_SIZE
+    jb .Done
+    call TxKick                     ; Make sure the device has every packet before waiting
+    mov dx, NET_TX
+    in eax, dx                      ; Also acknowledges the transmit interrupt
+    mov r15d, eax
+    mov eax, r13d
+    sub eax, r15d
+    cmp eax, QUEUE_SIZE
+    jb .Done
+    mov dx, NET_INT_MASK            ; Ask to be interrupted once the other side consumes packets
+    mov eax, NET_INT_RX | NET_INT_TX
+    out dx, eax
+    sti
+    hlt
+    cli
+    mov dx, NET_INT_MASK
+    mov eax, NET_INT_RX
+    out dx, eax
+    jmp TxReserve
+.Done:
+    ret
+
+; Returns in RDI the buffer of the next transmit descriptor.
+TxBuffer:
+    mov edi, r13d
+    and edi, QUEUE_SIZE - 1
+    shl edi, 4
+    mov rdi, [rdi + TXQ]
+    ret
+
+; Rings the doorbell for every packet queued so far.
+TxKick:
+    mov dx, NET_TX
+    mov eax, r13d
+    out dx, eax
+    ret
+
+; Has the host timestamp the event in EAX.
+Mark:
+    mov dx, MARKER_PORT
+    out dx, eax
+    ret
+
+; The main loop checks the device registers when it wakes up
+NetInterrupt:
+    iretq
+
+ALIGN 4
+IDT:
+    dw NET_VECTOR * 16 + 15         ; Limit
+    dq IDT_BASE                     ; Base
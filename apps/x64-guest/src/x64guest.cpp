@@ -32,6 +32,7 @@ SOFTWARE.
 
 #include "print_helpers.hpp"
 #include "align_alloc.hpp"
+#include "snapshot.hpp"
 #include "utils.hpp"
 
 #include <cmath>
@@ -93,11 +94,46 @@ void runToHLT(VirtualProcessor& vp) {
     }
 }
 
+void printSnapshotStats(const SnapshotStats& stats) {
+    printf("  %" PRIu64 " pages, %" PRIu64 " of them all zeros, in %" PRIu64 " chunks on %zu threads\n", stats.pages, stats.zeroPages, stats.chunks, stats.threads);
+    printf("  %" PRIu64 " bytes of memory in a %" PRIu64 " byte file (%.2f%%), %.3f ms\n",
+        stats.memoryBytes, stats.fileBytes, stats.fileBytes * 100.0 / stats.memoryBytes, stats.elapsedNs / 1000000.0);
+}
+
+// Saves a snapshot, wipes guest memory and loads the snapshot back. The guest
+// can only continue running correctly if the snapshot was complete.
+bool snapshotRoundTrip(const char *path, VirtualProcessor& vp, const std::vector<SnapshotRegion>& regions) {
+    SnapshotStats stats;
+    printf("Saving snapshot to %s... ", path);
+    if (!saveSnapshot(path, vp, regions, 0, &stats)) {
+        printf("failed\n");
+        return false;
+    }
+    printf("succeeded\n");
+    printSnapshotStats(stats);
+
+    for (auto& region : regions) {
+        memset(region.memory, 0xCC, region.size);
+    }
+
+    printf("Loading snapshot from %s... ", path);
+    if (!loadSnapshot(path, vp, regions, 0, &stats)) {
+        printf("failed\n");
+        return false;
+    }
+    printf("succeeded\n");
+    printSnapshotStats(stats);
+    return true;
+}
+
 int main(int argc, char* argv[]) {
+    parsePlatformOptions(argc, argv);
+
     // Require two arguments: the ROM code and the RAM code
+    // An optional third argument specifies a snapshot file to save and restore
     if (argc < 3) {
         printf("fatal: no input files specified\n");
-        printf("usage: %s <rom> <ram>\n", argv[0]);
+        printf("usage: %s <rom> <ram> [snapshot]\n", argv[0]);
         return -1;
     }
 
@@ -185,27 +221,13 @@ int main(int argc, char* argv[]) {
 
     printf("virt86 version: " VIRT86_VERSION "\n\n");
 
-    // Pick the first hypervisor platform that is available and properly initialized on this system.
-    printf("Loading virtualization platform... ");
-
-    bool foundPlatform = false;
-    size_t platformIndex = 0;
-    for (size_t i = 0; i < array_size(PlatformFactories); i++) {
-        const Platform& platform = PlatformFactories[i]();
-        if (platform.GetInitStatus() == PlatformInitStatus::OK) {
-            printf("%s loaded successfully\n", platform.GetName().c_str());
-            foundPlatform = true;
-            platformIndex = i;
-            break;
-        }
-    }
-
-    if (!foundPlatform) {
-        printf("none found\n");
+    // Pick the first hypervisor platform that is available and properly initialized on this system,
+    // or the reference interpreter if --reference was given.
+    Platform *platformPtr = loadFirstPlatform();
+    if (platformPtr == NULL) {
         return -1;
     }
-
-    Platform& platform = PlatformFactories[platformIndex]();
+    Platform& platform = *platformPtr;
     auto& features = platform.GetFeatures();
 
     // Print out the host's features
@@ -275,6 +297,14 @@ int main(int argc, char* argv[]) {
     runToHLT(vp);
     printf("\n");
 
+    // ----- Snapshot -------------------------------------------------------------------------------------------------
+
+    // The guest is now in long mode with its page tables set up
+    if (argc >= 4) {
+        if (!snapshotRoundTrip(argv[3], vp, { { romBase, romSize, rom }, { ramBase, ramSize, ram } })) return -1;
+        printf("\n");
+    }
+
     // ----- Page table manipulation ----------------------------------------------------------------------------------
     
     // Map a page of memory to the guest and write some data to be read by the guest in order to check if the mapping worked